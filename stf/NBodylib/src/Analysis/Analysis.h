@@ -5,5 +5,6 @@
 #include <Energy.h>
 #include <Morphology.h>
 #include <Power.h>
+#include <Gravity.h>
 
 #endif
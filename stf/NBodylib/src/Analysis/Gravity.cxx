@@ -0,0 +1,944 @@
+/*! \file Gravity.cxx
+ *  \brief gravitational potential and accelerations by direct summation and with a kd-tree multipole calculation
+
+    Potentials stored in particles are the potential energy \f$ -G m_i\sum_j m_j/\sqrt{r_{ij}^2+\epsilon^2} \f$ while
+    accelerations are per unit mass, \f$ -G\sum_j m_j \vec{r}_{ij}/(r_{ij}^2+\epsilon^2)^{3/2} \f$.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <Gravity.h>
+
+using namespace std;
+using namespace Math;
+
+namespace NBody
+{
+
+///\name Direct summation kernels
+//@{
+/*!
+    Adds the mutual potential \f$ -m_j/\sqrt{r_{ij}^2+\epsilon^2} \f$ of the particles in [start,end) of the coordinate and mass arrays to pot,
+    visiting each pair once and accumulating it to both particles. For fixed i the loop over j>i has no dependencies, so it vectorises with
+    the sum for i kept in a register.
+*/
+static inline void DirectPotentialSelf(const Double_t *px, const Double_t *py, const Double_t *pz, const Double_t *pm, Double_t *pot,
+    const Int_t start, const Int_t end, const Double_t eps2)
+{
+    for (Int_t j=start;j<end-1;j++) {
+        Double_t xj=px[j], yj=py[j], zj=pz[j], mj=pm[j], pp=0;
+#ifdef USEOPENMP
+        #pragma omp simd reduction(+:pp)
+#endif
+        for (Int_t l=j+1;l<end;l++) {
+            Double_t dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+            Double_t ir=1.0/sqrt(dx*dx+dy*dy+dz*dz+eps2);
+            pp+=pm[l]*ir;
+            pot[l]-=mj*ir;
+        }
+        pot[j]-=pp;
+    }
+}
+
+///adds the potential of the particles in [bstart,bend) to those in [astart,aend), which must not overlap
+static inline void DirectPotentialPair(const Double_t *px, const Double_t *py, const Double_t *pz, const Double_t *pm, Double_t *pot,
+    const Int_t astart, const Int_t aend, const Int_t bstart, const Int_t bend, const Double_t eps2)
+{
+    for (Int_t j=astart;j<aend;j++) {
+        Double_t xj=px[j], yj=py[j], zj=pz[j], pp=0;
+#ifdef USEOPENMP
+        #pragma omp simd reduction(+:pp)
+#endif
+        for (Int_t l=bstart;l<bend;l++) {
+            Double_t dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+            pp+=pm[l]/sqrt(dx*dx+dy*dy+dz*dz+eps2);
+        }
+        pot[j]-=pp;
+    }
+}
+
+///as \ref DirectPotentialSelf but also adds the gradient of the potential, \f$ m_j\vec{r}_{ij}/(r_{ij}^2+\epsilon^2)^{3/2} \f$, to gx, gy, gz
+static inline void DirectGradientSelf(const Double_t *px, const Double_t *py, const Double_t *pz, const Double_t *pm, Double_t *pot,
+    Double_t *gx, Double_t *gy, Double_t *gz, const Int_t start, const Int_t end, const Double_t eps2)
+{
+    for (Int_t j=start;j<end-1;j++) {
+        Double_t xj=px[j], yj=py[j], zj=pz[j], mj=pm[j], pp=0, ax=0, ay=0, az=0;
+#ifdef USEOPENMP
+        #pragma omp simd reduction(+:pp,ax,ay,az)
+#endif
+        for (Int_t l=j+1;l<end;l++) {
+            Double_t dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+            Double_t ir=1.0/sqrt(dx*dx+dy*dy+dz*dz+eps2), ir3=ir*ir*ir;
+            pp+=pm[l]*ir;
+            ax+=pm[l]*dx*ir3;ay+=pm[l]*dy*ir3;az+=pm[l]*dz*ir3;
+            pot[l]-=mj*ir;
+            gx[l]+=mj*dx*ir3;gy[l]+=mj*dy*ir3;gz[l]+=mj*dz*ir3;
+        }
+        pot[j]-=pp;
+        gx[j]-=ax;gy[j]-=ay;gz[j]-=az;
+    }
+}
+
+///as \ref DirectPotentialPair but also adds the gradient of the potential
+static inline void DirectGradientPair(const Double_t *px, const Double_t *py, const Double_t *pz, const Double_t *pm, Double_t *pot,
+    Double_t *gx, Double_t *gy, Double_t *gz, const Int_t astart, const Int_t aend, const Int_t bstart, const Int_t bend, const Double_t eps2)
+{
+    for (Int_t j=astart;j<aend;j++) {
+        Double_t xj=px[j], yj=py[j], zj=pz[j], pp=0, ax=0, ay=0, az=0;
+#ifdef USEOPENMP
+        #pragma omp simd reduction(+:pp,ax,ay,az)
+#endif
+        for (Int_t l=bstart;l<bend;l++) {
+            Double_t dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+            Double_t ir=1.0/sqrt(dx*dx+dy*dy+dz*dz+eps2), ir3=ir*ir*ir;
+            pp+=pm[l]*ir;
+            ax+=pm[l]*dx*ir3;ay+=pm[l]*dy*ir3;az+=pm[l]*dz*ir3;
+        }
+        pot[j]-=pp;
+        gx[j]-=ax;gy[j]-=ay;gz[j]-=az;
+    }
+}
+
+/*!
+    Adds the potential (and gradient if gx is not NULL) of the sources in [bstart,bend) of the arrays qx, qy, qz, qm, which belong to another tree,
+    to the particles in [astart,aend). The same particle may be in both, so coincident pairs without softening are skipped.
+*/
+static inline void DirectPotentialExternal(const Double_t *px, const Double_t *py, const Double_t *pz, Double_t *pot, Double_t *gx, Double_t *gy, Double_t *gz,
+    const Int_t astart, const Int_t aend, const Double_t *qx, const Double_t *qy, const Double_t *qz, const Double_t *qm,
+    const Int_t bstart, const Int_t bend, const Double_t eps2)
+{
+    for (Int_t j=astart;j<aend;j++) {
+        Double_t xj=px[j], yj=py[j], zj=pz[j], pp=0, ax=0, ay=0, az=0;
+#ifdef USEOPENMP
+        #pragma omp simd reduction(+:pp,ax,ay,az)
+#endif
+        for (Int_t l=bstart;l<bend;l++) {
+            Double_t dx=qx[l]-xj, dy=qy[l]-yj, dz=qz[l]-zj, r2=dx*dx+dy*dy+dz*dz+eps2;
+            Double_t ir=(r2>0)?1.0/sqrt(r2):0, ir3=ir*ir*ir;
+            pp+=qm[l]*ir;
+            ax+=qm[l]*dx*ir3;ay+=qm[l]*dy*ir3;az+=qm[l]*dz*ir3;
+        }
+        pot[j]-=pp;
+        if (gx!=NULL) {gx[j]-=ax;gy[j]-=ay;gz[j]-=az;}
+    }
+}
+
+/*!
+    Mixed precision version of \ref DirectPotentialSelf. The pair terms are calculated in single precision and summed in blocks of \ref GRAVMIXEDBLOCK terms,
+    which are then added in double precision, so the rounding error does not grow with the number of particles. The terms of the second particle of each pair
+    are accumulated in the single precision scratch fpot over a block of \ref GRAVMIXEDBLOCK first particles before being added to pot.
+*/
+static inline void DirectPotentialSelfMixed(const float *px, const float *py, const float *pz, const float *pm, float *fpot, Double_t *pot,
+    const Int_t start, const Int_t end, const float eps2)
+{
+    for (Int_t jb=start;jb<end-1;jb+=GRAVMIXEDBLOCK) {
+        Int_t jend=min(jb+(Int_t)GRAVMIXEDBLOCK,end-1);
+        for (Int_t l=jb+1;l<end;l++) fpot[l]=0;
+        for (Int_t j=jb;j<jend;j++) {
+            float xj=px[j], yj=py[j], zj=pz[j], mj=pm[j];
+            double psum=0;
+            for (Int_t lb=j+1;lb<end;lb+=GRAVMIXEDBLOCK) {
+                Int_t lend=min(lb+(Int_t)GRAVMIXEDBLOCK,end);
+                float pp=0;
+#ifdef USEOPENMP
+                #pragma omp simd reduction(+:pp)
+#endif
+                for (Int_t l=lb;l<lend;l++) {
+                    float dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+                    float ir=1.0f/sqrtf(dx*dx+dy*dy+dz*dz+eps2);
+                    pp+=pm[l]*ir;
+                    fpot[l]-=mj*ir;
+                }
+                psum+=pp;
+            }
+            pot[j]-=psum;
+        }
+        for (Int_t l=jb+1;l<end;l++) pot[l]+=fpot[l];
+    }
+}
+
+///mixed precision version of \ref DirectPotentialPair, see \ref DirectPotentialSelfMixed
+static inline void DirectPotentialPairMixed(const float *px, const float *py, const float *pz, const float *pm, Double_t *pot,
+    const Int_t astart, const Int_t aend, const Int_t bstart, const Int_t bend, const float eps2)
+{
+    for (Int_t j=astart;j<aend;j++) {
+        float xj=px[j], yj=py[j], zj=pz[j];
+        double psum=0;
+        for (Int_t lb=bstart;lb<bend;lb+=GRAVMIXEDBLOCK) {
+            Int_t lend=min(lb+(Int_t)GRAVMIXEDBLOCK,bend);
+            float pp=0;
+#ifdef USEOPENMP
+            #pragma omp simd reduction(+:pp)
+#endif
+            for (Int_t l=lb;l<lend;l++) {
+                float dx=px[l]-xj, dy=py[l]-yj, dz=pz[l]-zj;
+                pp+=pm[l]/sqrtf(dx*dx+dy*dy+dz*dz+eps2);
+            }
+            psum+=pp;
+        }
+        pot[j]-=psum;
+    }
+}
+//@}
+
+/*!
+    Direct summation in mixed precision, see \ref DirectPotentialSelfMixed. Positions are stored in single precision relative to the mean position of the particles,
+    so their precision is set by the size of the set rather than its distance from the origin, and only the potential is kept in double precision,
+    which roughly halves the scratch memory.
+*/
+static void GravityDirectPotentialMixed(const GravityInfo &gi, const Int_t nbodies, Particle *Part)
+{
+    float fsbuff[5*GRAVDIRECTBUFFNUM], *fbuff=fsbuff;
+    Double_t sbuff[GRAVDIRECTBUFFNUM], *pot=sbuff;
+    float *px, *py, *pz, *pm, *fpot;
+    double cen[3]={0,0,0};
+    if (nbodies>GRAVDIRECTBUFFNUM) {fbuff=new float[5*nbodies];pot=new Double_t[nbodies];}
+    px=fbuff;py=&fbuff[nbodies];pz=&fbuff[2*nbodies];pm=&fbuff[3*nbodies];fpot=&fbuff[4*nbodies];
+    for (Int_t j=0;j<nbodies;j++) for (int k=0;k<3;k++) cen[k]+=Part[j].GetPosition(k);
+    for (int k=0;k<3;k++) cen[k]/=(double)nbodies;
+    for (Int_t j=0;j<nbodies;j++) {
+        px[j]=Part[j].GetPosition(0)-cen[0];py[j]=Part[j].GetPosition(1)-cen[1];pz[j]=Part[j].GetPosition(2)-cen[2];
+        pm[j]=Part[j].GetMass();
+        pot[j]=0;
+    }
+    DirectPotentialSelfMixed(px,py,pz,pm,fpot,pot,0,nbodies,(float)(gi.eps*gi.eps));
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(gi.G*Part[j].GetMass()*pot[j]);
+    if (fbuff!=fsbuff) {delete[] fbuff;delete[] pot;}
+}
+
+/*!
+    Coordinates and masses are copied to contiguous scratch arrays, on the stack for sets of up to \ref GRAVDIRECTBUFFNUM particles,
+    so the pair loop of \ref DirectPotentialSelf runs over unit stride data. In mixed precision (see \ref GravityInfo) the potential is calculated
+    by \ref GravityDirectPotentialMixed unless accelerations are wanted.
+*/
+void GravityDirectPotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, Double_t *acc)
+{
+    Double_t sbuff[8*GRAVDIRECTBUFFNUM], *buff=sbuff;
+    Double_t *px, *py, *pz, *pm, *pot, *gx, *gy, *gz;
+    Double_t eps2=gi.eps*gi.eps;
+    if (nbodies<=0) return;
+    if (gi.imixed && acc==NULL) {GravityDirectPotentialMixed(gi,nbodies,Part);return;}
+    if (nbodies>GRAVDIRECTBUFFNUM) buff=new Double_t[((acc==NULL)?5:8)*nbodies];
+    px=buff;py=&buff[nbodies];pz=&buff[2*nbodies];pm=&buff[3*nbodies];pot=&buff[4*nbodies];
+    gx=&buff[5*nbodies];gy=&buff[6*nbodies];gz=&buff[7*nbodies];
+    for (Int_t j=0;j<nbodies;j++) {
+        px[j]=Part[j].GetPosition(0);py[j]=Part[j].GetPosition(1);pz[j]=Part[j].GetPosition(2);
+        pm[j]=Part[j].GetMass();
+        pot[j]=0;
+    }
+    if (acc==NULL) DirectPotentialSelf(px,py,pz,pm,pot,0,nbodies,eps2);
+    else {
+        for (Int_t j=0;j<nbodies;j++) gx[j]=gy[j]=gz[j]=0;
+        DirectGradientSelf(px,py,pz,pm,pot,gx,gy,gz,0,nbodies,eps2);
+        for (Int_t j=0;j<nbodies;j++) {acc[3*j]=-gi.G*gx[j];acc[3*j+1]=-gi.G*gy[j];acc[3*j+2]=-gi.G*gz[j];}
+    }
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(gi.G*pm[j]*pot[j]);
+    if (buff!=sbuff) delete[] buff;
+}
+
+///The sum is over all other particles of the set in double precision, whatever the precision of Double_t
+double GravityParticlePotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, const Int_t i)
+{
+    double xi=Part[i].GetPosition(0), yi=Part[i].GetPosition(1), zi=Part[i].GetPosition(2), eps2=(double)gi.eps*(double)gi.eps, pp=0;
+    for (Int_t j=0;j<nbodies;j++) if (j!=i) {
+        double dx=Part[j].GetPosition(0)-xi, dy=Part[j].GetPosition(1)-yi, dz=Part[j].GetPosition(2)-zi;
+        pp+=Part[j].GetMass()/sqrt(dx*dx+dy*dy+dz*dz+eps2);
+    }
+    return -(double)gi.G*Part[i].GetMass()*pp;
+}
+
+///\name Tree gravity
+//@{
+///add the quadrupole of mass m at offset dx (with squared length r2) to q
+static inline void AddQuadrupole(Double_t *q, Double_t m, Double_t *dx, Double_t r2)
+{
+    q[0]+=m*(3.0*dx[0]*dx[0]-r2);
+    q[1]+=m*(3.0*dx[1]*dx[1]-r2);
+    q[2]+=m*(3.0*dx[2]*dx[2]-r2);
+    q[3]+=m*3.0*dx[0]*dx[1];
+    q[4]+=m*3.0*dx[0]*dx[2];
+    q[5]+=m*3.0*dx[1]*dx[2];
+}
+
+///calculate the moments of a leaf cell directly from its particles and the source masses. If imassive is set, the enclosing radius only includes particles with mass
+static void GetLeafMoments(const GravityTree &gt, GravityCell &c, const Int_t start, const Int_t end, const int imassive)
+{
+    const Double_t *pm=gt.msrc;
+    Double_t dx[3],r2;
+    c.mass=c.bmax=0;
+    for (int n=0;n<3;n++) c.cm[n]=0;
+    for (int n=0;n<6;n++) c.quad[n]=0;
+    for (Int_t k=start;k<end;k++) {
+        c.mass+=pm[k];
+        c.cm[0]+=pm[k]*gt.px[k];c.cm[1]+=pm[k]*gt.py[k];c.cm[2]+=pm[k]*gt.pz[k];
+    }
+    if (c.mass>0) for (int n=0;n<3;n++) c.cm[n]/=c.mass;
+    else {c.cm[0]=gt.px[start];c.cm[1]=gt.py[start];c.cm[2]=gt.pz[start];}
+    for (Int_t k=start;k<end;k++) {
+        if (imassive && pm[k]==0) continue;
+        dx[0]=gt.px[k]-c.cm[0];dx[1]=gt.py[k]-c.cm[1];dx[2]=gt.pz[k]-c.cm[2];
+        r2=dx[0]*dx[0]+dx[1]*dx[1]+dx[2]*dx[2];
+        if (r2>c.bmax) c.bmax=r2;
+        AddQuadrupole(c.quad,pm[k],dx,r2);
+    }
+    c.bmax=sqrt(c.bmax);
+}
+
+///combine the moments of the two daughter cells of a split node. The enclosing radius is the smaller of the daughters' spheres and the node's bounding box about the centre-of-mass
+static void GetSplitMoments(GravityCell &c, const GravityCell &l, const GravityCell &r, const GravityNode &node)
+{
+    Double_t dx[3],r2,b,bbox=0;
+    c.mass=l.mass+r.mass;
+    if (c.mass>0) for (int n=0;n<3;n++) c.cm[n]=(l.mass*l.cm[n]+r.mass*r.cm[n])/c.mass;
+    else for (int n=0;n<3;n++) c.cm[n]=0.5*(l.cm[n]+r.cm[n]);
+    for (int n=0;n<6;n++) c.quad[n]=l.quad[n]+r.quad[n];
+    for (int n=0;n<3;n++) dx[n]=l.cm[n]-c.cm[n];
+    r2=dx[0]*dx[0]+dx[1]*dx[1]+dx[2]*dx[2];
+    AddQuadrupole(c.quad,l.mass,dx,r2);
+    c.bmax=sqrt(r2)+l.bmax;
+    for (int n=0;n<3;n++) dx[n]=r.cm[n]-c.cm[n];
+    r2=dx[0]*dx[0]+dx[1]*dx[1]+dx[2]*dx[2];
+    AddQuadrupole(c.quad,r.mass,dx,r2);
+    b=sqrt(r2)+r.bmax;
+    if (b>c.bmax) c.bmax=b;
+    for (int n=0;n<3;n++) {
+        b=max(c.cm[n]-node.bnd[n][0],node.bnd[n][1]-c.cm[n]);
+        bbox+=b*b;
+    }
+    bbox=sqrt(bbox);
+    if (bbox<c.bmax) c.bmax=bbox;
+}
+
+/*!
+    Calculate the source moments of cell id from the particles whose tree order positions are src[lo..hi), which must be sorted.
+    Only cells that contain such particles are visited and the daughters without any are given zero mass, so the tree walk skips them.
+*/
+static void GetSourceMoments(GravityTree &gt, const Int_t id, const Int_t *src, const Int_t lo, const Int_t hi)
+{
+    const GravityNode &node=gt.nodes[id];
+    GravityCell &c=gt.sources[id];
+    if (node.left<0) {GetLeafMoments(gt,c,node.start,node.end,1);return;}
+    Int_t mid=lower_bound(&src[lo],&src[hi],gt.nodes[node.right].start)-src;
+    if (mid==lo) gt.sources[node.left].mass=0;
+    else GetSourceMoments(gt,node.left,src,lo,mid);
+    if (mid==hi) gt.sources[node.right].mass=0;
+    else GetSourceMoments(gt,node.right,src,mid,hi);
+    if (mid==lo) c=gt.sources[node.right];
+    else if (mid==hi) c=gt.sources[node.left];
+    else GetSplitMoments(c,gt.sources[node.left],gt.sources[node.right],node);
+}
+
+///collect the roots of the subtrees into which the tree gravity calculation is divided, the largest cells with at most ntask particles
+static void GetGravityTasks(const GravityTree &gt, const Int_t id, vector<Int_t> &tasks, const Int_t ntask)
+{
+    const GravityNode &node=gt.nodes[id];
+    if (node.end-node.start<=ntask || node.left<0) tasks.push_back(id);
+    else {
+        GetGravityTasks(gt,node.left,tasks,ntask);
+        GetGravityTasks(gt,node.right,tasks,ntask);
+    }
+}
+
+/*!
+    Add the field of the multipole of cell b to the local expansion of cell a. The expansion holds all terms up to third order in the sizes of the cells
+    relative to their separation d but for the octupole of b, which is not stored. With \f$ s=b_{\rm max,a}+b_{\rm max,b} \f$ the missing octupole is bounded by
+    \f$ M_b b_{\rm max,b}^3/(d-b_{\rm max,a})^4 \f$ and the higher order terms by \f$ M_b s^4/(d^4(d-s)) \f$.
+*/
+static inline void GravityM2L(GravityTree &gt, const Int_t ia, const GravityCell &b, const Double_t r2, const Double_t s)
+{
+    const GravityCell &a=gt.cells[ia];
+    Double_t *local=gt.local[ia];
+    Double_t dx[3],qx[3],d,da,ir,ir2,ir3,ir5,ir7,qrr,m3,m5,m15,q5;
+    for (int n=0;n<3;n++) dx[n]=a.cm[n]-b.cm[n];
+    d=sqrt(r2);
+    da=d-a.bmax;
+    gt.errlocal[ia]+=b.mass*(b.bmax*b.bmax*b.bmax/(da*da*da*da)+s*s*s*s/(d*d*d*d*(d-s)));
+    ir=1.0/sqrt(r2+gt.eps2);ir2=ir*ir;ir3=ir*ir2;ir5=ir3*ir2;ir7=ir5*ir2;
+    qx[0]=b.quad[0]*dx[0]+b.quad[3]*dx[1]+b.quad[4]*dx[2];
+    qx[1]=b.quad[3]*dx[0]+b.quad[1]*dx[1]+b.quad[5]*dx[2];
+    qx[2]=b.quad[4]*dx[0]+b.quad[5]*dx[1]+b.quad[2]*dx[2];
+    qrr=qx[0]*dx[0]+qx[1]*dx[1]+qx[2]*dx[2];
+    //potential of monopole and quadrupole
+    local[0]-=b.mass*ir+0.5*qrr*ir5;
+    //gradient of monopole and quadrupole
+    q5=2.5*qrr*ir7;
+    for (int n=0;n<3;n++) local[1+n]+=b.mass*ir3*dx[n]-qx[n]*ir5+q5*dx[n];
+    //second and third derivatives of the monopole
+    m3=b.mass*ir3;
+    m5=3.0*b.mass*ir5;
+    local[4]+=m3-m5*dx[0]*dx[0];
+    local[5]+=m3-m5*dx[1]*dx[1];
+    local[6]+=m3-m5*dx[2]*dx[2];
+    local[7]-=m5*dx[0]*dx[1];
+    local[8]-=m5*dx[0]*dx[2];
+    local[9]-=m5*dx[1]*dx[2];
+    m15=15.0*b.mass*ir7;
+    local[10]+=m15*dx[0]*dx[0]*dx[0]-3.0*m5*dx[0];
+    local[11]+=m15*dx[1]*dx[1]*dx[1]-3.0*m5*dx[1];
+    local[12]+=m15*dx[2]*dx[2]*dx[2]-3.0*m5*dx[2];
+    local[13]+=m15*dx[0]*dx[0]*dx[1]-m5*dx[1];
+    local[14]+=m15*dx[0]*dx[0]*dx[2]-m5*dx[2];
+    local[15]+=m15*dx[0]*dx[1]*dx[1]-m5*dx[0];
+    local[16]+=m15*dx[1]*dx[1]*dx[2]-m5*dx[2];
+    local[17]+=m15*dx[0]*dx[2]*dx[2]-m5*dx[0];
+    local[18]+=m15*dx[1]*dx[2]*dx[2]-m5*dx[1];
+    local[19]+=m15*dx[0]*dx[1]*dx[2];
+}
+
+///evaluate a local expansion at offset dx from its centre
+static inline Double_t GravityL2P(const Double_t *local, const Double_t *dx)
+{
+    Double_t x=dx[0],y=dx[1],z=dx[2];
+    return local[0]+local[1]*x+local[2]*y+local[3]*z
+        +0.5*(local[4]*x*x+local[5]*y*y+local[6]*z*z)+local[7]*x*y+local[8]*x*z+local[9]*y*z
+        +(1.0/6.0)*(local[10]*x*x*x+local[11]*y*y*y+local[12]*z*z*z)
+        +0.5*(local[13]*x*x*y+local[14]*x*x*z+local[15]*x*y*y+local[16]*y*y*z+local[17]*x*z*z+local[18]*y*z*z)
+        +local[19]*x*y*z;
+}
+
+///add the gradient of the local expansion l at offset dx from its centre to g
+static inline void GravityL2G(const Double_t *l, const Double_t *dx, Double_t *g)
+{
+    Double_t x=dx[0],y=dx[1],z=dx[2];
+    g[0]+=l[1]+l[4]*x+l[7]*y+l[8]*z+0.5*(l[10]*x*x+l[15]*y*y+l[17]*z*z)+l[13]*x*y+l[14]*x*z+l[19]*y*z;
+    g[1]+=l[2]+l[7]*x+l[5]*y+l[9]*z+0.5*(l[13]*x*x+l[11]*y*y+l[18]*z*z)+l[15]*x*y+l[19]*x*z+l[16]*y*z;
+    g[2]+=l[3]+l[8]*x+l[9]*y+l[6]*z+0.5*(l[14]*x*x+l[16]*y*y+l[12]*z*z)+l[19]*x*y+l[17]*x*z+l[18]*y*z;
+}
+
+///add the local expansion l, shifted by dx, to the local expansion dl
+static inline void GravityL2L(const Double_t *l, const Double_t *dx, Double_t *dl)
+{
+    Double_t x=dx[0],y=dx[1],z=dx[2];
+    dl[0]+=GravityL2P(l,dx);
+    GravityL2G(l,dx,&dl[1]);
+    dl[4]+=l[4]+l[10]*x+l[13]*y+l[14]*z;
+    dl[5]+=l[5]+l[15]*x+l[11]*y+l[16]*z;
+    dl[6]+=l[6]+l[17]*x+l[18]*y+l[12]*z;
+    dl[7]+=l[7]+l[13]*x+l[15]*y+l[19]*z;
+    dl[8]+=l[8]+l[14]*x+l[19]*y+l[17]*z;
+    dl[9]+=l[9]+l[19]*x+l[16]*y+l[18]*z;
+    for (int n=10;n<GRAVLOCALNUM;n++) dl[n]+=l[n];
+}
+
+///add the potential (and gradient) of the monopole and quadrupole of cell b to each particle of leaf a, with the bound on the missing octupole and higher order terms for particles at least dmin from b
+static inline void GravityM2P(GravityTree &gt, const Int_t ia, const GravityCell &b, const Double_t dmin)
+{
+    Double_t dx[3],qx[3],r2,ir,ir2,ir3,ir5,qrr,q5,err;
+    err=b.mass*b.bmax*b.bmax*b.bmax/(dmin*dmin*dmin*(dmin-b.bmax));
+    for (Int_t j=gt.nodes[ia].start;j<gt.nodes[ia].end;j++) {
+        dx[0]=gt.px[j]-b.cm[0];dx[1]=gt.py[j]-b.cm[1];dx[2]=gt.pz[j]-b.cm[2];
+        r2=dx[0]*dx[0]+dx[1]*dx[1]+dx[2]*dx[2]+gt.eps2;
+        ir=1.0/sqrt(r2);ir2=ir*ir;ir5=ir2*ir2*ir;
+        qrr=b.quad[0]*dx[0]*dx[0]+b.quad[1]*dx[1]*dx[1]+b.quad[2]*dx[2]*dx[2]
+            +2.0*(b.quad[3]*dx[0]*dx[1]+b.quad[4]*dx[0]*dx[2]+b.quad[5]*dx[1]*dx[2]);
+        gt.pot[j]-=b.mass*ir+0.5*qrr*ir5;
+        gt.errpot[j]+=err;
+        if (gt.gx!=NULL) {
+            qx[0]=b.quad[0]*dx[0]+b.quad[3]*dx[1]+b.quad[4]*dx[2];
+            qx[1]=b.quad[3]*dx[0]+b.quad[1]*dx[1]+b.quad[5]*dx[2];
+            qx[2]=b.quad[4]*dx[0]+b.quad[5]*dx[1]+b.quad[2]*dx[2];
+            ir3=ir*ir2;
+            q5=2.5*qrr*ir5*ir2;
+            gt.gx[j]+=b.mass*ir3*dx[0]-qx[0]*ir5+q5*dx[0];
+            gt.gy[j]+=b.mass*ir3*dx[1]-qx[1]*ir5+q5*dx[1];
+            gt.gz[j]+=b.mass*ir3*dx[2]-qx[2]*ir5+q5*dx[2];
+        }
+    }
+}
+
+///add the direct potential (and gradient) of the particles of leaf b to the particles of leaf a, excluding self-interaction when a and b are the same leaf. Without gradients the potential is summed in mixed precision if the tree stores single precision positions
+static inline void GravityP2P(GravityTree &gt, const Int_t ia, const Int_t ib)
+{
+    const GravityNode &a=gt.nodes[ia], &b=gt.nodes[ib];
+    if (gt.gx!=NULL) {
+        if (ia==ib) DirectGradientSelf(gt.px,gt.py,gt.pz,gt.msrc,gt.pot,gt.gx,gt.gy,gt.gz,a.start,a.end,gt.eps2);
+        else DirectGradientPair(gt.px,gt.py,gt.pz,gt.msrc,gt.pot,gt.gx,gt.gy,gt.gz,a.start,a.end,b.start,b.end,gt.eps2);
+    }
+    else if (gt.fx!=NULL) {
+        if (ia==ib) DirectPotentialSelfMixed(gt.fx,gt.fy,gt.fz,gt.fm,gt.fpot,gt.pot,a.start,a.end,gt.eps2);
+        else DirectPotentialPairMixed(gt.fx,gt.fy,gt.fz,gt.fm,gt.pot,a.start,a.end,b.start,b.end,gt.eps2);
+    }
+    else if (ia==ib) DirectPotentialSelf(gt.px,gt.py,gt.pz,gt.msrc,gt.pot,a.start,a.end,gt.eps2);
+    else DirectPotentialPair(gt.px,gt.py,gt.pz,gt.msrc,gt.pot,a.start,a.end,b.start,b.end,gt.eps2);
+}
+
+/*!
+    Dual tree walk adding the field of source cell b to sink cell a. The cells are well separated if \f$ \theta d > b_{\rm max,a}+b_{\rm max,b} \f$,
+    with d the distance between their centres-of-mass. Then, if a is also small compared to d, \f$ b_{\rm max,a}\leq f\theta d \f$ with f=\ref GRAVSINKTHETAFAC,
+    the multipole of b is added to the local expansion of a. If a is too large for its local expansion to be accurate it is split, and once it is a leaf
+    the multipole of b is applied to each of its particles. This matters for sparse regions, such as the outskirts of haloes, where the cells are large
+    and the potential is dominated by the distant centre.
+    If the cells are not well separated the larger cell is split and for two leaves the particles interact directly. Sources without mass are skipped.
+    Only a and its descendants are updated so different sinks can be processed in parallel.
+*/
+static void GravityDualWalk(GravityTree &gt, const Int_t ia, const Int_t ib)
+{
+    const GravityCell &ca=gt.cells[ia], &cb=gt.sources[ib];
+    const GravityNode &a=gt.nodes[ia], &b=gt.nodes[ib];
+    if (cb.mass==0) return;
+    Double_t r2=0, s=ca.bmax+cb.bmax;
+    for (int n=0;n<3;n++) r2+=(ca.cm[n]-cb.cm[n])*(ca.cm[n]-cb.cm[n]);
+    int aleaf=(a.left<0), bleaf=(b.left<0);
+    if (ia!=ib && r2*gt.theta2>s*s) {
+        if (ca.bmax*ca.bmax<=GRAVSINKTHETAFAC*GRAVSINKTHETAFAC*gt.theta2*r2) GravityM2L(gt,ia,cb,r2,s);
+        else if (aleaf) GravityM2P(gt,ia,cb,sqrt(r2)-ca.bmax);
+        else {
+            GravityDualWalk(gt,a.left,ib);
+            GravityDualWalk(gt,a.right,ib);
+        }
+    }
+    else if (aleaf && bleaf) GravityP2P(gt,ia,ib);
+    else if (bleaf || (!aleaf && ca.bmax>=cb.bmax)) {
+        GravityDualWalk(gt,a.left,ib);
+        GravityDualWalk(gt,a.right,ib);
+    }
+    else {
+        GravityDualWalk(gt,ia,b.left);
+        GravityDualWalk(gt,ia,b.right);
+    }
+}
+
+/*!
+    As \ref GravityDualWalk but for the sources of another tree et, such as a tree copied from another process by \ref GravityTreeGetLET.
+    Closed cells of et cannot be split, so when one is not well separated from sink cell a, a is split and the multipole is applied to the particles of its leaves.
+    This is accurate because a closed cell is well separated from every point of the region for which the tree was copied.
+*/
+static void GravityExternalDualWalk(GravityTree &gt, const Int_t ia, const GravityTree &et, const Int_t ib)
+{
+    const GravityCell &ca=gt.cells[ia], &cb=et.cells[ib];
+    const GravityNode &a=gt.nodes[ia], &b=et.nodes[ib];
+    if (cb.mass==0) return;
+    Double_t r2=0, s=ca.bmax+cb.bmax;
+    for (int n=0;n<3;n++) r2+=(ca.cm[n]-cb.cm[n])*(ca.cm[n]-cb.cm[n]);
+    int aleaf=(a.left<0), bleaf=(b.left<0);
+    if (r2*gt.theta2>s*s) {
+        if (ca.bmax*ca.bmax<=GRAVSINKTHETAFAC*GRAVSINKTHETAFAC*gt.theta2*r2) GravityM2L(gt,ia,cb,r2,s);
+        else if (aleaf) GravityM2P(gt,ia,cb,sqrt(r2)-ca.bmax);
+        else {
+            GravityExternalDualWalk(gt,a.left,et,ib);
+            GravityExternalDualWalk(gt,a.right,et,ib);
+        }
+    }
+    else if (aleaf && bleaf) {
+        if (b.start<b.end) DirectPotentialExternal(gt.px,gt.py,gt.pz,gt.pot,gt.gx,gt.gy,gt.gz,a.start,a.end,et.px,et.py,et.pz,et.pm,b.start,b.end,gt.eps2);
+        else {
+            Double_t d2, dmin2=r2;
+            for (Int_t j=a.start;j<a.end;j++) {
+                d2=(gt.px[j]-cb.cm[0])*(gt.px[j]-cb.cm[0])+(gt.py[j]-cb.cm[1])*(gt.py[j]-cb.cm[1])+(gt.pz[j]-cb.cm[2])*(gt.pz[j]-cb.cm[2]);
+                if (d2<dmin2) dmin2=d2;
+            }
+            GravityM2P(gt,ia,cb,sqrt(dmin2));
+        }
+    }
+    else if (bleaf || (!aleaf && ca.bmax>=cb.bmax)) {
+        GravityExternalDualWalk(gt,a.left,et,ib);
+        GravityExternalDualWalk(gt,a.right,et,ib);
+    }
+    else {
+        GravityExternalDualWalk(gt,ia,et,b.left);
+        GravityExternalDualWalk(gt,ia,et,b.right);
+    }
+}
+
+///pass the local expansion of cell a, about its centre-of-mass, down to its daughters and at leaves evaluate it (and its gradient) for each particle
+static void GravityDownPass(GravityTree &gt, const Int_t ia)
+{
+    const GravityCell &ca=gt.cells[ia];
+    const GravityNode &a=gt.nodes[ia];
+    const Double_t *local=gt.local[ia];
+    Double_t dx[3],g[3];
+    if (a.left<0) {
+        for (Int_t j=a.start;j<a.end;j++) {
+            dx[0]=gt.px[j]-ca.cm[0];dx[1]=gt.py[j]-ca.cm[1];dx[2]=gt.pz[j]-ca.cm[2];
+            gt.pot[j]+=GravityL2P(local,dx);
+            gt.errpot[j]+=gt.errlocal[ia];
+            if (gt.gx!=NULL) {
+                g[0]=g[1]=g[2]=0;
+                GravityL2G(local,dx,g);
+                gt.gx[j]+=g[0];gt.gy[j]+=g[1];gt.gz[j]+=g[2];
+            }
+        }
+        return;
+    }
+    Int_t daughter[2]={a.left,a.right};
+    for (int k=0;k<2;k++) {
+        Int_t id=daughter[k];
+        for (int n=0;n<3;n++) dx[n]=gt.cells[id].cm[n]-ca.cm[n];
+        GravityL2L(local,dx,gt.local[id]);
+        gt.errlocal[id]+=gt.errlocal[ia];
+        GravityDownPass(gt,id);
+    }
+}
+
+/*!
+    Allocates the arrays of a tree of nbodies particles and ncell cells, with the gradient if iacc is set and the single precision copies if imixed is set
+    (and iacc is not). The sources are the cells and particle masses. A tree that is only the source of the field of other trees (see \ref GravityTreeExternalWalk)
+    needs just its topology, cell moments and particle positions and masses, so if isource is set the other arrays are left NULL.
+*/
+void GravityTreeAllocate(GravityTree &gt, const Int_t nbodies, const Int_t ncell, const int iacc, const int imixed, const int isource)
+{
+    gt.nbodies=nbodies;
+    gt.ncell=ncell;
+    gt.mremoved=0;
+    gt.nodes=new GravityNode[gt.ncell];
+    gt.cells=new GravityCell[gt.ncell];
+    gt.px=new Double_t[nbodies];
+    gt.py=new Double_t[nbodies];
+    gt.pz=new Double_t[nbodies];
+    gt.pm=new Double_t[nbodies];
+    gt.sources=gt.cells;
+    gt.msrc=gt.pm;
+    if (isource) {
+        gt.local=NULL;
+        gt.errlocal=gt.pot=gt.errpot=gt.gx=gt.gy=gt.gz=NULL;
+        gt.fx=gt.fy=gt.fz=gt.fm=gt.fpot=NULL;
+        gt.ids=gt.slot=NULL;
+        return;
+    }
+    gt.local=new Double_t[gt.ncell][GRAVLOCALNUM];
+    gt.errlocal=new Double_t[gt.ncell];
+    gt.pot=new Double_t[nbodies];
+    gt.errpot=new Double_t[nbodies];
+    if (iacc) {
+        gt.gx=new Double_t[nbodies];
+        gt.gy=new Double_t[nbodies];
+        gt.gz=new Double_t[nbodies];
+    }
+    else gt.gx=gt.gy=gt.gz=NULL;
+    if (imixed && !iacc) {
+        gt.fx=new float[nbodies];
+        gt.fy=new float[nbodies];
+        gt.fz=new float[nbodies];
+        gt.fm=new float[nbodies];
+        gt.fpot=new float[nbodies];
+    }
+    else gt.fx=gt.fy=gt.fz=gt.fm=gt.fpot=NULL;
+    gt.ids=new Int_t[nbodies];
+    gt.slot=new Int_t[nbodies];
+}
+
+/*!
+    The kd-tree is freed once its topology and the particle positions and masses in tree order have been copied, which returns the particles to their
+    original order, but their ids are left set to their index.
+*/
+void GravityTreeBuild(const GravityInfo &gi, GravityTree &gt, const Int_t nbodies, Particle *Part, const int iacc)
+{
+    KDTree *tree;
+    Double_t mtot=0;
+    gt.bsize=gi.bsize;
+    gt.ompnum=gi.ompnum;
+    gt.theta2=gi.theta*gi.theta;
+    gt.eps2=gi.eps*gi.eps;
+    //ids are set to the original index of the particles by the tree
+    tree=new KDTree(Part,nbodies,gi.bsize,KDTree::TPHYS);
+    GravityTreeAllocate(gt,nbodies,tree->GetNumNodes(),iacc,gi.imixed);
+
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<gt.ncell;j++) {
+        Node *np=tree->GetNode(j);
+        gt.nodes[j].start=np->GetStart();
+        gt.nodes[j].end=np->GetEnd();
+        if (np->GetCount()>gt.bsize) {
+            gt.nodes[j].left=((SplitNode*)np)->GetLeft()->GetID();
+            gt.nodes[j].right=((SplitNode*)np)->GetRight()->GetID();
+        }
+        else gt.nodes[j].left=gt.nodes[j].right=-1;
+        for (int n=0;n<3;n++) {gt.nodes[j].bnd[n][0]=np->GetBoundary(n,0);gt.nodes[j].bnd[n][1]=np->GetBoundary(n,1);}
+    }
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) reduction(+:mtot) if (nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<nbodies;j++) {
+        gt.px[j]=Part[j].GetPosition(0);gt.py[j]=Part[j].GetPosition(1);gt.pz[j]=Part[j].GetPosition(2);
+        gt.pm[j]=Part[j].GetMass();
+        mtot+=gt.pm[j];
+        gt.ids[j]=Part[j].GetID();
+        gt.slot[gt.ids[j]]=j;
+    }
+    gt.mtot=mtot;
+    delete tree;
+    //single precision positions relative to the centre of the root cell
+    if (gt.fx!=NULL) {
+        Double_t cen[3];
+        for (int n=0;n<3;n++) cen[n]=0.5*(gt.nodes[0].bnd[n][0]+gt.nodes[0].bnd[n][1]);
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>gt.ompnum)
+#endif
+        for (Int_t j=0;j<nbodies;j++) {
+            gt.fx[j]=gt.px[j]-cen[0];gt.fy[j]=gt.py[j]-cen[1];gt.fz[j]=gt.pz[j]-cen[2];
+            gt.fm[j]=gt.pm[j];
+        }
+    }
+
+    //moments of leaves directly from particles, then moving up the tree as cells are stored in pre-order, so daughters follow their parent
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(dynamic,64) if (nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<gt.ncell;j++) if (gt.nodes[j].left<0) GetLeafMoments(gt,gt.cells[j],gt.nodes[j].start,gt.nodes[j].end,0);
+    for (Int_t j=gt.ncell-1;j>=0;j--) if (gt.nodes[j].left>=0)
+        GetSplitMoments(gt.cells[j],gt.cells[gt.nodes[j].left],gt.cells[gt.nodes[j].right],gt.nodes[j]);
+}
+
+///zero the local expansions of the cells and, if ipot is set, the potential (and gradient) of the particles
+static void GravityTreeReset(GravityTree &gt, const int ipot)
+{
+#ifdef USEOPENMP
+#pragma omp parallel if (gt.nbodies>gt.ompnum)
+{
+    #pragma omp for schedule(static) nowait
+#endif
+    for (Int_t j=0;j<gt.ncell;j++) {
+        for (int n=0;n<GRAVLOCALNUM;n++) gt.local[j][n]=0;
+        gt.errlocal[j]=0;
+    }
+    if (ipot) {
+#ifdef USEOPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (Int_t j=0;j<gt.nbodies;j++) {
+            gt.pot[j]=gt.errpot[j]=0;
+            if (gt.gx!=NULL) gt.gx[j]=gt.gy[j]=gt.gz[j]=0;
+        }
+    }
+#ifdef USEOPENMP
+}
+#endif
+}
+
+///the sinks are divided into subtrees, several per thread to balance the load, each of which is walked by one thread
+static void GetGravityTaskList(const GravityTree &gt, vector<Int_t> &tasks)
+{
+    Int_t ntask, nthreads=1;
+#ifdef USEOPENMP
+    if (gt.nbodies>gt.ompnum) nthreads=omp_get_max_threads();
+#endif
+    ntask=max((Int_t)GRAVTASKMINNUM,gt.nbodies/(GRAVTASKNUM*nthreads));
+    GetGravityTasks(gt,0,tasks,ntask);
+}
+
+///The sinks are divided into subtrees, several per thread to balance the load, each of which is walked against the whole tree by one thread
+void GravityTreeWalk(GravityTree &gt)
+{
+    vector<Int_t> tasks;
+    Int_t ntasks;
+    GravityTreeReset(gt,1);
+    GetGravityTaskList(gt,tasks);
+    ntasks=tasks.size();
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(dynamic,1) if (gt.nbodies>gt.ompnum)
+#endif
+    for (Int_t it=0;it<ntasks;it++) {
+        GravityDualWalk(gt,tasks[it],0);
+        GravityDownPass(gt,tasks[it]);
+    }
+}
+
+void GravityTreeFree(GravityTree &gt)
+{
+    if (gt.sources!=gt.cells) delete[] gt.sources;
+    if (gt.msrc!=gt.pm) delete[] gt.msrc;
+    delete[] gt.nodes;
+    delete[] gt.cells;
+    delete[] gt.local;
+    delete[] gt.errlocal;
+    delete[] gt.px;
+    delete[] gt.py;
+    delete[] gt.pz;
+    delete[] gt.pm;
+    delete[] gt.pot;
+    delete[] gt.errpot;
+    if (gt.gx!=NULL) {
+        delete[] gt.gx;
+        delete[] gt.gy;
+        delete[] gt.gz;
+    }
+    if (gt.fx!=NULL) {
+        delete[] gt.fx;
+        delete[] gt.fy;
+        delete[] gt.fz;
+        delete[] gt.fm;
+        delete[] gt.fpot;
+    }
+    delete[] gt.ids;
+    delete[] gt.slot;
+}
+
+/*!
+    Calculates the gravitational potential energy of a set of particles, \f$ -G m_i\sum_j m_j/\sqrt{r_{ij}^2+\epsilon^2} \f$, using a kd-tree
+    with quadrupole moments and a fast multipole style dual tree walk (see \ref GravityDualWalk).
+    Well separated pairs of cells interact once through the third order local expansion of the sink cell, which is then passed down the tree to the particles,
+    so only particles in neighbouring leaves are summed directly. The accuracy is set by the opening angle \ref GravityInfo.theta.
+
+    If potV is NULL the potential is stored in the particles, otherwise it is stored in potV in the original order of the particles.
+    If acc is not NULL the accelerations are stored in acc[3*i+k] and if errV is not NULL the bound on the relative error of the potential of each
+    particle is stored in errV, both in the original order of the particles.
+    Returns the maximum over particles of the bound on the relative error of the expansions. This is a worst case bound and the typical error
+    is orders of magnitude smaller.
+*/
+Double_t GravityTreePotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, Double_t *potV, Double_t *acc, Double_t *errV)
+{
+    GravityTree gt;
+    Double_t maxerr;
+
+    if (nbodies<=0) return 0;
+    GravityTreeBuild(gi,gt,nbodies,Part,(acc!=NULL));
+    GravityTreeWalk(gt);
+    maxerr=GravityTreeGetPotential(gi,gt,Part,potV,acc,errV);
+    GravityTreeFree(gt);
+    return maxerr;
+}
+
+///Stores the potential calculated by the walk of a tree as described in \ref GravityTreePotential and returns the largest bound on the relative error
+Double_t GravityTreeGetPotential(const GravityInfo &gi, const GravityTree &gt, Particle *Part, Double_t *potV, Double_t *acc, Double_t *errV)
+{
+    Double_t maxerr=0;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) reduction(max:maxerr) if (gt.nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<gt.nbodies;j++) {
+        Int_t id=gt.ids[j];
+        if (gt.pot[j]<0 && gt.errpot[j]>-maxerr*gt.pot[j]) maxerr=-gt.errpot[j]/gt.pot[j];
+        Double_t pot=gi.G*gt.pm[j]*gt.pot[j];
+        if (potV==NULL) Part[id].SetPotential(pot);
+        else potV[id]=pot;
+        if (acc!=NULL) {acc[3*id]=-gi.G*gt.gx[j];acc[3*id+1]=-gi.G*gt.gy[j];acc[3*id+2]=-gi.G*gt.gz[j];}
+        if (errV!=NULL) errV[id]=(gt.pot[j]<0)?-gt.errpot[j]/gt.pot[j]:0;
+    }
+    return maxerr;
+}
+
+/*!
+    Removes particles from a tree kept while particles are removed from a set, such as when unbinding a large group. The change in the potential of the remaining particles
+    is just the field of the removed particles, so the source moments of the removed particles are calculated, only for the cells that contain them,
+    and the dual tree walk is repeated with them as the only sources. Cells without removed particles are skipped, so only the cell-cell terms involving
+    removed particles are refreshed. The particles are indexed as when the tree was built, with \ref GravityTree.slot kept up to date by the caller as particles
+    are moved, and the change in their potential energy is scaled by Gscale. In mixed precision the single precision source masses follow msrc. Only the potential stored in the particles is updated.
+*/
+void GravityTreeRemove(GravityTree &gt, const Int_t nbodies, Particle *Part, const Int_t nremove, const Int_t *removeid, const Double_t Gscale)
+{
+    Int_t *src;
+    if (nremove<=0) return;
+    if (gt.sources==gt.cells) {
+        gt.sources=new GravityCell[gt.ncell];
+        gt.msrc=new Double_t[gt.nbodies];
+        for (Int_t j=0;j<gt.nbodies;j++) gt.msrc[j]=0;
+        if (gt.fm!=NULL) for (Int_t j=0;j<gt.nbodies;j++) gt.fm[j]=0;
+    }
+    src=new Int_t[nremove];
+    for (Int_t k=0;k<nremove;k++) {
+        src[k]=gt.slot[removeid[k]];
+        gt.msrc[src[k]]=gt.pm[src[k]];
+        if (gt.fm!=NULL) gt.fm[src[k]]=gt.pm[src[k]];
+        gt.mremoved+=gt.pm[src[k]];
+    }
+    sort(src,src+nremove);
+    GetSourceMoments(gt,0,src,0,nremove);
+    GravityTreeWalk(gt);
+    for (Int_t k=0;k<nremove;k++) gt.msrc[src[k]]=0;
+    if (gt.fm!=NULL) for (Int_t k=0;k<nremove;k++) gt.fm[src[k]]=0;
+    delete[] src;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(Part[j].GetPotential()-Gscale*gt.pm[gt.slot[j]]*gt.pot[gt.slot[j]]);
+}
+
+///append cell id of gt, and the cells below it that are needed, to the copy of the tree for the field in the box bnd, see \ref GravityTreeGetLET, returning its index in the copy
+static Int_t GetLETCells(const GravityTree &gt, const Int_t id, const Double_t bnd[3][2], vector<GravityNode> &nodes, vector<GravityCell> &cells, vector<Int_t> &parts)
+{
+    const GravityNode &node=gt.nodes[id];
+    const GravityCell &c=gt.cells[id];
+    Int_t il=nodes.size(), left, right;
+    Double_t d2=0, dx;
+    for (int n=0;n<3;n++) {
+        dx=max(max(bnd[n][0]-c.cm[n],c.cm[n]-bnd[n][1]),(Double_t)0);
+        d2+=dx*dx;
+    }
+    nodes.push_back(node);
+    cells.push_back(c);
+    nodes[il].start=nodes[il].end=parts.size();
+    nodes[il].left=nodes[il].right=-1;
+    if (c.mass==0 || d2*gt.theta2>c.bmax*c.bmax) return il;
+    if (node.left<0) {
+        for (Int_t k=node.start;k<node.end;k++) parts.push_back(k);
+        nodes[il].end=parts.size();
+        return il;
+    }
+    left=GetLETCells(gt,node.left,bnd,nodes,cells,parts);
+    right=GetLETCells(gt,node.right,bnd,nodes,cells,parts);
+    nodes[il].left=left;
+    nodes[il].right=right;
+    nodes[il].end=parts.size();
+    return il;
+}
+
+/*!
+    Copies the part of a tree needed to calculate its field at any point of the box bnd, a locally essential tree in the sense of parallel tree codes, to let,
+    which is allocated here as a source tree (see \ref GravityTreeAllocate). Cells whose multipole is accurate everywhere in the box, \f$ \theta d > b_{\rm max} \f$
+    with d the distance from the centre-of-mass to the box, are copied as closed cells with their moments but without their daughters or particles,
+    and the particles of the leaves that are not are copied. For a box far from the tree only a few cells are copied.
+*/
+void GravityTreeGetLET(const GravityTree &gt, const Double_t bnd[3][2], GravityTree &let)
+{
+    vector<GravityNode> nodes;
+    vector<GravityCell> cells;
+    vector<Int_t> parts;
+    GetLETCells(gt,0,bnd,nodes,cells,parts);
+    GravityTreeAllocate(let,parts.size(),nodes.size(),0,0,1);
+    let.bsize=gt.bsize;
+    let.ompnum=gt.ompnum;
+    let.theta2=gt.theta2;
+    let.eps2=gt.eps2;
+    let.mtot=cells[0].mass;
+    for (Int_t j=0;j<let.ncell;j++) {let.nodes[j]=nodes[j];let.cells[j]=cells[j];}
+    for (Int_t j=0;j<let.nbodies;j++) {
+        let.px[j]=gt.px[parts[j]];let.py[j]=gt.py[parts[j]];let.pz[j]=gt.pz[parts[j]];
+        let.pm[j]=gt.pm[parts[j]];
+    }
+}
+
+/*!
+    Adds the field of the sources of the trees ext[0..next) to the potential (and gradient) of the particles of gt, walking each against the subtrees of gt
+    (see \ref GravityExternalDualWalk) before passing the local expansions down once. Trees without cells are skipped. The particles of ext are always
+    summed in double precision. With the trees of other processes copied by \ref GravityTreeGetLET for the box of gt, this completes the potential calculated by
+    \ref GravityTreeWalk for a set of particles divided between processes.
+*/
+void GravityTreeExternalWalk(GravityTree &gt, const int next, const GravityTree *ext)
+{
+    vector<Int_t> tasks;
+    Int_t ntasks;
+    GravityTreeReset(gt,0);
+    GetGravityTaskList(gt,tasks);
+    ntasks=tasks.size();
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(dynamic,1) if (gt.nbodies>gt.ompnum)
+#endif
+    for (Int_t it=0;it<ntasks;it++) {
+        for (int ie=0;ie<next;ie++) if (ext[ie].ncell>0) GravityExternalDualWalk(gt,tasks[it],ext[ie],0);
+        GravityDownPass(gt,tasks[it]);
+    }
+}
+
+/*!
+    As \ref GravityTreeRemove but the removed particles are those of the tree rt rather than of gt, such as the particles removed by all the processes
+    unbinding a group divided between them. The potential of the particles of gt is recalculated with rt as the only source and the change in the potential energy
+    of Part, indexed through \ref GravityTree.slot, is scaled by Gscale. The removed mass is not added to \ref GravityTree.mremoved, as rt need not come from gt.
+*/
+void GravityTreeRemoveExternal(GravityTree &gt, const Int_t nbodies, Particle *Part, const GravityTree &rt, const Double_t Gscale)
+{
+    if (rt.nbodies<=0) return;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (gt.nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<gt.nbodies;j++) gt.pot[j]=gt.errpot[j]=0;
+    GravityTreeExternalWalk(gt,1,&rt);
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>gt.ompnum)
+#endif
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(Part[j].GetPotential()-Gscale*gt.pm[gt.slot[j]]*gt.pot[gt.slot[j]]);
+}
+//@}
+
+}
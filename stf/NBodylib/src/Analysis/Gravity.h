@@ -0,0 +1,138 @@
+/*! \file Gravity.h
+ *  \brief gravitational potential and accelerations of a set of particles by direct summation or with a kd-tree
+ */
+
+#ifndef GRAVITY_H
+#define GRAVITY_H
+
+#include <vector>
+#include <NBody.h>
+#include <KDTree.h>
+
+///\name Parameters of the tree gravity calculation
+//@{
+///minimum number of particles in the subtrees into which the tree potential calculation is divided
+#define GRAVTASKMINNUM 1024
+///number of subtrees per thread into which the tree potential calculation is divided
+#define GRAVTASKNUM 16
+///number of coefficients of the third order local expansion of the potential used by the tree potential calculation
+#define GRAVLOCALNUM 20
+///in the tree potential calculation, the local expansion of a sink cell is only used if the cell is smaller than this fraction of the opening angle times the distance to the source
+#define GRAVSINKTHETAFAC 0.25
+///sets of up to this many particles use scratch arrays on the stack for direct summation
+#define GRAVDIRECTBUFFNUM 256
+///in mixed precision, the number of pair interactions summed in single precision before the partial sum is added in double precision
+#define GRAVMIXEDBLOCK 256
+///relative accuracy of potentials summed in mixed precision, below which energies should be checked in double precision
+#define GRAVMIXEDERR 1e-4
+//@}
+
+namespace NBody
+{
+    /*!
+        Parameters of a gravity calculation: the gravitational constant, the plummer softening length, the opening angle of the tree,
+        the bucket size of the kd-tree and the number of particles above which the calculation is run with openmp.
+        If imixed is set, the particle-particle interactions of the potential are calculated in single precision from positions relative to the
+        centre of the particles and summed in blocks of \ref GRAVMIXEDBLOCK terms before being added in double precision,
+        giving a relative accuracy of about \ref GRAVMIXEDERR. Accelerations and multipole interactions are always calculated in full precision.
+    */
+    struct GravityInfo
+    {
+        Double_t G, eps, theta;
+        int bsize;
+        Int_t ompnum;
+        int imixed;
+        GravityInfo(){
+            G=1.0;
+            eps=0;
+            theta=0.5;
+            bsize=8;
+            ompnum=1000;
+            imixed=0;
+        }
+    };
+
+    /*!
+        Multipole moments of a tree cell: the mass, centre-of-mass, the radius about the centre-of-mass that encloses
+        all of the cell's particles and the traceless quadrupole tensor \f$ Q_{ij}=\sum_k m_k(3y_{k,i}y_{k,j}-y_k^2\delta_{ij}) \f$,
+        with \f$ y \f$ the offset from the centre-of-mass, stored as xx,yy,zz,xy,xz,yz.
+    */
+    struct GravityCell
+    {
+        Double_t mass, bmax;
+        Double_t cm[3], quad[6];
+    };
+
+    /*!
+        Topology of a tree cell copied from the kd-tree, so that the tree gravity calculation does not depend on the lifetime of the kd-tree:
+        the range of the cell's particles in tree order, the ids of the daughter cells (-1 for leaves) and the bounding box of the particles.
+        In a tree copied for the field of a region (see \ref GravityTreeGetLET) a leaf without particles is a closed cell, whose field is that of its multipole.
+    */
+    struct GravityNode
+    {
+        Int_t start, end, left, right;
+        Double_t bnd[3][2];
+    };
+
+    /*!
+        Data shared by the routines of the tree gravity calculation: the tree topology, the cell moments, the local expansion of each cell about its centre-of-mass
+        (the potential, its gradient, its second derivatives stored as xx,yy,zz,xy,xz,yz and its third derivatives stored as
+        xxx,yyy,zzz,xxy,xxz,xyy,yyz,xzz,yzz,xyz), the bound on the error of the local expansion,
+        the particle positions and masses copied to contiguous arrays in tree order and the potential (without G and the particle's own mass) accumulated for each particle.
+        If the tree is built to calculate accelerations the gradient of the potential of each particle is accumulated in gx, gy, gz, otherwise these are NULL.
+        In mixed precision the particle positions relative to the centre of the root cell and the source masses are also stored in single precision in
+        fx, fy, fz, fm, with fpot single precision scratch for the direct sums, otherwise these are NULL.
+        The sources of the field are the moments in sources and the masses in msrc, which are the cell moments and particle masses unless only the field of
+        a subset of the particles is wanted (see \ref GravityTreeRemove). ids stores the index of each particle in the array from which the tree was built and slot
+        its inverse. The total mass and the mass removed since the tree was built are used by callers that keep a tree while removing particles to decide when to rebuild it.
+    */
+    struct GravityTree
+    {
+        Int_t nbodies, ncell, bsize, ompnum;
+        GravityNode *nodes;
+        GravityCell *cells, *sources;
+        Double_t (*local)[GRAVLOCALNUM];
+        Double_t *errlocal;
+        Double_t *px, *py, *pz, *pm, *msrc, *pot, *errpot;
+        Double_t *gx, *gy, *gz;
+        float *fx, *fy, *fz, *fm, *fpot;
+        Int_t *ids, *slot;
+        Double_t theta2, eps2, mtot, mremoved;
+    };
+
+    ///\name Direct summation
+    //@{
+    /// Calculate the potential of a set of particles, \f$ -G m_i\sum_j m_j/\sqrt{r_{ij}^2+\epsilon^2} \f$, by direct summation and store it in the particles.
+    /// If acc is not NULL the accelerations are stored in acc[3*i+k]. Used for small sets, where building a tree is not worthwhile.
+    void GravityDirectPotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, Double_t *acc=NULL);
+    /// Calculate the potential of particle i of a set by direct summation in double precision, used to check potentials calculated in mixed precision
+    double GravityParticlePotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, const Int_t i);
+    //@}
+
+    ///\name Tree gravity
+    //@{
+    /// Allocate the arrays of a tree, used by \ref GravityTreeBuild and to hold copies of a tree built elsewhere. If isource is set only the arrays of a tree used as a source of the field of other trees are allocated
+    void GravityTreeAllocate(GravityTree &gt, const Int_t nbodies, const Int_t ncell, const int iacc=0, const int imixed=0, const int isource=0);
+    /// Build the kd-tree of the particles, copy its topology and the particle positions and masses to gt and calculate the cell moments.
+    /// If iacc is set the tree also accumulates the gradient of the potential.
+    void GravityTreeBuild(const GravityInfo &gi, GravityTree &gt, const Int_t nbodies, Particle *Part, const int iacc=0);
+    /// Calculate the potential (and gradient) of all the particles in the tree due to its sources
+    void GravityTreeWalk(GravityTree &gt);
+    /// Subtract G times scale times the field of a set of particles from the potential of the particles of the tree, see \ref GravityTreeRemove
+    void GravityTreeRemove(GravityTree &gt, const Int_t nbodies, Particle *Part, const Int_t nremove, const Int_t *removeid, const Double_t Gscale);
+    /// Copy the part of a tree needed to calculate its field in the box bnd, see \ref GravityTreeGetLET
+    void GravityTreeGetLET(const GravityTree &gt, const Double_t bnd[3][2], GravityTree &let);
+    /// Add the field of the trees ext to the potential (and gradient) of the particles of a tree, see \ref GravityTreeExternalWalk
+    void GravityTreeExternalWalk(GravityTree &gt, const int next, const GravityTree *ext);
+    /// Subtract G times scale times the field of the particles of another tree from the potential of the particles of the tree, see \ref GravityTreeRemoveExternal
+    void GravityTreeRemoveExternal(GravityTree &gt, const Int_t nbodies, Particle *Part, const GravityTree &rt, const Double_t Gscale);
+    /// Free the memory of a tree
+    void GravityTreeFree(GravityTree &gt);
+    /// Calculate the potential of a set of particles with the tree, returning the largest bound on the relative error, see \ref GravityTreePotential
+    Double_t GravityTreePotential(const GravityInfo &gi, const Int_t nbodies, Particle *Part, Double_t *potV=NULL, Double_t *acc=NULL, Double_t *errV=NULL);
+    /// Store the potential calculated by the walk of a tree in the particles it was built from, see \ref GravityTreeGetPotential
+    Double_t GravityTreeGetPotential(const GravityInfo &gi, const GravityTree &gt, Particle *Part, Double_t *potV=NULL, Double_t *acc=NULL, Double_t *errV=NULL);
+    //@}
+}
+
+#endif
@@ -53,7 +53,79 @@ namespace NBody
         }
         return (total<1);
     }
+    //3D fof where the primary particle must be of type params[7] for a link to occur
+    //here params 6 is physical linking length
+    inline int FOF3dType(Particle &a, Particle &b, Double_t *params){
+        if (a.GetType()!=int(params[7])) return 0;
+        Double_t total=0;
+        for (int j=0;j<3;j++)
+            total+=(a.GetPosition(j)-b.GetPosition(j))*(a.GetPosition(j)-b.GetPosition(j))/params[6];
+        return (total<1);
+    }
+
     //simple no check function just as placeholder
     inline int Pnocheck(Particle &a, Double_t *params){return 0;}
+
+    //-- FOF Comparison Functors
+
+    /// \name FOF comparison functors
+    /// Compile time versions of the common comparison functions above. The FOF searches in \ref NBody::KDTree use these
+    /// in place of \ref FOF3d, \ref FOF6d and \ref FOF3dType so that the comparison is inlined into the leaf loop.
+    /// Linking lengths are taken from params when constructed and stored so the pair test has no divisions.
+    //@{
+    class FOF3dFunctor
+    {
+        Double_t xl2;
+        public:
+        FOF3dFunctor(Double_t *params){xl2=params[6];}
+        inline int operator()(Particle &a, Particle &b) const {
+            Double_t dx, total=0;
+            for (int j=0;j<3;j++) {dx=a.GetPosition(j)-b.GetPosition(j);total+=dx*dx;}
+            return (total<xl2);
+        }
+        ///linking measure used to order links, the distance^2 in units of the linking length^2
+        inline Double_t LinkMeasure(Particle &a, Particle &b) const {
+            Double_t dx, total=0;
+            for (int j=0;j<3;j++) {dx=a.GetPosition(j)-b.GetPosition(j);total+=dx*dx;}
+            return total/xl2;
+        }
+    };
+    class FOF6dFunctor
+    {
+        Double_t ixl2, ivl2;
+        public:
+        FOF6dFunctor(Double_t *params){ixl2=1.0/params[6];ivl2=1.0/params[7];}
+        inline int operator()(Particle &a, Particle &b) const {
+            Double_t dx, dv, totalx=0, totalv=0;
+            for (int j=0;j<3;j++) {
+                dx=a.GetPosition(j)-b.GetPosition(j);totalx+=dx*dx;
+                dv=a.GetVelocity(j)-b.GetVelocity(j);totalv+=dv*dv;
+            }
+            return (totalx*ixl2+totalv*ivl2<1);
+        }
+        ///linking measure used to order links, which are those with a measure below one
+        inline Double_t LinkMeasure(Particle &a, Particle &b) const {
+            Double_t dx, dv, totalx=0, totalv=0;
+            for (int j=0;j<3;j++) {
+                dx=a.GetPosition(j)-b.GetPosition(j);totalx+=dx*dx;
+                dv=a.GetVelocity(j)-b.GetVelocity(j);totalv+=dv*dv;
+            }
+            return totalx*ixl2+totalv*ivl2;
+        }
+    };
+    class FOF3dTypeFunctor
+    {
+        Double_t xl2;
+        int itype;
+        public:
+        FOF3dTypeFunctor(Double_t *params){xl2=params[6];itype=int(params[7]);}
+        inline int operator()(Particle &a, Particle &b) const {
+            if (a.GetType()!=itype) return 0;
+            Double_t dx, total=0;
+            for (int j=0;j<3;j++) {dx=a.GetPosition(j)-b.GetPosition(j);total+=dx*dx;}
+            return (total<xl2);
+        }
+    };
+    //@}
 }
 #endif 
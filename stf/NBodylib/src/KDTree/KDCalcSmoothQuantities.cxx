@@ -324,6 +324,29 @@ namespace NBody
             Nsmooth=Nsearch;
         }
 
+        //the physical neighbours of all particles are found together with the dual tree search, a chunk at a time
+        if (treetype==TPHYS) {
+            PriorityQueue *pq2=new PriorityQueue(Nsmooth);
+            Int_t *nnIDs=new Int_t[DUALTREECHUNKSIZE*Nsearch];
+            Double_t *nndist2=new Double_t[DUALTREECHUNKSIZE*Nsearch];
+            Double_t *vdist=new Double_t[Nsearch];
+            Double_t *vden=new Double_t[DUALTREECHUNKSIZE];
+            Double_t *qbound=new Double_t[GetRangeBoundSize(DUALTREECHUNKSIZE)];
+            for (Int_t istart = 0; istart < numparts; istart+=DUALTREECHUNKSIZE)
+            {
+                Int_t iend=min(istart+DUALTREECHUNKSIZE,numparts);
+                CalcVelDensityRange(istart,iend,vden,Nsmooth,Nsearch,pq2,nnIDs,nndist2,vdist,qbound);
+                for (Int_t i = istart; i < iend; i++) bucket[i].SetDensity(vden[i-istart]);
+            }
+            delete pq2;
+            delete[] nnIDs;
+            delete[] nndist2;
+            delete[] vdist;
+            delete[] vden;
+            delete[] qbound;
+            return;
+        }
+
         for (Int_t i = 0; i < numparts; i++) bucket[i].SetDensity(0);
 
         //create priority queues
@@ -888,43 +911,103 @@ namespace NBody
                 }
             }
         }
-        for (Int_t j = 0; j <Nsearch; j++) {
+        //store neighbours in order of increasing distance
+        for (Int_t j = Nsearch-1; j >=0; j--) {
             if (pq->TopQueue() == -1)
             {
                 printf("CalcDensity failed for some reason\n");
                 exit(1);
             }
             nnIDs[j]=pq->TopQueue();
-            vdist[j]=sqrt(VelDistSqd(bucket[target].GetVelocity(),bucket[nnIDs[j]].GetVelocity(),ND));
             pq->Pop();
         }
+        vden=CalcVelDensityNN(target,Nsmooth,Nsearch,nnIDs,vdist,pq2);
+        if (iflag==0) {
+        delete pq;
+        delete pq2;
+        delete[] vdist;
+        delete[] nnIDs;
+        }
+        return vden;
+    }
+    void KDTree::CalcVelDensityParticles(Int_t nq, Int_t *tt, Double_t *vden, Int_t Nsmooth, Int_t Nsearch, PriorityQueue *pq, PriorityQueue *pq2, Int_t *nnIDs, Double_t *nndist2, Double_t *vdist)
+    {
+        if (root==NULL) {
+            printf("Error in tree construction, rootNode==NULL. Nothing Done.\n");
+            exit(1);
+        }
+        //only physical trees are searched in batches, with the search ignoring periodicity as in CalcVelDensityParticle
+        if (treetype!=TPHYS) {
+            for (Int_t i=0;i<nq;i++) vden[i]=CalcVelDensityParticle(tt[i],Nsmooth,Nsearch,1,pq,pq2,nnIDs,vdist);
+            return;
+        }
+        if (Nsmooth>Nsearch) {
+            printf("CalcVelDensity Nsmooth must be < Nsearch, setting Nsmooth=Nsearch\n");
+            Nsmooth=Nsearch;
+        }
+        FindNearestPosBatch(nq,tt,nnIDs,nndist2,Nsearch,pq);
+        for (Int_t i=0;i<nq;i++) {
+            if (nnIDs[i*Nsearch+Nsearch-1] == -1)
+            {
+                printf("CalcDensity failed for some reason\n");
+                exit(1);
+            }
+            vden[i]=CalcVelDensityNN(tt[i],Nsmooth,Nsearch,&nnIDs[i*Nsearch],vdist,pq2);
+        }
+    }
+
+    void KDTree::CalcVelDensityRange(Int_t istart, Int_t iend, Double_t *vden, Int_t Nsmooth, Int_t Nsearch, PriorityQueue *pq2, Int_t *nnIDs, Double_t *nndist2, Double_t *vdist, Double_t *qbound)
+    {
+        if (root==NULL) {
+            printf("Error in tree construction, rootNode==NULL. Nothing Done.\n");
+            exit(1);
+        }
+        //only physical trees use the dual tree search, which ignores periodicity as in CalcVelDensityParticle
+        if (treetype!=TPHYS) {
+            for (Int_t i=istart;i<iend;i++) vden[i-istart]=CalcVelDensityParticle(i,Nsmooth,Nsearch);
+            return;
+        }
+        if (Nsmooth>Nsearch) {
+            printf("CalcVelDensity Nsmooth must be < Nsearch, setting Nsmooth=Nsearch\n");
+            Nsmooth=Nsearch;
+        }
+        FindNearestRangePos(istart,iend,nnIDs,nndist2,Nsearch,qbound);
+        for (Int_t i=0;i<iend-istart;i++) {
+            if (nnIDs[i*Nsearch+Nsearch-1] == -1)
+            {
+                printf("CalcDensity failed for some reason\n");
+                exit(1);
+            }
+            vden[i]=CalcVelDensityNN(istart+i,Nsmooth,Nsearch,&nnIDs[i*Nsearch],vdist,pq2);
+        }
+    }
+
+    ///The velocity distances are added to the queue starting with the furthest physical neighbour
+    Double_t KDTree::CalcVelDensityNN(Int_t target, Int_t Nsmooth, Int_t Nsearch, Int_t *nnIDs, Double_t *vdist, PriorityQueue *pq2)
+    {
+        Double_t furthest = MAXVALUE;
+        Double_t vden=0.;
+        for (Int_t j = 0; j <Nsearch; j++) vdist[j]=sqrt(VelDistSqd(bucket[target].GetVelocity(),bucket[nnIDs[j]].GetVelocity(),ND));
         for (Int_t j = 0; j <Nsmooth; j++) pq2->Push(-1, furthest);
-        for (Int_t j=0;j<Nsearch;j++)
+        for (Int_t j=Nsearch-1;j>=0;j--)
             if (vdist[j] < pq2->TopPriority()){
                 pq2->Pop();
                 pq2->Push(nnIDs[j], vdist[j]);
             }
         Double_t hi=0.5*pq2->TopPriority();
-        Double_t new_furthest = 0.0;
         //Normalizing by most distant neighbour
         Double_t norm=1.0/pow(hi,(Double_t)(ND*1.));
         for (Int_t j = 0; j < Nsmooth; j++)
         {
             Double_t rij = pq2->TopPriority();
-            Int_t id=pq2->TopQueue();
             //smoothing kernel used to get weight of particle in SPH calculation
             Double_t Wij = Wsm(rij/hi, (int)(rij/hi*0.5*(kernres-1)), kernres, 2.0/(Double_t)(kernres-1), Kernel)*norm;
             vden+=Wij;
             pq2->Pop();
         }
-        if (iflag==0) {
-        delete pq;
-        delete pq2;
-        delete[] vdist;
-        delete[] nnIDs;
-        }
         return vden;
     }
+
     Double_t KDTree::CalcVelDensityWithPhysDensityParticle(Int_t target, Int_t Nsmooth, Int_t Nsearch, int densityset)
     {
         if (root==NULL) {
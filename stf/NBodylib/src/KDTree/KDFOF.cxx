@@ -5,12 +5,291 @@
 */
 
 #include <KDTree.h>
+#include <algorithm>
 
 namespace NBody
 {
 
-    Int_t* KDTree::FOF(Double_t fdist, Int_t &numgroup, Int_t minnum, int order, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen)
+    /// \name Templated FOF searches
+    /// Same algorithms as the FOFcompfunc node searches in \ref KDLeafNode.cxx and \ref KDSplitNode.cxx but the comparison is a functor
+    /// inlined into the leaf loop. Nodes are leaves if they contain no more than the bucket size.
+    //@{
+    template<class FOFFunctor> void KDTree::FOFSearchCriterionFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, int isetbasis, Int_t iGroup, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t *off, Particle &p, Int_t target)
     {
+        if (np->GetCount()<=b) {
+            Int_t nid=np->GetID(), start=np->GetStart(), end=np->GetEnd(), id;
+            //if bucket already linked and particle already part of group, do nothing.
+            if(BucketFlag[nid]&&Head[target]==Head[start])return;
+            int flag=Head[start];
+            for (Int_t i = start; i < end; i++)
+            {
+                if (flag!=Head[i])flag=0;
+                id=bucket[i].GetID();
+                if (Group[id]==iGroup) continue;
+                if (Group[id]<0) continue;
+                if (cmp(p,bucket[i])) {
+                    //particle in another group cannot be used to generate links
+                    if (isetbasis && Group[id]>0) continue;
+                    Group[id]=iGroup;
+                    Fifo[iTail++]=i;
+                    Len[iGroup]++;
+
+                    Next[Tail[Head[target]]]=Head[i];
+                    Tail[Head[target]]=Tail[Head[i]];
+                    Head[i]=Head[target];
+                    if(iTail==numparts)iTail=0;
+                    flag=0;
+                }
+            }
+            if (flag) BucketFlag[nid]=1;
+            return;
+        }
+        SplitNode *sp=(SplitNode*)np;
+        int cut_dim=sp->GetCutDim();
+        Double_t old_off = off[cut_dim];
+        Double_t new_off = p.GetPhase(cut_dim) - sp->GetCutValue();
+        Node *first=sp->GetLeft(), *second=sp->GetRight();
+        if (new_off >= 0) {first=sp->GetRight();second=sp->GetLeft();}
+        FOFSearchCriterionFunctor(first,rd,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,p,target);
+        if ((int)params[0]==0) rd += (-old_off*old_off + new_off*new_off)/params[1];
+        else if ((int)params[0]==1) rd += (-old_off*old_off + new_off*new_off)/params[2];
+        else if ((int)params[0]==2) rd += (-old_off*old_off + new_off*new_off)/params[(cut_dim<3)*1+(cut_dim>=3)*2];
+        if (rd < 1)
+        {
+            off[cut_dim] = new_off;
+            FOFSearchCriterionFunctor(second,rd,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,p,target);
+            off[cut_dim] = old_off;
+        }
+    }
+
+    template<class FOFFunctor> void KDTree::FOFSearchCriterionFunctorPeriodic(FOFFunctor &cmp, Double_t *params, int isetbasis, Int_t iGroup, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t *off, Particle &p, Int_t target)
+    {
+        FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,p,target);
+        Coordinate x0(p.GetPosition()),xp;
+        Particle pp(p);
+        for (int k=0;k<NSPACEDIM;k++) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection1D(x0,xp,period,k);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,pp,target);
+        }
+        if (NSPACEDIM==3) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,0,1);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,0,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,1,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,pp,target);
+        }
+        if (NSPACEDIM>1) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflectionND(x0,xp,period,NSPACEDIM);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,Group,Len,Head,Tail,Next,BucketFlag,Fifo,iTail,off,pp,target);
+        }
+    }
+
+    template<class FOFFunctor> void KDTree::FOFSearchCriterionUnionFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, Int_t *Group, Int_tree_t *Parent, Double_t *off, Particle &p, Int_t target)
+    {
+        //only particles with tree index larger than target are linked
+        if (np->GetEnd()<=target+1) return;
+        if (np->GetCount()<=b) {
+            Int_t start=np->GetStart(), end=np->GetEnd();
+            if (start<=target) start=target+1;
+            for (Int_t i = start; i < end; i++)
+            {
+                //the inlined comparison is cheaper than the random access of the particle's tag so is done first
+                if (cmp(p,bucket[i]) && Group[bucket[i].GetID()]>=0) FOFUnion(Parent,target,i);
+            }
+            return;
+        }
+        SplitNode *sp=(SplitNode*)np;
+        int cut_dim=sp->GetCutDim();
+        Double_t old_off = off[cut_dim];
+        Double_t new_off = p.GetPhase(cut_dim) - sp->GetCutValue();
+        Node *first=sp->GetLeft(), *second=sp->GetRight();
+        if (new_off >= 0) {first=sp->GetRight();second=sp->GetLeft();}
+        FOFSearchCriterionUnionFunctor(first,rd,cmp,params,Group,Parent,off,p,target);
+        if ((int)params[0]==0) rd += (-old_off*old_off + new_off*new_off)/params[1];
+        else if ((int)params[0]==1) rd += (-old_off*old_off + new_off*new_off)/params[2];
+        else if ((int)params[0]==2) rd += (-old_off*old_off + new_off*new_off)/params[(cut_dim<3)*1+(cut_dim>=3)*2];
+        if (rd < 1)
+        {
+            off[cut_dim] = new_off;
+            FOFSearchCriterionUnionFunctor(second,rd,cmp,params,Group,Parent,off,p,target);
+            off[cut_dim] = old_off;
+        }
+    }
+
+    template<class FOFFunctor> void KDTree::FOFSearchCriterionUnionFunctorPeriodic(FOFFunctor &cmp, Double_t *params, Int_t *Group, Int_tree_t *Parent, Double_t *off, Particle &p, Int_t target)
+    {
+        FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,p,target);
+        Coordinate x0(p.GetPosition()),xp;
+        Particle pp(p);
+        for (int k=0;k<NSPACEDIM;k++) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection1D(x0,xp,period,k);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,pp,target);
+        }
+        if (NSPACEDIM==3) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,0,1);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,0,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflection2D(x0,xp,period,1,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,pp,target);
+        }
+        if (NSPACEDIM>1) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            PeriodicReflectionND(x0,xp,period,NSPACEDIM);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,Group,Parent,off,pp,target);
+        }
+    }
+
+    //same algorithm as FOFCriterion and FOFCriterionSetBasisForLinks (if isetbasis) below using the templated search
+    template<class FOFFunctor> Int_t* KDTree::FOFCriterionFunctor(FOFFunctor cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, int isetbasis, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen)
+    {
+        Int_t *pGroup=new Int_t[numparts];
+        Int_tree_t *pGroupHead=new Int_tree_t[numparts];
+        Int_tree_t *Fifo=new Int_tree_t[numparts];
+        short *pBucketFlag=new short[numnodes];
+
+        bool iph,ipt,ipn,ipl;
+        iph=ipt=ipn=ipl=false;
+        if (pHead==NULL)    {pHead=new Int_tree_t[numparts];iph=true;}
+        if (pNext==NULL)    {pNext=new Int_tree_t[numparts];ipn=true;}
+        if (pLen==NULL)     {pLen=new Int_tree_t[numparts];ipl=true;}
+        if (pTail==NULL)    {pTail=new Int_tree_t[numparts];ipt=true;}
+
+        Double_t off[6];
+        Particle p;
+        Int_t iGroup=0,iHead=0,iTail=0,id,iid;
+
+        //initial arrays
+        for (Int_t i=0;i<numparts;i++) {
+            id=bucket[i].GetID();
+            if (ipcheckflag && !isetbasis) pGroup[id]=check(bucket[i],params);
+            else pGroup[id]=0;
+            pHead[i]=pTail[i]=i;
+            pNext[i]=-1;
+        }
+        for (Int_t i=0;i<numnodes;i++) pBucketFlag[i]=0;
+
+        for (Int_t i=0;i<numparts;i++){
+            //if particle already member of group, ignore and go to next particle
+            id=bucket[i].GetID();
+            if (isetbasis && check(bucket[i],params)!=0) continue;
+            if(pGroup[id]!=0) continue;
+            pGroup[id]=++iGroup;
+            pLen[iGroup]=1;
+            pGroupHead[iGroup]=i;
+            Fifo[iTail++]=i;
+
+            if(iTail==numparts) iTail=0;
+            while(iHead!=iTail) {
+                iid=Fifo[iHead++];
+                if (iHead==numparts) iHead=0;
+                //check if head particle should be used as basis for links
+                if (isetbasis && check(bucket[iid],params)!=0) continue;
+                p=bucket[iid];
+                for (int j = 0; j < 6; j++) off[j] = 0.0;
+                if (period==NULL) FOFSearchCriterionFunctor(root,0.0,cmp,params,isetbasis,iGroup,pGroup,pLen,pHead,pTail,pNext,pBucketFlag,Fifo,iTail,off,p,iid);
+                else FOFSearchCriterionFunctorPeriodic(cmp,params,isetbasis,iGroup,pGroup,pLen,pHead,pTail,pNext,pBucketFlag,Fifo,iTail,off,p,iid);
+            }
+
+            //make sure group big enough
+            if(pLen[iGroup]<minnum){
+                Int_t ii=pHead[pGroupHead[iGroup]];
+                do {
+                    pGroup[bucket[ii].GetID()]=-1;
+                } while ((ii=pNext[ii])!=-1);
+            pLen[iGroup--]=0;
+            }
+        }
+
+        //for all groups that were too small reset id to 0
+        for (Int_t i=0;i<numparts;i++) if(pGroup[bucket[i].GetID()]==-1)pGroup[bucket[i].GetID()]=0;
+
+        delete[] Fifo;
+        delete[] pBucketFlag;
+        if (iph) delete[] pHead;
+        if (ipt) delete[] pTail;
+        if (ipn) delete[] pNext;
+
+        if (iGroup>0 && order) FOFOrderGroups(pGroup,iGroup,pLen);
+
+        if (ipl) delete[] pLen;
+        delete[] pGroupHead;
+        numgroup=iGroup;
+        return pGroup;
+    }
+
+    //link phase of FOFUnionFind
+    template<class FOFFunctor> void KDTree::FOFUnionFindLink(FOFFunctor cmp, Double_t *params, Int_t *pGroup, Int_tree_t *pParent, Int_t chunksize)
+    {
+        Double_t off[6];
+        Particle p;
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(off,p) firstprivate(cmp) schedule(dynamic,chunksize)
+#endif
+        for (Int_t i=0;i<numparts;i++) {
+            if (pGroup[bucket[i].GetID()]<0) continue;
+            p=bucket[i];
+            for (int j = 0; j < 6; j++) off[j] = 0.0;
+            if (period==NULL) FOFSearchCriterionUnionFunctor(root,0.0,cmp,params,pGroup,pParent,off,p,i);
+            else FOFSearchCriterionUnionFunctorPeriodic(cmp,params,pGroup,pParent,off,p,i);
+        }
+    }
+    //@}
+
+    void KDTree::FOFOrderGroups(Int_t *pGroup, Int_t numgroup, Int_tree_t *pLen)
+    {
+        //generate pList array to store go through particle list and generate linked list
+        Int_t **pList, *pCount;
+        pList=new Int_t*[numgroup+1];
+        pCount=new Int_t[numgroup+1];
+        for (Int_t i=1;i<=numgroup;i++) {pList[i]=new Int_t[pLen[i]];pCount[i]=0;}
+        for (Int_t i=0;i<numparts;i++) {
+            Int_t gid=pGroup[bucket[i].GetID()];
+            if (gid>0) pList[gid][pCount[gid]++]=i;
+        }
+        //now order group indices
+        PriorityQueue *pq=new PriorityQueue(numgroup);
+        for (Int_t i = 1; i <=numgroup; i++) pq->Push(i, pLen[i]);
+        for (Int_t i = 1;i<=numgroup; i++) {
+            Int_t groupid=pq->TopQueue();
+            pq->Pop();
+            for (Int_t j=0;j<pLen[groupid];j++) pGroup[bucket[pList[groupid][j]].GetID()]=i;
+            delete[] pList[groupid];
+        }
+        delete[] pList;
+        delete[] pCount;
+        delete pq;
+    }
+
+    Int_t* KDTree::FOF(Double_t fdist, Int_t &numgroup, Int_t minnum, int order, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen, int iparallel)
+    {
+#ifdef USEOPENMP
+        //large searches, or any search if requested, are run in parallel. The ball search measures distances in position (or phase) space
+        //so only trees built in that space are searched this way, other trees use the serial search below
+        if ((numparts>=CRITPARALLELFOFSIZE || iparallel) && omp_get_max_threads()>1 && !omp_in_parallel() && (treetype==TPHYS||treetype==TPHS))
+            return FOFUnionFind(fdist*fdist,NULL,NULL,numgroup,minnum,order,0,Pnocheck,pHead,pNext,pTail,pLen);
+#endif
         Double_t fdist2=fdist*fdist, off[3];
         //array containing particles group id
         Int_t *pGroup=new Int_t[numparts];
@@ -133,6 +412,14 @@ namespace NBody
     //For example cmp function for FOF search see FOFFunc.h
     Int_t* KDTree::FOFCriterion(FOFcompfunc cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen)
     {
+#ifdef USEOPENMP
+        if (numparts>=CRITPARALLELFOFSIZE && omp_get_max_threads()>1 && !omp_in_parallel())
+            return FOFUnionFind(0.0,cmp,params,numgroup,minnum,order,ipcheckflag,check,pHead,pNext,pTail,pLen);
+#endif
+        //comparisons with a functor use the templated search
+        if (cmp==FOF3d) return FOFCriterionFunctor(FOF3dFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,0,pHead,pNext,pTail,pLen);
+        if (cmp==FOF6d) return FOFCriterionFunctor(FOF6dFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,0,pHead,pNext,pTail,pLen);
+        if (cmp==FOF3dType) return FOFCriterionFunctor(FOF3dTypeFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,0,pHead,pNext,pTail,pLen);
         Int_t *pGroup=new Int_t[numparts];
         Int_tree_t *pGroupHead=new Int_tree_t[numparts];
         Int_tree_t *Fifo=new Int_tree_t[numparts];
@@ -243,6 +530,9 @@ namespace NBody
     //FOF search with particles allowed to be basis of links set by FOFcheckfunc
     Int_t* KDTree::FOFCriterionSetBasisForLinks(FOFcompfunc cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen)
     {
+        if (cmp==FOF3d) return FOFCriterionFunctor(FOF3dFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,1,pHead,pNext,pTail,pLen);
+        if (cmp==FOF6d) return FOFCriterionFunctor(FOF6dFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,1,pHead,pNext,pTail,pLen);
+        if (cmp==FOF3dType) return FOFCriterionFunctor(FOF3dTypeFunctor(params),params,numgroup,minnum,order,ipcheckflag,check,1,pHead,pNext,pTail,pLen);
         Int_t *pGroup=new Int_t[numparts];
         Int_tree_t *pGroupHead=new Int_tree_t[numparts];
         Int_tree_t *Fifo=new Int_tree_t[numparts];
@@ -353,6 +643,316 @@ namespace NBody
         return pGroup;
     }
 
+    //parallel FOF using a concurrent union-find. Unlike the serial routines above, which grow one group at a time,
+    //all links are found at once by threads searching disjoint ranges of particles in tree order and only joining a particle
+    //to those with larger tree index. Every set is rooted at its member with the smallest tree index,
+    //which is the particle that would have seeded the group in the serial search, so group ids are assigned in the same order.
+    Int_t* KDTree::FOFUnionFind(Double_t fdist2, FOFcompfunc cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen)
+    {
+        Int_t *pGroup=new Int_t[numparts];
+        //union-find array indexed by tree index
+        Int_tree_t *pParent=new Int_tree_t[numparts];
+        //indexed by the root of a set, stores the length of the set and then the group id of the set
+        Int_t *pRootGroup=new Int_t[numparts];
+
+        bool iph,ipt,ipn,ipl;
+        iph=ipt=ipn=ipl=false;
+        if (pHead==NULL)    {pHead=new Int_tree_t[numparts];iph=true;}
+        if (pNext==NULL)    {pNext=new Int_tree_t[numparts];ipn=true;}
+        if (pLen==NULL)     {pLen=new Int_tree_t[numparts];ipl=true;}
+        if (pTail==NULL)    {pTail=new Int_tree_t[numparts];ipt=true;}
+
+        Double_t off[6];
+        Particle p;
+        Int_t iGroup=0,id,iroot;
+        Int_t chunksize;
+
+        //initial arrays
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(id) schedule(static)
+#endif
+        for (Int_t i=0;i<numparts;i++) {
+            id=bucket[i].GetID();
+            if (ipcheckflag) pGroup[id]=check(bucket[i],params);
+            else pGroup[id]=0;
+            pParent[i]=i;
+        }
+
+        //link particles. Threads are given contiguous chunks of the tree ordered particles so search
+        //disjoint ranges of leaf nodes and dynamic scheduling balances dense and sparse regions
+#ifdef USEOPENMP
+        chunksize=numparts/(64*omp_get_max_threads());
+#else
+        chunksize=numparts;
+#endif
+        if (chunksize<b) chunksize=b;
+        if (cmp==FOF3d) FOFUnionFindLink(FOF3dFunctor(params),params,pGroup,pParent,chunksize);
+        else if (cmp==FOF6d) FOFUnionFindLink(FOF6dFunctor(params),params,pGroup,pParent,chunksize);
+        else if (cmp==FOF3dType) FOFUnionFindLink(FOF3dTypeFunctor(params),params,pGroup,pParent,chunksize);
+        else {
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(off,p) schedule(dynamic,chunksize)
+#endif
+            for (Int_t i=0;i<numparts;i++) {
+                //if tag below zero then particle is not linked
+                if (pGroup[bucket[i].GetID()]<0) continue;
+                //search with a copy so that periodic reflections do not alter the bucket being searched by other threads
+                p=bucket[i];
+                for (int j = 0; j < 6; j++) off[j] = 0.0;
+                if (cmp==NULL) {
+                    if (period==NULL) root->FOFSearchBallUnion(0.0,fdist2,bucket,pParent,off,p,i);
+                    else root->FOFSearchBallUnionPeriodic(0.0,fdist2,bucket,pParent,off,period,p,i);
+                }
+                else {
+                    if (period==NULL) root->FOFSearchCriterionUnion(0.0,cmp,params,bucket,pGroup,pParent,off,p,i);
+                    else root->FOFSearchCriterionUnionPeriodic(0.0,cmp,params,bucket,pGroup,pParent,off,period,p,i);
+                }
+            }
+        }
+
+        //compress so every particle points directly to its root
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) schedule(static)
+#endif
+        for (Int_t i=0;i<numparts;i++) __atomic_store_n(&pParent[i],FOFFindRoot(pParent,i),__ATOMIC_RELAXED);
+
+        //get length of sets. As roots are the smallest member, a root is always reached before the rest of its set
+        for (Int_t i=0;i<numparts;i++) {
+            iroot=pParent[i];
+            if (iroot==i) pRootGroup[i]=0;
+            pRootGroup[iroot]++;
+        }
+        //assign group ids to sets that are large enough in order of their roots and build the linked lists
+        //of the group (or set for groups that are too small) in tree order
+        for (Int_t i=0;i<numparts;i++) {
+            iroot=pParent[i];
+            if (iroot==i) {
+                if (pRootGroup[i]>=minnum && pGroup[bucket[i].GetID()]>=0) {
+                    pLen[++iGroup]=pRootGroup[i];
+                    pRootGroup[i]=iGroup;
+                }
+                else pRootGroup[i]=0;
+            }
+            pHead[i]=iroot;
+            pTail[i]=i;
+            pNext[i]=-1;
+            if (iroot!=i) {
+                pNext[pTail[iroot]]=i;
+                pTail[iroot]=i;
+            }
+        }
+        //relabel
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) schedule(static)
+#endif
+        for (Int_t i=0;i<numparts;i++) pGroup[bucket[i].GetID()]=pRootGroup[pParent[i]];
+
+        //free memory for arrays that are not needed
+        delete[] pParent;
+        delete[] pRootGroup;
+        if (iph) delete[] pHead;
+        if (ipt) delete[] pTail;
+        if (ipn) delete[] pNext;
+
+        if (iGroup>0 && order) FOFOrderGroups(pGroup,iGroup,pLen);
+
+        if (ipl) delete[] pLen;
+        numgroup=iGroup;
+        return pGroup;
+    }
+
+    ///order edges by linking measure and then tree indices so that the forest is unique
+    static inline bool FOFMSTEdgeCompare(const FOFMSTEdge &a, const FOFMSTEdge &b)
+    {
+        if (a.w!=b.w) return a.w<b.w;
+        if (a.i!=b.i) return a.i<b.i;
+        return a.j<b.j;
+    }
+
+    /// \name Minimum spanning forest construction
+    //@{
+    template<class FOFFunctor> void KDTree::FOFSearchCriterionEdgeFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, Int_t *Group, Double_t *off, Particle &p, Int_t target, vector<FOFMSTEdge> &edges)
+    {
+        //only particles with tree index larger than target are linked
+        if (np->GetEnd()<=target+1) return;
+        if (np->GetCount()<=b) {
+            Int_t start=np->GetStart(), end=np->GetEnd();
+            if (start<=target) start=target+1;
+            FOFMSTEdge e;
+            e.i=target;
+            for (Int_t i = start; i < end; i++)
+            {
+                if (cmp(p,bucket[i]) && Group[bucket[i].GetID()]>=0) {
+                    e.j=i;
+                    e.w=cmp.LinkMeasure(p,bucket[i]);
+                    edges.push_back(e);
+                }
+            }
+            return;
+        }
+        SplitNode *sp=(SplitNode*)np;
+        int cut_dim=sp->GetCutDim();
+        Double_t old_off = off[cut_dim];
+        Double_t new_off = p.GetPhase(cut_dim) - sp->GetCutValue();
+        Node *first=sp->GetLeft(), *second=sp->GetRight();
+        if (new_off >= 0) {first=sp->GetRight();second=sp->GetLeft();}
+        FOFSearchCriterionEdgeFunctor(first,rd,cmp,params,Group,off,p,target,edges);
+        if ((int)params[0]==0) rd += (-old_off*old_off + new_off*new_off)/params[1];
+        else if ((int)params[0]==1) rd += (-old_off*old_off + new_off*new_off)/params[2];
+        else if ((int)params[0]==2) rd += (-old_off*old_off + new_off*new_off)/params[(cut_dim<3)*1+(cut_dim>=3)*2];
+        if (rd < 1)
+        {
+            off[cut_dim] = new_off;
+            FOFSearchCriterionEdgeFunctor(second,rd,cmp,params,Group,off,p,target,edges);
+            off[cut_dim] = old_off;
+        }
+    }
+
+    void KDTree::FOFMinimumSpanningForest(vector<FOFMSTEdge> &edges, Int_tree_t *pParent)
+    {
+        size_t nkeep=0;
+        Int_tree_t ri, rj;
+        sort(edges.begin(),edges.end(),FOFMSTEdgeCompare);
+        //Kruskal, an edge is kept if it joins two trees of the forest
+        for (size_t k=0;k<edges.size();k++) {
+            ri=FOFFindRoot(pParent,edges[k].i);
+            rj=FOFFindRoot(pParent,edges[k].j);
+            if (ri==rj) continue;
+            if (ri<rj) pParent[rj]=ri;
+            else pParent[ri]=rj;
+            edges[nkeep++]=edges[k];
+        }
+        //reset the union-find array, only particles in the forest were touched
+        for (size_t k=0;k<nkeep;k++) {pParent[edges[k].i]=edges[k].i;pParent[edges[k].j]=edges[k].j;}
+        edges.resize(nkeep);
+    }
+
+    template<class FOFFunctor> void KDTree::FOFMinimumSpanningTreeLink(FOFFunctor cmp, Double_t *params, Int_t *pGroup, vector<FOFMSTEdge> &edges)
+    {
+        Int_t chunksize;
+        int nthreads=1;
+#ifdef USEOPENMP
+        if (numparts>=CRITPARALLELFOFSIZE && !omp_in_parallel()) nthreads=omp_get_max_threads();
+#endif
+        chunksize=numparts/(64*nthreads);
+        if (chunksize<b) chunksize=b;
+        Int_tree_t *pParent=new Int_tree_t[numparts];
+        for (Int_t i=0;i<numparts;i++) pParent[i]=i;
+#ifdef USEOPENMP
+#pragma omp parallel \
+default(shared) firstprivate(cmp) num_threads(nthreads) if (nthreads>1)
+#endif
+        {
+        Double_t off[6];
+        Particle p;
+        vector<FOFMSTEdge> threadedges;
+        Int_tree_t *pThreadParent=pParent;
+        //number of links collected before they are reduced to their forest
+        size_t nreduce=max((Int_t)numparts/nthreads,(Int_t)1024)*4;
+        if (nthreads>1) {
+            pThreadParent=new Int_tree_t[numparts];
+            for (Int_t i=0;i<numparts;i++) pThreadParent[i]=i;
+        }
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic,chunksize) nowait
+#endif
+        for (Int_t i=0;i<numparts;i++) {
+            if (pGroup[bucket[i].GetID()]<0) continue;
+            p=bucket[i];
+            for (int j = 0; j < 6; j++) off[j] = 0.0;
+            FOFSearchCriterionEdgeFunctor(root,0.0,cmp,params,pGroup,off,p,i,threadedges);
+            if (threadedges.size()>nreduce) {
+                FOFMinimumSpanningForest(threadedges,pThreadParent);
+                nreduce=max(nreduce,2*threadedges.size());
+            }
+        }
+        if (nthreads>1) {
+            FOFMinimumSpanningForest(threadedges,pThreadParent);
+            delete[] pThreadParent;
+        }
+#ifdef USEOPENMP
+#pragma omp critical
+#endif
+        edges.insert(edges.end(),threadedges.begin(),threadedges.end());
+        }
+        //the union of the forests of the threads contains the forest of all links
+        FOFMinimumSpanningForest(edges,pParent);
+        delete[] pParent;
+    }
+
+    template<class FOFFunctor> void KDTree::FOFMinimumSpanningTreeJoin(FOFFunctor cmp, vector<FOFMSTEdge> &edges, Int_t *pGroup, Int_tree_t *pParent)
+    {
+        for (size_t k=0;k<edges.size();k++) {
+            if (pGroup[bucket[edges[k].i].GetID()]<0 || pGroup[bucket[edges[k].j].GetID()]<0) continue;
+            if (cmp(bucket[edges[k].i],bucket[edges[k].j])) FOFUnion(pParent,edges[k].i,edges[k].j);
+        }
+    }
+    //@}
+
+    int KDTree::FOFMinimumSpanningTree(FOFcompfunc cmp, Double_t *params, vector<FOFMSTEdge> &edges, int ipcheckflag, FOFcheckfunc check)
+    {
+        if (period!=NULL) return 0;
+        if (cmp!=FOF3d && cmp!=FOF6d) return 0;
+        Int_t *pGroup=new Int_t[numparts];
+        for (Int_t i=0;i<numparts;i++) {
+            if (ipcheckflag) pGroup[bucket[i].GetID()]=check(bucket[i],params);
+            else pGroup[bucket[i].GetID()]=0;
+        }
+        edges.clear();
+        if (cmp==FOF3d) FOFMinimumSpanningTreeLink(FOF3dFunctor(params),params,pGroup,edges);
+        else FOFMinimumSpanningTreeLink(FOF6dFunctor(params),params,pGroup,edges);
+        delete[] pGroup;
+        return 1;
+    }
+
+    Int_t* KDTree::FOFMinimumSpanningTreeGroups(FOFcompfunc cmp, Double_t *params, vector<FOFMSTEdge> &edges, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check)
+    {
+        Int_t *pGroup=new Int_t[numparts];
+        Int_tree_t *pParent=new Int_tree_t[numparts];
+        Int_t *pRootGroup=new Int_t[numparts];
+        Int_tree_t *pLen=new Int_tree_t[numparts+1];
+        Int_t iGroup=0,iroot;
+
+        for (Int_t i=0;i<numparts;i++) {
+            if (ipcheckflag) pGroup[bucket[i].GetID()]=check(bucket[i],params);
+            else pGroup[bucket[i].GetID()]=0;
+            pParent[i]=i;
+        }
+        //roots are the smallest tree index of a set as in FOFUnionFind
+        if (cmp==FOF3d) FOFMinimumSpanningTreeJoin(FOF3dFunctor(params),edges,pGroup,pParent);
+        else FOFMinimumSpanningTreeJoin(FOF6dFunctor(params),edges,pGroup,pParent);
+        for (Int_t i=0;i<numparts;i++) pParent[i]=FOFFindRoot(pParent,i);
+
+        //get length of sets and assign group ids to sets that are large enough in order of their roots
+        for (Int_t i=0;i<numparts;i++) {
+            iroot=pParent[i];
+            if (iroot==i) pRootGroup[i]=0;
+            pRootGroup[iroot]++;
+        }
+        for (Int_t i=0;i<numparts;i++) {
+            if (pParent[i]!=i) continue;
+            if (pRootGroup[i]>=minnum && pGroup[bucket[i].GetID()]>=0) {
+                pLen[++iGroup]=pRootGroup[i];
+                pRootGroup[i]=iGroup;
+            }
+            else pRootGroup[i]=0;
+        }
+        for (Int_t i=0;i<numparts;i++) pGroup[bucket[i].GetID()]=pRootGroup[pParent[i]];
+
+        delete[] pParent;
+        delete[] pRootGroup;
+
+        if (iGroup>0 && order) FOFOrderGroups(pGroup,iGroup,pLen);
+
+        delete[] pLen;
+        numgroup=iGroup;
+        return pGroup;
+    }
+
     Int_t *KDTree::FOFNNCriterion(FOFcompfunc cmp, Double_t *params, Int_t numNN, Int_t **nnID, Int_t &numgroup, Int_t minnum)
     {
         //declare useful fof arrays
@@ -434,6 +434,484 @@ namespace NBody
         delete pq;
     }
 
+    void KDTree::FindNearestBatch(Int_t nq, Int_t *tt, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq)
+    {
+        //a periodic tree consisting of a single leaf node ignores periodicity, so it is left to the single search
+        if (treetype!=TPHYS || (period!=NULL && root->GetCount()<=b)) {
+            for (Int_t i=0;i<nq;i++) FindNearest(tt[i],&nn[i*Nsearch],&dist2[i*Nsearch],Nsearch);
+            return;
+        }
+        bool ipq=(pq==NULL);
+        if (ipq) pq=new PriorityQueue(Nsearch);
+        FindNearestPosBatch(nq,tt,nn,dist2,Nsearch,pq,period);
+        if (ipq) delete pq;
+    }
+    void KDTree::FindNearestBatch(Int_t nq, Double_t *x, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq)
+    {
+        if (treetype!=TPHYS || (period!=NULL && root->GetCount()<=b)) {
+            for (Int_t i=0;i<nq;i++) FindNearestPos(&x[i*3],&nn[i*Nsearch],&dist2[i*Nsearch],Nsearch);
+            return;
+        }
+        bool ipq=(pq==NULL);
+        if (ipq) pq=new PriorityQueue(Nsearch);
+        FindNearestPosBatch(nq,x,nn,dist2,Nsearch,pq,period);
+        if (ipq) delete pq;
+    }
+
+    ///sets xp to the ik-th (ik=1..7) periodic reflection of x0 searched by \ref SplitNode::FindNearestPosPeriodic, that is the
+    ///reflections in each dimension, then in the pairs of dimensions and finally in all dimensions. Returns whether the reflection
+    ///is searched given the current search radius top, using the same tests
+    static inline bool PeriodicImage(int ik, const Coordinate &x0, Coordinate &xp, Double_t *p, Double_t top)
+    {
+        //pairs of dimensions reflected by the 2D reflections
+        static const int k2d[3][2]={{0,1},{0,2},{1,2}};
+        if (ik<=3) return (sqrt(top)>PeriodicReflection1D(x0,xp,p,ik-1));
+        else if (ik<=6) return (top>PeriodicReflection2D(x0,xp,p,k2d[ik-4][0],k2d[ik-4][1]));
+        else return (top>PeriodicReflectionND(x0,xp,p,3));
+    }
+
+    ///Walks the tree in the same order and with the same arithmetic as \ref SplitNode::FindNearestPos and \ref LeafNode::FindNearestPos
+    ///but nodes still to be examined are kept on an explicit stack, along with their distance and offsets, that is reused for all targets.
+    ///The Nsearch nearest neighbours of the previous target all lie within r+d of the current target, where r is the distance of the
+    ///furthest of them and d the distance between the two targets. The queue is initialised with this (slightly enlarged) bound
+    ///rather than MAXVALUE, so that nodes are pruned from the start. Should the bound not contain Nsearch particles, which can happen
+    ///if some of these particles are excluded from the search of the current target, the search is repeated with no bound.
+    ///If periodic, targets are searched as positions with one extra neighbour, the closest of which (the target itself) is dropped,
+    ///exactly as \ref FindNearest does.
+    void KDTree::FindNearestPosBatch(Int_t nq, Int_t *tt, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq, Double_t *p)
+    {
+        if (p!=NULL) {
+            Double_t *x=new Double_t[nq*3];
+            Int_t *nnp=new Int_t[nq*(Nsearch+1)];
+            Double_t *dist2p=new Double_t[nq*(Nsearch+1)];
+            PriorityQueue *pqp=new PriorityQueue(Nsearch+1);
+            for (Int_t iq=0;iq<nq;iq++) for (int j=0;j<3;j++) x[iq*3+j]=bucket[tt[iq]].GetPosition(j);
+            FindNearestPosBatch(nq,x,nnp,dist2p,Nsearch+1,pqp,p);
+            for (Int_t iq=0;iq<nq;iq++) for (Int_t j=0;j<Nsearch;j++) {
+                nn[iq*Nsearch+j]=nnp[iq*(Nsearch+1)+j+1];
+                dist2[iq*Nsearch+j]=dist2p[iq*(Nsearch+1)+j+1];
+            }
+            delete[] x;
+            delete[] nnp;
+            delete[] dist2p;
+            delete pqp;
+            return;
+        }
+        struct nnstack_entry {
+            Node *np;
+            Double_t rd;
+            Double_t off[3];
+        };
+        vector<nnstack_entry> nodestack;
+        nnstack_entry e;
+        Node *np;
+        SplitNode *sp;
+        Int_t target, start, end;
+        Double_t bound, new_off, old_off, dist2i;
+        double r, d;
+        int cut_dim;
+        nodestack.reserve(64);
+        for (Int_t iq=0;iq<nq;iq++) {
+            target=tt[iq];
+            bound=MAXVALUE;
+            if (iq>0) {
+                r=sqrt((double)dist2[(iq-1)*Nsearch+Nsearch-1]);
+                d=0;
+                for (int j=0;j<3;j++) d+=((double)bucket[target].GetPosition(j)-(double)bucket[tt[iq-1]].GetPosition(j))*((double)bucket[target].GetPosition(j)-(double)bucket[tt[iq-1]].GetPosition(j));
+                d=sqrt(d);
+                if ((r+d)*(r+d)*(1.0+1e-5)<(double)MAXVALUE) bound=(r+d)*(r+d)*(1.0+1e-5);
+            }
+            while (true) {
+                pq->Reset();
+                for (Int_t i = 0; i < Nsearch; i++) pq->Push(-1, bound);
+                e.np=root; e.rd=0.0;
+                for (int j=0;j<3;j++) e.off[j]=0.0;
+                nodestack.push_back(e);
+                while (nodestack.size()>0) {
+                    e=nodestack.back();
+                    nodestack.pop_back();
+                    //a node that was deferred is only searched if it can still contain a closer particle
+                    if (!(e.rd < pq->TopPriority())) continue;
+                    np=e.np;
+                    //descend to the leaf on the target's side of each split, deferring the other side
+                    while (np->GetCount()>b) {
+                        sp=(SplitNode*)np;
+                        cut_dim=sp->GetCutDim();
+                        old_off=e.off[cut_dim];
+                        new_off=bucket[target].GetPosition(cut_dim)-sp->GetCutValue();
+                        nodestack.push_back(e);
+                        nodestack.back().rd += -old_off*old_off + new_off*new_off;
+                        nodestack.back().off[cut_dim] = new_off;
+                        if (new_off < 0) {nodestack.back().np=sp->GetRight(); np=sp->GetLeft();}
+                        else {nodestack.back().np=sp->GetLeft(); np=sp->GetRight();}
+                    }
+                    start=np->GetStart();
+                    end=np->GetEnd();
+                    for (Int_t i = start; i < end; i++)
+                    {
+                        if (i!=target){
+                        dist2i = DistanceSqd(bucket[target].GetPosition(),bucket[i].GetPosition(), 3);
+                        if (dist2i < pq->TopPriority() && dist2i > 0)
+                        {
+                            pq->Pop();
+                            pq->Push(i, dist2i);
+                        }
+                        }
+                    }
+                }
+                if (pq->TopQueue()!=-1 || bound==MAXVALUE) break;
+                bound=MAXVALUE;
+            }
+            LoadNN(Nsearch,pq,&nn[iq*Nsearch],&dist2[iq*Nsearch]);
+        }
+    }
+
+    ///Same walk as above with the arithmetic of \ref SplitNode::FindNearestPos and \ref LeafNode::FindNearestPos for a position.
+    ///As no particle is excluded, the bound given by the previous position always contains Nsearch particles if the tree does.
+    ///If periodic, the reflections of the position are then walked in the order and with the tests of \ref SplitNode::FindNearestPosPeriodic.
+    ///A reflection skipped while the queue still holds the bound rather than Nsearch particles might have been searched with no bound,
+    ///so the search is then also repeated with no bound.
+    void KDTree::FindNearestPosBatch(Int_t nq, Double_t *x, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq, Double_t *p)
+    {
+        struct nnstack_entry {
+            Node *np;
+            Double_t rd;
+            Double_t off[3];
+        };
+        vector<nnstack_entry> nodestack;
+        nnstack_entry e;
+        Node *np;
+        SplitNode *sp;
+        Int_t start, end;
+        Double_t *xq, *xw, bound, new_off, old_off, dist2i;
+        double r, d;
+        int cut_dim, nimage=(p==NULL)?1:8;
+        bool iunbound;
+        Coordinate x0, xp;
+        nodestack.reserve(64);
+        for (Int_t iq=0;iq<nq;iq++) {
+            xq=&x[iq*3];
+            bound=MAXVALUE;
+            if (iq>0) {
+                r=sqrt((double)dist2[(iq-1)*Nsearch+Nsearch-1]);
+                d=0;
+                for (int j=0;j<3;j++) d+=((double)xq[j]-(double)xq[j-3])*((double)xq[j]-(double)xq[j-3]);
+                d=sqrt(d);
+                if ((r+d)*(r+d)*(1.0+1e-5)<(double)MAXVALUE) bound=(r+d)*(r+d)*(1.0+1e-5);
+            }
+            if (p!=NULL) x0=Coordinate(xq);
+            while (true) {
+                pq->Reset();
+                for (Int_t i = 0; i < Nsearch; i++) pq->Push(-1, bound);
+                iunbound=false;
+                for (int ik=0;ik<nimage;ik++) {
+                    xw=xq;
+                    if (ik>0) {
+                        if (!PeriodicImage(ik,x0,xp,p,pq->TopPriority())) {
+                            if (pq->TopQueue()==-1 && bound!=MAXVALUE) {iunbound=true; break;}
+                            continue;
+                        }
+                        xw=xp.GetCoord();
+                    }
+                    e.np=root; e.rd=0.0;
+                    for (int j=0;j<3;j++) e.off[j]=0.0;
+                    nodestack.push_back(e);
+                    while (nodestack.size()>0) {
+                        e=nodestack.back();
+                        nodestack.pop_back();
+                        if (!(e.rd < pq->TopPriority())) continue;
+                        np=e.np;
+                        while (np->GetCount()>b) {
+                            sp=(SplitNode*)np;
+                            cut_dim=sp->GetCutDim();
+                            old_off=e.off[cut_dim];
+                            new_off=xw[cut_dim]-sp->GetCutValue();
+                            nodestack.push_back(e);
+                            nodestack.back().rd += -old_off*old_off + new_off*new_off;
+                            nodestack.back().off[cut_dim] = new_off;
+                            if (new_off < 0) {nodestack.back().np=sp->GetRight(); np=sp->GetLeft();}
+                            else {nodestack.back().np=sp->GetLeft(); np=sp->GetRight();}
+                        }
+                        start=np->GetStart();
+                        end=np->GetEnd();
+                        for (Int_t i = start; i < end; i++)
+                        {
+                            dist2i = DistanceSqd(xw,bucket[i].GetPosition(), 3);
+                            if (dist2i < pq->TopPriority())
+                            {
+                                pq->Pop();
+                                pq->Push(i, dist2i);
+                            }
+                        }
+                    }
+                }
+                if ((pq->TopQueue()!=-1 && !iunbound) || bound==MAXVALUE) break;
+                bound=MAXVALUE;
+            }
+            LoadNN(Nsearch,pq,&nn[iq*Nsearch],&dist2[iq*Nsearch]);
+        }
+    }
+
+    ///\name Helpers for the dual tree search
+    //@{
+    ///squared distance between the bounding boxes of two nodes. The separation in each dimension is calculated in the same
+    ///precision and accumulated in the same order as \ref DistanceSqd, so it is never larger than the distance of any pair of
+    ///particles in the two nodes
+    static inline Double_t NodeDistanceSqd(Node *a, Node *b)
+    {
+        Double_t total=0;
+        DoublePos_t d;
+        const DoublePos_t *ba, *bb;
+        for (int j=0;j<3;j++) {
+            ba=a->GetBoundaryPos(j); bb=b->GetBoundaryPos(j);
+            if (ba[0]>bb[1]) d=ba[0]-bb[1];
+            else if (bb[0]>ba[1]) d=bb[0]-ba[1];
+            else d=0;
+            total+=d*d;
+        }
+        return total;
+    }
+    ///dimensions reflected by the ik-th periodic reflection of \ref PeriodicImage, bit j set if dimension j is reflected
+    static const int PeriodicImageMask[8]={0,1,2,4,3,5,6,7};
+    ///squared distance between the box of node b and the ik-th periodic reflections of the particles in node a. Particles below
+    ///half the period are moved up by a period and others down, so a box spanning half the period is reflected as two pieces.
+    ///Separations are calculated from the reflected box in the precision of the reflected positions, so this is never larger than
+    ///the distance of any reflected particle of a to a particle of b
+    static inline Double_t NodeImageDistanceSqd(Node *a, Node *b, Double_t *p, int ik)
+    {
+        Double_t total=0, d, dp, lo, hi, half;
+        const DoublePos_t *ba, *bb;
+        for (int j=0;j<3;j++) {
+            ba=a->GetBoundaryPos(j); bb=b->GetBoundaryPos(j);
+            if (!(PeriodicImageMask[ik]>>j&1)) {lo=ba[0]; hi=ba[1]; half=-1;}
+            else {
+                half=p[j]/2.0;
+                if (ba[0]<half) {lo=(Double_t)ba[0]+p[j]; hi=(ba[1]<half)?(Double_t)ba[1]+p[j]:half+p[j];}
+                else {lo=(Double_t)ba[0]-p[j]; hi=(Double_t)ba[1]-p[j];}
+            }
+            if (lo>bb[1]) d=lo-bb[1];
+            else if (bb[0]>hi) d=bb[0]-hi;
+            else d=0;
+            //the part of the box above half the period moves down
+            if (half>0 && ba[0]<half && ba[1]>=half) {
+                lo=half-p[j]; hi=(Double_t)ba[1]-p[j];
+                if (lo>bb[1]) dp=lo-bb[1];
+                else if (bb[0]>hi) dp=bb[0]-hi;
+                else dp=0;
+                if (dp<d) d=dp;
+            }
+            total+=d*d;
+        }
+        return total;
+    }
+    ///replace the largest entry of the max-heap of size n stored in d,nn with (dnew,inew) and restore the heap
+    static inline void NNHeapReplaceTop(Int_t n, Double_t *d, Int_t *nn, Double_t dnew, Int_t inew)
+    {
+        Int_t i=0, c;
+        while ((c=2*i+1)<n) {
+            if (c+1<n && d[c+1]>d[c]) c++;
+            if (!(d[c]>dnew)) break;
+            d[i]=d[c]; nn[i]=nn[c];
+            i=c;
+        }
+        d[i]=dnew; nn[i]=inew;
+    }
+    ///sort the max-heaps of size n of the nt targets stored in d,nn by increasing distance
+    static inline void NNHeapSort(Int_t nt, Int_t n, Double_t *d, Int_t *nn)
+    {
+        Int_t *ni, nk;
+        Double_t *di, dk;
+        for (Int_t i=0;i<nt;i++) {
+            ni=&nn[i*n];
+            di=&d[i*n];
+            for (Int_t k=n-1;k>0;k--) {
+                dk=di[k]; nk=ni[k];
+                di[k]=di[0]; ni[k]=ni[0];
+                NNHeapReplaceTop(k,di,ni,dk,nk);
+            }
+        }
+    }
+    //@}
+
+    void KDTree::FindNearestRange(Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch, Double_t *qbound)
+    {
+        //a periodic tree consisting of a single leaf node ignores periodicity, so it is left to the single search
+        if (treetype!=TPHYS || ND!=3 || (period!=NULL && root->GetCount()<=b)) {
+            for (Int_t i=istart;i<iend;i++) FindNearest(i,&nn[(i-istart)*Nsearch],&dist2[(i-istart)*Nsearch],Nsearch);
+            return;
+        }
+        FindNearestRangePos(istart,iend,nn,dist2,Nsearch,qbound,period);
+    }
+
+    Int_t KDTree::GetRangeBoundSize(Int_t n)
+    {
+        return NumNodes(max(n,(Int_t)1));
+    }
+
+    ///The nodes spanning the range are found first, each is then searched against the whole tree. Since the nodes of a subtree are
+    ///numbered consecutively (see \ref BuildNodes), the search radius of every node in the subtree of a query node is stored in the
+    ///first \ref NumNodes entries of qbound, which is reset for each query node. Finally the max-heaps of each target are sorted in place.
+    ///If periodic, targets are searched as positions with one extra neighbour, the closest of which (the target itself) is dropped,
+    ///as in \ref FindNearest. The reflections are then walked one after the other, in the order of \ref SplitNode::FindNearestPosPeriodic,
+    ///with each target taking part in a reflection only if it passes the test of the single search given its neighbours so far.
+    void KDTree::FindNearestRangePos(Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch, Double_t *qbound, Double_t *p)
+    {
+        vector<Node*> qnodes, nodestack;
+        vector<Double_t> qboundbuf;
+        vector<Int_t> nnp;
+        vector<Double_t> dist2p;
+        vector<char> active;
+        Node *np;
+        Int_t nt=iend-istart, ns=Nsearch, *nnw=nn, nqbound=0, qs, qe;
+        Double_t *dw=dist2;
+        Coordinate x0, xp;
+        int nimage=(p==NULL)?1:8;
+        bool iactive;
+        //find the largest nodes that lie within the range, along with any leaf nodes that only partially overlap it
+        nodestack.push_back(root);
+        while (nodestack.size()>0) {
+            np=nodestack.back();
+            nodestack.pop_back();
+            if (np->GetEnd()<=istart || np->GetStart()>=iend) continue;
+            if ((np->GetStart()>=istart && np->GetEnd()<=iend) || np->GetCount()<=b) {
+                qnodes.push_back(np);
+                nqbound=max(nqbound,NumNodes(np->GetCount()));
+            }
+            else {
+                nodestack.push_back(((SplitNode*)np)->GetRight());
+                nodestack.push_back(((SplitNode*)np)->GetLeft());
+            }
+        }
+        if (qbound==NULL) {
+            qboundbuf.resize(nqbound);
+            qbound=qboundbuf.data();
+        }
+        if (p!=NULL) {
+            ns=Nsearch+1;
+            nnp.resize(nt*ns);
+            dist2p.resize(nt*ns);
+            nnw=nnp.data();
+            dw=dist2p.data();
+        }
+        for (Int_t i=0;i<nt*ns;i++) {nnw[i]=-1; dw[i]=MAXVALUE;}
+        active.assign(nt,1);
+        for (int ik=0;ik<nimage;ik++) {
+            //the radius of each target is the top of its heap
+            if (ik>0) for (Int_t i=0;i<nt;i++) {
+                x0=Coordinate(bucket[istart+i].GetPosition());
+                active[i]=PeriodicImage(ik,x0,xp,p,dw[i*ns]);
+            }
+            for (size_t k=0;k<qnodes.size();k++) {
+                qs=max(qnodes[k]->GetStart(),istart);
+                qe=min(qnodes[k]->GetEnd(),iend);
+                iactive=false;
+                for (Int_t i=qs;i<qe && !iactive;i++) iactive=active[i-istart];
+                if (!iactive) continue;
+                nqbound=NumNodes(qnodes[k]->GetCount());
+                for (Int_t j=0;j<nqbound;j++) qbound[j]=MAXVALUE;
+                FindNearestDual(qnodes[k],root,qnodes[k]->GetID(),qbound,istart,iend,nnw,dw,ns,p,ik,active.data());
+            }
+        }
+        NNHeapSort(nt,ns,dw,nnw);
+        if (p!=NULL) {
+            for (Int_t i=0;i<nt;i++) for (Int_t j=0;j<Nsearch;j++) {
+                nn[i*Nsearch+j]=nnp[i*ns+j+1];
+                dist2[i*Nsearch+j]=dist2p[i*ns+j+1];
+            }
+        }
+        for (Int_t i=0;i<nt;i++) if (nn[i*Nsearch+Nsearch-1]==-1) printf("FindNearest failed for unknown reasons\n");
+    }
+
+    ///Query and reference nodes are pruned if their boxes are further apart than the largest search radius of the targets in the query
+    ///node. Otherwise the larger of the two nodes is split, the query node if they are the same size. The child of a reference node
+    ///on the same side of the cut as the centre of the query node is searched first, as in a single tree search. When both are leaf nodes,
+    ///the reference node is skipped for targets whose own radius does not reach its box and otherwise particles are added to the
+    ///targets' heaps with the same test as \ref LeafNode::FindNearestPos, so the neighbours found are those of a single tree search.
+    ///For reflections, the reflected box of the query node is used and only active targets are searched. The bound of a query leaf
+    ///is set from its active targets when it is first visited, so that leaves with none are pruned at once.
+    void KDTree::FindNearestDual(Node *q, Node *r, Int_t qbase, Double_t *qbound, Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch,
+        Double_t *p, int ik, char *active)
+    {
+        Int_t iq=q->GetID()-qbase;
+        bool qleaf=(q->GetCount()<=b), rleaf=(r->GetCount()<=b);
+        if (ik>0 && qleaf && qbound[iq]==MAXVALUE) {
+            qbound[iq]=0;
+            for (Int_t i=max(q->GetStart(),istart);i<min(q->GetEnd(),iend);i++)
+                if (active[i-istart] && dist2[(i-istart)*Nsearch]>qbound[iq]) qbound[iq]=dist2[(i-istart)*Nsearch];
+        }
+        if (ik==0) {if (!(NodeDistanceSqd(q,r) < qbound[iq])) return;}
+        else if (!(NodeImageDistanceSqd(q,r,p,ik) < qbound[iq])) return;
+        if (qleaf && rleaf) {
+            Int_t qs=max(q->GetStart(),istart), qe=min(q->GetEnd(),iend), rs=r->GetStart(), re=r->GetEnd();
+            Int_t *ni;
+            Double_t *di, bound=0, rd, dist2i, dx, dlo[3], dhi[3];
+            DoublePos_t lo[3], hi[3], d;
+            const DoublePos_t *pos;
+            Coordinate x0, xp;
+            const Double_t *xw;
+            for (int j=0;j<3;j++) {lo[j]=r->GetBoundaryPos(j)[0]; hi[j]=r->GetBoundaryPos(j)[1]; dlo[j]=lo[j]; dhi[j]=hi[j];}
+            for (Int_t i=qs;i<qe;i++) {
+                ni=&nn[(i-istart)*Nsearch];
+                di=&dist2[(i-istart)*Nsearch];
+                if (!active[i-istart]) continue;
+                rd=0;
+                //without a period the particle itself is excluded, otherwise it is searched as a position as in FindNearestPosPeriodic
+                if (p==NULL) {
+                    pos=bucket[i].GetPosition();
+                    for (int j=0;j<3;j++) {
+                        if (pos[j]<lo[j]) d=lo[j]-pos[j];
+                        else if (pos[j]>hi[j]) d=pos[j]-hi[j];
+                        else d=0;
+                        rd+=d*d;
+                    }
+                    if (rd < di[0]) {
+                        for (Int_t k=rs;k<re;k++) {
+                            if (k!=i) {
+                            dist2i = DistanceSqd(pos,bucket[k].GetPosition(), 3);
+                            if (dist2i < di[0] && dist2i > 0) NNHeapReplaceTop(Nsearch,di,ni,dist2i,k);
+                            }
+                        }
+                    }
+                }
+                else {
+                    x0=Coordinate(bucket[i].GetPosition());
+                    if (ik>0) {PeriodicImage(ik,x0,xp,p,0); xw=xp.GetCoord();}
+                    else xw=x0.GetCoord();
+                    for (int j=0;j<3;j++) {
+                        if (xw[j]<dlo[j]) dx=dlo[j]-xw[j];
+                        else if (xw[j]>dhi[j]) dx=xw[j]-dhi[j];
+                        else dx=0;
+                        rd+=dx*dx;
+                    }
+                    if (rd < di[0]) {
+                        for (Int_t k=rs;k<re;k++) {
+                            dist2i = DistanceSqd(xw,bucket[k].GetPosition(), 3);
+                            if (dist2i < di[0]) NNHeapReplaceTop(Nsearch,di,ni,dist2i,k);
+                        }
+                    }
+                }
+                if (di[0]>bound) bound=di[0];
+            }
+            qbound[iq]=bound;
+        }
+        else if (qleaf || (!rleaf && q->GetCount()<r->GetCount())) {
+            Node *r0=((SplitNode*)r)->GetLeft(), *r1=((SplitNode*)r)->GetRight();
+            int cut_dim=((SplitNode*)r)->GetCutDim();
+            Double_t qc=q->GetBoundaryPos(cut_dim)[0]+q->GetBoundaryPos(cut_dim)[1];
+            //the centre of a reflected query node lies on the other side of the box
+            if (PeriodicImageMask[ik]>>cut_dim&1) qc+=(qc<p[cut_dim])?2.0*p[cut_dim]:-2.0*p[cut_dim];
+            if (qc >= 2.0*((SplitNode*)r)->GetCutValue()) {r0=r1; r1=((SplitNode*)r)->GetLeft();}
+            FindNearestDual(q,r0,qbase,qbound,istart,iend,nn,dist2,Nsearch,p,ik,active);
+            FindNearestDual(q,r1,qbase,qbound,istart,iend,nn,dist2,Nsearch,p,ik,active);
+        }
+        else {
+            Node *q0=((SplitNode*)q)->GetLeft(), *q1=((SplitNode*)q)->GetRight();
+            FindNearestDual(q0,r,qbase,qbound,istart,iend,nn,dist2,Nsearch,p,ik,active);
+            FindNearestDual(q1,r,qbase,qbound,istart,iend,nn,dist2,Nsearch,p,ik,active);
+            qbound[iq]=max(qbound[q0->GetID()-qbase],qbound[q1->GetID()-qbase]);
+        }
+    }
+
     // Same as above but done for every particle
     void KDTree::FindNearest(Int_t **nn, Double_t **dist2, Int_t Nsearch){
         for (Int_t i=0;i<numparts;i++) FindNearest(i,nn[i],dist2[i],Nsearch);
@@ -726,6 +1204,23 @@ namespace NBody
         }
         return np;
     }
+    // Find nodes that are the leaf nodes of a coarser tree. Since nodes are numbered in pre-order, the subtree of a node
+    // with n particles occupies the next NumNodes(n) ids and can be skipped
+    vector<Node*> KDTree::FindCoarseNodes(Int_t ncell){
+        vector<Node*> nodes;
+        Node *np;
+        Int_t inode=0;
+        if (ncell<b) ncell=b;
+        while (inode<numnodes) {
+            np=GetNode(inode);
+            if (np->GetCount()<=ncell) {
+                nodes.push_back(np);
+                inode+=NumNodes(np->GetCount());
+            }
+            else inode++;
+        }
+        return nodes;
+    }
     // Find Node enclosing volume
     Node *KDTree::FindLeafNode(Double_t search[6][2]){
         Node* np=root;
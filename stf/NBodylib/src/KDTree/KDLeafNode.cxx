@@ -14,6 +14,25 @@ namespace NBody
     //@{
     void LeafNode::FindNearestPos(Double_t rd, Particle *bucket, PriorityQueue *pq, Double_t* off, Int_t target, int dim)
     {
+        //if positions are loaded, blocks are first masked with the current largest distance in the queue. As this only
+        //decreases, every particle accepted by the test below lies in the mask and the result is unchanged
+        if (soapos!=NULL && dim==3) {
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(bucket[target].GetPosition(),k,SoABallThreshold(pq->TopPriority()));
+                for (i=bucket_start+k;mask;i++,mask>>=1) {
+                    if (!(mask&1ULL) || i==target) continue;
+                    Double_t dist2 = DistanceSqd(bucket[target].GetPosition(),bucket[i].GetPosition(), dim);
+                    if (dist2 < pq->TopPriority() && dist2 > 0)
+                    {
+                        pq->Pop();
+                        pq->Push(i, dist2);
+                    }
+                }
+            }
+            return;
+        }
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
             if (i!=target){
@@ -103,6 +122,26 @@ namespace NBody
 
     void LeafNode::FindNearestPos(Double_t rd, Particle *bucket, PriorityQueue *pq, Double_t* off, Double_t *x, int dim)
     {
+        //as above, masked blocks are only used if x has the precision of the positions
+#ifdef SOAPOINTQUERY
+        if (soapos!=NULL && dim==3) {
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(x,k,SoABallThreshold(pq->TopPriority()));
+                for (i=bucket_start+k;mask;i++,mask>>=1) {
+                    if (!(mask&1ULL)) continue;
+                    Double_t dist2 = DistanceSqd(x,bucket[i].GetPosition(), dim);
+                    if (dist2 < pq->TopPriority())
+                    {
+                        pq->Pop();
+                        pq->Push(i, dist2);
+                    }
+                }
+            }
+            return;
+        }
+#endif
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
             Double_t dist2 = DistanceSqd(x,bucket[i].GetPosition(), dim);
@@ -216,6 +255,21 @@ namespace NBody
                 Group[id]=iGroup;
                 pdist2[id]=dist2;
             }
+        //if positions are loaded, particles are selected by blocks of up to 64 with the vectorised kernel
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(bucket[target].GetPosition(),k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) {
+                    if (!(mask&1ULL) || i==target) continue;
+                    Int_t id=bucket[i].GetID();
+                    Group[id]=iGroup;
+                    pdist2[id]=DistanceSqd(bucket[target].GetPosition(),bucket[i].GetPosition(), dim);
+                }
+            }
+        }
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -247,6 +301,22 @@ namespace NBody
                 Group[id]=iGroup;
                 pdist2[id]=dist2;
             }
+#ifdef SOAPOINTQUERY
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(x,k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) {
+                    if (!(mask&1ULL)) continue;
+                    Int_t id=bucket[i].GetID();
+                    Group[id]=iGroup;
+                    pdist2[id]=DistanceSqd(x,bucket[i].GetPosition(), dim);
+                }
+            }
+        }
+#endif
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -276,6 +346,15 @@ namespace NBody
         if (maxr0<fdist2&&maxr1<fdist2)
             for (Int_t i = bucket_start; i < bucket_end; i++)
                 tagged[nt++]=i;
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(bucket[target].GetPosition(),k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) if ((mask&1ULL) && i!=target) tagged[nt++]=i;
+            }
+        }
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -298,6 +377,17 @@ namespace NBody
         if (maxr0<fdist2&&maxr1<fdist2)
             for (Int_t i = bucket_start; i < bucket_end; i++)
                 tagged[nt++]=i;
+#ifdef SOAPOINTQUERY
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(x,k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) if (mask&1ULL) tagged[nt++]=i;
+            }
+        }
+#endif
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -324,6 +414,15 @@ namespace NBody
         if (maxr0<fdist2&&maxr1<fdist2)
             for (Int_t i = bucket_start; i < bucket_end; i++)
                 tagged.push_back(i);
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(bucket[target].GetPosition(),k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) if ((mask&1ULL) && i!=target) tagged.push_back(i);
+            }
+        }
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -345,6 +444,17 @@ namespace NBody
         if (maxr0<fdist2&&maxr1<fdist2)
             for (Int_t i = bucket_start; i < bucket_end; i++)
                 tagged.push_back(i);
+#ifdef SOAPOINTQUERY
+        else if (soapos!=NULL && dim==3) {
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            Int_t i;
+            for (Int_t k=0;k<count;k+=64) {
+                mask=SoABlockMask(x,k,thr);
+                for (i=bucket_start+k;mask;i++,mask>>=1) if (mask&1ULL) tagged.push_back(i);
+            }
+        }
+#endif
         else
         for (Int_t i = bucket_start; i < bucket_end; i++)
         {
@@ -504,27 +614,43 @@ namespace NBody
         }
         //otherwise check each particle individually
         else {
-            Int_t id;
+            Int_t id,k,stride=SoAStride();
             Double_t dist2;
+            //if positions are loaded, distances of blocks of up to 64 particles are calculated at once, but only
+            //once a particle in the block that is not yet grouped is reached as most are in a group already
+            unsigned long long mask=0;
+            Int_t kblock=-1;
+            DoublePos_t thr=SoABallThreshold(fdist2);
             for (Int_t i = bucket_start; i < bucket_end; i++)
             {
                 if (flag!=Head[i])flag=0;
                 id=bucket[i].GetID();
                 if (Group[id]) continue;
-                dist2 = DistanceSqd(bucket[target].GetPosition(),bucket[i].GetPosition());
-                if (numdim==6) dist2+=DistanceSqd(bucket[target].GetVelocity(),bucket[i].GetVelocity());
-                if (dist2 < fdist2) {
-                    Group[id]=iGroup;
-                    Fifo[iTail++]=i;
-                    Len[iGroup]++;
+                if (soapos!=NULL) {
+                    k=i-bucket_start;
+                    if ((k>>6)!=kblock) {
+                        kblock=k>>6;
+                        k=kblock<<6;
+                        mask=SoABallMask(bucket[target].GetPosition(),&soapos[k],&soapos[stride+k],&soapos[2*stride+k],(count-k<64)?count-k:64,thr);
+                        k=i-bucket_start;
+                    }
+                    if (!((mask>>(k&63))&1ULL)) continue;
+                }
+                else {
+                    dist2 = DistanceSqd(bucket[target].GetPosition(),bucket[i].GetPosition());
+                    if (numdim==6) dist2+=DistanceSqd(bucket[target].GetVelocity(),bucket[i].GetVelocity());
+                    if (!(dist2 < fdist2)) continue;
+                }
+                Group[id]=iGroup;
+                Fifo[iTail++]=i;
+                Len[iGroup]++;
 
-                    Next[Tail[Head[target]]]=Head[i];
-                    Tail[Head[target]]=Tail[Head[i]];
-                    Head[i]=Head[target];
+                Next[Tail[Head[target]]]=Head[i];
+                Tail[Head[target]]=Tail[Head[i]];
+                Head[i]=Head[target];
 
-                    if(iTail==nActive)iTail=0;
-                    flag=0;
-                }
+                if(iTail==nActive)iTail=0;
+                flag=0;
             }
         }
         if (flag) BucketFlag[nid]=1;
@@ -781,6 +907,70 @@ namespace NBody
     }
     //@}
 
+    ///\name FOF Union searches
+    //@{
+    void LeafNode::FOFSearchBallUnion(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target)
+    {
+        //each pair is only examined once, from the particle with the smaller tree index
+        if ((Int_t)bucket_end<=target+1) return;
+        Int_t istart=((Int_t)bucket_start>target)?(Int_t)bucket_start:target+1;
+        Double_t maxr0=0.,maxr1=0.;
+        for (int j=0;j<numdim;j++){
+            maxr0+=(p.GetPhase(j)-xbnd[j][0])*(p.GetPhase(j)-xbnd[j][0]);
+            maxr1+=(p.GetPhase(j)-xbnd[j][1])*(p.GetPhase(j)-xbnd[j][1]);
+        }
+        //first check to see if entire node lies wihtin search distance
+        if (maxr0<fdist2&&maxr1<fdist2){
+            for (Int_t i = istart; i < bucket_end; i++) FOFUnion(Parent,target,i);
+        }
+        else if (soapos!=NULL) {
+            Int_t stride=SoAStride(),n,k0=istart-bucket_start;
+            DoublePos_t thr=SoABallThreshold(fdist2);
+            unsigned long long mask;
+            //blocks start at multiples of 64 in the leaf to keep loads within the padded arrays, entries below istart are masked
+            for (Int_t k = (k0/64)*64; k < (Int_t)count; k+=64)
+            {
+                n=((Int_t)count-k<64)?(Int_t)count-k:64;
+                mask=SoABallMask(p.GetPosition(),&soapos[k],&soapos[stride+k],&soapos[2*stride+k],n,thr);
+                if (k0>k) mask&=~((1ULL<<(k0-k))-1ULL);
+                //visit set bits in increasing index
+                while (mask) {
+                    FOFUnion(Parent,target,bucket_start+k+__builtin_ctzll(mask));
+                    mask&=mask-1ULL;
+                }
+            }
+        }
+        else {
+            Double_t dist2;
+            for (Int_t i = istart; i < bucket_end; i++)
+            {
+                dist2 = DistanceSqd(p.GetPosition(),bucket[i].GetPosition());
+                if (numdim==6) dist2+=DistanceSqd(p.GetVelocity(),bucket[i].GetVelocity());
+                if (dist2 < fdist2) FOFUnion(Parent,target,i);
+            }
+        }
+    }
+    void LeafNode::FOFSearchCriterionUnion(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target)
+    {
+        if ((Int_t)bucket_end<=target+1) return;
+        Int_t istart=((Int_t)bucket_start>target)?(Int_t)bucket_start:target+1;
+        for (Int_t i = istart; i < bucket_end; i++)
+        {
+            //if tag below zero then don't do anything
+            if (Group[bucket[i].GetID()]<0) continue;
+            if (cmp(p,bucket[i],params)) FOFUnion(Parent,target,i);
+        }
+    }
+    void LeafNode::FOFSearchBallUnionPeriodic(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target)
+    {
+        FOFSearchBallUnion(rd, fdist2, bucket, Parent, off, p, target);
+    }
+    void LeafNode::FOFSearchCriterionUnionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target)
+    {
+        FOFSearchCriterionUnion(rd, cmp, params, bucket, Group, Parent, off, p, target);
+    }
+    //@}
+
     //@}
 
 }
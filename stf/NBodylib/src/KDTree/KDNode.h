@@ -33,9 +33,78 @@ typedef int Int_tree_t;
 typedef unsigned int UInt_tree_t;
 #endif
 
+///leaf nodes can hold a structure-of-arrays copy of their positions that is searched with vectorised kernels
+///(see \ref KDSIMD.cxx). The copies are only made if positions are stored as float or double (SOALEAF). The blocks of each
+///leaf are padded to a multiple of SOAPAD entries, enough for the widest vector used, and the runtime dispatched SIMD kernels
+///are only available on x86 with gcc compatible compilers, otherwise a scalar kernel is used.
+#define SOAPAD 16
+///alignment in bytes of the structure-of-arrays positions, that of the widest vector used. As blocks are a multiple of SOAPAD
+///entries every block, and every row of 64 entries searched at a time, starts on this alignment
+#define SOAALIGN 64
+#if defined(LOWPRECISIONPOS) || (!defined(QUADPRECISION) && !defined(QUADQUADPRECISION))
+#define SOALEAF
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#if defined(LOWPRECISIONPOS) || defined(SINGLEPRECISION)
+#define SOASIMDFLOAT
+#else
+#define SOASIMDDOUBLE
+#endif
+#endif
+#endif
+///searches about a point given as Double_t rather than about a particle can only use the copies if positions are stored as Double_t
+#if !defined(LOWPRECISIONPOS) || defined(SINGLEPRECISION)
+#define SOAPOINTQUERY
+#endif
+
 namespace NBody
 {
 
+    /// \name Vectorised ball kernels used on the structure-of-arrays positions of leaf nodes
+    //@{
+    ///returns a bitmask of the n<=64 entries of the x,y,z arrays whose squared distance to q is <= thr
+    typedef unsigned long long (*SoABallMaskfunc)(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr);
+    ///kernel for the instruction set selected at run time
+    extern SoABallMaskfunc SoABallMask;
+    ///threshold to pass to \ref SoABallMask so that it selects the same particles as dist2<fdist2
+    DoublePos_t SoABallThreshold(Double_t fdist2);
+    //@}
+
+    /// \name Concurrent union-find used by the parallel FOF routines
+    /// Parent is indexed by tree index and every set is rooted at its smallest member, so that
+    /// the roots give the same group ordering as the serial FOF search which seeds groups in tree order.
+    //@{
+    ///find the root of i, halving the path as it goes. Safe to call while other threads call \ref FOFUnion
+    inline Int_tree_t FOFFindRoot(Int_tree_t *Parent, Int_tree_t i)
+    {
+        Int_tree_t p=__atomic_load_n(&Parent[i],__ATOMIC_RELAXED), gp;
+        while (p!=i) {
+            gp=__atomic_load_n(&Parent[p],__ATOMIC_RELAXED);
+            if (gp!=p) {
+                Int_tree_t expected=p;
+                __atomic_compare_exchange_n(&Parent[i],&expected,gp,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+            }
+            i=p;
+            p=gp;
+        }
+        return i;
+    }
+    ///join the sets containing i and j by attaching the larger root to the smaller one with an atomic compare and swap
+    inline void FOFUnion(Int_tree_t *Parent, Int_tree_t i, Int_tree_t j)
+    {
+        Int_tree_t ri, rj;
+        while (true) {
+            ri=FOFFindRoot(Parent,i);
+            rj=FOFFindRoot(Parent,j);
+            if (ri==rj) return;
+            if (ri<rj) {Int_tree_t temp=ri;ri=rj;rj=temp;}
+            //only succeeds if ri is still a root, otherwise another thread has moved it so try again
+            Int_tree_t expected=ri;
+            if (__atomic_compare_exchange_n(&Parent[ri],&expected,rj,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) return;
+            i=ri;j=rj;
+        }
+    }
+    //@}
+
 /*!
     \class NBody::Node
     \brief Base virtual class for a node used by \ref NBody::KDTree.
@@ -64,6 +133,8 @@ namespace NBody
         virtual Int_t GetID(){return nid;}
         ///Get boundary of volume enclosed by node
         virtual Double_t GetBoundary(int i, int j){return xbnd[i][j];}
+        ///Get boundary of volume enclosed by node in its stored precision, without a virtual call, for use in tight loops
+        const DoublePos_t *GetBoundaryPos(int i) const {return xbnd[i];}
         ///Get total number of particles in node
         virtual Int_t GetCount(){return count;}
         ///Get start index in particle array of particles enclosed by node
@@ -217,6 +288,18 @@ namespace NBody
         virtual void FOFSearchCriterionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target) = 0;
         virtual void FOFSearchCriterionSetBasisForLinksPeriodic(Double_t rd, FOFcompfunc cmp, FOFcheckfunc check, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target) = 0;
         //@}
+
+        /// \name FOF Union Searches
+        /// Used by the parallel FOF routines. Instead of growing one group at a time these find all particles with
+        /// tree index larger than target that are linked to the particle p (a copy of bucket[target] which for periodic searches is reflected
+        /// rather than the bucket itself so that many threads can search at once) and join their sets in the union-find array Parent.
+        /// For the criterion search particles with Group[id]<0 are ignored.
+        //@{
+        virtual void FOFSearchBallUnion(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target) = 0;
+        virtual void FOFSearchCriterionUnion(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target) = 0;
+        virtual void FOFSearchBallUnionPeriodic(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target) = 0;
+        virtual void FOFSearchCriterionUnionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target) = 0;
+        //@}
     };
 
 /*!
@@ -248,7 +331,8 @@ namespace NBody
             numdim=ndim;
             for (int j=0;j<numdim;j++) {xbnd[j][0]=bnd[j][0];xbnd[j][1]=bnd[j][1];}
         }
-        ~SplitNode() { delete left; delete right; }
+        ///children are not deleted here as all nodes are owned by the node block of \ref NBody::KDTree
+        ~SplitNode() { }
 
         /// \name Simple Get functions
         //@{
@@ -352,6 +436,11 @@ namespace NBody
         void FOFSearchBallPeriodic(Double_t rd, Double_t fdist2, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
         void FOFSearchCriterionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
         void FOFSearchCriterionSetBasisForLinksPeriodic(Double_t rd, FOFcompfunc cmp, FOFcheckfunc check, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
+
+        void FOFSearchBallUnion(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target);
+        void FOFSearchCriterionUnion(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target);
+        void FOFSearchBallUnionPeriodic(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target);
+        void FOFSearchCriterionUnionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target);
     };
 
 /*!
@@ -363,6 +452,9 @@ namespace NBody
     class LeafNode : public Node
     {
         private:
+        ///structure-of-arrays copy of the positions in the leaf, x, y and z blocks each padded to \ref SoAStride entries.
+        ///Set for the lifetime of a TPHYS tree (see \ref NBody::KDTree::LoadLeafPositions), otherwise NULL
+        DoublePos_t *soapos;
         public:
         LeafNode(Int_t id, Int_t new_bucket_start, Int_t new_bucket_end, Double_t bnd[6][2], unsigned short ndim)
         {
@@ -372,9 +464,23 @@ namespace NBody
             count=bucket_end-bucket_start;
             numdim=ndim;
             for (int j=0;j<numdim;j++) {xbnd[j][0]=bnd[j][0];xbnd[j][1]=bnd[j][1];}
+            soapos=NULL;
         }
         ~LeafNode() { }
 
+        ///\name structure-of-arrays positions
+        //@{
+        ///number of entries in each coordinate block
+        Int_t SoAStride() const {return ((count+SOAPAD-1)/SOAPAD)*SOAPAD;}
+        void SetSoAPosition(DoublePos_t *p) {soapos=p;}
+        DoublePos_t *GetSoAPosition() {return soapos;}
+        ///mask of the entries in the block of at most 64 starting at entry k whose squared distance to q is <= thr, see \ref SoABallMask
+        unsigned long long SoABlockMask(const DoublePos_t *q, Int_t k, DoublePos_t thr) const {
+            Int_t stride=SoAStride();
+            return SoABallMask(q,&soapos[k],&soapos[stride+k],&soapos[2*stride+k],(count-k<64)?count-k:64,thr);
+        }
+        //@}
+
         //implementations of Find functions
         void FindNearestPos(Double_t rd, Particle *bucket, PriorityQueue *pq, Double_t* off, Int_t t, int dim=3);
         void FindNearestVel(Double_t rd, Particle *bucket, PriorityQueue *pq, Double_t* off, Int_t t, int dim=3);
@@ -465,6 +571,11 @@ namespace NBody
         void FOFSearchBallPeriodic(Double_t rd, Double_t fdist2, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
         void FOFSearchCriterionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
         void FOFSearchCriterionSetBasisForLinksPeriodic(Double_t rd, FOFcompfunc cmp, FOFcheckfunc check, Double_t *params, Int_t iGroup, Int_t nActive, Particle *bucket, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t* off, Double_t *period, Int_t target);
+
+        void FOFSearchBallUnion(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target);
+        void FOFSearchCriterionUnion(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target);
+        void FOFSearchBallUnionPeriodic(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target);
+        void FOFSearchCriterionUnionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target);
     };
 
 }
@@ -0,0 +1,165 @@
+/*! \file KDSIMD.cxx
+ *  \brief This file contains the vectorised distance kernels used by leaf nodes on structure-of-arrays copies of particle positions
+
+    The kernel returns a bitmask of all particles in a block of at most 64 entries that lie within a squared distance of a point.
+    Distances are accumulated in the same order and precision as \ref DistanceSqd, that is ((dx*dx+dy*dy)+dz*dz) in DoublePos_t,
+    so a kernel selects exactly the particles that the scalar leaf loops select. The instruction set is chosen once at run time.
+    The position blocks are aligned to SOAALIGN bytes (see \ref NBody::KDTree::LoadLeafPositions) so the kernels use aligned loads.
+*/
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <KDNode.h>
+#if defined(SOASIMDFLOAT) || defined(SOASIMDDOUBLE)
+#include <immintrin.h>
+#endif
+
+namespace NBody
+{
+    ///\name Ball mask kernels
+    //@{
+    ///scalar kernel, also used in builds where the positions are never loaded into leaf nodes
+    static unsigned long long SoABallMaskScalar(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        DoublePos_t dx,dy,dz;
+        for (int i=0;i<n;i++) {
+            dx=q[0]-x[i];dy=q[1]-y[i];dz=q[2]-z[i];
+            if (dx*dx+dy*dy+dz*dz<=thr) mask|=1ULL<<i;
+        }
+        return mask;
+    }
+
+#if defined(SOASIMDFLOAT)
+    //intrinsics must not be contracted into fused multiply-adds otherwise distances would differ from the scalar loops
+    __attribute__((target("sse2"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskSSE(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m128 qx=_mm_set1_ps(q[0]),qy=_mm_set1_ps(q[1]),qz=_mm_set1_ps(q[2]),t=_mm_set1_ps(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=4) {
+            dx=_mm_sub_ps(qx,_mm_load_ps(&x[i]));
+            dy=_mm_sub_ps(qy,_mm_load_ps(&y[i]));
+            dz=_mm_sub_ps(qz,_mm_load_ps(&z[i]));
+            d2=_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy)),_mm_mul_ps(dz,dz));
+            mask|=(unsigned long long)_mm_movemask_ps(_mm_cmple_ps(d2,t))<<i;
+        }
+        return mask;
+    }
+    __attribute__((target("avx2"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskAVX2(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m256 qx=_mm256_set1_ps(q[0]),qy=_mm256_set1_ps(q[1]),qz=_mm256_set1_ps(q[2]),t=_mm256_set1_ps(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=8) {
+            dx=_mm256_sub_ps(qx,_mm256_load_ps(&x[i]));
+            dy=_mm256_sub_ps(qy,_mm256_load_ps(&y[i]));
+            dz=_mm256_sub_ps(qz,_mm256_load_ps(&z[i]));
+            d2=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx),_mm256_mul_ps(dy,dy)),_mm256_mul_ps(dz,dz));
+            mask|=(unsigned long long)_mm256_movemask_ps(_mm256_cmp_ps(d2,t,_CMP_LE_OQ))<<i;
+        }
+        return mask;
+    }
+    __attribute__((target("avx512f"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskAVX512(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m512 qx=_mm512_set1_ps(q[0]),qy=_mm512_set1_ps(q[1]),qz=_mm512_set1_ps(q[2]),t=_mm512_set1_ps(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=16) {
+            dx=_mm512_sub_ps(qx,_mm512_load_ps(&x[i]));
+            dy=_mm512_sub_ps(qy,_mm512_load_ps(&y[i]));
+            dz=_mm512_sub_ps(qz,_mm512_load_ps(&z[i]));
+            d2=_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx,dx),_mm512_mul_ps(dy,dy)),_mm512_mul_ps(dz,dz));
+            mask|=(unsigned long long)_mm512_cmp_ps_mask(d2,t,_CMP_LE_OQ)<<i;
+        }
+        return mask;
+    }
+#elif defined(SOASIMDDOUBLE)
+    __attribute__((target("sse2"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskSSE(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m128d qx=_mm_set1_pd(q[0]),qy=_mm_set1_pd(q[1]),qz=_mm_set1_pd(q[2]),t=_mm_set1_pd(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=2) {
+            dx=_mm_sub_pd(qx,_mm_load_pd(&x[i]));
+            dy=_mm_sub_pd(qy,_mm_load_pd(&y[i]));
+            dz=_mm_sub_pd(qz,_mm_load_pd(&z[i]));
+            d2=_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx,dx),_mm_mul_pd(dy,dy)),_mm_mul_pd(dz,dz));
+            mask|=(unsigned long long)_mm_movemask_pd(_mm_cmple_pd(d2,t))<<i;
+        }
+        return mask;
+    }
+    __attribute__((target("avx2"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskAVX2(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m256d qx=_mm256_set1_pd(q[0]),qy=_mm256_set1_pd(q[1]),qz=_mm256_set1_pd(q[2]),t=_mm256_set1_pd(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=4) {
+            dx=_mm256_sub_pd(qx,_mm256_load_pd(&x[i]));
+            dy=_mm256_sub_pd(qy,_mm256_load_pd(&y[i]));
+            dz=_mm256_sub_pd(qz,_mm256_load_pd(&z[i]));
+            d2=_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx,dx),_mm256_mul_pd(dy,dy)),_mm256_mul_pd(dz,dz));
+            mask|=(unsigned long long)_mm256_movemask_pd(_mm256_cmp_pd(d2,t,_CMP_LE_OQ))<<i;
+        }
+        return mask;
+    }
+    __attribute__((target("avx512f"),optimize("fp-contract=off")))
+    static unsigned long long SoABallMaskAVX512(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=0;
+        __m512d qx=_mm512_set1_pd(q[0]),qy=_mm512_set1_pd(q[1]),qz=_mm512_set1_pd(q[2]),t=_mm512_set1_pd(thr),dx,dy,dz,d2;
+        for (int i=0;i<n;i+=8) {
+            dx=_mm512_sub_pd(qx,_mm512_load_pd(&x[i]));
+            dy=_mm512_sub_pd(qy,_mm512_load_pd(&y[i]));
+            dz=_mm512_sub_pd(qz,_mm512_load_pd(&z[i]));
+            d2=_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx,dx),_mm512_mul_pd(dy,dy)),_mm512_mul_pd(dz,dz));
+            mask|=(unsigned long long)_mm512_cmp_pd_mask(d2,t,_CMP_LE_OQ)<<i;
+        }
+        return mask;
+    }
+#endif
+
+    ///wraps a kernel so that bits from the zeroed padding past n are never returned
+    template<unsigned long long (*K)(const DoublePos_t *, const DoublePos_t *, const DoublePos_t *, const DoublePos_t *, int, DoublePos_t)>
+    static unsigned long long SoABallMaskPadded(const DoublePos_t *q, const DoublePos_t *x, const DoublePos_t *y, const DoublePos_t *z, int n, DoublePos_t thr)
+    {
+        unsigned long long mask=K(q,x,y,z,n,thr);
+        if (n<64) mask&=(1ULL<<n)-1ULL;
+        return mask;
+    }
+
+    ///select the widest kernel supported by the processor. Can be overridden by setting the environment variable
+    ///NBODYSIMD to scalar, sse, avx2 or avx512 (if the requested instruction set is not supported, the next narrower one is used)
+    static SoABallMaskfunc SelectSoABallMask()
+    {
+#if (defined(SOASIMDFLOAT) || defined(SOASIMDDOUBLE))
+        const char *req=getenv("NBODYSIMD");
+        int ilevel=3;
+        if (req!=NULL) {
+            if (strcmp(req,"scalar")==0) ilevel=0;
+            else if (strcmp(req,"sse")==0) ilevel=1;
+            else if (strcmp(req,"avx2")==0) ilevel=2;
+        }
+        __builtin_cpu_init();
+        if (ilevel>=3 && __builtin_cpu_supports("avx512f")) return SoABallMaskPadded<SoABallMaskAVX512>;
+        if (ilevel>=2 && __builtin_cpu_supports("avx2")) return SoABallMaskPadded<SoABallMaskAVX2>;
+        if (ilevel>=1 && __builtin_cpu_supports("sse2")) return SoABallMaskPadded<SoABallMaskSSE>;
+#endif
+        return SoABallMaskScalar;
+    }
+    SoABallMaskfunc SoABallMask=SelectSoABallMask();
+
+    DoublePos_t SoABallThreshold(Double_t fdist2)
+    {
+        //largest value representable in DoublePos_t that is strictly less than fdist2, so that dist2<=thr in DoublePos_t
+        //is equivalent to the dist2<fdist2 test of the scalar loops
+        DoublePos_t thr=(DoublePos_t)fdist2;
+#ifdef SOALEAF
+        if (!(thr<fdist2)) thr=std::nextafter(thr,-std::numeric_limits<DoublePos_t>::infinity());
+#endif
+        return thr;
+    }
+    //@}
+}
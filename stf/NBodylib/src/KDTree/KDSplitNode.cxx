@@ -1465,4 +1465,152 @@ namespace NBody
     }
 
     //@}
+
+    ///\name FOF Union searches
+    ///Like the FOF searches above but pairs are joined in the union-find Parent array and the target particle is passed as a copy,
+    ///so periodic searches reflect the copy rather than the bucket and the searches can be run by many threads at once.
+    //@{
+    void SplitNode::FOFSearchBallUnion(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target)
+    {
+        //only particles with tree index larger than target are linked so skip nodes that lie entirely before it
+        if ((Int_t)bucket_end<=target+1) return;
+        Double_t old_off = off[cut_dim];
+        Double_t new_off = p.GetPhase(cut_dim) - cut_val;
+        if (new_off < 0)
+        {
+            left->FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,p,target);
+            rd += -old_off*old_off + new_off*new_off;
+            if (rd < fdist2)
+            {
+                off[cut_dim] = new_off;
+                right->FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,p,target);
+                off[cut_dim] = old_off;
+            }
+        }
+        else
+        {
+            right->FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,p,target);
+            rd += -old_off*old_off + new_off*new_off;
+            if (rd < fdist2)
+            {
+                off[cut_dim] = new_off;
+                left->FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,p,target);
+                off[cut_dim] = old_off;
+            }
+        }
+    }
+
+    void SplitNode::FOFSearchCriterionUnion(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Particle &p, Int_t target)
+    {
+        if ((Int_t)bucket_end<=target+1) return;
+        Double_t old_off = off[cut_dim];
+        Double_t new_off = p.GetPhase(cut_dim) - cut_val;
+        if (new_off < 0)
+        {
+            left->FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,p,target);
+            if ((int)params[0]==0) rd += (-old_off*old_off + new_off*new_off)/params[1];
+            else if ((int)params[0]==1) rd += (-old_off*old_off + new_off*new_off)/params[2];
+            else if ((int)params[0]==2) rd += (-old_off*old_off + new_off*new_off)/params[(cut_dim<3)*1+(cut_dim>=3)*2];
+            if (rd < 1)
+            {
+                off[cut_dim] = new_off;
+                right->FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,p,target);
+                off[cut_dim] = old_off;
+            }
+        }
+        else
+        {
+            right->FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,p,target);
+            if ((int)params[0]==0) rd += (-old_off*old_off + new_off*new_off)/params[1];
+            else if ((int)params[0]==1) rd += (-old_off*old_off + new_off*new_off)/params[2];
+            else if ((int)params[0]==2) rd += (-old_off*old_off + new_off*new_off)/params[(cut_dim<3)*1+(cut_dim>=3)*2];
+            if (rd < 1)
+            {
+                off[cut_dim] = new_off;
+                left->FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,p,target);
+                off[cut_dim] = old_off;
+            }
+        }
+    }
+
+    void SplitNode::FOFSearchBallUnionPeriodic(Double_t rd, Double_t fdist2, Particle *bucket, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target)
+    {
+        FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,p,target);
+        Coordinate x0(p.GetPosition()),xp;
+        Particle pp(p);
+        Double_t sval;
+        for (int k=0;k<NSPACEDIM;k++) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection1D(x0,xp,period,k);
+            if (fdist2>sval*sval) {
+                for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+                FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,pp,target);
+            }
+        }
+        if (NSPACEDIM==3) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,0,1);
+            if (fdist2>sval*sval) {
+                for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+                FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,pp,target);
+            }
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,0,2);
+            if (fdist2>sval*sval) {
+                for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+                FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,pp,target);
+            }
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,1,2);
+            if (fdist2>sval*sval) {
+                for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+                FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,pp,target);
+            }
+        }
+        // search all axis if current max dist less than search radius
+        if (NSPACEDIM>1) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflectionND(x0,xp,period,NSPACEDIM);
+            if (fdist2>sval*sval) {
+                for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+                FOFSearchBallUnion(rd,fdist2,bucket,Parent,off,pp,target);
+            }
+        }
+    }
+
+    void SplitNode::FOFSearchCriterionUnionPeriodic(Double_t rd, FOFcompfunc cmp, Double_t *params, Particle *bucket, Int_t *Group, Int_tree_t *Parent, Double_t* off, Double_t *period, Particle &p, Int_t target)
+    {
+        FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,p,target);
+        Coordinate x0(p.GetPosition()),xp;
+        Particle pp(p);
+        Double_t sval;
+        for (int k=0;k<NSPACEDIM;k++) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection1D(x0,xp,period,k);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,pp,target);
+        }
+        if (NSPACEDIM==3) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,0,1);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,0,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,pp,target);
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflection2D(x0,xp,period,1,2);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,pp,target);
+        }
+        // search all axis if current max dist less than search radius
+        if (NSPACEDIM>1) {
+            for (int j = 0; j < NSPACEDIM; j++) off[j] = 0.0;
+            sval=PeriodicReflectionND(x0,xp,period,NSPACEDIM);
+            for (int j=0;j<3;j++) pp.SetPosition(j,xp[j]);
+            FOFSearchCriterionUnion(rd,cmp,params,bucket,Group,Parent,off,pp,target);
+        }
+    }
+    //@}
 }
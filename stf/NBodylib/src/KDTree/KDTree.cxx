@@ -347,7 +347,7 @@ namespace NBody
         Int_t i;
 #ifdef USEOPENMP
     #pragma omp parallel default(shared) \
-    private(i)
+    private(i) if (end-start>=CRITPARALLELSIZE)
     {
     #pragma omp for reduction(+:disp)
 #endif
@@ -365,7 +365,7 @@ namespace NBody
         Int_t i;
 #ifdef USEOPENMP
     #pragma omp parallel default(shared)     \
-    private(i)
+    private(i) if (end-start>=CRITPARALLELSIZE)
     {
     #pragma omp for reduction(+:disp)
 #endif
@@ -383,7 +383,7 @@ namespace NBody
         Int_t i;
 #ifdef USEOPENMP
     #pragma omp parallel default(shared) \
-    private(i)
+    private(i) if (end-start>=CRITPARALLELSIZE)
     {
     #pragma omp for reduction(+:disp)
 #endif
@@ -488,6 +488,80 @@ namespace NBody
         }
         return entropy/log10(nbins);
     }
+
+    /// \name Same as above but using the contiguous coordinate array pcoord, where the index array pindex
+    /// gives the particle associated with each entry. Here ND coordinates are stored per entry
+    /// so that only these and the index need to be moved when partitioning the data.
+    //@{
+    inline Double_t KDTree::SpreadestIndex(int j, Int_t start, Int_t end, Double_t *bnd)
+    {
+        Double_t min = pcoord[start*ND+j];
+        Double_t max = min;
+        Int_t i;
+#ifdef USEOPENMP
+    #pragma omp parallel for \
+    default(shared) private(i) reduction(min:min) reduction(max:max) if (end-start>=CRITPARALLELSIZE)
+#endif
+        for (i = start + 1; i < end; i++)
+        {
+            if (pcoord[i*ND+j] < min) min = pcoord[i*ND+j];
+            if (pcoord[i*ND+j] > max) max = pcoord[i*ND+j];
+        }
+        bnd[0]=min;bnd[1]=max;
+        return max - min;
+    }
+    inline Double_t KDTree::BoundaryandMeanIndex(int j, Int_t start, Int_t end, Double_t *bnd)
+    {
+        Double_t mean=pcoord[start*ND+j];
+        Double_t min = mean, max = mean;
+        Int_t i;
+#ifdef USEOPENMP
+    #pragma omp parallel for \
+    default(shared) private(i) reduction(min:min) reduction(max:max) reduction(+:mean) if (end-start>=CRITPARALLELSIZE)
+#endif
+        for (i = start + 1; i < end; i++)
+        {
+            if (pcoord[i*ND+j] < min) min = pcoord[i*ND+j];
+            if (pcoord[i*ND+j] > max) max = pcoord[i*ND+j];
+            mean+=pcoord[i*ND+j];
+        }
+        bnd[0]=min;bnd[1]=max;
+        mean/=(Double_t)(end-start);
+        return mean;
+    }
+    inline Double_t KDTree::DispersionIndex(int j, Int_t start, Int_t end, Double_t mean)
+    {
+        Double_t disp=0;
+        Int_t i;
+#ifdef USEOPENMP
+    #pragma omp parallel for \
+    default(shared) private(i) reduction(+:disp) if (end-start>=CRITPARALLELSIZE)
+#endif
+        for (i = start; i < end; i++)
+            disp+=(pcoord[i*ND+j]-mean)*(pcoord[i*ND+j]-mean);
+        disp/=(Double_t)(end-start);
+        return disp;
+    }
+    inline Double_t KDTree::EntropyIndex(int j, Int_t start, Int_t end, Double_t low, Double_t up, Double_t nbins, Double_t *nientropy)
+    {
+        Int_t ibin, i;
+        Double_t mtot=0.,entropy=0.;
+        Double_t dx=(up-low)/nbins;
+        for (i=0;i<nbins;i++) nientropy[i]=0.;
+        for (i=start;i<end;i++){
+            mtot+=bucket[pindex[i]].GetMass();
+            ibin=(Int_t)((pcoord[i*ND+j]-low)/dx);
+            nientropy[ibin]+=bucket[pindex[i]].GetMass();
+        }
+        mtot=1.0/mtot;
+        for (i=0;i<nbins;i++) {
+            if (nientropy[i]>0) {
+                Double_t temp=nientropy[i]*mtot;
+                entropy-=temp*log10(temp);
+            }
+        }
+        return entropy/log10((Double_t)nbins);
+    }
     //@}
 
     /// \name Determine the median coordinates in some space
@@ -616,6 +690,150 @@ namespace NBody
             exit(9);
         }
     }
+    ///same as above but swaps entries of the index and coordinate arrays, following the identical sequence of
+    ///operations so that the resulting tree is the same as that produced by swapping particles.
+    ///The number of dimensions is a template parameter so that moving an entry's coordinates is unrolled.
+    template<int NDIM> inline Double_t KDTree::MedianIndexDim(int d, Int_t k, Int_t start, Int_t end)
+    {
+        Int_t left = start;
+        Int_t right = end - 1;
+        Int_t i, j, iw;
+        Double_t x, w[NDIM];
+        Double_t *ci, *cj;
+
+        while (left < right)
+        {
+            x = pcoord[k*NDIM+d];
+            iw = pindex[right]; pindex[right] = pindex[k]; pindex[k] = iw;
+            ci = &pcoord[right*NDIM]; cj = &pcoord[k*NDIM];
+            for (int n = 0; n < NDIM; n++) {w[n] = ci[n]; ci[n] = cj[n]; cj[n] = w[n];}
+            i = left-1;
+            j = right;
+            while (1) {
+                while (i < j) if (pcoord[(++i)*NDIM+d] >= x) break;
+                while (i < j) if (pcoord[(--j)*NDIM+d] <= x) break;
+                iw = pindex[i]; pindex[i] = pindex[j]; pindex[j] = iw;
+                ci = &pcoord[i*NDIM]; cj = &pcoord[j*NDIM];
+                for (int n = 0; n < NDIM; n++) {w[n] = ci[n]; ci[n] = cj[n]; cj[n] = w[n];}
+                if (j <= i) break;
+            }
+            //undo the last swap and move the pivot (currently at right) into place, index iw and coordinates w hold the old [i]
+            pindex[j] = pindex[i]; pindex[i] = pindex[right]; pindex[right] = iw;
+            ci = &pcoord[i*NDIM]; cj = &pcoord[j*NDIM];
+            for (int n = 0; n < NDIM; n++) {cj[n] = ci[n]; ci[n] = pcoord[right*NDIM+n]; pcoord[right*NDIM+n] = w[n];}
+            if (i >= k) right = i - 1;
+            if (i <= k) left = i + 1;
+        }
+        return pcoord[k*NDIM+d];
+    }
+    inline Double_t KDTree::MedianIndex(int d, Int_t k, Int_t start, Int_t end, bool balanced)
+    {
+        if (balanced){
+            if (ND==3) return MedianIndexDim<3>(d, k, start, end);
+            else if (ND==6) return MedianIndexDim<6>(d, k, start, end);
+            else return MedianIndexDim<2>(d, k, start, end);
+        }
+        //much quicker but does not guarantee a balanced tree
+        else
+        {
+            printf("Note yet implemented\n");
+            exit(9);
+        }
+    }
+    ///Parallel selection used for all nodes larger than CRITPARALLELSIZE. The range is repeatedly partitioned about the median
+    ///of three values into entries lower, equal and greater than this pivot, with each thread counting and then scattering the
+    ///indices and coordinates of a contiguous chunk into temporary arrays. As this partition is stable, the resulting order does not
+    ///depend on the number of threads (including one, a nested region or a build without openmp, where it is run serially), so
+    ///the tree is the same in all builds. The extra memory is one index and ND coordinates per particle of the node.
+    ///Once the range containing the k'th entry is small enough, the serial selection is used.
+    template<int NDIM> Double_t KDTree::MedianIndexParallelDim(int d, Int_t k, Int_t start, Int_t end)
+    {
+        Int_t left = start, right = end;
+        Int_t nlowtot, neqtot;
+        Double_t x, x0, x1, x2;
+#ifdef USEOPENMP
+        int maxnthreads = omp_get_max_threads();
+#else
+        int maxnthreads = 1;
+#endif
+        Int_t *tindex = new Int_t[end-start];
+        Double_t *tcoord = new Double_t[(end-start)*NDIM];
+        Int_t *nlow = new Int_t[maxnthreads], *neq = new Int_t[maxnthreads], *nhigh = new Int_t[maxnthreads];
+
+        while (right-left >= CRITPARALLELTASKSIZE)
+        {
+            x0 = pcoord[left*NDIM+d]; x1 = pcoord[((left+right)/2)*NDIM+d]; x2 = pcoord[(right-1)*NDIM+d];
+            if (x0 > x1) {x = x0; x0 = x1; x1 = x;}
+            if (x1 > x2) x1 = x2;
+            x = (x0 > x1) ? x0 : x1;
+#ifdef USEOPENMP
+#pragma omp parallel default(shared)
+#endif
+    {
+#ifdef USEOPENMP
+            int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+#else
+            int tid = 0, nthreads = 1;
+#endif
+            Int_t chunk = (right-left+nthreads-1)/nthreads;
+            Int_t i0 = left+chunk*tid, i1 = i0+chunk, il, ie, ih, nl, ne, inew;
+            Double_t xi;
+            if (i0 > right) i0 = right;
+            if (i1 > right) i1 = right;
+            nlow[tid] = neq[tid] = 0;
+            for (Int_t i = i0; i < i1; i++) {
+                xi = pcoord[i*NDIM+d];
+                nlow[tid] += (xi < x);
+                neq[tid] += (xi == x);
+            }
+            nhigh[tid] = (i1-i0)-nlow[tid]-neq[tid];
+#ifdef USEOPENMP
+#pragma omp barrier
+#endif
+            //offsets in temporary arrays relative to left
+            il = ie = ih = nl = ne = 0;
+            for (int t = 0; t < nthreads; t++) {
+                if (t < tid) {il += nlow[t]; ie += neq[t]; ih += nhigh[t];}
+                nl += nlow[t]; ne += neq[t];
+            }
+            ie += nl;
+            ih += nl+ne;
+            if (tid == 0) {nlowtot = nl; neqtot = ne;}
+            for (Int_t i = i0; i < i1; i++) {
+                xi = pcoord[i*NDIM+d];
+                if (xi < x) inew = il++;
+                else if (xi == x) inew = ie++;
+                else inew = ih++;
+                tindex[inew] = pindex[i];
+                for (int n = 0; n < NDIM; n++) tcoord[inew*NDIM+n] = pcoord[i*NDIM+n];
+            }
+#ifdef USEOPENMP
+#pragma omp barrier
+#endif
+            for (Int_t i = i0; i < i1; i++) {
+                pindex[i] = tindex[i-left];
+                for (int n = 0; n < NDIM; n++) pcoord[i*NDIM+n] = tcoord[(i-left)*NDIM+n];
+            }
+    }
+            if (k < left+nlowtot) right = left+nlowtot;
+            else if (k < left+nlowtot+neqtot) {right = left; break;}
+            else left = left+nlowtot+neqtot;
+        }
+        delete[] tindex;
+        delete[] tcoord;
+        delete[] nlow;
+        delete[] neq;
+        delete[] nhigh;
+        //if k'th entry lies in the block equal to the pivot, selection is complete
+        if (right <= left) return pcoord[k*NDIM+d];
+        return MedianIndexDim<NDIM>(d, k, left, right);
+    }
+    Double_t KDTree::MedianIndexParallel(int d, Int_t k, Int_t start, Int_t end)
+    {
+        if (ND==3) return MedianIndexParallelDim<3>(d, k, start, end);
+        else if (ND==6) return MedianIndexParallelDim<6>(d, k, start, end);
+        else return MedianIndexParallelDim<2>(d, k, start, end);
+    }
     //@}
     //-- End of inline functions
 
@@ -624,44 +842,48 @@ namespace NBody
     /// Recursively build the nodes of the tree.  This works by first finding the dimension under
     /// which the data has the most spread, and then splitting the data about the median
     /// in that dimension.  BuildNodes() is then called on each half. Once the size of the data is
-    /// small enough, a leaf node is formed.
-    Node *KDTree::BuildNodes(Int_t start, Int_t end)
+    /// small enough, a leaf node is formed. \n
+    /// Nodes are numbered in pre-order, with inode the id of this node, so that the right child's id
+    /// is given by the number of nodes in the left subtree (see \ref NumNodes). This makes the numbering independent
+    /// of the order in which subtrees are built and lets each node be constructed directly in its slot of the node block
+    /// (see \ref nodearena). With openmp, nodes larger than CRITPARALLELSIZE
+    /// calculate the spread and partition the data using parallel loops, below this size the left and right subtrees
+    /// are built as independent tasks down to CRITPARALLELTASKSIZE.
+    Node *KDTree::BuildNodes(Int_t start, Int_t end, Int_t inode)
     {
         Double_t bnd[6][2];
         Int_t size = end - start;
+#ifdef USEOPENMP
+        //if not already in a parallel region, start one so that subtrees can be built as tasks
+        if (size<CRITPARALLELSIZE && size>=CRITPARALLELTASKSIZE && !omp_in_parallel() && omp_get_max_threads()>1)
+        {
+            Node *node;
+#pragma omp parallel default(shared)
+    {
+#pragma omp single
+            node=BuildNodes(start, end, inode);
+    }
+            return node;
+        }
+#endif
         if (size <= b)
         {
-            numleafnodes++;numnodes++;
             for (int j=0;j<ND;j++) (this->*bmfunc)(j, start, end, bnd[j]);
-            return new LeafNode(numnodes-1,start, end,  bnd, ND);
+            return new (GetNode(inode)) LeafNode(inode,start, end,  bnd, ND);
         }
         else
         {
-            numnodes++;
-            int splitdim=0,j, enflag;
+            int splitdim=0,j;
             Int_t k = start + (size - 1) / 2;
             Double_t maxspread, minentropy, maxsig,splitvalue;
-            Double_t nbins;
+            Double_t spreada[MAXND]={0},meana[MAXND]={0},vara[MAXND]={0},entropya[MAXND]={0};
+            Double_t nbins, *nientropy=NULL;
+            Node *left, *right;
             //if using shannon entropy criterion
-            if(splittingcriterion==1) if(end-start>8) nbins=ceil(pow((end-start),1./3.));else nbins=2;
-#ifdef USEOMP
-            //if openmp and region is above the critical size then run otherwise, set omp num threads=1;
-            int nthreads;
-#pragma omp parallel
-    {
-            if (omp_get_thread_num()==0) nthreads=omp_get_num_threads();
-    }
-            if (size<CRITPARALLELSIZE)nthreads=1;
-            else nthreads=6;
-#pragma omp master
-    {
-            omp_set_num_threads(nthreads);
-    }
-    #pragma omp parallel default(shared) \
-    private(j)
-    {
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
+            if(splittingcriterion==1) {
+                if(end-start>8) nbins=ceil(pow((end-start),1./3.));else nbins=2;
+                nientropy=new Double_t[(Int_t)nbins+1];
+            }
             for (j = 0; j < ND; j++)
             {
                 if(splittingcriterion==1) {
@@ -669,7 +891,7 @@ namespace NBody
                     Double_t low, up;
                     low=bnd[j][0]-2.0*(spreada[j])/(Double_t)(end-start);
                     up=bnd[j][1]+2.0*(spreada[j])/(Double_t)(end-start);
-                    entropya[j] = (this->*entropyfunc)(j, start, end, low, up, nbins, nientropy[j]);
+                    entropya[j] = (this->*entropyfunc)(j, start, end, low, up, nbins, nientropy);
                 }
                 else if (splittingcriterion==2) {
                     meana[j] = (this->*bmfunc)(j, start, end, bnd[j]);
@@ -679,10 +901,7 @@ namespace NBody
                     spreada[j] = (this->*spreadfunc)(j, start, end, bnd[j]);
                 }
             }
-#ifdef USEOMP
-    }
-#endif
-
+            if (splittingcriterion==1) delete[] nientropy;
 
             splitdim=0; maxspread=spreada[0]; minentropy=entropya[0];maxsig=vara[0];
             //splitdim=0; maxspread=0.0; minentropy=1.0;enflag=0;
@@ -711,12 +930,51 @@ namespace NBody
                 }
             }
 
-            splitvalue= (this->*medianfunc)(splitdim, k, start, end,true);
+            //used regardless of the number of threads, and in builds without openmp, so that the tree does not depend on either
+            if (ibuildindex && size>=CRITPARALLELSIZE) splitvalue = MedianIndexParallel(splitdim, k, start, end);
+            else splitvalue= (this->*medianfunc)(splitdim, k, start, end,true);
 
-            return new SplitNode(numnodes-1, splitdim, splitvalue, size, bnd, start, end, ND, BuildNodes(start, k+1),BuildNodes(k+1, end));
+            //right subtree starts after all the nodes of the left subtree
+            Int_t iright = inode + 1 + NumNodes(k + 1 - start);
+#ifdef USEOPENMP
+            if (size>=CRITPARALLELTASKSIZE && omp_in_parallel()) {
+#pragma omp task default(shared)
+                left = BuildNodes(start, k+1, inode+1);
+                right = BuildNodes(k+1, end, iright);
+#pragma omp taskwait
+            }
+            else
+#endif
+            {
+                left = BuildNodes(start, k+1, inode+1);
+                right = BuildNodes(k+1, end, iright);
+            }
+            return new (GetNode(inode)) SplitNode(inode, splitdim, splitvalue, size, bnd, start, end, ND, left, right);
         }
     }
 
+    ///Returns the number of nodes in a (sub)tree built from size particles. Since the data is always split
+    ///such that the left node has (size-1)/2+1 particles, this only depends on size and the bucket size
+    ///and can be calculated by recursively finding the number of nodes for size n and n+1 together.
+    Int_t KDTree::NumNodes(Int_t size)
+    {
+        Int_t n0, n1;
+        NumNodesPair(size, n0, n1);
+        return n0;
+    }
+    void KDTree::NumNodesPair(Int_t n, Int_t &n0, Int_t &n1)
+    {
+        if (n+1 <= b) {n0 = n1 = 1; return;}
+        Int_t m = n/2, m0, m1;
+        NumNodesPair(m, m0, m1);
+        //n even is split into (m,m), n odd into (m+1,m)
+        if (n <= b) n0 = 1;
+        else if (n%2 == 0) n0 = 1 + 2*m0;
+        else n0 = 1 + m1 + m0;
+        if ((n+1)%2 == 0) n1 = 1 + 2*m1;
+        else n1 = 1 + m1 + m0;
+    }
+
     ///scales the space and calculates the corrected volumes
     ///note here this is not mass weighted which may lead to issues later on.
     void KDTree::ScaleSpace(){
@@ -796,6 +1054,14 @@ namespace NBody
             entropyfunc=&NBody::KDTree::EntropyPos;
             medianfunc=&NBody::KDTree::MedianPos;
         }
+        if (treetype==TMETRIC) ibuildindex=0;
+        if (ibuildindex) {
+            bmfunc=&NBody::KDTree::BoundaryandMeanIndex;
+            dispfunc=&NBody::KDTree::DispersionIndex;
+            spreadfunc=&NBody::KDTree::SpreadestIndex;
+            entropyfunc=&NBody::KDTree::EntropyIndex;
+            medianfunc=&NBody::KDTree::MedianIndex;
+        }
         return 1;
         }
     }
@@ -841,11 +1107,136 @@ namespace NBody
         }
     }
 
+    ///Allocate the index array and copy the coordinates of the tree space into a contiguous array
+    void KDTree::LoadIndexBuffer(){
+        Int_t i;
+        pindex=new Int_t[numparts];
+        pcoord=new Double_t[numparts*ND];
+#ifdef USEOPENMP
+    #pragma omp parallel for \
+    default(shared) private(i) if (numparts>=CRITPARALLELSIZE)
+#endif
+        for (i=0;i<numparts;i++) {
+            pindex[i]=i;
+            for (int j=0;j<ND;j++) pcoord[i*ND+j]=IndexCoord(i,j);
+        }
+    }
+
+    ///Move particles into tree order, so that bucket[i] becomes the particle originally at pindex[i].
+    ///This follows the cycles of the permutation so that each particle is copied once, using
+    ///pindex to mark entries that are already in place.
+    void KDTree::ApplyIndexPermutation(){
+        Int_t i, j, k;
+        Particle w;
+        delete[] pcoord;
+        pcoord=NULL;
+        for (i=0;i<numparts;i++) {
+            if (pindex[i]==i) continue;
+            w=bucket[i];
+            j=i;
+            while (pindex[j]!=i) {
+                k=pindex[j];
+                bucket[j]=bucket[k];
+                pindex[j]=j;
+                j=k;
+            }
+            bucket[j]=w;
+            pindex[j]=j;
+        }
+        delete[] pindex;
+        pindex=NULL;
+    }
+
+    ///Every slot is large enough for either type of node and, as operator new[] returns storage aligned for any
+    ///fundamental type, rounding the slot size to the largest alignment keeps every slot aligned
+    void KDTree::AllocateNodes(){
+        size_t align=max(alignof(SplitNode),alignof(LeafNode));
+        nodeslotsize=max(sizeof(SplitNode),sizeof(LeafNode));
+        nodeslotsize=((nodeslotsize+align-1)/align)*align;
+        nodearena=new char[numnodes*nodeslotsize];
+    }
+
+    void KDTree::FreeNodes(){
+        if (nodearena==NULL) return;
+        for (Int_t i=0;i<numnodes;i++) GetNode(i)->~Node();
+        delete[] nodearena;
+        nodearena=NULL;
+        root=NULL;
+    }
+
     //-- End of private functions used to build the tree
 
+    //-- Private functions that manage the leaf node positions
+
+    ///Leaves are collected in tree order and each is given a contiguous block of 3*SoAStride() entries
+    ///(x, then y, then z) so that its positions can be searched with \ref SoABallMask. The array is aligned to SOAALIGN bytes.
+    int KDTree::LoadLeafPositions()
+    {
+#ifdef SOALEAF
+        if (root==NULL || treetype!=TPHYS || leafpos!=NULL) return 0;
+        vector<LeafNode*> leaves;
+        vector<Int_t> offsets;
+        Node *np;
+        Int_t ntot=0;
+        leaves.reserve(numleafnodes);
+        offsets.reserve(numleafnodes);
+        //pre-order ids visit the leaves in tree order
+        for (Int_t i=0;i<numnodes;i++) {
+            np=GetNode(i);
+            if (np->GetCount()<=b) {
+                leaves.push_back((LeafNode*)np);
+                offsets.push_back(ntot);
+                ntot+=3*((LeafNode*)np)->SoAStride();
+            }
+        }
+        //aligned so the SIMD kernels can use aligned loads
+        void *ptr;
+        if (posix_memalign(&ptr,SOAALIGN,ntot*sizeof(DoublePos_t))!=0) return 0;
+        leafpos=(DoublePos_t*)ptr;
+        Int_t nleaves=leaves.size();
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) schedule(static) if (numparts>=CRITPARALLELSIZE)
+#endif
+        for (Int_t i=0;i<nleaves;i++) {
+            LeafNode *lp=leaves[i];
+            DoublePos_t *x=&leafpos[offsets[i]];
+            Int_t stride=lp->SoAStride(), start=lp->GetStart(), n=lp->GetCount();
+            for (int j=0;j<3;j++) {
+                for (Int_t k=0;k<n;k++) x[j*stride+k]=bucket[start+k].GetPosition(j);
+                for (Int_t k=n;k<stride;k++) x[j*stride+k]=0;
+            }
+            lp->SetSoAPosition(x);
+        }
+        return 1;
+#else
+        return 0;
+#endif
+    }
+
+    void KDTree::UnloadLeafPositions()
+    {
+        if (leafpos==NULL) return;
+        Node *np;
+        for (Int_t i=0;i<numnodes;i++) {
+            np=GetNode(i);
+            if (np->GetCount()<=b) ((LeafNode*)np)->SetSoAPosition(NULL);
+        }
+        free(leafpos);
+        leafpos=NULL;
+    }
+
+    //-- Public functions that manage the leaf node positions
+
+    void KDTree::UpdateLeafPositions()
+    {
+        UnloadLeafPositions();
+        LoadLeafPositions();
+    }
+
     //-- Public constructors
 
-    KDTree::KDTree(Particle *p, Int_t nparts, Int_t bucket_size, int ttype, int smfunctype, int smres, int criterion, int aniso, int scale, Double_t *Period, Double_t **m)
+    KDTree::KDTree(Particle *p, Int_t nparts, Int_t bucket_size, int ttype, int smfunctype, int smres, int criterion, int aniso, int scale, Double_t *Period, Double_t **m, int buildindex)
     {
         numparts = nparts;
         numleafnodes=numnodes=0;
@@ -858,6 +1249,12 @@ namespace NBody
         anisotropic=aniso;
         scalespace = scale;
         metric = m;
+        ibuildindex = buildindex;
+        pindex = NULL;
+        pcoord = NULL;
+        leafpos = NULL;
+        root = NULL;
+        nodearena = NULL;
         if (Period!=NULL)
         {
             period=new Double_t[3];
@@ -871,14 +1268,18 @@ namespace NBody
             for (int j=0;j<ND;j++) {xvar[j]=1.0;ixvar[j]=1.0;}
             if (scalespace) ScaleSpace();
             for (int j=0;j<ND;j++) {vol*=xvar[j];ivol*=ixvar[j];}
-            if (splittingcriterion==1) for (int j=0;j<ND;j++) nientropy[j]=new Double_t[numparts];
-            root=BuildNodes(0,numparts);
+            if (ibuildindex) LoadIndexBuffer();
+            numnodes=NumNodes(numparts);
+            numleafnodes=(numnodes+1)/2;
+            AllocateNodes();
+            root=BuildNodes(0,numparts,0);
+            if (ibuildindex) ApplyIndexPermutation();
+            LoadLeafPositions();
             //else if (treetype==TMETRIC) root = BuildNodesDim(0, numparts,metric);
-            if (splittingcriterion==1) for (int j=0;j<ND;j++) delete[] nientropy[j];
         }
     }
 
-    KDTree::KDTree(System &s, Int_t bucket_size, int ttype, int smfunctype, int smres, int criterion, int aniso, int scale, Double_t **m)
+    KDTree::KDTree(System &s, Int_t bucket_size, int ttype, int smfunctype, int smres, int criterion, int aniso, int scale, Double_t **m, int buildindex)
     {
 //        KDTree(s.Parts(),s.GetNumParts(),bucket_size,ttype,smfunctype,smres,ecalc,aniso,scale,s.GetPeriod().GetCoord(),m);
 
@@ -893,6 +1294,12 @@ namespace NBody
         anisotropic=aniso;
         scalespace = scale;
         metric = m;
+        ibuildindex = buildindex;
+        pindex = NULL;
+        pcoord = NULL;
+        leafpos = NULL;
+        root = NULL;
+        nodearena = NULL;
         if (s.GetPeriod()[0]>0&&s.GetPeriod()[1]>0&&s.GetPeriod()[2]>0){
             period=new Double_t[3];
             for (int k=0;k<3;k++) period[k]=s.GetPeriod()[k];
@@ -905,19 +1312,35 @@ namespace NBody
             for (int j=0;j<ND;j++) {xvar[j]=1.0;ixvar[j]=1.0;}
             if (scalespace) ScaleSpace();
             for (int j=0;j<ND;j++) {vol*=xvar[j];ivol*=ixvar[j];}
-            if (splittingcriterion==1) for (int j=0;j<ND;j++) nientropy[j]=new Double_t[numparts];
-            root=BuildNodes(0,numparts);
-            if (splittingcriterion==1) for (int j=0;j<ND;j++) delete[] nientropy[j];
+            if (ibuildindex) LoadIndexBuffer();
+            numnodes=NumNodes(numparts);
+            numleafnodes=(numnodes+1)/2;
+            AllocateNodes();
+            root=BuildNodes(0,numparts,0);
+            if (ibuildindex) ApplyIndexPermutation();
+            LoadLeafPositions();
         }
     }
     KDTree::~KDTree()
     {
 	    if (root!=NULL) {
-            delete root;
+            UnloadLeafPositions();
+            FreeNodes();
             delete[] Kernel;
             delete[] derKernel;
             if (period!=NULL) delete[] period;
-            qsort(bucket, numparts, sizeof(Particle), IDCompare);
+            //ids store original index so restore order by swapping each particle directly into place,
+            //which is linear in numparts. Should ids have been altered while the tree existed, revert to sorting.
+            Int_t k;
+            int isort=0;
+            Particle w;
+            for (Int_t i=0;i<numparts&&!isort;i++) {
+                while ((k=bucket[i].GetID())!=i) {
+                    if (k<0||k>=numparts||bucket[k].GetID()==k) {isort=1;break;}
+                    w=bucket[k];bucket[k]=bucket[i];bucket[i]=w;
+                }
+            }
+            if (isort) qsort(bucket, numparts, sizeof(Particle), IDCompare);
             if (scalespace) {
             for (Int_t i=0;i<numparts;i++)
                 for (int j=0;j<3;j++) {
@@ -42,21 +42,40 @@
 #include <iomanip>
 #include <cstdio>
 #include <iostream>
+#include <new>
 #include <vector>
 
+///size above which nodes are built with parallel loops. Defined in all builds since the median of these nodes is found with
+///the same selection with or without openmp, see \ref NBody::KDTree::MedianIndexParallel
+#define CRITPARALLELSIZE 1000000
+///size below which subtrees are not built as separate openmp tasks, also the size below which the selection of large nodes is serial
+#define CRITPARALLELTASKSIZE 10000
+
+///size above which FOF searches use the parallel union-find algorithm, smaller searches can request it, see \ref NBody::KDTree::FOF.
+///Defined in all builds since it also sets which groups \ref SearchFullSet always searches one at a time
+#define CRITPARALLELFOFSIZE 100000
+
 #ifdef USEOPENMP
 #include <omp.h>
-#define CRITPARALLELSIZE 1000000
 #endif
 
 #ifdef USEMPI
 #include <mpi.h>
-#define CRITPARALLELSIZE 1000000
 #endif
 
+///number of consecutive particles whose nearest neighbours are found together by the dual tree search when calculating
+///the velocity density of every particle (see \ref NBody::KDTree::CalcVelDensity)
+#define DUALTREECHUNKSIZE 512
+
 namespace NBody
 {
 
+    ///link between the particles at tree indices i<j with linking measure w, see \ref KDTree::FOFMinimumSpanningTree
+    struct FOFMSTEdge
+    {
+        Int_tree_t i, j;
+        Double_t w;
+    };
 
     class KDTree
     {
@@ -105,9 +124,8 @@ namespace NBody
         int scalespace;
         Double_t xmean[MAXND],xvar[MAXND],ixvar[MAXND],vol,ivol;
 
-        ///0 if using most spread dimension as criterion, 1 if use entropy along with entropy array, 2 if using largest dispersion
+        ///0 if using most spread dimension as criterion, 1 if use entropy, 2 if using largest dispersion
         int splittingcriterion;
-        Double_t *nientropy[MAXND];
 
         ///kernel construction
         ///resolution in kernel array and type
@@ -127,6 +145,21 @@ namespace NBody
         ///this array is necessary for calculating the phase-space density corectly.
         Double_t **metric;
 
+        ///if 1, tree is built by partitioning a compact index array and a contiguous copy of the tree coordinates
+        ///instead of swapping entire particles. The particle array is then permuted once into tree order.
+        int ibuildindex;
+        ///index into the particle array of each entry in the tree order, only allocated during construction
+        Int_t *pindex;
+        ///contiguous coordinates in the tree space (ND values per entry) that are kept in the same order as pindex
+        Double_t *pcoord;
+        ///structure-of-arrays positions of all leaf nodes, see \ref LoadLeafPositions
+        DoublePos_t *leafpos;
+        ///all nodes are constructed in a single contiguous block, sized from the number of particles and the bucket size,
+        ///with the node of id i (its pre-order index) in slot i of nodeslotsize bytes. The left child of a split node is
+        ///thus the next slot and subtrees occupy contiguous memory. Nodes built by different threads never share an allocation.
+        char *nodearena;
+        size_t nodeslotsize;
+
         /// \name Private function pointers used in building tree
         //@{
         Double_t(NBody::KDTree::*bmfunc)(int , Int_t , Int_t , Double_t *);
@@ -136,35 +169,51 @@ namespace NBody
         Double_t(NBody::KDTree::*medianfunc)(int , Int_t , Int_t, Int_t, bool);
         //@}
 
-        /// \name Private arrays used to build tree
-        //@{
-        Double_t spreada[MAXND];
-        Double_t meana[MAXND];
-        Double_t vara[MAXND];
-        Double_t entropya[MAXND];
-        //@}
-
         /// \name Tree construction methods
         /// Private methods used in constructing the tree
         //@{
-        ///uses prviate function pointers to recursive build the tree
-        Node* BuildNodes(Int_t start, Int_t end);
+        ///uses prviate function pointers to recursive build the tree, where inode is the id of the node
+        Node* BuildNodes(Int_t start, Int_t end, Int_t inode);
+        ///number of nodes in a tree built from size particles
+        Int_t NumNodes(Int_t size);
+        void NumNodesPair(Int_t n, Int_t &n0, Int_t &n1);
         ///scales the space if necessary by the variance in each dimension
         void ScaleSpace();
         ///checks to see if tree is of proper type
         int TreeTypeCheck();
         ///build the table of kernel values
         void KernelConstruction();
+        ///allocate and load the index and coordinate arrays used to build the tree with ibuildindex
+        void LoadIndexBuffer();
+        ///apply the permutation stored in the index array to the particle array and free the build arrays
+        void ApplyIndexPermutation();
+        ///allocate the block holding numnodes nodes
+        void AllocateNodes();
+        ///destroy the nodes and free their block
+        void FreeNodes();
+        //@}
+
+        /// \name Leaf positions
+        /// Copies of the particle positions in each leaf node stored as structure-of-arrays so that leaf ball searches
+        /// and nearest neighbour searches can use vectorised kernels. Only meaningful for TPHYS trees, where they are loaded
+        /// once the tree is built and kept until it is destroyed. Callers that move particles while the tree exists
+        /// must call \ref UpdateLeafPositions before searching again.
+        //@{
+        ///load the positions into the leaf nodes. Returns 1 if they were loaded by this call, 0 otherwise
+        int LoadLeafPositions();
+        ///free the leaf positions
+        void UnloadLeafPositions();
         //@}
 
         public :
 
         /// \name Constructors/Destructors
         //@{
-        ///Creates tree from an NBody::Particle array
-        KDTree(Particle *p, Int_t numparts, Int_t bucket_size = 16, int TreeType=TPHYS, int KernType=KEPAN, int KernRes=1000, int SplittingCriterion=0, int Aniso=0, int ScaleSpace=0, Double_t *Period=NULL, Double_t **metric=NULL);
+        ///Creates tree from an NBody::Particle array. If BuildIndex, the tree is constructed on an index array and the
+        ///particles are moved into tree order with a single permutation (see \ref ibuildindex), otherwise particles are swapped in place.
+        KDTree(Particle *p, Int_t numparts, Int_t bucket_size = 16, int TreeType=TPHYS, int KernType=KEPAN, int KernRes=1000, int SplittingCriterion=0, int Aniso=0, int ScaleSpace=0, Double_t *Period=NULL, Double_t **metric=NULL, int BuildIndex=1);
         ///Creates tree from NBody::System
-        KDTree(System &s, Int_t bucket_size = 16, int TreeType=TPHYS, int KernType=KEPAN, int KernRes=1000, int SplittingCriterion=0, int Aniso=0, int ScaleSpace=0, Double_t **metric=NULL);
+        KDTree(System &s, Int_t bucket_size = 16, int TreeType=TPHYS, int KernType=KEPAN, int KernRes=1000, int SplittingCriterion=0, int Aniso=0, int ScaleSpace=0, Double_t **metric=NULL, int BuildIndex=1);
         ///resets particle order
         ~KDTree();
         //@}
@@ -178,9 +227,17 @@ namespace NBody
         Int_t GetKernType(){return kernfunctype;}
         Double_t GetKernNorm(){return kernnorm;}
         Node * GetRoot(){return root;}
+        ///Get node from its id, with ids running from 0 (the root) to numnodes-1 in pre-order
+        Node * GetNode(Int_t id){return (Node*)(nodearena+id*nodeslotsize);}
         Double_t GetPeriod(int j){return period[j];}
         //@}
 
+        /// \name Leaf positions
+        //@{
+        ///reload the structure-of-arrays leaf positions after particle positions have been altered while the tree exists
+        void UpdateLeafPositions();
+        //@}
+
         /// \name Find Nearest Neighbour functions
         /// using tree, for each particle find nearest.
         /// FindNearest is using treetype, rest are explicit search using position, velocity, phase regardless of treetype.
@@ -214,6 +271,25 @@ namespace NBody
         void FindNearestCriterion(Int_t tt, FOFcompfunc cmp, Double_t *params,Int_t *nn, Double_t *dist2, Int_t Nsearch=64);
         //using tree nearest particles that meet a criterion relative to particle passed
         void FindNearestCriterion(Particle p, FOFcompfunc cmp, Double_t *params,Int_t *nn, Double_t *dist2, Int_t Nsearch=64);
+
+        ///batched search for the nearest particles of the nq targets bucket[tt[i]], storing results of target i in
+        ///nn[i*Nsearch+j] and dist2[i*Nsearch+j] in order of increasing distance. The queue can be passed so that it is reused
+        ///between calls. Targets should be spatially sorted, such as in tree order, since the search of each target starts with the
+        ///radius bounded by that of the previous target. Only position searches in physical trees are batched, including periodic
+        ///reflections if the tree is periodic, other trees are searched using \ref FindNearest for each target.
+        void FindNearestBatch(Int_t nq, Int_t *tt, Int_t *nn, Double_t *dist2, Int_t Nsearch=64, PriorityQueue *pq=NULL);
+        ///as above but for the nq positions x[i*3+j] rather than particles of the tree, with the same results as \ref FindNearestPos
+        ///for each position. Positions should also be spatially sorted. As above, only physical trees are batched.
+        void FindNearestBatch(Int_t nq, Double_t *x, Int_t *nn, Double_t *dist2, Int_t Nsearch=64, PriorityQueue *pq=NULL);
+        ///find the nearest particles of all particles bucket[istart] to bucket[iend-1] with a dual tree search, where the nodes
+        ///spanning this range are walked against the tree so that whole groups of targets are bounded at once. Results of
+        ///bucket[i] are stored in nn[(i-istart)*Nsearch+j] and dist2[(i-istart)*Nsearch+j] in order of increasing distance and
+        ///are the same as those of \ref FindNearest. As with \ref FindNearestBatch, only physical trees use the dual tree search,
+        ///which also searches the periodic reflections if the tree is periodic. The buffer qbound can be passed so that it is reused
+        ///between calls and must then have \ref GetRangeBoundSize(iend-istart) entries.
+        void FindNearestRange(Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch=64, Double_t *qbound=NULL);
+        ///size of the buffer of node search radii used by \ref FindNearestRange for ranges of up to n particles
+        Int_t GetRangeBoundSize(Int_t n);
         //@}
 
         /// \name Search for all particles within a given distance
@@ -269,6 +345,9 @@ namespace NBody
         Node* FindLeafNode(Int_t tt);
         Node* FindLeafNode(Double_t *x);
         Node* FindLeafNode(Double_t search[6][2]);
+        ///return, in tree order, the nodes that would be the leaf nodes had the tree been built with bucket size ncell>=b.
+        ///As nodes are always split at the median, these are the first nodes encountered with at most ncell particles
+        vector<Node*> FindCoarseNodes(Int_t ncell);
         //@}
 
         /*! \name Calculates SPH quantities
@@ -308,6 +387,13 @@ namespace NBody
 
         Double_t CalcDensityParticle(Int_t target, Int_t Nsmooth=64);
         Double_t CalcVelDensityParticle(Int_t target, Int_t Nsmooth=64, Int_t Nsearch=64, int iflag=0, PriorityQueue *pq=NULL, PriorityQueue *pq2=NULL, Int_t *nnIDs=NULL, Double_t *vdist=NULL);
+        ///same as above for the nq targets tt, storing the velocity density in vden. The nearest neighbours are found with
+        ///\ref FindNearestBatch and nnIDs, nndist2 must be of size nq*Nsearch and vdist of size Nsearch
+        void CalcVelDensityParticles(Int_t nq, Int_t *tt, Double_t *vden, Int_t Nsmooth, Int_t Nsearch, PriorityQueue *pq, PriorityQueue *pq2, Int_t *nnIDs, Double_t *nndist2, Double_t *vdist);
+        ///same as above for all particles bucket[istart] to bucket[iend-1], storing the velocity density of bucket[i] in vden[i-istart].
+        ///The nearest neighbours are found with the dual tree search of \ref FindNearestRange ignoring periodicity, as in
+        ///\ref CalcVelDensityParticle, and nnIDs, nndist2 must be of size (iend-istart)*Nsearch. qbound is as in \ref FindNearestRange
+        void CalcVelDensityRange(Int_t istart, Int_t iend, Double_t *vden, Int_t Nsmooth, Int_t Nsearch, PriorityQueue *pq2, Int_t *nnIDs, Double_t *nndist2, Double_t *vdist, Double_t *qbound=NULL);
         Double_t CalcVelDensityWithPhysDensityParticle(Int_t target, Int_t Nsmooth=64, Int_t Nsearch=64,int densityset=1);
         Coordinate CalcSmoothVelParticle(Int_t target, Int_t Nsmooth=64, int densityset=1);
         Matrix CalcSmoothVelDispParticle(Int_t target, Coordinate smvel, Int_t Nsmooth=64, int densityset=1);
@@ -361,8 +447,9 @@ namespace NBody
         */
         //@{
 
-        /// simple physical FOF search, velocity FOF, and 6D phase FOF.
-        Int_t *FOF(Double_t fdist, Int_t &numgroup, Int_t minnum=8, int order=0, Int_tree_t *pHead=NULL, Int_tree_t *pNext=NULL, Int_tree_t *pTail=NULL, Int_tree_t *pLen=NULL);
+        /// simple physical FOF search, velocity FOF, and 6D phase FOF. Searches of at least \ref CRITPARALLELFOFSIZE particles outside a parallel region
+        /// use all threads (see \ref FOFUnionFind), as do smaller searches if iparallel is set, for callers that would otherwise leave threads idle.
+        Int_t *FOF(Double_t fdist, Int_t &numgroup, Int_t minnum=8, int order=0, Int_tree_t *pHead=NULL, Int_tree_t *pNext=NULL, Int_tree_t *pTail=NULL, Int_tree_t *pLen=NULL, int iparallel=0);
         /// this searches tree for particles that meed some criterion given by some comparison function
         /// NOTE: comparison function is used only for leaf nodes.
         /// NOTE: parameters for tree search and comparison are contained in the params variable
@@ -396,8 +483,61 @@ namespace NBody
                                   Double_t disfunc(Int_t , Double_t *), Int_t npc, Int_t *npca, Int_t &numgroups, Int_t minnum=8);
         //@}
 
+        /// \name Minimum spanning tree FOF
+        /// FOF groups for a sequence of decreasing linking lengths from a single search of the tree. \ref FOFMinimumSpanningTree
+        /// finds the links of cmp (\ref FOF3d or \ref FOF6d) with params, ignoring particles as \ref FOFCriterion does if ipcheckflag,
+        /// and keeps the minimum spanning forest of these links ordered by their linking measure. For params whose linking lengths
+        /// are all scaled down by the same factor, \ref FOFMinimumSpanningTreeGroups then finds the groups by joining only the edges
+        /// of the forest that are still linked, giving the same group ids as \ref FOFCriterion in linear time.
+        /// Returns 0 if the forest cannot be built (periodic trees and other comparison functions).
+        //@{
+        int FOFMinimumSpanningTree(FOFcompfunc cmp, Double_t *params, vector<FOFMSTEdge> &edges, int ipcheckflag=0, FOFcheckfunc check=Pnocheck);
+        Int_t *FOFMinimumSpanningTreeGroups(FOFcompfunc cmp, Double_t *params, vector<FOFMSTEdge> &edges, Int_t &numgroup, Int_t minnum=8, int order=0, int ipcheckflag=0, FOFcheckfunc check=Pnocheck);
+        //@}
+
         private:
 
+        /// \name Parallel FOF
+        /// Multithreaded version of \ref FOF and \ref FOFCriterion. Threads search disjoint ranges of the tree ordered particles and
+        /// join linked pairs in a concurrent union-find array, which is then compressed and relabelled. Returns the same groups, ordering
+        /// and Head/Next/Tail/Len arrays as the serial search (for symmetric comparison functions).
+        /// If cmp is NULL a simple ball search with distance^2 fdist2 is used.
+        //@{
+        Int_t *FOFUnionFind(Double_t fdist2, FOFcompfunc cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen);
+        ///link phase of \ref FOFUnionFind for the comparison functors
+        template<class FOFFunctor> void FOFUnionFindLink(FOFFunctor cmp, Double_t *params, Int_t *pGroup, Int_tree_t *pParent, Int_t chunksize);
+        //@}
+
+        /// \name Minimum spanning forest construction
+        /// Threads collect the links of disjoint ranges of tree ordered particles and periodically reduce them to their minimum
+        /// spanning forest (Kruskal), so memory is bounded by the forest rather than by the number of links.
+        //@{
+        ///link phase of \ref FOFMinimumSpanningTree for the comparison functors
+        template<class FOFFunctor> void FOFMinimumSpanningTreeLink(FOFFunctor cmp, Double_t *params, Int_t *pGroup, vector<FOFMSTEdge> &edges);
+        ///collect the links of target to particles with larger tree index
+        template<class FOFFunctor> void FOFSearchCriterionEdgeFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, Int_t *Group, Double_t *off, Particle &p, Int_t target, vector<FOFMSTEdge> &edges);
+        ///join the particles of the edges still linked by cmp
+        template<class FOFFunctor> void FOFMinimumSpanningTreeJoin(FOFFunctor cmp, vector<FOFMSTEdge> &edges, Int_t *pGroup, Int_tree_t *pParent);
+        ///reduce edges to their minimum spanning forest, sorted by linking measure. pParent is a union-find array of self roots
+        ///and is left as such
+        void FOFMinimumSpanningForest(vector<FOFMSTEdge> &edges, Int_tree_t *pParent);
+        //@}
+
+        /// \name Templated FOF searches
+        /// Used in place of the FOFcompfunc searches when the comparison function is one with a functor in \ref FOFFunc.h
+        /// (\ref FOF3d, \ref FOF6d, \ref FOF3dType) so that the comparison is inlined in the leaf loop. These walk the tree directly
+        /// rather than through the virtual node searches and pass the target particle as a copy. See \ref KDFOF.cxx
+        //@{
+        ///serial FOF for \ref FOFCriterion and, if isetbasis, \ref FOFCriterionSetBasisForLinks
+        template<class FOFFunctor> Int_t *FOFCriterionFunctor(FOFFunctor cmp, Double_t *params, Int_t &numgroup, Int_t minnum, int order, int ipcheckflag, FOFcheckfunc check, int isetbasis, Int_tree_t *pHead, Int_tree_t *pNext, Int_tree_t *pTail, Int_tree_t *pLen);
+        template<class FOFFunctor> void FOFSearchCriterionFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, int isetbasis, Int_t iGroup, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t *off, Particle &p, Int_t target);
+        template<class FOFFunctor> void FOFSearchCriterionFunctorPeriodic(FOFFunctor &cmp, Double_t *params, int isetbasis, Int_t iGroup, Int_t *Group, Int_tree_t *Len, Int_tree_t *Head, Int_tree_t *Tail, Int_tree_t *Next, short *BucketFlag, Int_tree_t *Fifo, Int_t &iTail, Double_t *off, Particle &p, Int_t target);
+        template<class FOFFunctor> void FOFSearchCriterionUnionFunctor(Node *np, Double_t rd, FOFFunctor &cmp, Double_t *params, Int_t *Group, Int_tree_t *Parent, Double_t *off, Particle &p, Int_t target);
+        template<class FOFFunctor> void FOFSearchCriterionUnionFunctorPeriodic(FOFFunctor &cmp, Double_t *params, Int_t *Group, Int_tree_t *Parent, Double_t *off, Particle &p, Int_t target);
+        ///renumber groups in pGroup in descending order of their length pLen
+        void FOFOrderGroups(Int_t *pGroup, Int_t numgroup, Int_tree_t *pLen);
+        //@}
+
         //-- private inline functions declarations
 
         /// \name Splitting criteria methods
@@ -433,6 +573,11 @@ namespace NBody
         inline Double_t EntropyVel(int j, Int_t start, Int_t end, Double_t low, Double_t up, Double_t nbins, Double_t *ni);
         /// and for phase
         inline Double_t EntropyPhs(int j, Int_t start, Int_t end, Double_t low, Double_t up, Double_t nbins, Double_t *ni);
+        /// Same as above but operating on the contiguous coordinate array used when building with an index array
+        inline Double_t SpreadestIndex(int j, Int_t start, Int_t end, Double_t *bnd);
+        inline Double_t BoundaryandMeanIndex(int j, Int_t start, Int_t end, Double_t *bnd);
+        inline Double_t DispersionIndex(int j, Int_t start, Int_t end, Double_t mean);
+        inline Double_t EntropyIndex(int j, Int_t start, Int_t end, Double_t low, Double_t up, Double_t nbins, Double_t *ni);
         //@}
 
         /// \name Rearrange and balance the tree
@@ -445,6 +590,18 @@ namespace NBody
         inline Double_t MedianVel(int d, Int_t k, Int_t start, Int_t end, bool balanced=true);
         /// same as above but with full phase-space
         inline Double_t MedianPhs(int d, Int_t k, Int_t start, Int_t end, bool balanced=true);
+        /// same as above but only rearranges the index and coordinate arrays, leaving the particles untouched
+        inline Double_t MedianIndex(int d, Int_t k, Int_t start, Int_t end, bool balanced=true);
+        template<int NDIM> inline Double_t MedianIndexDim(int d, Int_t k, Int_t start, Int_t end);
+        /// coordinate j of particle ip in the space of the tree, as stored in pcoord
+        inline Double_t IndexCoord(Int_t ip, int j) {
+            if (treetype==TPHYS||treetype==TPROJ) return bucket[ip].GetPosition(j);
+            else if (treetype==TVEL) return bucket[ip].GetVelocity(j);
+            else return bucket[ip].GetPhase(j);
+        }
+        /// same as above but partitions the data in parallel (serially without openmp), used for large nodes at the top of the tree
+        Double_t MedianIndexParallel(int d, Int_t k, Int_t start, Int_t end);
+        template<int NDIM> Double_t MedianIndexParallelDim(int d, Int_t k, Int_t start, Int_t end);
         /// same as above but with possibly a subset of dimensions of full phase space
         /// NOTE Dim DOES NOT DO ANYTHING SPECIAL YET
         //inline Double_t MedianDim(int d, Int_t k, Int_t start, Int_t end, bool balanced=true, Double_t **metric=NULL);
@@ -467,6 +624,21 @@ namespace NBody
         //inline void CalculateMetricTensor(int target, int treetype, PriorityQueue *pq, GMatrix gmetric);
         ///load data from queue to array also check if search failed.
         inline void LoadNN(const Int_t ns, PriorityQueue *pq, Int_t *nn, Double_t *dist);
+        ///position search used by \ref FindNearestBatch. The tree is walked with an explicit stack that is shared by all targets.
+        ///Periodic reflections are searched if the period p is passed, otherwise periodicity is ignored
+        void FindNearestPosBatch(Int_t nq, Int_t *tt, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq, Double_t *p=NULL);
+        ///as above for positions that are not particles of the tree, so no particle is excluded from the search
+        void FindNearestPosBatch(Int_t nq, Double_t *x, Int_t *nn, Double_t *dist2, Int_t Nsearch, PriorityQueue *pq, Double_t *p=NULL);
+        ///dual tree search used by \ref FindNearestRange. Periodic reflections are searched if the period p is passed, otherwise
+        ///periodicity is ignored
+        void FindNearestRangePos(Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch, Double_t *qbound, Double_t *p=NULL);
+        ///dual tree search of query node q against reference node r used by \ref FindNearestRangePos. The neighbours of each target
+        ///are kept as max-heaps in nn and dist2 and qbound stores the largest search radius of the targets in each node below qbase.
+        ///If ik>0, the ik-th periodic reflection of the targets flagged in active is searched
+        void FindNearestDual(Node *q, Node *r, Int_t qbase, Double_t *qbound, Int_t istart, Int_t iend, Int_t *nn, Double_t *dist2, Int_t Nsearch,
+            Double_t *p=NULL, int ik=0, char *active=NULL);
+        ///velocity density of target given its Nsearch nearest physical neighbours nnIDs in order of increasing distance
+        Double_t CalcVelDensityNN(Int_t target, Int_t Nsmooth, Int_t Nsearch, Int_t *nnIDs, Double_t *vdist, PriorityQueue *pq2);
         //@}
     };
 
@@ -32,6 +32,7 @@
 #include <NBody.h>
 #include <NBodyMath.h>
 #include <KDTree.h>
+#include <Gravity.h>
 
 #ifdef USEOPENMP
 #include <omp.h>
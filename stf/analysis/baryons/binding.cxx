@@ -8,167 +8,38 @@
 
 #include "baryoniccontent.h"
 
-///\name Tree-Potential routines
+///\name Potential routines
 //@{
-///subroutine that generates node list for tree gravity calculation
-void GetNodeList(Node *np, Int_t &ncell, Node **nodelist, const Int_t bsize){
-    nodelist[ncell]=np;
-    nodelist[ncell]->SetID(ncell);
-    if (np->GetCount()>bsize){
-        ncell++;GetNodeList(((SplitNode*)np)->GetLeft(),ncell,nodelist,bsize);
-        ncell++;GetNodeList(((SplitNode*)np)->GetRight(),ncell,nodelist,bsize);
-    }
-    //else ncell++;
-}
-
-///subroutine that marks a cell for a given particle in tree-walk
-inline void MarkCell(Node *np, Int_t *marktreecell, Int_t *markleafcell, Int_t &ntreecell, Int_t &nleafcell, Double_t *r2val, const Int_t bsize, Double_t *cR2max, Coordinate *cm, Double_t *cmtot, Coordinate xpos, Double_t eps2){
-    Int_t nid=np->GetID();
-    Double_t r2;
-    r2=0;
-    //determine the distance from cells cm to particle
-    for (int k=0;k<3;k++)r2+=(cm[nid][k]-xpos[k])*(cm[nid][k]-xpos[k]);
-    //if the particle is not distant enough to treat cell (and all subcells) as a mono (or quad) pole mass then
-    //enter the cell so long as it is not a leaf node (or minimum cell size)
-    //if it is a minimum cell size, the cell is marked with a ileafflag
-    if (r2<cR2max[nid]) {
-        if (np->GetCount()>bsize){
-            MarkCell(((SplitNode*)np)->GetLeft(),marktreecell,markleafcell,ntreecell,nleafcell,r2val,bsize,cR2max,cm,cmtot,xpos,eps2);
-            MarkCell(((SplitNode*)np)->GetRight(),marktreecell,markleafcell,ntreecell,nleafcell,r2val,bsize,cR2max,cm,cmtot,xpos,eps2);
-        }
-        else markleafcell[nleafcell++]=nid;
-    }
-    else {
-        r2val[ntreecell]=cmtot[nid]/sqrt(r2+eps2);
-        marktreecell[ntreecell++]=nid;
-    }
+///parameters of the gravity calculations of \ref Gravity.h
+static inline GravityInfo GetGravityInfo(Options &opt)
+{
+    GravityInfo gi;
+    gi.G=opt.G;
+    gi.eps=opt.uinfo.eps;
+    gi.theta=opt.uinfo.TreeThetaOpen;
+    gi.bsize=opt.uinfo.BucketSize;
+    gi.ompnum=ompunbindnum;
+    return gi;
 }
 
-///calculate potential
+///calculate potential with the tree gravity of \ref NBody::GravityTreePotential
 void Potential(Options &opt, Int_t nbodies, Particle *Part)
 {
-    int maxnthreads,nthreads,l,n;
-    Int_t i,j,k,ntreecell,nleafcell;
-    Double_t v2,r2,Ti,eps2=opt.uinfo.eps*opt.uinfo.eps;
-    //for tree code potential calculation
-    Int_t ncell;
-    Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
-    Coordinate *cellcm;
-    Node *root;
-    Node **nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
-    //Double_t **nnr2;
-    KDTree *tree;
-
-    //for parallel environment store maximum number of threads
-    nthreads=1;
-#ifdef USEOPENMP
-#pragma omp parallel
-    {
-    if (omp_get_thread_num()==0) maxnthreads=nthreads=omp_get_num_threads();
-    }
-#endif
-    //otherwise use tree tree gravity calculation
-    //here openmp is per group since each group is large
-    //to make this memory efficient really need just KDTree that uses Coordinates
-    tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS);
-    ncell=tree->GetNumNodes();
-    root=tree->GetRoot();
-    //to store particles in a given node
-    start=new Int_t[ncell];
-    end=new Int_t[ncell];
-    //distance calculations used to determine when one uses cell or when one uses particles
-    cmtot=new Double_t[ncell];
-    cBmax=new Double_t[ncell];
-    cR2max=new Double_t[ncell];
-    cellcm=new Coordinate[ncell];
-    //to store note list
-    nodelist=new Node*[ncell];
-
-    //search tree
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-    for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
-    //from root node calculate cm for each node
-    //start at root node and recursively move through list
-    ncell=0;
-    GetNodeList(root,ncell,nodelist,opt.uinfo.BucketSize);
-    ncell++;
-    //determine cm for all cells and openings
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,n)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-    for (j=0;j<ncell;j++) {
-        start[j]=(nodelist[j])->GetStart();
-        end[j]=(nodelist[j])->GetEnd();
-        cellcm[j][0]=cellcm[j][1]=cellcm[j][2]=0.;
-        cmtot[j]=0;
-        for (k=start[j];k<end[j];k++) {
-            for (n=0;n<3;n++) cellcm[j][n]+=Part[k].GetPosition(n)*Part[k].GetMass();
-            cmtot[j]+=Part[k].GetMass();
-        }
-        for (n=0;n<3;n++) cellcm[j][n]/=cmtot[j];
-        Double_t xdiff,xdiff1;
-        xdiff=(cellcm[j]-Coordinate(Part[start[j]].GetPosition())).Length();
-        for (k=start[j]+1;k<end[j];k++) {
-            xdiff1=(cellcm[j]-Coordinate(Part[k].GetPosition())).Length();
-            if (xdiff<xdiff1) xdiff=xdiff1;
-        }
-        cBmax[j]=xdiff;
-        cR2max[j]=4.0/3.0*xdiff*xdiff/(opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen);
-    }
-#ifdef USEOPENMP
+    GravityTreePotential(GetGravityInfo(opt),nbodies,Part);
 }
-#endif
-    //then for each cell find all other cells that contain particles within a cells gRmax and mark those
-    //and mark all cells for which one does not have to unfold
-    //for marked cells calculate pp, for every other cell just use the CM of the cell to calculate the potential.
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,l,n,ntreecell,nleafcell,r2)
+
+///calculate potential by direct summation with \ref NBody::GravityDirectPotential, adding the potential energy of the particles to Pot and Pottyped
+static void DirectPotential(Options &opt, Int_t nbodies, Particle *Part, Double_t &Pot, Double_t *Pottyped)
 {
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-    for (j=0;j<nbodies;j++) {
-        int tid;
-#ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
+    GravityDirectPotential(GetGravityInfo(opt),nbodies,Part);
+    for (Int_t j=0;j<nbodies;j++) {
+#ifdef NOMASS
+        Part[j].SetPotential(Part[j].GetPotential()*opt.MassValue*opt.MassValue);
 #endif
-        npomp[tid]=tree->GetRoot();
-        Part[j].SetPotential(0.);
-        ntreecell=nleafcell=0;
-        Coordinate xpos(Part[j].GetPosition());
-        MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
-        for (k=0;k<ntreecell;k++) {
-          Part[j].SetPotential(Part[j].GetPotential()-Part[j].GetMass()*r2val[tid][k]);
-        }
-        for (k=0;k<nleafcell;k++) {
-            for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
-                if (j!=l) {
-                    r2=0.;for (n=0;n<3;n++) r2+=pow(Part[j].GetPosition(n)-Part[l].GetPosition(n),(Double_t)2.0);
-                    r2+=eps2;
-                    r2=1.0/sqrt(r2);
-                    Part[j].SetPotential(Part[j].GetPotential()-(Part[j].GetMass()*Part[l].GetMass())*r2);
-                }
-            }
-        }
-        Part[j].SetPotential(Part[j].GetPotential()*opt.G);
+        Pot+=Part[j].GetPotential();
+        Pottyped[Part[j].GetType()]+=Part[j].GetPotential();
     }
-#ifdef USEOPENMP
 }
-#endif
-    delete tree;
-}
-
 //@}
 
 ///Gas energy routines, assumes that particle class has temparture
@@ -184,8 +55,7 @@ void GetBindingEnergy(Options &opt, Particle *Part, Int_t ngroup, PropData *pdat
     cout<<"Get Energy"<<endl;
     Particle *Pval;
     Int_t i,j,k;
-    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps;
-    Double_t r2,v2,Ti,poti,pot;
+    Double_t v2,Ti,poti;
     Double_t Tval,Potval,Efracval,Eval,intE;
     Double_t *Tvaltyped,*Potvaltyped,*Efracvaltyped;
     Double_t mv2=opt.MassValue*opt.MassValue;
@@ -207,7 +77,7 @@ void GetBindingEnergy(Options &opt, Particle *Part, Int_t ngroup, PropData *pdat
 
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,v2,poti,Ti,pot,Eval,intE,noffset)
+private(i,j,k,v2,poti,Ti,Eval,intE,noffset)
 {
     #pragma omp for schedule(dynamic,1) reduction(+:ngdone) nowait
 #endif
@@ -221,24 +91,7 @@ private(i,j,k,r2,v2,poti,Ti,pot,Eval,intE,noffset)
             pdata[i].T=pdata[i].Efrac=0.;
             for (j=0;j<NPARTTYPES;j++) pdata[i].Ttyped[j]=pdata[i].Efractyped[j]=0.;
         }
-        if (opt.ipotcalc) {
-        for (j=0;j<hp[i].AllNumberofParticles;j++) {
-            for (k=j+1;k<hp[i].AllNumberofParticles;k++) {
-                r2=0.;for (int n=0;n<3;n++) r2+=pow(Part[j+noffset].GetPosition(n)-Part[k+noffset].GetPosition(n),2.0);
-                r2+=eps2;
-                r2=1.0/sqrt(r2);
-#ifdef NOMASS
-                pot=-opt.G*(Part[j+noffset].GetMass()*Part[k+noffset].GetMass())*r2*mv2;
-#else
-                pot=-opt.G*(Part[j+noffset].GetMass()*Part[k+noffset].GetMass())*r2;
-#endif
-                poti=Part[j+noffset].GetPotential()+pot;Part[j+noffset].SetPotential(poti);
-                poti=Part[k+noffset].GetPotential()+pot;Part[k+noffset].SetPotential(poti);
-            }
-            pdata[i].Pot+=Part[j+noffset].GetPotential();
-            pdata[i].Pottyped[Part[j+noffset].GetType()]+=Part[j+noffset].GetPotential();
-        }
-        }
+        if (opt.ipotcalc) DirectPotential(opt,hp[i].AllNumberofParticles,&Part[noffset],pdata[i].Pot,pdata[i].Pottyped);
         for (j=0;j<hp[i].AllNumberofParticles;j++) {
             v2=0.;for (int n=0;n<3;n++) v2+=pow(Part[j+noffset].GetVelocity(n),2.0);
             intE=0;
@@ -335,11 +188,8 @@ void GetPotentialEnergy(Options &opt, Particle *Part, Int_t ngroup, PropData *pd
     cout<<"Get Potential Energy"<<endl;
     Particle *Pval;
     Int_t i,j,k;
-    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps;
-    Double_t r2,poti,pot;
     Double_t Potval;
     Double_t *Potvaltyped;
-    Double_t mv2=opt.MassValue*opt.MassValue;
     Int_t noffset;
     Double_t t1;
     Int_t ngdone=0;
@@ -357,7 +207,7 @@ void GetPotentialEnergy(Options &opt, Particle *Part, Int_t ngroup, PropData *pd
     t1=MyGetTime();
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,poti,pot,noffset)
+private(i,j,noffset)
 {
     #pragma omp for schedule(dynamic,1) reduction(+:ngdone) nowait
 #endif
@@ -366,22 +216,7 @@ private(i,j,k,r2,poti,pot,noffset)
         noffset=hp[i].noffset;
 	pdata[i].Pot=0;
         for (j=0;j<NPARTTYPES;j++) pdata[i].Pottyped[j]=0.;
-        for (j=0;j<hp[i].AllNumberofParticles;j++) {
-            for (k=j+1;k<hp[i].AllNumberofParticles;k++) {
-                r2=0.;for (int n=0;n<3;n++) r2+=pow(Part[j+noffset].GetPosition(n)-Part[k+noffset].GetPosition(n),2.0);
-                r2+=eps2;
-                r2=1.0/sqrt(r2);
-#ifdef NOMASS
-                pot=-opt.G*(Part[j+noffset].GetMass()*Part[k+noffset].GetMass())*r2*mv2;
-#else
-                pot=-opt.G*(Part[j+noffset].GetMass()*Part[k+noffset].GetMass())*r2;
-#endif
-                poti=Part[j+noffset].GetPotential()+pot;Part[j+noffset].SetPotential(poti);
-                poti=Part[k+noffset].GetPotential()+pot;Part[k+noffset].SetPotential(poti);
-            }
-            pdata[i].Pot+=Part[j+noffset].GetPotential();
-            pdata[i].Pottyped[Part[j+noffset].GetType()]+=Part[j+noffset].GetPotential();
-        }
+        DirectPotential(opt,hp[i].AllNumberofParticles,&Part[noffset],pdata[i].Pot,pdata[i].Pottyped);
         ngdone++;
     }
 #ifdef USEOPENMP
@@ -67,11 +67,7 @@ inline int GetNBins(Int_t n, int ibintype=1);
 
 ///\name Binding routines in \ref binding.cxx
 //@{
-///subroutine that generates node list for tree gravity calculation
-void GetNodeList(Node *np, Int_t &ncell, Node **nodelist, const Int_t bsize);
-///subroutine that marks a cell for a given particle in tree-walk
-inline void MarkCell(Node *np, Int_t *marktreecell, Int_t *markleafcell, Int_t &ntreecell, Int_t &nleafcell, Double_t *r2val, const Int_t bsize, Double_t *cR2max, Coordinate *cm, Double_t *cmtot, Coordinate xpos, Double_t eps2);
-///calculate potential
+///calculate potential with the tree gravity of \ref Gravity.h
 void Potential(Options &opt, Int_t nbodies, Particle *Part);
 ///calculate potential energy for all groups
 void GetPotentialEnergy(Options &opt, Particle *Part, Int_t ngroup, PropData *pdata, HaloParticleData *hp);
@@ -0,0 +1,164 @@
+/*! \file bench.cxx
+ *  \brief timed calls of the potential, unbinding and binding energy routines
+
+    Each routine is passed a copy of the halo so that it can be repeated. Particles of a halo have PID equal to
+    their index in the generated halo, which is used to compare results as the routines can reorder particles.
+*/
+
+#include "unbindbench.h"
+
+void SetBenchOptions(BenchOptions &bopt, Options &opt, const Double_t mpart)
+{
+    opt.G=1.0;
+#ifdef NOMASS
+    opt.MassValue=mpart;
+#else
+    opt.MassValue=1.0;
+#endif
+    opt.MinSize=bopt.minsize;
+    opt.iverbose=0;
+    opt.uinfo.unbindflag=1;
+    opt.uinfo.bgpot=0;
+    opt.uinfo.unbindtype=UPART;
+    opt.uinfo.cmvelreftype=CMVELREF;
+    opt.uinfo.Eratio=1.0;
+    opt.uinfo.eps=bopt.eps;
+}
+
+///factor applied to the potentials calculated by \ref DirectPotential and \ref TreePotential, as in \ref Unbind
+static inline Double_t PotentialScale(Options &opt)
+{
+#ifdef NOMASS
+    return opt.MassValue*opt.MassValue;
+#else
+    return 1.0;
+#endif
+}
+
+///kinetic energy of a particle relative to cmvel, as in \ref UnbindGroup
+static inline Double_t KineticEnergy(Options &opt, Particle &p, Coordinate &cmvel)
+{
+    Double_t v2=0;
+    for (int k=0;k<3;k++) v2+=(p.GetVelocity(k)-cmvel[k])*(p.GetVelocity(k)-cmvel[k]);
+#ifdef NOMASS
+    return 0.5*p.GetMass()*v2*opt.MassValue;
+#else
+    return 0.5*p.GetMass()*v2;
+#endif
+}
+
+///mass weighted velocity of a set of particles
+static void GetCMVel(const Int_t nbodies, Particle *Part, Coordinate &cmvel, Double_t &gmass)
+{
+    cmvel=Coordinate(0.);
+    gmass=0;
+    for (Int_t i=0;i<nbodies;i++) {
+        gmass+=Part[i].GetMass();
+        for (int k=0;k<3;k++) cmvel[k]+=Part[i].GetVelocity(k)*Part[i].GetMass();
+    }
+    for (int k=0;k<3;k++) cmvel[k]/=gmass;
+}
+
+BenchResult BenchDirectPotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *pot)
+{
+    BenchResult r;
+    double t0=MyGetTime();
+    DirectPotential(opt,nbodies,Part);
+    r.time=MyGetTime()-t0;
+    if (pot!=NULL) for (Int_t i=0;i<nbodies;i++) pot[Part[i].GetPID()]=Part[i].GetPotential();
+    return r;
+}
+
+BenchResult BenchTreePotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *potref)
+{
+    BenchResult r;
+    double t0=MyGetTime(),err;
+    TreePotential(opt,nbodies,Part);
+    r.time=MyGetTime()-t0;
+    if (potref!=NULL) {
+        r.maxerr=r.rmserr=0;
+        for (Int_t i=0;i<nbodies;i++) {
+            err=fabs(Part[i].GetPotential()-potref[Part[i].GetPID()])/fabs(potref[Part[i].GetPID()]);
+            if (err>r.maxerr) r.maxerr=err;
+            r.rmserr+=err*err;
+        }
+        r.rmserr=sqrt(r.rmserr/(double)nbodies);
+    }
+    return r;
+}
+
+BenchResult BenchUnbind(Options &opt, const Int_t nbodies, Particle *Part, int *bound, Coordinate &cmvel)
+{
+    BenchResult r;
+    Int_t nig=nbodies,*pfof=new Int_t[nbodies];
+    Double_t potscale=PotentialScale(opt),gmass,totV=0;
+    for (Int_t i=0;i<nbodies;i++) pfof[i]=1;
+    double t0=MyGetTime();
+    //same choice of potential calculation as in Unbind
+    if (nbodies<=UNBINDNUM) DirectPotential(opt,nbodies,Part);
+    else TreePotential(opt,nbodies,Part);
+    for (Int_t i=0;i<nbodies;i++) {
+        Part[i].SetPotential(Part[i].GetPotential()*potscale);
+        totV+=0.5*Part[i].GetPotential();
+    }
+    GetCMVel(nbodies,Part,cmvel,gmass);
+    r.niter=UnbindGroup(opt,nig,Part,NULL,pfof,cmvel,gmass,totV,potscale,1);
+    r.time=MyGetTime()-t0;
+    r.nbound=nig;
+    for (Int_t i=0;i<nbodies;i++) bound[i]=(pfof[i]>0);
+    delete[] pfof;
+    return r;
+}
+
+BenchResult BenchBindingEnergy(Options &opt, const Int_t nbound, Particle *Part, Coordinate &cmvel)
+{
+    BenchResult r;
+    Int_t *numingroup=new Int_t[2],*noffset=new Int_t[2],*pfof=new Int_t[nbound];
+    PropData *pdata=new PropData[2];
+    numingroup[0]=noffset[0]=noffset[1]=0;
+    numingroup[1]=nbound;
+    for (Int_t i=0;i<nbound;i++) pfof[i]=1;
+    pdata[1].gcmvel=cmvel;
+    double t0=MyGetTime();
+    GetBindingEnergy(opt,nbound,Part,1,pfof,numingroup,pdata,noffset);
+    r.time=MyGetTime()-t0;
+    r.nbound=nbound;
+    delete[] numingroup;
+    delete[] noffset;
+    delete[] pfof;
+    delete[] pdata;
+    return r;
+}
+
+BenchResult ReferenceUnbind(Options &opt, const Int_t nbodies, Particle *Part, int *bound)
+{
+    BenchResult r;
+    Int_t nig=nbodies,nremove,j;
+    Double_t potscale=PotentialScale(opt),gmass;
+    Coordinate cmvel;
+    Particle ptemp;
+    double t0=MyGetTime();
+    do {
+        DirectPotential(opt,nig,Part);
+        GetCMVel(nig,Part,cmvel,gmass);
+        //move particles with positive energy to the end
+        nremove=0;
+        j=nig-1;
+        for (Int_t i=0;i<=j;) {
+            if (KineticEnergy(opt,Part[i],cmvel)+Part[i].GetPotential()*potscale>0) {
+                ptemp=Part[i];Part[i]=Part[j];Part[j]=ptemp;
+                j--;
+                nremove++;
+            }
+            else i++;
+        }
+        nig-=nremove;
+        r.niter++;
+    } while (nremove>0 && nig>=opt.MinSize);
+    if (nig<opt.MinSize) nig=0;
+    r.time=MyGetTime()-t0;
+    r.nbound=nig;
+    for (Int_t i=0;i<nbodies;i++) bound[i]=0;
+    for (Int_t i=0;i<nig;i++) bound[Part[i].GetPID()]=1;
+    return r;
+}
@@ -0,0 +1,109 @@
+/*! \file halos.cxx
+ *  \brief generates synthetic haloes used by the benchmark
+
+    Haloes are in units where G, the total mass and the virial radius are 1. The host follows an NFW or Hernquist profile
+    truncated at the virial radius, subhaloes are Hernquist spheres with radii set by the tidal field of the host at their
+    distance and contaminants are spread uniformly through the host with speeds well above the escape speed.
+    Velocities are drawn from isotropic gaussians with a dispersion set by the local potential of each component so that most
+    particles are bound. The same seed always produces the same halo.
+*/
+
+#include "unbindbench.h"
+
+///fraction of the mass of an NFW profile within x=r/rs
+static inline Double_t NFWMass(const double x)
+{
+    return log(1.0+x)-x/(1.0+x);
+}
+
+///sample the radius enclosing a fraction u of the mass of a profile truncated at unit radius with scale radius rs
+static double SampleRadius(const int profile, const double rs, const double u)
+{
+    if (profile==NFWPROFILE) {
+        double c=1.0/rs, mtarget=u*NFWMass(c), xlow=0, xhigh=c, x;
+        for (int i=0;i<60;i++) {
+            x=0.5*(xlow+xhigh);
+            if (NFWMass(x)<mtarget) xlow=x;
+            else xhigh=x;
+        }
+        return 0.5*(xlow+xhigh)*rs;
+    }
+    else {
+        double s=sqrt(u)/(1.0+rs);
+        return rs*s/(1.0-s);
+    }
+}
+
+///potential of a profile truncated at unit radius with unit mass and scale radius rs
+static double ProfilePotential(const int profile, const double rs, double r)
+{
+    if (r<1e-8) r=1e-8;
+    if (r>=1.0) return -1.0/r;
+    if (profile==NFWPROFILE) {
+        double c=1.0/rs;
+        return -(log(1.0+r/rs)/r-1.0/(rs*(1.0+c)))/NFWMass(c);
+    }
+    else return -((1.0+rs)*(1.0+rs)/(r+rs)-rs);
+}
+
+///random isotropic direction
+static void RandomDirection(BenchRandom &rng, double *dir)
+{
+    double cost=2.0*rng.Uniform()-1.0, sint=sqrt(1.0-cost*cost), phi=2.0*M_PI*rng.Uniform();
+    dir[0]=sint*cos(phi);dir[1]=sint*sin(phi);dir[2]=cost;
+}
+
+///add a component of n particles of mass mass and radius radius centred on cen moving with vcen
+static void AddComponent(BenchRandom &rng, Particle *Part, const Int_t start, const Int_t n, const int profile, const double rs,
+    const double mass, const double radius, const double *cen, const double *vcen, const double mpart)
+{
+    double r,sigma,dir[3];
+    for (Int_t i=start;i<start+n;i++) {
+        r=SampleRadius(profile,rs,rng.UniformPos());
+        sigma=sqrt(fabs(ProfilePotential(profile,rs,r))*mass/radius/3.0);
+        RandomDirection(rng,dir);
+        Part[i]=Particle(mpart,cen[0]+r*radius*dir[0],cen[1]+r*radius*dir[1],cen[2]+r*radius*dir[2],
+            vcen[0]+rng.Gaussian(sigma),vcen[1]+rng.Gaussian(sigma),vcen[2]+rng.Gaussian(sigma),i);
+        Part[i].SetPID(i);
+    }
+}
+
+Particle *GenerateHalo(BenchOptions &bopt, const Int_t nbodies, const int profile, const unsigned long int seed, Double_t &mpart, Int_t &ncontam)
+{
+    Particle *Part=new Particle[nbodies];
+    BenchRandom rng(seed);
+    double rs=1.0/bopt.conc, zero[3]={0,0,0}, cen[3], vcen[3], dir[3];
+    double d,msub,rsub,sigma,vesc;
+    Int_t nsub,nhost,noffset;
+
+    mpart=1.0/(double)nbodies;
+    ncontam=(Int_t)(bopt.fcontam*nbodies);
+    nsub=(bopt.nsub>0)?(Int_t)(bopt.fsub*nbodies/bopt.nsub):0;
+    nhost=nbodies-ncontam-nsub*bopt.nsub;
+
+    AddComponent(rng,Part,0,nhost,profile,rs,nhost*mpart,1.0,zero,zero,mpart);
+    noffset=nhost;
+    for (int isub=0;isub<bopt.nsub && nsub>0;isub++) {
+        //place subhaloes between 0.2 and 0.7 virial radii with a radius set by the tidal field of the host
+        d=0.2+0.5*rng.Uniform();
+        msub=nsub*mpart;
+        rsub=d*pow(msub/3.0,1.0/3.0);
+        RandomDirection(rng,dir);
+        sigma=sqrt(fabs(ProfilePotential(profile,rs,d))/3.0);
+        for (int k=0;k<3;k++) {cen[k]=d*dir[k];vcen[k]=rng.Gaussian(sigma);}
+        AddComponent(rng,Part,noffset,nsub,HERNQUISTPROFILE,0.1,msub,rsub,cen,vcen,mpart);
+        noffset+=nsub;
+    }
+    //contaminants move at twice the escape speed from the centre of the host
+    vesc=sqrt(2.0*fabs(ProfilePotential(profile,rs,0)));
+    for (Int_t i=noffset;i<nbodies;i++) {
+        d=pow(rng.Uniform(),1.0/3.0);
+        RandomDirection(rng,dir);
+        for (int k=0;k<3;k++) cen[k]=d*dir[k];
+        RandomDirection(rng,dir);
+        for (int k=0;k<3;k++) vcen[k]=2.0*vesc*dir[k];
+        Part[i]=Particle(mpart,cen[0],cen[1],cen[2],vcen[0],vcen[1],vcen[2],i);
+        Part[i].SetPID(i);
+    }
+    return Part;
+}
@@ -0,0 +1,217 @@
+/*! \file main.cxx
+ *  \brief Benchmark of the potential, unbinding and binding energy calculations of VELOCIraptor
+
+    Generates reproducible haloes (see \ref halos.cxx) of a range of sizes and, for each number of openmp threads, times
+    \arg \b direct the direct summation potential, \ref DirectPotential
+    \arg \b tree the tree potential, \ref TreePotential, with its error relative to direct summation when that is run
+    \arg \b unbind the potential and unbinding of the halo as a single group, \ref UnbindGroup
+    \arg \b energy the binding energies of the bound particles, \ref GetBindingEnergy
+
+    Rates are the number of pair interactions of direct summation, n(n-1)/2, per second so the paths can be compared directly.
+    For haloes of at most nrefmax particles the bound set is compared to a reference that recalculates the potential
+    by direct summation each iteration and removes all particles with positive energy (\ref ReferenceUnbind). The agreement is
+    the fraction of particles whose bound status is the same and the last column is the fraction of the contaminants removed.
+*/
+
+#include "unbindbench.h"
+
+///parse a comma separated list of values
+template<typename T> static vector<T> ParseList(const char *arg)
+{
+    vector<T> values;
+    string s(arg),item;
+    size_t start=0,end;
+    do {
+        end=s.find(',',start);
+        item=s.substr(start,end-start);
+        if (item.size()>0) values.push_back((T)atof(item.c_str()));
+        start=end+1;
+    } while (end!=string::npos);
+    return values;
+}
+
+static void BenchUsage(void)
+{
+    BenchOptions bopt;
+    cerr<<"USAGE:\n";
+    cerr<<"\n";
+    cerr<<"-n <comma separated number of particles of each halo, default 20,...,1000000 > \n";
+    cerr<<"-t <comma separated number of openmp threads, default 1 and the maximum number of threads > \n";
+    cerr<<"-p <comma separated profiles, "<<NFWPROFILE<<" for NFW, "<<HERNQUISTPROFILE<<" for Hernquist, default both > \n";
+    cerr<<"-d <largest halo for which the direct potential is timed, default "<<bopt.ndirectmax<<" > \n";
+    cerr<<"-r <largest halo for which the direct summation reference unbinding is run, default "<<bopt.nrefmax<<" > \n";
+    cerr<<"-b <number of subhaloes, default "<<bopt.nsub<<" > \n";
+    cerr<<"-f <fraction of mass in subhaloes, default "<<bopt.fsub<<" > \n";
+    cerr<<"-u <fraction of particles that are unbound contaminants, default "<<bopt.fcontam<<" > \n";
+    cerr<<"-c <concentration of the host, default "<<bopt.conc<<" > \n";
+    cerr<<"-e <softening length in units of the virial radius, default "<<bopt.eps<<" > \n";
+    cerr<<"-m <minimum number of particles of a bound group, default "<<bopt.minsize<<" > \n";
+    cerr<<"-R <number of times each measurement is repeated, default "<<bopt.nrepeat<<" > \n";
+    cerr<<"-s <random seed, default "<<bopt.seed<<" > \n";
+    exit(1);
+}
+
+void GetBenchArgs(int argc, char *argv[], BenchOptions &bopt)
+{
+    int option;
+    while ((option = getopt(argc, argv, ":n:t:p:d:r:b:f:u:c:e:m:R:s:h")) != EOF)
+    {
+        switch(option)
+        {
+            case 'n':
+                bopt.sizes=ParseList<Int_t>(optarg);
+                break;
+            case 't':
+                bopt.nthreads=ParseList<int>(optarg);
+                break;
+            case 'p':
+                bopt.profiles=ParseList<int>(optarg);
+                break;
+            case 'd':
+                bopt.ndirectmax=atol(optarg);
+                break;
+            case 'r':
+                bopt.nrefmax=atol(optarg);
+                break;
+            case 'b':
+                bopt.nsub=atoi(optarg);
+                break;
+            case 'f':
+                bopt.fsub=atof(optarg);
+                break;
+            case 'u':
+                bopt.fcontam=atof(optarg);
+                break;
+            case 'c':
+                bopt.conc=atof(optarg);
+                break;
+            case 'e':
+                bopt.eps=atof(optarg);
+                break;
+            case 'm':
+                bopt.minsize=atol(optarg);
+                break;
+            case 'R':
+                bopt.nrepeat=max(1,atoi(optarg));
+                break;
+            case 's':
+                bopt.seed=atol(optarg);
+                break;
+            case 'h':
+            case '?':
+            case ':':
+                BenchUsage();
+        }
+    }
+    if (bopt.sizes.size()==0 || bopt.nthreads.size()==0 || bopt.profiles.size()==0) BenchUsage();
+}
+
+///print a row of the results table
+static void PrintResult(const int profile, const Int_t n, const int nthreads, const char *path, BenchResult &r,
+    const double agree=-1, const double fcontam=-1)
+{
+    double npairs=0.5*(double)n*(double)(n-1);
+    cout<<setw(9)<<(profile==NFWPROFILE?"NFW":"Hernquist")<<setw(10)<<n<<setw(5)<<nthreads<<setw(8)<<path;
+    cout<<scientific<<setprecision(3)<<setw(12)<<r.time<<setw(12)<<((r.time>0)?npairs/r.time:0.0);
+    cout<<setw(6)<<r.niter<<setw(10)<<r.nbound<<fixed<<setprecision(4)<<setw(9)<<(double)r.nbound/(double)n;
+    if (agree>=0) cout<<setw(9)<<agree; else cout<<setw(9)<<"-";
+    if (fcontam>=0) cout<<setw(9)<<fcontam; else cout<<setw(9)<<"-";
+    cout<<scientific<<setprecision(2);
+    if (r.maxerr>=0) cout<<setw(11)<<r.maxerr<<setw(11)<<r.rmserr; else cout<<setw(11)<<"-"<<setw(11)<<"-";
+    cout<<endl;
+}
+
+///keep the fastest of repeated measurements
+static inline void KeepFastest(BenchResult &best, BenchResult &r, const int irepeat)
+{
+    if (irepeat==0 || r.time<best.time) best=r;
+}
+
+int main(int argc,char **argv)
+{
+#ifdef USEMPI
+    MPI_Init(&argc,&argv);
+#endif
+    BenchOptions bopt;
+    Options opt;
+    Particle *Part,*Pcopy;
+    Double_t mpart,*potref;
+    Int_t ncontam,nremoved;
+    int *bound,*boundref;
+    Coordinate cmvel;
+    BenchResult r,best,ref;
+    double agree;
+
+    GetBenchArgs(argc, argv, bopt);
+
+    cout<<"#  profile         n  thr    path     time(s)  pairs/s     iter    nbound   fbound    agree  fcontam     maxerr     rmserr"<<endl;
+    for (auto profile:bopt.profiles) for (auto n:bopt.sizes) {
+        Part=GenerateHalo(bopt,n,profile,bopt.seed+n+1000003*profile,mpart,ncontam);
+        SetBenchOptions(bopt,opt,mpart);
+        Pcopy=new Particle[n];
+        bound=new int[n];
+        boundref=NULL;
+        potref=NULL;
+        if (n<=bopt.nrefmax) {
+            boundref=new int[n];
+            for (Int_t i=0;i<n;i++) Pcopy[i]=Part[i];
+            ref=ReferenceUnbind(opt,n,Pcopy,boundref);
+            PrintResult(profile,n,1,"ref",ref);
+        }
+        for (auto nthreads:bopt.nthreads) {
+#ifdef USEOPENMP
+            omp_set_num_threads(nthreads);
+#endif
+            if (n<=bopt.ndirectmax) {
+                if (potref==NULL) potref=new Double_t[n];
+                for (int irepeat=0;irepeat<bopt.nrepeat;irepeat++) {
+                    for (Int_t i=0;i<n;i++) Pcopy[i]=Part[i];
+                    r=BenchDirectPotential(opt,n,Pcopy,potref);
+                    KeepFastest(best,r,irepeat);
+                }
+                PrintResult(profile,n,nthreads,"direct",best);
+            }
+            for (int irepeat=0;irepeat<bopt.nrepeat;irepeat++) {
+                for (Int_t i=0;i<n;i++) Pcopy[i]=Part[i];
+                r=BenchTreePotential(opt,n,Pcopy,potref);
+                KeepFastest(best,r,irepeat);
+            }
+            PrintResult(profile,n,nthreads,"tree",best);
+            for (int irepeat=0;irepeat<bopt.nrepeat;irepeat++) {
+                for (Int_t i=0;i<n;i++) Pcopy[i]=Part[i];
+                r=BenchUnbind(opt,n,Pcopy,bound,cmvel);
+                KeepFastest(best,r,irepeat);
+            }
+            agree=-1;
+            if (boundref!=NULL) {
+                agree=0;
+                for (Int_t i=0;i<n;i++) agree+=(bound[i]==boundref[i]);
+                agree/=(double)n;
+            }
+            nremoved=0;
+            for (Int_t i=n-ncontam;i<n;i++) nremoved+=(bound[i]==0);
+            PrintResult(profile,n,nthreads,"unbind",best,agree,(ncontam>0)?nremoved/(double)ncontam:-1);
+            //binding energies of the bound particles, which the last unbinding call left at the start of the array
+            if (r.nbound>0) {
+                Int_t nbound=r.nbound;
+                Particle *Pbound=new Particle[nbound];
+                for (int irepeat=0;irepeat<bopt.nrepeat;irepeat++) {
+                    for (Int_t i=0;i<nbound;i++) Pbound[i]=Pcopy[i];
+                    r=BenchBindingEnergy(opt,nbound,Pbound,cmvel);
+                    KeepFastest(best,r,irepeat);
+                }
+                PrintResult(profile,n,nthreads,"energy",best);
+                delete[] Pbound;
+            }
+        }
+        delete[] Part;
+        delete[] Pcopy;
+        delete[] bound;
+        if (boundref!=NULL) delete[] boundref;
+        if (potref!=NULL) delete[] potref;
+    }
+#ifdef USEMPI
+    MPI_Finalize();
+#endif
+    return 0;
+}
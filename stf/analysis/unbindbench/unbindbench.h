@@ -0,0 +1,120 @@
+/*! \file unbindbench.h
+ *  \brief header file for the unbinding benchmark
+ */
+
+#ifndef UNBINDBENCH_H
+#define UNBINDBENCH_H
+
+#include "stf.h"
+#include <random>
+
+using namespace std;
+using namespace Math;
+using namespace NBody;
+
+///\name halo density profiles
+//@{
+#define NFWPROFILE 0
+#define HERNQUISTPROFILE 1
+//@}
+
+/// Options of the benchmark, set by \ref GetBenchArgs
+struct BenchOptions
+{
+    ///number of particles of each halo
+    vector<Int_t> sizes;
+    ///numbers of openmp threads to use
+    vector<int> nthreads;
+    ///density profiles of the haloes
+    vector<int> profiles;
+    ///largest halo for which the direct potential and the direct summation reference unbinding are run
+    Int_t ndirectmax, nrefmax;
+    ///number of subhaloes and the fraction of the mass in subhaloes
+    int nsub;
+    Double_t fsub;
+    ///fraction of particles that are unbound contaminants
+    Double_t fcontam;
+    ///concentration of the host, rvir/rs
+    Double_t conc;
+    ///softening length in units of the virial radius
+    Double_t eps;
+    ///minimum size of a bound group
+    Int_t minsize;
+    ///number of times each measurement is repeated, the fastest is reported
+    int nrepeat;
+    unsigned long int seed;
+
+    BenchOptions(){
+        for (Int_t n=20;n<=1000000;n*=10) sizes.push_back(n);
+        nthreads.push_back(1);
+#ifdef USEOPENMP
+        if (omp_get_max_threads()>1) nthreads.push_back(omp_get_max_threads());
+#endif
+        profiles.push_back(NFWPROFILE);
+        profiles.push_back(HERNQUISTPROFILE);
+        ndirectmax=50000;
+        nrefmax=20000;
+        nsub=4;
+        fsub=0.1;
+        fcontam=0.05;
+        conc=10.0;
+        eps=1e-3;
+        minsize=10;
+        nrepeat=1;
+        seed=4357;
+    }
+};
+
+/// Random numbers of the 64 bit Mersenne twister. The deviates are calculated here rather than with the standard library distributions so that a seed gives the same haloes on all platforms
+struct BenchRandom
+{
+    mt19937_64 engine;
+    BenchRandom(unsigned long int seed) : engine(seed) {}
+    ///uniform in [0,1)
+    double Uniform(){
+        return (engine()>>11)*(1.0/9007199254740992.0);
+    }
+    ///uniform in (0,1)
+    double UniformPos(){
+        double u;
+        do u=Uniform(); while (u==0);
+        return u;
+    }
+    ///gaussian with zero mean using the Box-Muller transform
+    double Gaussian(const double sigma){
+        return sigma*sqrt(-2.0*log(UniformPos()))*cos(2.0*M_PI*Uniform());
+    }
+};
+
+/// Result of one benchmark measurement
+struct BenchResult
+{
+    ///time in seconds
+    double time;
+    ///number of unbinding iterations
+    int niter;
+    ///number of bound particles
+    Int_t nbound;
+    ///relative error of the potential compared to direct summation, if available
+    Double_t maxerr, rmserr;
+    BenchResult(){
+        time=0;niter=0;nbound=0;maxerr=rmserr=-1;
+    }
+};
+
+///\name Benchmark routines, see \ref halos.cxx and \ref bench.cxx
+//@{
+void GetBenchArgs(int argc, char *argv[], BenchOptions &bopt);
+///generate a halo with subhaloes and unbound contaminants, which are the last ncontam particles
+Particle *GenerateHalo(BenchOptions &bopt, const Int_t nbodies, const int profile, const unsigned long int seed, Double_t &mpart, Int_t &ncontam);
+///set the options used by the unbinding routines
+void SetBenchOptions(BenchOptions &bopt, Options &opt, const Double_t mpart);
+BenchResult BenchDirectPotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *pot);
+BenchResult BenchTreePotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *potref);
+BenchResult BenchUnbind(Options &opt, const Int_t nbodies, Particle *Part, int *bound, Coordinate &cmvel);
+BenchResult BenchBindingEnergy(Options &opt, const Int_t nbound, Particle *Part, Coordinate &cmvel);
+///unbind by recalculating the potential with direct summation every iteration and removing all particles with positive energy
+BenchResult ReferenceUnbind(Options &opt, const Int_t nbodies, Particle *Part, int *bound);
+//@}
+
+#endif
@@ -7,4 +7,6 @@
 //-- Structures and external variables
 ///external pointer to keep track of structure levels and parent
 StrucLevelData *psldata;
+///external pointer to the cache of potentials calculated when unbinding
+PotentialCache *potcache=NULL;
 
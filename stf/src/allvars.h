@@ -24,7 +24,10 @@
 #include <cmath>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
+#include <limits>
+#include <cstring>
 #include <getopt.h>
 #include <sys/stat.h>
 #include <sys/timeb.h>
@@ -155,6 +158,14 @@ using namespace NBody;
 ///3d search
 #define  FOF3D 5
 //@}
+
+/// \name Neighbour search used by the initial 3D FOF search for field objects
+//@{
+///kd-tree
+#define FOFENGINETREE 0
+///uniform grid of cells, see \ref SearchFOFGrid
+#define FOFENGINEGRID 1
+//@}
 //@}
 
 /// \defgroup INTERATIVESEARCHPARAMS
@@ -192,6 +203,22 @@ using namespace NBody;
 
 //@}
 
+/// \name Space filling curves used to reorder the particle data after it is read
+//@{
+#define PREORDERNONE 0
+#define PREORDERMORTON 1
+#define PREORDERPH 2
+///number of bits per dimension of the space filling curve keys
+#define PREORDERBITS 21
+//@}
+
+/// \name For local velocity density
+//@{
+///number of particles (consecutive in tree order) whose nearest neighbours are searched together when calculating the local velocity density
+///(see \ref NBody::KDTree::CalcVelDensityRange), also the number of untagged particles searched together against the cores in \ref HaloCoreGrowth
+#define NNBATCHSIZE 256
+//@}
+
 ///\defgroup INPUTTYPES
 //@{
 /// \name defining types of input
@@ -242,6 +269,10 @@ using namespace NBody;
 #define splitflag -1
 ///cellflag means a node that is not necessarily a leaf node can be approximated by mono-pole
 #define cellflag 0
+///fraction of the mass of a large group that can be removed while unbinding before its potential is recalculated and its tree rebuilt
+#define GRAVREBUILDFRAC 0.25
+///fraction of the members of a group that may have been added or removed since its potential was cached for the cached values to be corrected rather than recalculated
+#define GRAVCACHEMAXFRAC 0.5
 
 //@}
 
@@ -253,6 +284,21 @@ using namespace NBody;
 #define ompunbindnum 1000
 #define ompperiodnum 50000
 #define omppropnum 50000
+#define ompreordernum 50000
+//@}
+
+///\name For scheduling groups of very different sizes, see \ref GroupSchedule
+//@{
+///cost of processing a group scales as n
+#define GSCHEDLINEAR 0
+///cost of processing a group scales as n log n
+#define GSCHEDNLOGN 1
+///cost of processing a group scales as n^2
+#define GSCHEDNSQUARED 2
+///a group whose cost exceeds this fraction of the share of the total cost per thread is processed alone with all threads
+#define GSCHEDFRAC 0.5
+///groups larger than this factor times the openmp threshold of a loop are always processed alone with all threads
+#define GSCHEDMAXFAC 100
 //@}
 //@}
 
@@ -296,10 +342,18 @@ struct UnbindInfo
     ///\name gravity and tree potential calculation;
     //@{
     int BucketSize;
+    ///opening angle of tree cells, which are used as multipoles if further than bmax/TreeThetaOpen
     Double_t TreeThetaOpen;
     ///softening length
     Double_t eps;
     //@}
+    ///flag whether the potentials calculated when unbinding are cached and reused when calculating binding energies, see \ref PotentialCache.
+    ///Off by default as reused values of large groups have tree accuracy and the cache holds several values per particle in groups
+    int icachepot;
+    ///flag whether particle-particle potentials are summed in mixed precision, see \ref NBody::GravityInfo
+    int imixedpot;
+    ///in mpi runs, halos with at least this many particles are divided between mpi tasks and unbound by them together, see \ref MPIUnbindLargeGroups (0 to disable)
+    Int_t mpiunbindnum;
     UnbindInfo(){
         unbindflag=0;
         bgpot=1;
@@ -314,6 +368,9 @@ struct UnbindInfo
         maxunbindfrac=0.05;
         Npotref=10;
         fracpotref=0.1;
+        icachepot=0;
+        imixedpot=0;
+        mpiunbindnum=0;
     }
 };
 
@@ -361,6 +418,8 @@ struct Options
     int icosmologicalin;
     /// input buffer size when reading data
     long int inputbufsize;
+    /// reorder particles along a space filling curve once read, \ref PREORDERNONE, \ref PREORDERMORTON or \ref PREORDERPH
+    int iparticlereorder;
     /// mpi paritcle buffer size when sending input particle information
     long int mpiparticletotbufsize,mpiparticlebufsize;
     /// mpi factor by which to multiple the memory allocated, ie: buffer region
@@ -404,6 +463,8 @@ struct Options
     int iSubSearch;
     ///type of search
     int foftype,fofbgtype;
+    ///neighbour search used by the 3D FOF search for field objects, \ref FOFENGINETREE or \ref FOFENGINEGRID
+    int fofengine;
     ///grid type, physical, physical+entropy splitting criterion, phase+entropy splitting criterion. Note that this parameter should not be changed from the default value
     int gridtype;
     ///flag indicating search all particle types or just dark matter
@@ -572,6 +633,7 @@ struct Options
         foftype=FOFSTPROB;
         gridtype=PHYSENGRID;
         fofbgtype=FOF6D;
+        fofengine=FOFENGINETREE;
         idenvflag=0;
         iBaryonSearch=0;
         icmrefadjust=1;
@@ -651,6 +713,7 @@ struct Options
         iScaleLengths=0;
 
         inputbufsize=100000;
+        iparticlereorder=PREORDERNONE;
 
         mpiparticletotbufsize=-1;
         mpiparticlebufsize=-1;
@@ -685,6 +748,8 @@ struct ConfigInfo{
         datainfo.push_back(to_string(opt.foftype));
         nameinfo.push_back("FoF_Field_search_type");
         datainfo.push_back(to_string(opt.fofbgtype));
+        nameinfo.push_back("FoF_Field_search_engine");
+        datainfo.push_back(to_string(opt.fofengine));
         nameinfo.push_back("Search_for_substructure");
         datainfo.push_back(to_string(opt.iSubSearch));
         nameinfo.push_back("Keep_FOF");
@@ -827,6 +892,12 @@ struct ConfigInfo{
         //unbinding
         nameinfo.push_back("Softening_length");
         datainfo.push_back(to_string(opt.uinfo.eps));
+        nameinfo.push_back("Tree_potential_opening_angle");
+        datainfo.push_back(to_string(opt.uinfo.TreeThetaOpen));
+        nameinfo.push_back("Cache_potential");
+        datainfo.push_back(to_string(opt.uinfo.icachepot));
+        nameinfo.push_back("Mixed_precision_potential");
+        datainfo.push_back(to_string(opt.uinfo.imixedpot));
         nameinfo.push_back("Allowed_kinetic_potential_ratio");
         datainfo.push_back(to_string(opt.uinfo.Eratio));
         nameinfo.push_back("Min_bound_mass_frac");
@@ -859,8 +930,12 @@ struct ConfigInfo{
         datainfo.push_back(to_string(opt.icosmologicalin));
         nameinfo.push_back("Input_chunk_size");
         datainfo.push_back(to_string(opt.inputbufsize));
+        nameinfo.push_back("Particle_reorder_type");
+        datainfo.push_back(to_string(opt.iparticlereorder));
         nameinfo.push_back("MPI_particle_total_buf_size");
         datainfo.push_back(to_string(opt.mpiparticletotbufsize));
+        nameinfo.push_back("MPI_collective_unbinding_min_size");
+        datainfo.push_back(to_string(opt.uinfo.mpiunbindnum));
         nameinfo.push_back("Separate_output_files");
         datainfo.push_back(to_string(opt.iseparatefiles));
         nameinfo.push_back("Binary_output");
@@ -2133,6 +2208,53 @@ struct DataGroupNames {
 #include "mpivar.h"
 #endif
 
+/*!
+    Potentials of the members of a group stored when the group was unbound, see \ref StorePotentialCache.
+    The members are identified by their particle ids, which are also combined into an order independent hash of the membership.
+    Their positions and masses are kept to correct the potentials when the group has since lost or gained particles.
+    The potentials do not include the factor applied when NOMASS is set.
+*/
+struct PotentialCacheGroup
+{
+    ///hash of the ids of the members
+    unsigned long long hash;
+    ///number of members whose index in \ref PotentialCache still refers to this group
+    Int_t nref;
+    vector<PARTPIDTYPE> pid;
+    vector<Double_t> x, y, z, mass, pot;
+};
+
+/*!
+    Cache of the potentials of groups calculated when unbinding, so that \ref GetBindingEnergy does not repeat the calculation.
+    The index maps a particle id to the cached group that most recently contained it and its position in that group.
+    Each particle in a cached group therefore costs its id, position, mass and potential plus an index entry.
+    Also counts the number of groups whose potentials were reused, corrected for changes in membership or had to be recalculated.
+*/
+struct PotentialCache
+{
+    vector<PotentialCacheGroup*> groups;
+    unordered_map<PARTPIDTYPE, pair<Int_t,Int_t> > index;
+    Int_t nreused, ncorrected, nmissed;
+    PotentialCache(){
+        nreused=ncorrected=nmissed=0;
+    }
+    ~PotentialCache(){
+        for (auto g:groups) if (g!=NULL) delete g;
+    }
+};
+
+/*!
+    Order in which the groups of a loop are processed. Groups in pool are processed concurrently, one group per thread, and
+    groups in large are processed one after the other using all threads. Both lists are ordered by decreasing cost so that
+    the most expensive groups are started first. The large groups are processed before the pool, see \ref BuildGroupSchedule.
+*/
+struct GroupSchedule
+{
+    vector<Int_t> pool, large;
+};
+
 extern StrucLevelData *psldata;
+///external pointer to the cache of potentials calculated when unbinding
+extern PotentialCache *potcache;
 
 #endif
@@ -142,6 +142,46 @@ void FillTreeGrid(Options &opt, const Int_t nbodies, const Int_t ngrid, KDTree *
     if (opt.iverbose) cout<<"Done."<<endl;
 }
 
+///Fills the GridCell struct using the coarse nodes of an existing physical tree
+/*!
+    Nodes are split at the median irrespective of the bucket size, so the nodes of a physical tree containing at most opt.Ncell particles
+    are the leaf nodes of the tree \ref InitializeTreeGrid builds for a \ref PHYSGRID or, if the tree uses the shannon entropy splitting criterion,
+    a \ref PHYSENGRID. Here these nodes are used directly so
+    the tree used to search for structures need not be rebuilt. The tree is not deleted, particles remain in tree order
+    and the index stored in the grid is that of the (reordered) particle array, so grid quantities must be calculated before the tree is deleted.
+    The grid is allocated here and ngrid is set.
+*/
+void FillTreeGridFromTree(Options &opt, const Int_t nbodies, Int_t &ngrid, KDTree *tree, Particle *Part, GridCell* &grid)
+{
+    vector<Node*> cells=tree->FindCoarseNodes(opt.Ncell);
+    ngrid=cells.size();
+    grid=new GridCell[ngrid];
+    if (opt.iverbose) cout<<"Filling KD-Tree Grid using existing tree with "<<ngrid<<" cells"<<endl;
+    for (Int_t i=0;i<ngrid;i++) {
+        Node *np=cells[i];
+        Int_t start=np->GetStart(), end=np->GetEnd();
+        grid[i].ndim=3;
+        for (int j=0;j<3;j++) {
+            grid[i].xm[j]=0.;
+            grid[i].xbl[j]=np->GetBoundary(j,0);
+            grid[i].xbu[j]=np->GetBoundary(j,1);
+        }
+        grid[i].nparts=np->GetCount();
+        grid[i].gid=np->GetID();
+        grid[i].nindex=new Int_t[grid[i].nparts];
+        Double_t mtot=0.;
+        for (Int_t k=start,l=0;k<end;k++,l++){
+            grid[i].nindex[l]=k;
+            for (int j=0;j<3;j++) grid[i].xm[j]+=Part[k].GetPosition(j)*Part[k].GetMass();
+            mtot+=Part[k].GetMass();
+        }
+        grid[i].mass=mtot;
+        mtot=1.0/mtot;
+        for (int j=0;j<3;j++) grid[i].xm[j]*=mtot;
+    }
+    if (opt.iverbose) cout<<"Done."<<endl;
+}
+
 //@}
 
 ///\name Calculate mean velocity distribution quantities
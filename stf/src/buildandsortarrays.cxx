@@ -233,3 +233,173 @@ void ReorderGroupIDsAndHaloDatabyValue(const Int_t numgroups, const Int_t newnum
     delete[] ptemp;
 }
 //@}
+
+/// \name Space filling curve reordering of the particle data
+//@{
+
+///spread the lowest \ref PREORDERBITS bits of x so that there are two zero bits between each
+static inline unsigned long long SFCSpreadBits(unsigned long long x)
+{
+    x&=0x1fffffULL;
+    x=(x|x<<32)&0x1f00000000ffffULL;
+    x=(x|x<<16)&0x1f0000ff0000ffULL;
+    x=(x|x<<8)&0x100f00f00f00f00fULL;
+    x=(x|x<<4)&0x10c30c30c30c30c3ULL;
+    x=(x|x<<2)&0x1249249249249249ULL;
+    return x;
+}
+
+///Morton key of integer coordinates, with x[0] the most significant dimension
+unsigned long long MortonKey(unsigned int x[3])
+{
+    return (SFCSpreadBits(x[0])<<2)|(SFCSpreadBits(x[1])<<1)|SFCSpreadBits(x[2]);
+}
+
+///Peano-Hilbert key of integer coordinates. The coordinates are transformed to the transpose of the Hilbert index
+///following Skilling (2004, AIP Conf. Proc. 707, 381) and then interleaved as a Morton key
+static inline unsigned long long PHKey(unsigned int x[3])
+{
+    unsigned int M=1U<<(PREORDERBITS-1), P, Q, t;
+    for (Q=M;Q>1;Q>>=1) {
+        P=Q-1;
+        for (int i=0;i<3;i++) {
+            if (x[i]&Q) x[0]^=P;
+            else {t=(x[0]^x[i])&P; x[0]^=t; x[i]^=t;}
+        }
+    }
+    for (int i=1;i<3;i++) x[i]^=x[i-1];
+    t=0;
+    for (Q=M;Q>1;Q>>=1) if (x[2]&Q) t^=Q-1;
+    for (int i=0;i<3;i++) x[i]^=t;
+    return MortonKey(x);
+}
+
+///sort the keys along with the index array with a least significant digit radix sort of 8 bit digits. Each thread
+///histograms and then scatters its own contiguous chunk of the data. Digits that are the same for all keys are skipped.
+void SFCRadixSort(const Int_t n, unsigned long long *&key, Int_t *&index)
+{
+    int nthreads=1;
+    bool iskip;
+#ifdef USEOPENMP
+    if (n>ompreordernum) nthreads=omp_get_max_threads();
+#endif
+    unsigned long long *key2=new unsigned long long[n];
+    Int_t *index2=new Int_t[n];
+    Int_t *count=new Int_t[nthreads*256];
+    for (int shift=0;shift<3*PREORDERBITS;shift+=8) {
+        for (Int_t j=0;j<nthreads*256;j++) count[j]=0;
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) num_threads(nthreads)
+{
+#endif
+        int tid=0;
+#ifdef USEOPENMP
+        tid=omp_get_thread_num();
+#endif
+        Int_t istart=n*tid/nthreads, iend=n*(tid+1)/nthreads;
+        Int_t *c=&count[tid*256];
+        for (Int_t i=istart;i<iend;i++) c[(key[i]>>shift)&0xff]++;
+#ifdef USEOPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+        {
+            //offsets ordered by digit then by thread so that the sort is stable
+            Int_t offset=0, ntmp;
+            iskip=false;
+            for (int d=0;d<256;d++) {
+                ntmp=0;
+                for (int t=0;t<nthreads;t++) ntmp+=count[t*256+d];
+                if (ntmp==n) iskip=true;
+            }
+            for (int d=0;d<256;d++) for (int t=0;t<nthreads;t++) {ntmp=count[t*256+d];count[t*256+d]=offset;offset+=ntmp;}
+        }
+        //if all keys share this digit the pass would not move anything
+        if (!iskip) for (Int_t i=istart;i<iend;i++) {
+            Int_t j=c[(key[i]>>shift)&0xff]++;
+            key2[j]=key[i];
+            index2[j]=index[i];
+        }
+#ifdef USEOPENMP
+}
+#endif
+        if (!iskip) {swap(key,key2);swap(index,index2);}
+    }
+    delete[] key2;
+    delete[] index2;
+    delete[] count;
+}
+
+///move the particle at index perm[i] to i by following the cycles of the permutation, so that no copy of the particle array is needed
+static void SFCPermuteParticles(const Int_t nbodies, Particle *Part, Int_t *perm)
+{
+    vector<bool> idone(nbodies,false);
+    Particle ptemp;
+    Int_t j, k;
+    for (Int_t i=0;i<nbodies;i++) {
+        if (idone[i] || perm[i]==i) continue;
+        ptemp=Part[i];
+        j=i;
+        while (true) {
+            idone[j]=true;
+            k=perm[j];
+            if (k==i) {Part[j]=ptemp;break;}
+            Part[j]=Part[k];
+            j=k;
+        }
+    }
+}
+
+/*! Reorders the particles along a Morton or Peano-Hilbert curve (see \ref Options.iparticlereorder) spanning the bounding box of
+    the particles, so that particles close in space are close in memory, which improves the cache behaviour of the tree builds
+    and searches that follow. Keys are sorted with a parallel radix sort. On return porder[i] stores the input index (offset by
+    ioffset) of the particle now at i and particle ids, which store the index of a particle, are set to ioffset+i.
+*/
+void ReorderParticlesSFC(Options &opt, const Int_t nbodies, Particle *Part, Int_t *porder, Int_t ioffset)
+{
+    if (nbodies<=0) return;
+    Double_t xmin[3], xmax[3], scale=0;
+    unsigned long long *key=new unsigned long long[nbodies];
+    Int_t *perm=new Int_t[nbodies];
+    for (int k=0;k<3;k++) xmin[k]=xmax[k]=Part[0].GetPosition(k);
+    for (Int_t i=1;i<nbodies;i++) for (int k=0;k<3;k++) {
+        if (Part[i].GetPosition(k)<xmin[k]) xmin[k]=Part[i].GetPosition(k);
+        else if (Part[i].GetPosition(k)>xmax[k]) xmax[k]=Part[i].GetPosition(k);
+    }
+    for (int k=0;k<3;k++) if (xmax[k]-xmin[k]>scale) scale=xmax[k]-xmin[k];
+    if (scale>0) scale=((1U<<PREORDERBITS)-1)/scale;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>ompreordernum)
+#endif
+    for (Int_t i=0;i<nbodies;i++) {
+        unsigned int x[3];
+        for (int k=0;k<3;k++) x[k]=(unsigned int)((Part[i].GetPosition(k)-xmin[k])*scale);
+        if (opt.iparticlereorder==PREORDERPH) key[i]=PHKey(x);
+        else key[i]=MortonKey(x);
+        perm[i]=i;
+    }
+    SFCRadixSort(nbodies,key,perm);
+    delete[] key;
+    SFCPermuteParticles(nbodies,Part,perm);
+    for (Int_t i=0;i<nbodies;i++) {
+        porder[i]=perm[i]+ioffset;
+        Part[i].SetID(i+ioffset);
+    }
+    delete[] perm;
+}
+
+///Returns particles reordered by \ref ReorderParticlesSFC to their input order, along with the group ids in pfof (if not NULL)
+void RestoreParticleOrder(const Int_t nbodies, Particle *Part, Int_t *porder, Int_t *pfof)
+{
+    Int_t *perm=new Int_t[nbodies];
+    for (Int_t i=0;i<nbodies;i++) perm[porder[i]]=i;
+    SFCPermuteParticles(nbodies,Part,perm);
+    for (Int_t i=0;i<nbodies;i++) Part[i].SetID(i);
+    if (pfof!=NULL) {
+        Int_t *pfoftemp=new Int_t[nbodies];
+        for (Int_t i=0;i<nbodies;i++) pfoftemp[porder[i]]=pfof[i];
+        for (Int_t i=0;i<nbodies;i++) pfof[i]=pfoftemp[i];
+        delete[] pfoftemp;
+    }
+}
+//@}
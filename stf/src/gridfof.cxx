@@ -0,0 +1,325 @@
+/*! \file gridfof.cxx
+ *  \brief this file contains routines for a 3DFOF search that uses a uniform grid of cells (a cell-linked list) instead of a kd-tree
+
+    For a single linking length in configuration space, cells with a size of the linking length mean that all particles a particle
+    can be linked to lie in the 27 cells surrounding (and including) its own cell. Each of these cells is split in 2x2x2 fine cells
+    whose diagonal is shorter than the linking length, so that all particles in a fine cell belong to the same group and two fine
+    cells need only a single link to be joined. Only occupied cells are stored, with particles sorted by the Morton key of their
+    fine cell so that the particles of a cell and of nearby cells are close in memory.
+*/
+
+#include "stf.h"
+
+/// \name Cell-linked-list 3DFOF search
+//@{
+
+///cell coordinates of the particle p, wrapping positions into the box if period>0 and placing anything beyond the last cell in the last cell
+static inline void FOFGridCellCoord(Particle &p, Double_t *xmin, double *icell, unsigned int *ncell, Double_t period, unsigned int *x)
+{
+    double xx;
+    for (int k=0;k<3;k++) {
+        xx=p.GetPosition(k)-xmin[k];
+        if (period>0) xx-=period*floor(xx/period);
+        if (xx<0) xx=0;
+        x[k]=(unsigned int)(xx*icell[k]);
+        if (x[k]>=ncell[k]) x[k]=ncell[k]-1;
+    }
+}
+
+///distance squared between entries i and j of the structure-of-arrays positions, using the nearest periodic image if period>0
+static inline Double_t FOFGridDistSqd(Double_t *px, Double_t *py, Double_t *pz, Int_t i, Int_t j, Double_t period)
+{
+    Double_t dx=px[i]-px[j], dy=py[i]-py[j], dz=pz[i]-pz[j];
+    if (period>0) {
+        Double_t hp=0.5*period;
+        if (dx>hp) dx-=period; else if (dx<-hp) dx+=period;
+        if (dy>hp) dy-=period; else if (dy<-hp) dy+=period;
+        if (dz>hp) dz-=period; else if (dz<-hp) dz+=period;
+    }
+    return dx*dx+dy*dy+dz*dz;
+}
+
+///fine cells and the sorted particle data used when linking cells in \ref SearchFOFGrid
+struct FOFGridCells {
+    ///fine cell f holds the sorted particles fstart[f] to fstart[f+1]-1 and has coordinates fx[3*f] to fx[3*f+2]
+    Int_t *fstart;
+    unsigned int *fx;
+    ///number and size of fine cells in each dimension
+    unsigned int ncell[3];
+    double fcellsize[3];
+    ///sorted positions and union-find array
+    Double_t *px, *py, *pz;
+    Int_tree_t *pParent;
+    Double_t period, fdist2;
+    ///whether all particles in a fine cell are linked
+    bool iclique;
+};
+
+///link the particles of two different fine cells
+static inline void FOFGridLinkFineCells(FOFGridCells &g, Int_t f1, Int_t f2)
+{
+    //smallest possible separation of particles in the two fine cells
+    Double_t gap2=0, dd;
+    for (int k=0;k<3;k++) {
+        long long df=(long long)g.fx[3*f2+k]-(long long)g.fx[3*f1+k];
+        if (g.period>0) {
+            if (df>(long long)g.ncell[k]/2) df-=g.ncell[k];
+            else if (df<-(long long)g.ncell[k]/2) df+=g.ncell[k];
+        }
+        if (df<0) df=-df;
+        if (df>1) {dd=(df-1)*g.fcellsize[k];gap2+=dd*dd;}
+    }
+    if (gap2>g.fdist2*(1.0+1e-4)) return;
+    if (g.iclique) {
+        //a single link joins the two cells
+        if (FOFFindRoot(g.pParent,g.fstart[f1])==FOFFindRoot(g.pParent,g.fstart[f2])) return;
+        for (Int_t i=g.fstart[f1];i<g.fstart[f1+1];i++)
+            for (Int_t j=g.fstart[f2];j<g.fstart[f2+1];j++)
+                if (FOFGridDistSqd(g.px,g.py,g.pz,i,j,g.period)<g.fdist2) {FOFUnion(g.pParent,i,j);return;}
+    }
+    else {
+        for (Int_t i=g.fstart[f1];i<g.fstart[f1+1];i++)
+            for (Int_t j=g.fstart[f2];j<g.fstart[f2+1];j++)
+                if (FOFGridDistSqd(g.px,g.py,g.pz,i,j,g.period)<g.fdist2) FOFUnion(g.pParent,i,j);
+    }
+}
+
+/*! 3DFOF search of all particles with linking length fdist using a cell-linked list, used in place of \ref NBody::KDTree::FOF
+    when \ref Options.fofengine is \ref FOFENGINEGRID. Returns the group id of each particle (indexed by particle index, which is
+    the particle id) with groups ordered from largest to smallest and particles in groups smaller than minsize having id 0.
+
+    Cells are slightly larger than the linking length (or larger still should more than 2^(\ref PREORDERBITS-1) cells be needed
+    in a dimension) and fine cells are half this size. Particles are sorted by the Morton key of their fine cell with the radix sort
+    used to reorder the input data, so the fine cells of a cell are contiguous. Only occupied cells are stored, so memory scales
+    with the number of particles, and the neighbours of all cells are found by walking a list of cells sorted by row-major index.
+    Periodic boundaries wrap the cell index and distances use the nearest image.
+    Links are recorded with the concurrent union-find (\ref NBody::FOFUnion) so that cells can be searched in parallel.
+    Each cell is searched against itself and the 13 neighbouring cells at a positive offset, so every pair of fine cells is examined once.
+    A pair of fine cells is skipped if they are too far apart or already in the same set, otherwise the search stops at the first link.
+    Should the fine cells be too large to guarantee their particles are linked (periodic boxes only a few linking lengths across),
+    all pairs of particles are checked instead.
+*/
+Int_t *SearchFOFGrid(Options &opt, const Int_t nbodies, Particle *Part, Double_t fdist, Int_t &numgroups, Int_t minsize)
+{
+    Int_t *pfof=new Int_t[nbodies];
+    numgroups=0;
+    if (nbodies==0) return pfof;
+    Double_t period=0, xmin[3], xmax[3], fdist2=fdist*fdist;
+    double cellsize, icell[3], fcellsize[3], ellcell, diag2=0;
+    unsigned int ncell[3];
+    const unsigned int maxncell=(1U<<(PREORDERBITS-1))-1;
+    Int_t nfine, ncoarse;
+    bool iclique;
+    Double_t time1=MyGetTime();
+
+    //cells are marginally larger than the linking length so that rounding can not place linked particles more than a cell apart.
+    //ncell is the number of fine cells in each dimension, always twice the number of cells
+    ellcell=fdist*(1.0+1e-5);
+    if (opt.p>0) {
+        period=opt.p;
+        for (int k=0;k<3;k++) {
+            xmin[k]=0;
+            ncell[k]=(unsigned int)min((double)maxncell,floor(period/ellcell));
+            if (ncell[k]<1) ncell[k]=1;
+            ncell[k]*=2;
+            fcellsize[k]=period/(double)ncell[k];
+        }
+    }
+    else {
+        for (int k=0;k<3;k++) xmin[k]=xmax[k]=Part[0].GetPosition(k);
+        for (Int_t i=1;i<nbodies;i++) for (int k=0;k<3;k++) {
+            if (Part[i].GetPosition(k)<xmin[k]) xmin[k]=Part[i].GetPosition(k);
+            else if (Part[i].GetPosition(k)>xmax[k]) xmax[k]=Part[i].GetPosition(k);
+        }
+        for (int k=0;k<3;k++) {
+            cellsize=max(ellcell,(double)(xmax[k]-xmin[k])/maxncell);
+            ncell[k]=2*(unsigned int)min((double)maxncell,floor((xmax[k]-xmin[k])/cellsize)+1);
+            fcellsize[k]=0.5*cellsize;
+        }
+    }
+    for (int k=0;k<3;k++) {icell[k]=1.0/fcellsize[k];diag2+=fcellsize[k]*fcellsize[k];}
+    //all particles in a fine cell are linked if its diagonal is shorter than the linking length, allowing for rounding
+    iclique=(diag2<fdist2*(1.0-1e-4));
+    if (opt.iverbose) cout<<"Grid of "<<ncell[0]/2<<"x"<<ncell[1]/2<<"x"<<ncell[2]/2<<" cells for linking length "<<fdist<<endl;
+
+    //sort particles by the Morton key of their fine cell
+    unsigned long long *key=new unsigned long long[nbodies];
+    Int_t *sortindex=new Int_t[nbodies];
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>ompsearchnum)
+#endif
+    for (Int_t i=0;i<nbodies;i++) {
+        unsigned int x[3];
+        FOFGridCellCoord(Part[i],xmin,icell,ncell,period,x);
+        key[i]=MortonKey(x);
+        sortindex[i]=i;
+    }
+    SFCRadixSort(nbodies,key,sortindex);
+
+    //list of occupied fine cells, fine cell f holding the sorted particles fstart[f] to fstart[f+1]-1, and of occupied cells,
+    //cell c holding the fine cells cstart[c] to cstart[c+1]-1. Dropping the last bit of each fine coordinate, the last 3 bits
+    //of the Morton key, gives the key of the cell
+    nfine=ncoarse=1;
+    for (Int_t i=1;i<nbodies;i++) if (key[i]!=key[i-1]) {nfine++;if ((key[i]>>3)!=(key[i-1]>>3)) ncoarse++;}
+    FOFGridCells g;
+    g.fstart=new Int_t[nfine+1];
+    g.fx=new unsigned int[3*nfine];
+    Int_t *cstart=new Int_t[ncoarse+1];
+    nfine=ncoarse=0;
+    for (Int_t i=0;i<nbodies;i++) {
+        if (i>0&&key[i]==key[i-1]) continue;
+        if (i==0||(key[i]>>3)!=(key[i-1]>>3)) cstart[ncoarse++]=nfine;
+        FOFGridCellCoord(Part[sortindex[i]],xmin,icell,ncell,period,&g.fx[3*nfine]);
+        g.fstart[nfine++]=i;
+    }
+    g.fstart[nfine]=nbodies;
+    cstart[ncoarse]=nfine;
+    delete[] key;
+
+    //cells are also listed in order of their row-major index, in which the neighbour at a given offset is at a fixed offset in
+    //index. Neighbours are then found by stepping through this list once for each offset rather than by searching for each one
+    unsigned int nc[3];
+    for (int k=0;k<3;k++) nc[k]=ncell[k]/2;
+    unsigned long long *lkey=new unsigned long long[ncoarse];
+    Int_t *lorder=new Int_t[ncoarse];
+    for (Int_t c=0;c<ncoarse;c++) {
+        unsigned int *x=&g.fx[3*cstart[c]];
+        lkey[c]=((unsigned long long)(x[0]>>1)*nc[1]+(x[1]>>1))*nc[2]+(x[2]>>1);
+        lorder[c]=c;
+    }
+    SFCRadixSort(ncoarse,lkey,lorder);
+    //the 13 offsets with a positive row-major index, so that each pair of neighbouring cells is found once
+    int noff=0, off[13][3];
+    long long koff[13];
+    for (int dx=-1;dx<=1;dx++) for (int dy=-1;dy<=1;dy++) for (int dz=-1;dz<=1;dz++) {
+        if (!(dx>0||(dx==0&&(dy>0||(dy==0&&dz>0))))) continue;
+        off[noff][0]=dx;off[noff][1]=dy;off[noff][2]=dz;
+        koff[noff++]=((long long)dx*nc[1]+dy)*nc[2]+dz;
+    }
+
+    //positions in sorted order and the union-find array, indexed by sorted index. If fine cells are cliques,
+    //their particles start in a set rooted at the first particle of the cell
+    g.px=new Double_t[3*nbodies];
+    g.py=&g.px[nbodies];
+    g.pz=&g.px[2*nbodies];
+    g.pParent=new Int_tree_t[nbodies];
+    g.period=period;
+    g.fdist2=fdist2;
+    g.iclique=iclique;
+    for (int k=0;k<3;k++) {g.ncell[k]=ncell[k];g.fcellsize[k]=fcellsize[k];}
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>ompsearchnum)
+#endif
+    for (Int_t f=0;f<nfine;f++) {
+        for (Int_t i=g.fstart[f];i<g.fstart[f+1];i++) {
+            g.px[i]=Part[sortindex[i]].GetPosition(0);
+            g.py[i]=Part[sortindex[i]].GetPosition(1);
+            g.pz[i]=Part[sortindex[i]].GetPosition(2);
+            g.pParent[i]=iclique?g.fstart[f]:i;
+        }
+    }
+
+    //link. Dense cells take far longer to search than sparse ones so cells are scheduled dynamically in small chunks.
+    //The position reached in the list for each offset is kept between consecutive cells and found again at the start of a chunk
+#ifdef USEOPENMP
+    Int_t chunksize=max((Int_t)1,ncoarse/(64*omp_get_max_threads()));
+#pragma omp parallel default(shared) if (nbodies>ompsearchnum)
+{
+#endif
+    Int_t jnext[13], sprev=-2, c, cn, j;
+    unsigned long long target;
+    bool iwrap, iskip;
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic,chunksize)
+#endif
+    for (Int_t s=0;s<ncoarse;s++) {
+        c=lorder[s];
+        if (s!=sprev+1) for (int o=0;o<noff;o++) jnext[o]=lower_bound(lkey,lkey+ncoarse,lkey[s]+koff[o])-lkey;
+        sprev=s;
+        //fine cells of the same cell
+        for (Int_t f1=cstart[c];f1<cstart[c+1];f1++) {
+            if (!iclique) {
+                for (Int_t i=g.fstart[f1];i<g.fstart[f1+1];i++)
+                    for (Int_t j2=i+1;j2<g.fstart[f1+1];j2++)
+                        if (FOFGridDistSqd(g.px,g.py,g.pz,i,j2,period)<fdist2) FOFUnion(g.pParent,i,j2);
+            }
+            for (Int_t f2=f1+1;f2<cstart[c+1];f2++) FOFGridLinkFineCells(g,f1,f2);
+        }
+        //neighbouring cells
+        for (int o=0;o<noff;o++) {
+            unsigned int y[3];
+            iwrap=iskip=false;
+            for (int k=0;k<3;k++) {
+                long long yy=(long long)(g.fx[3*cstart[c]+k]>>1)+off[o][k];
+                if (yy<0||yy>=nc[k]) {
+                    if (period>0) {yy=(yy<0)?yy+nc[k]:yy-nc[k];iwrap=true;}
+                    else {iskip=true;break;}
+                }
+                y[k]=yy;
+            }
+            if (iskip) continue;
+            if (!iwrap) {
+                target=lkey[s]+koff[o];
+                while (jnext[o]<ncoarse&&lkey[jnext[o]]<target) jnext[o]++;
+                j=jnext[o];
+            }
+            else {
+                target=((unsigned long long)y[0]*nc[1]+y[1])*nc[2]+y[2];
+                j=lower_bound(lkey,lkey+ncoarse,target)-lkey;
+            }
+            if (j==ncoarse||lkey[j]!=target) continue;
+            //with fewer than 3 cells in a periodic dimension a cell can be its own neighbour
+            cn=lorder[j];
+            if (cn==c) continue;
+            for (Int_t f1=cstart[c];f1<cstart[c+1];f1++)
+                for (Int_t f2=cstart[cn];f2<cstart[cn+1];f2++) FOFGridLinkFineCells(g,f1,f2);
+        }
+    }
+#ifdef USEOPENMP
+}
+#endif
+    delete[] lkey;
+    delete[] lorder;
+    delete[] cstart;
+    delete[] g.fstart;
+    delete[] g.fx;
+    delete[] g.px;
+    Int_tree_t *pParent=g.pParent;
+
+    //compress so every particle points to its root, then count the members of each set
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>ompsearchnum)
+#endif
+    for (Int_t i=0;i<nbodies;i++) __atomic_store_n(&pParent[i],FOFFindRoot(pParent,i),__ATOMIC_RELAXED);
+    Int_t *pRootGroup=new Int_t[nbodies];
+    for (Int_t i=0;i<nbodies;i++) pRootGroup[i]=0;
+    for (Int_t i=0;i<nbodies;i++) pRootGroup[pParent[i]]++;
+    //sets large enough to be groups are numbered in order of their roots and then ordered by size
+    Int_t *pLen=new Int_t[nbodies+1];
+    for (Int_t i=0;i<nbodies;i++) {
+        if (pParent[i]!=i) continue;
+        if (pRootGroup[i]>=minsize) {pLen[++numgroups]=pRootGroup[i];pRootGroup[i]=numgroups;}
+        else pRootGroup[i]=0;
+    }
+    Int_t *pRank=new Int_t[numgroups+1];
+    pRank[0]=0;
+    if (numgroups>0) {
+        PriorityQueue *pq=new PriorityQueue(numgroups);
+        for (Int_t i=1;i<=numgroups;i++) pq->Push(i,pLen[i]);
+        for (Int_t i=1;i<=numgroups;i++) {pRank[pq->TopQueue()]=i;pq->Pop();}
+        delete pq;
+    }
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>ompsearchnum)
+#endif
+    for (Int_t i=0;i<nbodies;i++) pfof[sortindex[i]]=pRank[pRootGroup[pParent[i]]];
+    delete[] pRank;
+    delete[] pLen;
+    delete[] pRootGroup;
+    delete[] pParent;
+    delete[] sortindex;
+    if (opt.iverbose) cout<<"Grid 3DFOF found "<<numgroups<<" groups in "<<MyGetTime()-time1<<endl;
+    return pfof;
+}
+
+//@}
@@ -102,7 +102,7 @@ void ReadData(Options &opt, vector<Particle> &Part, const Int_t nbodies, Particl
 //@{
 
 ///Read local velocity density
-void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part){
+void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *porder){
     Int_t tempi;
     Double_t tempd;
     fstream Fin;
@@ -133,6 +133,13 @@ void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle
         }
         for(Int_t i=0;i<nbodies;i++) {Fin>>tempd;Part[i].SetDensity(tempd);}
     }
+    //the file is in input order, so if particles have been reordered move the values to the particles they belong to
+    if (porder!=NULL) {
+        Double_t *den=new Double_t[nbodies];
+        for(Int_t i=0;i<nbodies;i++) den[i]=Part[i].GetDensity();
+        for(Int_t i=0;i<nbodies;i++) Part[i].SetDensity(den[porder[i]]);
+        delete[] den;
+    }
     cout<<"Done"<<endl;
     Fin.close();
 }
@@ -143,7 +150,7 @@ void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle
 //@{
 
 ///Writes local velocity density of each particle to a file
-void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part){
+void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *porder){
     fstream Fout;
     char fname[1000];
 #ifdef USEMPI
@@ -153,19 +160,24 @@ void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particl
     if(opt.smname==NULL) sprintf(fname,"%s.smdata",opt.outname);
     else sprintf(fname,"%s",opt.smname);
 #endif
+    //values are written in input order
+    Double_t *den=new Double_t[nbodies];
+    if (porder!=NULL) for(Int_t i=0;i<nbodies;i++) den[porder[i]]=Part[i].GetDensity();
+    else for(Int_t i=0;i<nbodies;i++) den[i]=Part[i].GetDensity();
     if (opt.ibinaryout==OUTBINARY) {
         Fout.open(fname,ios::out|ios::binary);
         Fout.write((char*)&nbodies,sizeof(Int_t));
         Double_t tempd;
-        for(Int_t i=0;i<nbodies;i++) {tempd=Part[i].GetDensity();Fout.write((char*)&tempd,sizeof(Double_t));}
+        for(Int_t i=0;i<nbodies;i++) {tempd=den[i];Fout.write((char*)&tempd,sizeof(Double_t));}
     }
     if (opt.ibinaryout==OUTBINARY) {
         Fout.open(fname,ios::out);
         Fout<<nbodies<<endl;
         Fout<<scientific<<setprecision(10);
-        for(Int_t i=0;i<nbodies;i++)Fout<<Part[i].GetDensity()<<endl;
+        for(Int_t i=0;i<nbodies;i++)Fout<<den[i]<<endl;
     }
     Fout.close();
+    delete[] den;
 }
 
 //@}
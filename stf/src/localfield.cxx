@@ -63,59 +63,74 @@ void GetVelocityDensity(Options &opt, const Int_t nbodies, Particle *Part, KDTre
 #endif
 
     time2=MyGetTime();
+    //particles are searched in batches of NNBATCHSIZE consecutive particles, which are close to each other in tree order,
+    //so that their nearest neighbours can be found together (see \ref NBody::KDTree::FindNearestBatch)
+    Int_t *batchids, nbatch, ib, nb, ii;
+    Double_t *xbatch;
+    PriorityQueue *pqn;
+    nbatch=(nbodies+NNBATCHSIZE-1)/NNBATCHSIZE;
     //In loop determine if particles NN search radius overlaps another mpi threads domain.
     //If not, then proceed as usually to determine velocity density.
     //If so, do not calculate local velocity density and set its velocity density to -1 as a flag
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,j,k,tid,id,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,pqx,pqv)
+private(i,j,k,tid,id,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,pqx,pqv,batchids,ib,nb,ii)
 {
 #endif
-    nnids=new Int_t[opt.Nsearch];
-    nnr2=new Double_t[opt.Nsearch];
+    nnids=new Int_t[opt.Nsearch*NNBATCHSIZE];
+    nnr2=new Double_t[opt.Nsearch*NNBATCHSIZE];
+    batchids=new Int_t[NNBATCHSIZE];
     weight=new Double_t[opt.Nvel];
     pqx=new PriorityQueue(opt.Nsearch);
     pqv=new PriorityQueue(opt.Nvel);
 #ifdef USEOPENMP
 #pragma omp for schedule(dynamic)
 #endif
-    for (i=0;i<nbodies;i++) {
+    for (ib=0;ib<nbatch;ib++) {
+        nb=0;
+        for (i=ib*NNBATCHSIZE;i<nbodies && i<(ib+1)*NNBATCHSIZE;i++) {
         //if strucden compile flag set then only calculate velocity density for particles in groups
 #ifdef STRUCDEN
-        if (Part[i].GetType()>0) {
+            if (Part[i].GetType()>0) batchids[nb++]=i;
+            else maxrdist[i]=0.0;
+#else
+            batchids[nb++]=i;
+#endif
+        }
+#ifdef STRUCDEN
         //if not searching all particles in FOF then also doing baryon search then just find nearest neighbours
-        if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) tree->FindNearest(i,nnids,nnr2,opt.Nsearch);
+        if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) tree->FindNearestBatch(nb,batchids,nnids,nnr2,opt.Nsearch,pqx);
         //otherwise distinction must be made so that only base calculation on dark matter particles
-        else tree->FindNearestCriterion(i,FOFPositivetypes,NULL,nnids,nnr2,opt.Nsearch);
+        else for (ii=0;ii<nb;ii++) tree->FindNearestCriterion(batchids[ii],FOFPositivetypes,NULL,&nnids[ii*opt.Nsearch],&nnr2[ii*opt.Nsearch],opt.Nsearch);
 #else
-        tree->FindNearest(i,nnids,nnr2,opt.Nsearch);
+        tree->FindNearestBatch(nb,batchids,nnids,nnr2,opt.Nsearch,pqx);
 #endif
-        //once NN set is found, store maxrdist and see if particle's search radius overlaps with another mpi domain
-        maxrdist[i]=sqrt(nnr2[opt.Nsearch-1]);
-        if (MPISearchForOverlap(Part[i],maxrdist[i])==0) {
-            for (j=0;j<opt.Nvel;j++) {
-                pqv->Push(-1, MAXVALUE);
-                weight[j]=1.0;
-            }
-            for (j=0;j<opt.Nsearch;j++) {
-                v2=0;
-                id=nnids[j];
-                for (k=0;k<3;k++) v2+=(Part[i].GetVelocity(k)-Part[id].GetVelocity(k))*(Part[i].GetVelocity(k)-Part[id].GetVelocity(k));
-                if (v2 < pqv->TopPriority()){
-                    pqv->Pop();
-                    pqv->Push(id, v2);
+        for (ii=0;ii<nb;ii++) {
+            i=batchids[ii];
+            //once NN set is found, store maxrdist and see if particle's search radius overlaps with another mpi domain
+            maxrdist[i]=sqrt(nnr2[ii*opt.Nsearch+opt.Nsearch-1]);
+            if (MPISearchForOverlap(Part[i],maxrdist[i])==0) {
+                for (j=0;j<opt.Nvel;j++) {
+                    pqv->Push(-1, MAXVALUE);
+                    weight[j]=1.0;
                 }
+                for (j=0;j<opt.Nsearch;j++) {
+                    v2=0;
+                    id=nnids[ii*opt.Nsearch+j];
+                    for (k=0;k<3;k++) v2+=(Part[i].GetVelocity(k)-Part[id].GetVelocity(k))*(Part[i].GetVelocity(k)-Part[id].GetVelocity(k));
+                    if (v2 < pqv->TopPriority()){
+                        pqv->Pop();
+                        pqv->Push(id, v2);
+                    }
+                }
+                Part[i].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv, weight));
             }
-            Part[i].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv, weight));
-        }
-        else Part[i].SetDensity(-1.0);
-#ifdef STRUCDEN
+            else Part[i].SetDensity(-1.0);
         }
-        else maxrdist[i]=0.0;
-#endif
     }
     delete[] nnids;
     delete[] nnr2;
+    delete[] batchids;
     delete[] weight;
     delete pqx;
     delete pqv;
@@ -144,61 +159,62 @@ private(i,j,k,tid,id,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,pqx,pqv
     //first build neighbouring tree
     KDTree *treeneighbours=NULL;
     if (nimport>0) treeneighbours=new KDTree(PartDataGet,nimport,1,tree->TPHYS,tree->KEPAN,100,0,0,0,period);
-    //then run search
+    //then run search, again in batches of the flagged particles of NNBATCHSIZE consecutive particles
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,j,k,tid,pid,pid2,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,pqx,pqv)
+private(i,j,k,tid,pid,pid2,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,pqx,pqv,batchids,xbatch,pqn,ib,nb,ii)
 {
 #endif
-    nnids=new Int_t[opt.Nsearch];
-    nnr2=new Double_t[opt.Nsearch];
-    nnidsneighbours=new Int_t[nimportsearch];
-    nnr2neighbours=new Double_t[nimportsearch];
+    nnids=new Int_t[opt.Nsearch*NNBATCHSIZE];
+    nnr2=new Double_t[opt.Nsearch*NNBATCHSIZE];
+    nnidsneighbours=new Int_t[nimportsearch*NNBATCHSIZE];
+    nnr2neighbours=new Double_t[nimportsearch*NNBATCHSIZE];
+    batchids=new Int_t[NNBATCHSIZE];
+    xbatch=new Double_t[3*NNBATCHSIZE];
     weight=new Double_t[opt.Nvel];
     pqx=new PriorityQueue(opt.Nsearch);
     pqv=new PriorityQueue(opt.Nvel);
+    pqn=new PriorityQueue(nimportsearch);
 #ifdef USEOPENMP
-#pragma omp for
+#pragma omp for schedule(dynamic)
 #endif
-    for (i=0;i<nbodies;i++) {
+    for (ib=0;ib<nbatch;ib++) {
+        nb=0;
+        for (i=ib*NNBATCHSIZE;i<nbodies && i<(ib+1)*NNBATCHSIZE;i++) {
 #ifdef STRUCDEN
-        if (Part[i].GetType()>0) {
+            if (Part[i].GetType()<=0) continue;
 #endif
-#ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
-#endif
-        pid=Part[i].GetID();
-        if (Part[i].GetDensity()==-1) {
-            //search trees
-
-            //if not searching all particles in FOF then also doing baryon search then just find nearest neighbours
-            if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) tree->FindNearest(i,nnids,nnr2,opt.Nsearch);
-            //otherwise distinction must be made so that only base calculation on dark matter particles
-            else tree->FindNearestCriterion(i,FOFPositivetypes,NULL,nnids,nnr2,opt.Nsearch);
+            if (Part[i].GetDensity()==-1) batchids[nb++]=i;
+        }
+        if (nb==0) continue;
+        //search trees
 
+        //if not searching all particles in FOF then also doing baryon search then just find nearest neighbours
+        if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) tree->FindNearestBatch(nb,batchids,nnids,nnr2,opt.Nsearch,pqx);
+        //otherwise distinction must be made so that only base calculation on dark matter particles
+        else for (ii=0;ii<nb;ii++) tree->FindNearestCriterion(batchids[ii],FOFPositivetypes,NULL,&nnids[ii*opt.Nsearch],&nnr2[ii*opt.Nsearch],opt.Nsearch);
+        //now search the export particle list
+        if (nimport>0) {
+            for (ii=0;ii<nb;ii++) for (k=0;k<3;k++) xbatch[ii*3+k]=Part[batchids[ii]].GetPosition(k);
+            treeneighbours->FindNearestBatch(nb,xbatch,nnidsneighbours,nnr2neighbours,nimportsearch,pqn);
+        }
+        for (ii=0;ii<nb;ii++) {
+            i=batchids[ii];
+            pid=Part[i].GetID();
             //fill priority queue, where queue value for neighbours is offset by local particle number
             for (j = 0; j <opt.Nsearch; j++) pqx->Push(-1, MAXVALUE);
             for (j=0;j<opt.Nsearch;j++) {
-                if (nnr2[j] < pqx->TopPriority()){
+                if (nnr2[ii*opt.Nsearch+j] < pqx->TopPriority()){
                     pqx->Pop();
-                    pqx->Push(nnids[j], nnr2[j]);
+                    pqx->Push(nnids[ii*opt.Nsearch+j], nnr2[ii*opt.Nsearch+j]);
                 }
             }
-            //now search the export particle list and fill appropriately
+            //and fill appropriately with the export particles
             if (nimport>0) {
-                /*if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) {
-                    Coordinate x(Part[i].GetPosition());
-                    treeneighbours->FindNearestPos(x,nnidsneighbours,nnr2neighbours,nimportsearch);
-                }
-                else treeneighbours->FindNearestCriterion(Part[i],FOFPositivetypes,NULL,nnidsneighbours,nnr2neighbours,nimportsearch);*/
-                Coordinate x(Part[i].GetPosition());
-                treeneighbours->FindNearestPos(x,nnidsneighbours,nnr2neighbours,nimportsearch);
                 for (j=0;j<nimportsearch;j++) {
-                    if (nnr2neighbours[j] < pqx->TopPriority()){
+                    if (nnr2neighbours[ii*nimportsearch+j] < pqx->TopPriority()){
                         pqx->Pop();
-                        pqx->Push(nnidsneighbours[j]+nbodies, nnr2neighbours[j]);
+                        pqx->Push(nnidsneighbours[ii*nimportsearch+j]+nbodies, nnr2neighbours[ii*nimportsearch+j]);
                     }
                 }
             }
@@ -225,17 +241,17 @@ private(i,j,k,tid,pid,pid2,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,p
             //and now calculate velocity density function
             Part[i].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv, weight));
         }
-#ifdef STRUCDEN
-        }
-#endif
     }
     delete[] nnids;
     delete[] nnr2;
     delete[] nnidsneighbours;
     delete[] nnr2neighbours;
+    delete[] batchids;
+    delete[] xbatch;
     delete[] weight;
     delete pqx;
     delete pqv;
+    delete pqn;
 #ifdef USEOPENMP
 }
 #endif
@@ -271,9 +287,20 @@ private(i,j,k,tid,pid,pid2,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,p
     Double_t *nnr2;
     Double_t *weight;
     PriorityQueue **pqx, **pqv;
+    //particles are processed in batches of NNBATCHSIZE consecutive particles, which are close to each other in tree order,
+    //so that their nearest neighbours can be found together. Each thread has its own set of buffers
+    Int_t *batchids, nbatch, ib, nb, nqbound;
+    Double_t *batchden, *vdist, *qbound;
+    int minbatch=minamount/NNBATCHSIZE+1;
+    nbatch=(nbodies+NNBATCHSIZE-1)/NNBATCHSIZE;
 
-    nnids=new Int_t[nthreads*opt.Nsearch];
-    nnr2=new Double_t[nthreads*opt.Nsearch];
+    nnids=new Int_t[nthreads*opt.Nsearch*NNBATCHSIZE];
+    nnr2=new Double_t[nthreads*opt.Nsearch*NNBATCHSIZE];
+    batchids=new Int_t[nthreads*NNBATCHSIZE];
+    batchden=new Double_t[nthreads*NNBATCHSIZE];
+    vdist=new Double_t[nthreads*opt.Nsearch];
+    nqbound=tree->GetRangeBoundSize(NNBATCHSIZE);
+    qbound=new Double_t[nthreads*nqbound];
     pqx=new PriorityQueue*[nthreads];
     pqv=new PriorityQueue*[nthreads];
     weight=new Double_t[nthreads*opt.Nvel];
@@ -284,40 +311,54 @@ private(i,j,k,tid,pid,pid2,v2,nnids,nnr2,nnidsneighbours,nnr2neighbours,weight,p
         pqv[j]=new PriorityQueue(opt.Nvel);
     }
 #pragma omp parallel default(shared) \
-private(i,tid)
+private(i,j,k,id,v2,tid,ib,nb)
 {
-#pragma omp for schedule(dynamic,minamount) nowait
-    for (i=0;i<nbodies;i++) {
+#pragma omp for schedule(dynamic,minbatch) nowait
+    for (ib=0;ib<nbatch;ib++) {
+        tid=omp_get_thread_num();
+        nb=0;
+        for (i=ib*NNBATCHSIZE;i<nbodies && i<(ib+1)*NNBATCHSIZE;i++) {
 #ifdef STRUCDEN
-        if (Part[i].GetType()>0) {
+            if (Part[i].GetType()<=0) continue;
 #endif
-        tid=omp_get_thread_num();
+            batchids[tid*NNBATCHSIZE+nb++]=i;
+        }
         //if not searching all particles in FOF then also doing baryon search then just find nearest neighbours
-        if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) Part[i].SetDensity(tree->CalcVelDensityParticle(i,opt.Nvel,opt.Nsearch,1,pqx[tid],pqv[tid],&nnids[tid*opt.Nsearch],&nnr2[tid*opt.Nsearch]));
+        if (!(opt.iBaryonSearch==1 && opt.partsearchtype==PSTALL)) {
+#ifdef STRUCDEN
+            tree->CalcVelDensityParticles(nb,&batchids[tid*NNBATCHSIZE],&batchden[tid*NNBATCHSIZE],opt.Nvel,opt.Nsearch,pqx[tid],pqv[tid],
+                &nnids[tid*opt.Nsearch*NNBATCHSIZE],&nnr2[tid*opt.Nsearch*NNBATCHSIZE],&vdist[tid*opt.Nsearch]);
+#else
+            //every particle in the batch is searched, so the batch is searched with the dual tree search
+            tree->CalcVelDensityRange(ib*NNBATCHSIZE,ib*NNBATCHSIZE+nb,&batchden[tid*NNBATCHSIZE],opt.Nvel,opt.Nsearch,pqv[tid],
+                &nnids[tid*opt.Nsearch*NNBATCHSIZE],&nnr2[tid*opt.Nsearch*NNBATCHSIZE],&vdist[tid*opt.Nsearch],&qbound[tid*nqbound]);
+#endif
+            for (j=0;j<nb;j++) Part[batchids[tid*NNBATCHSIZE+j]].SetDensity(batchden[tid*NNBATCHSIZE+j]);
+        }
         //otherwise distinction must be made so that only base calculation on dark matter particles
         else {
-            tree->FindNearestCriterion(i,FOFPositivetypes,NULL,&nnids[tid*opt.Nsearch],&nnr2[tid*opt.Nsearch],opt.Nsearch);
-            for (j=0;j<opt.Nvel;j++) {
-                pqv[tid]->Push(-1, MAXVALUE);
-                weight[j+tid*opt.Nvel]=1.0;
-            }
-            for (j=0;j<opt.Nsearch;j++) {
-                v2=0;
-                id=nnids[j+tid*opt.Nsearch];
-                for (k=0;k<3;k++) v2+=(Part[i].GetVelocity(k)-Part[id].GetVelocity(k))*(Part[i].GetVelocity(k)-Part[id].GetVelocity(k));
-                if (v2 < pqv[tid]->TopPriority()){
-                    pqv[tid]->Pop();
-                    pqv[tid]->Push(id, v2);
+            for (Int_t ii=0;ii<nb;ii++) {
+                i=batchids[tid*NNBATCHSIZE+ii];
+                tree->FindNearestCriterion(i,FOFPositivetypes,NULL,&nnids[tid*opt.Nsearch],&nnr2[tid*opt.Nsearch],opt.Nsearch);
+                for (j=0;j<opt.Nvel;j++) {
+                    pqv[tid]->Push(-1, MAXVALUE);
+                    weight[j+tid*opt.Nvel]=1.0;
                 }
+                for (j=0;j<opt.Nsearch;j++) {
+                    v2=0;
+                    id=nnids[j+tid*opt.Nsearch];
+                    for (k=0;k<3;k++) v2+=(Part[i].GetVelocity(k)-Part[id].GetVelocity(k))*(Part[i].GetVelocity(k)-Part[id].GetVelocity(k));
+                    if (v2 < pqv[tid]->TopPriority()){
+                        pqv[tid]->Pop();
+                        pqv[tid]->Push(id, v2);
+                    }
+                }
+                Part[i].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv[tid], &weight[tid*opt.Nvel]));
             }
-            Part[i].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv[tid], &weight[tid*opt.Nvel]));
         }
 
-        fracdone[tid]++;
+        fracdone[tid]+=nb;
         if (opt.iverbose) if (fracdone[tid]>fraclim[tid]) {printf("Task %d done %e of its share \n",tid,fracdone[tid]/((double)nbodies/(double)nthreads));fraclim[tid]+=addamount;}
-#ifdef STRUCDEN
-        }
-#endif
     }
 }
 #endif
@@ -331,6 +372,11 @@ private(i,tid)
     }
     delete[] nnids;
     delete[] nnr2;
+    delete[] batchids;
+    delete[] batchden;
+    delete[] vdist;
+    delete[] qbound;
+    delete[] weight;
     delete[] pqx;
     delete[] pqv;
     delete[] fracdone;
@@ -356,9 +402,19 @@ private(i,tid)
     Int_t *nnids;
     Double_t *nnr2;
     PriorityQueue **pqx, **pqv;
+    //particles are processed in batches of consecutive particles as above, all of which are searched with the dual tree search
+    Int_t *batchids, nbatch, ib, nb, nqbound;
+    Double_t *batchden, *vdist, *qbound;
+    int minbatch=minamount/NNBATCHSIZE+1;
+    nbatch=(nbodies+NNBATCHSIZE-1)/NNBATCHSIZE;
 
-    nnids=new Int_t[nthreads*opt.Nsearch];
-    nnr2=new Double_t[nthreads*opt.Nsearch];
+    nnids=new Int_t[nthreads*opt.Nsearch*NNBATCHSIZE];
+    nnr2=new Double_t[nthreads*opt.Nsearch*NNBATCHSIZE];
+    batchids=new Int_t[nthreads*NNBATCHSIZE];
+    batchden=new Double_t[nthreads*NNBATCHSIZE];
+    vdist=new Double_t[nthreads*opt.Nsearch];
+    nqbound=tree->GetRangeBoundSize(NNBATCHSIZE);
+    qbound=new Double_t[nthreads*nqbound];
     pqx=new PriorityQueue*[nthreads];
     pqv=new PriorityQueue*[nthreads];
     for (j=0;j<nthreads;j++) {
@@ -369,18 +425,22 @@ private(i,tid)
     }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,tid)
+private(i,j,tid,ib,nb)
 {
-#pragma omp for schedule(dynamic,minamount) nowait
+#pragma omp for schedule(dynamic,minbatch) nowait
 #endif
-    for (i=0;i<nbodies;i++) {
+    for (ib=0;ib<nbatch;ib++) {
 #ifdef USEOPENMP
         tid=omp_get_thread_num();
 #else
         tid=0;
 #endif
-        Part[i].SetDensity(tree->CalcVelDensityParticle(i,opt.Nvel,opt.Nsearch,1,pqx[tid],pqv[tid],&nnids[tid*opt.Nsearch],&nnr2[tid*opt.Nsearch]));
-        fracdone[tid]++;
+        nb=0;
+        for (i=ib*NNBATCHSIZE;i<nbodies && i<(ib+1)*NNBATCHSIZE;i++) batchids[tid*NNBATCHSIZE+nb++]=i;
+        tree->CalcVelDensityRange(ib*NNBATCHSIZE,ib*NNBATCHSIZE+nb,&batchden[tid*NNBATCHSIZE],opt.Nvel,opt.Nsearch,pqv[tid],
+            &nnids[tid*opt.Nsearch*NNBATCHSIZE],&nnr2[tid*opt.Nsearch*NNBATCHSIZE],&vdist[tid*opt.Nsearch],&qbound[tid*nqbound]);
+        for (j=0;j<nb;j++) Part[batchids[tid*NNBATCHSIZE+j]].SetDensity(batchden[tid*NNBATCHSIZE+j]);
+        fracdone[tid]+=nb;
         if (opt.iverbose) if (fracdone[tid]>fraclim[tid]) {printf("Task %d done %e of its share \n",tid,fracdone[tid]/((double)nbodies/(double)nthreads));fraclim[tid]+=addamount;}
     }
 #ifdef USEOPENMP
@@ -394,6 +454,10 @@ private(i,tid)
     }
     delete[] nnids;
     delete[] nnr2;
+    delete[] batchids;
+    delete[] batchden;
+    delete[] vdist;
+    delete[] qbound;
     delete[] pqx;
     delete[] pqv;
     delete[] fracdone;
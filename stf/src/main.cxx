@@ -241,6 +241,25 @@ int main(int argc,char **argv)
     cout<<"TIME::"<<ThisTask<<" took "<<time1<<" to load "<<nbodies<<endl;
 #endif
 
+    //reorder particles along a space filling curve so that particles close in space are close in memory. The input order
+    //is kept in pinputorder so that particles can be returned to this order before any output is written. With mpi, particles
+    //are only reordered within the local domain (and baryons stored separately are not reordered)
+    Int_t *pinputorder=NULL;
+    if (opt.iparticlereorder!=PREORDERNONE) {
+        time1=MyGetTime();
+#ifndef USEMPI
+        if (Pbaryons!=NULL && nbaryons>0) {
+            pinputorder=new Int_t[nbodies+nbaryons];
+            ReorderParticlesSFC(opt,nbaryons,Pbaryons,&pinputorder[nbodies],nbodies);
+        }
+        else
+#endif
+        pinputorder=new Int_t[nbodies];
+        ReorderParticlesSFC(opt,nbodies,Part.data(),pinputorder);
+        time1=MyGetTime()-time1;
+        cout<<"TIME::"<<ThisTask<<" took "<<time1<<" to reorder "<<nbodies<<" particles along a space filling curve"<<endl;
+    }
+
     //write out the configuration used by velociraptor having read in the data (as input data can contain cosmological information)
     WriteVELOCIraptorConfig(opt);
     WriteSimulationInfo(opt);
@@ -260,10 +279,10 @@ int main(int argc,char **argv)
 #else
     if (opt.iSubSearch==1) {
         time1=MyGetTime();
-        if(FileExists(fname4)) ReadLocalVelocityDensity(opt, nbodies,Part);
+        if(FileExists(fname4)) ReadLocalVelocityDensity(opt, nbodies,Part,pinputorder);
         else  {
             GetVelocityDensity(opt, nbodies, Part);
-            WriteLocalVelocityDensity(opt, nbodies,Part);
+            WriteLocalVelocityDensity(opt, nbodies,Part,pinputorder);
         }
         time1=MyGetTime()-time1;
         cout<<"TIME::"<<ThisTask<<" took "<<time1<<" to analyze/read local velocity density for "<<Nlocal<<" with "<<nthreads<<endl;
@@ -273,6 +292,9 @@ int main(int argc,char **argv)
     //here adjust Efrac to Omega_cdm/Omega_m from what it was before if baryonic search is separate
     if (opt.iBaryonSearch>0 && opt.partsearchtype!=PSTALL) opt.uinfo.Eratio*=opt.Omega_cdm/opt.Omega_m;
 
+    //potentials calculated when unbinding are kept to be reused when calculating binding energies
+    if (opt.uinfo.unbindflag && opt.uinfo.icachepot) potcache=new PotentialCache;
+
     //From here can either search entire particle array for "Halos" or if a single halo is loaded, then can just search for substructure
     if (!opt.iSingleHalo) {
 #ifndef USEMPI
@@ -424,6 +446,16 @@ int main(int argc,char **argv)
         Nlocal=nbodies;
     }
 
+    //return particles to input order so that output does not depend on the reordering. With mpi, particles have since been
+    //exchanged between domains so their order no longer corresponds to the input order anyway
+    if (pinputorder!=NULL) {
+#ifndef USEMPI
+        RestoreParticleOrder(nbodies,Part.data(),pinputorder,pfof);
+#endif
+        delete[] pinputorder;
+        pinputorder=NULL;
+    }
+
     //output results
     //if want to ignore any information regard particles themselves as particle PIDS are meaningless
     //which might be useful for runs where not interested in tracking just halo catalogues (save for
@@ -434,6 +466,7 @@ int main(int argc,char **argv)
         WriteProperties(opt,ngroup,pdata);
         delete[] numingroup;
         delete[] pdata;
+        FreePotentialCache(opt);
         //delete[] Part;
 #ifdef USEMPI
 #ifdef USEADIOS
@@ -518,6 +551,7 @@ int main(int argc,char **argv)
 #ifdef EXTENDEDHALOOUTPUT
     if (opt.iExtendedOutput) WriteExtendedOutput (opt, ngroup, nbodies, pdata, Part, pfof);
 #endif
+    FreePotentialCache(opt);
 
     delete[] numingroup;
     delete[] pdata;
@@ -2343,6 +2343,294 @@ void MPIBuildGridData(const Int_t ngrid, GridCell *grid, Coordinate *gvel, Matri
 }
 //@}
 
+/// \name Routines that divide the unbinding of a group between mpi tasks, see \ref MPIUnbindGroup
+/// The task that holds the group is the root of the communicator and divides its particles between the tasks, which then unbind them together.
+//@{
+///start sending nbytes of data to task dest of comm in chunks of at most \ref LOCAL_MAX_MSGSIZE bytes, adding the requests to req
+static void MPIUnbindIsend(const void *data, size_t nbytes, int dest, int tag, MPI_Comm comm, vector<MPI_Request> &req)
+{
+    const char *p=(const char*)data;
+    size_t chunk;
+    while (nbytes>0) {
+        chunk=min(nbytes,(size_t)LOCAL_MAX_MSGSIZE);
+        req.push_back(MPI_REQUEST_NULL);
+        MPI_Isend(p,chunk,MPI_BYTE,dest,tag,comm,&req.back());
+        p+=chunk;
+        nbytes-=chunk;
+    }
+}
+
+///start receiving nbytes of data sent by \ref MPIUnbindIsend from task source of comm, adding the requests to req
+static void MPIUnbindIrecv(void *data, size_t nbytes, int source, int tag, MPI_Comm comm, vector<MPI_Request> &req)
+{
+    char *p=(char*)data;
+    size_t chunk;
+    while (nbytes>0) {
+        chunk=min(nbytes,(size_t)LOCAL_MAX_MSGSIZE);
+        req.push_back(MPI_REQUEST_NULL);
+        MPI_Irecv(p,chunk,MPI_BYTE,source,tag,comm,&req.back());
+        p+=chunk;
+        nbytes-=chunk;
+    }
+}
+
+static void MPIUnbindWaitall(vector<MPI_Request> &req)
+{
+    if (req.size()>0) MPI_Waitall(req.size(),req.data(),MPI_STATUSES_IGNORE);
+    req.clear();
+}
+
+///divide the particles idx[start,end) of Part into npieces of equal number by recursive bisection along the longest side of their bounding box, storing the start of each piece in offset
+static void MPISplitGroup(Particle *Part, Int_t *idx, const Int_t start, const Int_t end, const int ifirst, const int npieces, Int_t *offset)
+{
+    if (npieces==1) {offset[ifirst]=start;return;}
+    Double_t xmin[3],xmax[3];
+    int isplit=0, nleft=npieces/2;
+    Int_t mid=start+(end-start)*nleft/npieces;
+    for (int k=0;k<3;k++) xmin[k]=xmax[k]=(end>start)?Part[idx[start]].GetPosition(k):0;
+    for (Int_t j=start;j<end;j++) for (int k=0;k<3;k++) {
+        if (Part[idx[j]].GetPosition(k)<xmin[k]) xmin[k]=Part[idx[j]].GetPosition(k);
+        if (Part[idx[j]].GetPosition(k)>xmax[k]) xmax[k]=Part[idx[j]].GetPosition(k);
+    }
+    for (int k=1;k<3;k++) if (xmax[k]-xmin[k]>xmax[isplit]-xmin[isplit]) isplit=k;
+    nth_element(&idx[start],&idx[mid],&idx[end],[Part,isplit](const Int_t a, const Int_t b){return Part[a].GetPosition(isplit)<Part[b].GetPosition(isplit);});
+    MPISplitGroup(Part,idx,start,mid,ifirst,nleft,offset);
+    MPISplitGroup(Part,idx,mid,end,ifirst+nleft,npieces-nleft,offset);
+}
+
+/*!
+    Divide the nig particles of a group held by the root of comm between its tasks, each receiving a spatially compact piece (see \ref MPISplitGroup)
+    in Plocal and the index of each particle in Part in orig, which are allocated here. Part is left unchanged. Returns the number of local particles.
+*/
+Int_t MPIDistributeGroup(MPI_Comm comm, const Int_t nig, Particle *Part, Particle *&Plocal, Int_t *&orig)
+{
+    int rank, size;
+    Int_t nlocal, *idx=NULL, *offset=NULL;
+    vector<Int_t> counts;
+    vector<MPI_Request> req;
+    MPI_Comm_rank(comm,&rank);
+    MPI_Comm_size(comm,&size);
+    if (rank==0) {
+        idx=new Int_t[nig];
+        offset=new Int_t[size+1];
+        for (Int_t j=0;j<nig;j++) idx[j]=j;
+        MPISplitGroup(Part,idx,0,nig,0,size,offset);
+        offset[size]=nig;
+        counts.resize(size);
+        for (int itask=0;itask<size;itask++) counts[itask]=offset[itask+1]-offset[itask];
+    }
+    MPI_Scatter(counts.data(),1,MPI_Int_t,&nlocal,1,MPI_Int_t,0,comm);
+    Plocal=new Particle[nlocal];
+    orig=new Int_t[nlocal];
+    if (rank==0) {
+        //send one piece at a time so the buffers are no larger than a piece
+        for (int itask=1;itask<size;itask++) {
+            Particle *Pbuf=new Particle[counts[itask]];
+            for (Int_t j=0;j<counts[itask];j++) Pbuf[j]=Part[idx[offset[itask]+j]];
+            MPIUnbindIsend(Pbuf,counts[itask]*sizeof(Particle),itask,TAG_UNBIND_A,comm,req);
+            MPIUnbindIsend(&idx[offset[itask]],counts[itask]*sizeof(Int_t),itask,TAG_UNBIND_B,comm,req);
+            MPIUnbindWaitall(req);
+            delete[] Pbuf;
+        }
+        for (Int_t j=0;j<nlocal;j++) {Plocal[j]=Part[idx[j]];orig[j]=idx[j];}
+        delete[] idx;
+        delete[] offset;
+    }
+    else {
+        MPIUnbindIrecv(Plocal,nlocal*sizeof(Particle),0,TAG_UNBIND_A,comm,req);
+        MPIUnbindIrecv(orig,nlocal*sizeof(Int_t),0,TAG_UNBIND_B,comm,req);
+        MPIUnbindWaitall(req);
+    }
+    return nlocal;
+}
+
+/*!
+    Collect the particles divided between the tasks of comm by \ref MPIDistributeGroup on its root, in Pall, along with the nidx indices of each particle in idxlocal,
+    such as its index in the group before it was divided, in idx. Pall and idx are allocated on the root. Returns the total number of particles on the root.
+*/
+Int_t MPIGatherGroup(MPI_Comm comm, const Int_t nlocal, Particle *Plocal, const int nidx, Int_t *idxlocal, Particle *&Pall, Int_t *&idx)
+{
+    int rank, size;
+    Int_t ntot=0, noffset;
+    vector<Int_t> counts;
+    vector<MPI_Request> req;
+    MPI_Comm_rank(comm,&rank);
+    MPI_Comm_size(comm,&size);
+    if (rank==0) counts.resize(size);
+    MPI_Gather(&nlocal,1,MPI_Int_t,counts.data(),1,MPI_Int_t,0,comm);
+    if (rank==0) {
+        for (int itask=0;itask<size;itask++) ntot+=counts[itask];
+        Pall=new Particle[ntot];
+        idx=new Int_t[nidx*ntot];
+        for (Int_t j=0;j<nlocal;j++) Pall[j]=Plocal[j];
+        for (Int_t j=0;j<nidx*nlocal;j++) idx[j]=idxlocal[j];
+        noffset=nlocal;
+        for (int itask=1;itask<size;itask++) {
+            MPIUnbindIrecv(&Pall[noffset],counts[itask]*sizeof(Particle),itask,TAG_UNBIND_A,comm,req);
+            MPIUnbindIrecv(&idx[nidx*noffset],nidx*counts[itask]*sizeof(Int_t),itask,TAG_UNBIND_B,comm,req);
+            noffset+=counts[itask];
+        }
+    }
+    else {
+        MPIUnbindIsend(Plocal,nlocal*sizeof(Particle),0,TAG_UNBIND_A,comm,req);
+        MPIUnbindIsend(idxlocal,nidx*nlocal*sizeof(Int_t),0,TAG_UNBIND_B,comm,req);
+    }
+    MPIUnbindWaitall(req);
+    return ntot;
+}
+
+/*!
+    Exchange the trees of the particles of a group divided between the tasks of comm. Each task copies the part of its tree gt (of nbodies particles)
+    needed for the field in the bounding box of each other task's tree (see \ref NBody::GravityTreeGetLET) and sends it, so only the top cells of distant
+    trees and the particles near the boundaries are exchanged. The tasks are paired in turn, so only one outgoing copy is held at a time.
+    Returns the received trees, indexed by task, those of tasks without particles and of this task having no cells.
+*/
+GravityTree *MPIExchangeLET(MPI_Comm comm, GravityTree &gt, const Int_t nbodies)
+{
+    int rank, size, dest, source;
+    Int_t header[2], recvheader[2];
+    Double_t bnd[6];
+    vector<Double_t> allbnd;
+    vector<Int_t> allnbodies;
+    vector<MPI_Request> req;
+    GravityTree *let, out;
+    MPI_Comm_rank(comm,&rank);
+    MPI_Comm_size(comm,&size);
+    allbnd.resize(6*size);
+    allnbodies.resize(size);
+    for (int k=0;k<3;k++) {bnd[2*k]=(nbodies>0)?gt.nodes[0].bnd[k][0]:0;bnd[2*k+1]=(nbodies>0)?gt.nodes[0].bnd[k][1]:0;}
+    MPI_Allgather(bnd,6,MPI_Real_t,allbnd.data(),6,MPI_Real_t,comm);
+    MPI_Allgather(&nbodies,1,MPI_Int_t,allnbodies.data(),1,MPI_Int_t,comm);
+    let=new GravityTree[size];
+    for (int itask=0;itask<size;itask++) let[itask].ncell=let[itask].nbodies=0;
+    for (int ishift=1;ishift<size;ishift++) {
+        dest=(rank+ishift)%size;
+        source=(rank-ishift+size)%size;
+        header[0]=header[1]=0;
+        if (nbodies>0 && allnbodies[dest]>0) {
+            Double_t destbnd[3][2];
+            for (int k=0;k<3;k++) {destbnd[k][0]=allbnd[6*dest+2*k];destbnd[k][1]=allbnd[6*dest+2*k+1];}
+            GravityTreeGetLET(gt,destbnd,out);
+            header[0]=out.ncell;header[1]=out.nbodies;
+        }
+        MPI_Sendrecv(header,2,MPI_Int_t,dest,TAG_UNBIND_C,recvheader,2,MPI_Int_t,source,TAG_UNBIND_C,comm,MPI_STATUS_IGNORE);
+        if (recvheader[0]>0) {
+            GravityTreeAllocate(let[source],recvheader[1],recvheader[0],0,0,1);
+            let[source].theta2=gt.theta2;
+            let[source].eps2=gt.eps2;
+            MPIUnbindIrecv(let[source].nodes,recvheader[0]*sizeof(GravityNode),source,TAG_UNBIND_A,comm,req);
+            MPIUnbindIrecv(let[source].cells,recvheader[0]*sizeof(GravityCell),source,TAG_UNBIND_B,comm,req);
+            MPIUnbindIrecv(let[source].px,recvheader[1]*sizeof(Double_t),source,TAG_UNBIND_C,comm,req);
+            MPIUnbindIrecv(let[source].py,recvheader[1]*sizeof(Double_t),source,TAG_UNBIND_C,comm,req);
+            MPIUnbindIrecv(let[source].pz,recvheader[1]*sizeof(Double_t),source,TAG_UNBIND_C,comm,req);
+            MPIUnbindIrecv(let[source].pm,recvheader[1]*sizeof(Double_t),source,TAG_UNBIND_C,comm,req);
+        }
+        if (header[0]>0) {
+            MPIUnbindIsend(out.nodes,header[0]*sizeof(GravityNode),dest,TAG_UNBIND_A,comm,req);
+            MPIUnbindIsend(out.cells,header[0]*sizeof(GravityCell),dest,TAG_UNBIND_B,comm,req);
+            MPIUnbindIsend(out.px,header[1]*sizeof(Double_t),dest,TAG_UNBIND_C,comm,req);
+            MPIUnbindIsend(out.py,header[1]*sizeof(Double_t),dest,TAG_UNBIND_C,comm,req);
+            MPIUnbindIsend(out.pz,header[1]*sizeof(Double_t),dest,TAG_UNBIND_C,comm,req);
+            MPIUnbindIsend(out.pm,header[1]*sizeof(Double_t),dest,TAG_UNBIND_C,comm,req);
+        }
+        MPIUnbindWaitall(req);
+        if (recvheader[0]>0) let[source].mtot=let[source].cells[0].mass;
+        if (header[0]>0) GravityTreeFree(out);
+    }
+    return let;
+}
+
+/*!
+    Collect on every task of comm the nlocal particles Plocal of each task, such as the particles removed from a group divided between them, in Pall,
+    along with an index of each particle in ilocal in iall, both allocated here. The particles are in task order. Returns the total number.
+*/
+Int_t MPIAllgatherParticles(MPI_Comm comm, const Int_t nlocal, Particle *Plocal, Int_t *ilocal, Particle *&Pall, Int_t *&iall)
+{
+    int size;
+    Int_t ntot=0;
+    vector<Int_t> counts;
+    vector<int> bytes, ibytes, displs, idispls;
+    MPI_Comm_size(comm,&size);
+    counts.resize(size);
+    bytes.resize(size);
+    ibytes.resize(size);
+    displs.resize(size);
+    idispls.resize(size);
+    MPI_Allgather(&nlocal,1,MPI_Int_t,counts.data(),1,MPI_Int_t,comm);
+    for (int itask=0;itask<size;itask++) {
+        bytes[itask]=counts[itask]*sizeof(Particle);
+        displs[itask]=ntot*sizeof(Particle);
+        ibytes[itask]=counts[itask]*sizeof(Int_t);
+        idispls[itask]=ntot*sizeof(Int_t);
+        ntot+=counts[itask];
+    }
+    Pall=new Particle[ntot];
+    iall=new Int_t[ntot];
+    MPI_Allgatherv(Plocal,nlocal*sizeof(Particle),MPI_BYTE,Pall,bytes.data(),displs.data(),MPI_BYTE,comm);
+    MPI_Allgatherv(ilocal,nlocal*sizeof(Int_t),MPI_BYTE,iall,ibytes.data(),idispls.data(),MPI_BYTE,comm);
+    return ntot;
+}
+
+///map a value to an integer key with the same ordering, so the keys can be bisected exactly
+static inline long long MPISelectKey(const double x)
+{
+    long long b;
+    memcpy(&b,&x,sizeof(b));
+    return (b>=0)?b:(b^0x7fffffffffffffffLL);
+}
+
+/*!
+    Select the k largest of the values val of all the tasks of comm, storing the local indices of those selected on this task in sel, which must hold min(n,k) entries,
+    and returning their number. Each task keeps its own k largest values as candidates and the k-th largest value over all tasks is found by bisecting the values,
+    counting the candidates above a trial value with a reduction, so only a few numbers are communicated per step. Equal values at the threshold are taken
+    in task order and then in index order, so the selection does not depend on how values are ordered within a task.
+*/
+Int_t MPISelectLargest(MPI_Comm comm, const Int_t n, const Double_t *val, const Int_t k, Int_t *sel)
+{
+    int rank, size;
+    Int_t ncand, ntot, count, ngreater, nties, nabove, nprior=0;
+    long long keymin, keymax, lo, hi, mid;
+    vector<pair<long long,Int_t> > cand(n);
+    vector<Int_t> allties;
+    auto keycmp=[](const pair<long long,Int_t> &a, const pair<long long,Int_t> &b){return (a.first>b.first)||(a.first==b.first&&a.second<b.second);};
+    MPI_Comm_rank(comm,&rank);
+    MPI_Comm_size(comm,&size);
+    MPI_Allreduce(&n,&ntot,1,MPI_Int_t,MPI_SUM,comm);
+    if (k<=0) return 0;
+    if (ntot<=k) {
+        for (Int_t j=0;j<n;j++) sel[j]=j;
+        return n;
+    }
+    //candidates ordered by decreasing value and then increasing index
+    for (Int_t j=0;j<n;j++) cand[j]=make_pair(MPISelectKey(val[j]),j);
+    ncand=min(n,k);
+    if (ncand<n) nth_element(cand.begin(),cand.begin()+ncand,cand.end(),keycmp);
+    cand.resize(ncand);
+    sort(cand.begin(),cand.end(),keycmp);
+    //the largest key with at least k values at or above it
+    keymin=(ncand>0)?cand[ncand-1].first:numeric_limits<long long>::max();
+    keymax=(ncand>0)?cand[0].first:numeric_limits<long long>::min();
+    MPI_Allreduce(&keymin,&lo,1,MPI_LONG_LONG,MPI_MIN,comm);
+    MPI_Allreduce(&keymax,&hi,1,MPI_LONG_LONG,MPI_MAX,comm);
+    while (lo<hi) {
+        mid=lo+(long long)(((unsigned long long)hi-(unsigned long long)lo+1ULL)/2ULL);
+        count=partition_point(cand.begin(),cand.end(),[mid](const pair<long long,Int_t> &a){return a.first>=mid;})-cand.begin();
+        MPI_Allreduce(MPI_IN_PLACE,&count,1,MPI_Int_t,MPI_SUM,comm);
+        if (count>=k) lo=mid;
+        else hi=mid-1;
+    }
+    ngreater=partition_point(cand.begin(),cand.end(),[lo](const pair<long long,Int_t> &a){return a.first>lo;})-cand.begin();
+    nties=partition_point(cand.begin(),cand.end(),[lo](const pair<long long,Int_t> &a){return a.first>=lo;})-cand.begin()-ngreater;
+    MPI_Allreduce(&ngreater,&nabove,1,MPI_Int_t,MPI_SUM,comm);
+    allties.resize(size);
+    MPI_Allgather(&nties,1,MPI_Int_t,allties.data(),1,MPI_Int_t,comm);
+    for (int itask=0;itask<rank;itask++) nprior+=allties[itask];
+    nties=max((Int_t)0,min(nties,k-nabove-nprior));
+    for (Int_t j=0;j<ngreater+nties;j++) sel[j]=cand[j].second;
+    return ngreater+nties;
+}
+//@}
+
 /// \name comparison functions used to assign particles to a specific mpi thread
 //@{
 ///comprasion function used to sort particles for export so that all particles being exported to the same processor are in a contiguous block and well ordered
@@ -43,6 +43,8 @@ GridCell *mpi_grid;
 Coordinate *mpi_gvel;
 Matrix *mpi_gveldisp;
 
+int mpi_icollectiveunbind=0;
+
 //@}
 
 
@@ -90,6 +90,11 @@ typedef short short_mpi_t;
 #define TAG_GRID_B 31
 #define TAG_GRID_C 32
 
+///flags for unbinding a group divided between tasks
+#define TAG_UNBIND_A 40
+#define TAG_UNBIND_B 41
+#define TAG_UNBIND_C 42
+
 ///flags for Extended output exchange
 #define TAG_EXTENDED_A 100
 #define TAG_EXTENDED_B 200
@@ -195,5 +200,11 @@ extern Int_t MinNumMPI,MinNumOld;
 
 //@}
 
+/// \name for mpi unbinding
+//@{
+///set while all tasks unbind their groups together, so that the largest groups can be divided between tasks, see \ref MPIUnbindLargeGroups
+extern int mpi_icollectiveunbind;
+//@}
+
 
 #endif
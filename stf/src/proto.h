@@ -52,9 +52,9 @@ void ReadRamses(Options &opt, vector<Particle> &Part, const Int_t nbodies,Partic
 void ReadNchilada(Options &opt, vector<Particle> &Part, const Int_t nbodies,Particle *&Pbaryons, Int_t nbaryons=0);
 
 ///Read local velocity density
-void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part);
+void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *porder=NULL);
 ///Writes local velocity density of each particle to a file
-void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part);
+void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *porder=NULL);
 
 
 ///Writes a tipsy formatted fof.grpfile
@@ -121,6 +121,8 @@ void WriteExtendedOutput (Options &opt, Int_t numgroups, Int_t nbodies, PropData
 KDTree* InitializeTreeGrid(Options &opt, const Int_t nbodies, Particle *Part);
 ///Fill cells of grid from tree
 void FillTreeGrid(Options &opt, const Int_t nbodies, const Int_t ngrid, KDTree *&tree, Particle *Part, GridCell* &grid);
+///Allocate and fill cells of grid from the coarse nodes of an existing physical tree, leaving the tree intact
+void FillTreeGridFromTree(Options &opt, const Int_t nbodies, Int_t &ngrid, KDTree *tree, Particle *Part, GridCell* &grid);
 
 //@}
 
@@ -175,7 +177,7 @@ Int_t GetOutliersValues(Options &opt, const Int_t nbodies, Particle *Part, int s
 ///Search full system without finding outliers first
 Int_t *SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t &numgroups);
 ///Search the outliers
-Int_t *SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t sublevel=0, Int_t *pnumcores=NULL);
+Int_t *SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t sublevel=0, Int_t *pnumcores=NULL, KDTree *subsettree=NULL);
 ///Search for subsubstructures
 void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubset, Int_t *&pfof, Int_t &ngroup, Int_t &nhalos, PropData *pdata=NULL);
 ///Given a set of tagged core particles, assign surroundings
@@ -193,6 +195,13 @@ void CopyHierarchy(Options &opt, PropData *pdata,Int_t ngroups, Int_t *nsub, Int
 void AdjustStructureForPeriod(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t numgroups, Int_t *pfof);
 //@}
 
+/// \name Cell-linked-list FOF search
+/// see \ref gridfof.cxx for implementation
+//@{
+///3DFOF search with a single linking length using a uniform grid of cells instead of a tree
+Int_t *SearchFOFGrid(Options &opt, const Int_t nbodies, Particle *Part, Double_t fdist, Int_t &numgroups, Int_t minsize);
+//@}
+
 /// \name Extra routines used in iterative search
 //@{
 
@@ -231,16 +240,26 @@ inline Int_t MergeHaloGroups(Options &opt, Particle *Partsubset, Int_t numgroups
 /// see \ref unbind.cxx for implementation
 //@{
 
-///used for tree potential calculation (which is only used for large groups)
-void GetNodeList(Node *np, Int_t &ncell, Node **nodelist, const Int_t bsize);
-///used for tree walk in potential calculation
-inline void MarkCell(Node *np, Int_t *marktreecell, Int_t *markleafcell, Int_t &ntreecell, Int_t &nleafcell, const Int_t bsize, Double_t *cR2max, Coordinate *cm, Double_t *cmtot, Coordinate xpos, Double_t eps2);
+///direct summation of the potential used for small groups
+void DirectPotential(Options &opt, const Int_t nbodies, Particle *Part);
+///tree gravity with quadrupole moments and a dual tree walk used for the potential of large groups, returns the bound on the relative error
+Double_t TreePotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *potV=NULL);
+///store the potentials of a group calculated when unbinding
+void StorePotentialCache(Options &opt, const Int_t nbodies, Particle *Part, const Double_t potscale);
+///set the potentials of a group from those cached when unbinding, returns 0 if they must be recalculated
+int GetPotentialCache(Options &opt, const Int_t nbodies, Particle *Part);
+///free the cache of potentials
+void FreePotentialCache(Options &opt);
+///reference frame at the minimum of the potential of a group, see \ref UnbindInfo.cmvelreftype
+void GetPotentialMinimumFrame(Options &opt, const Int_t nbodies, Particle *Part, Coordinate &potpos, Coordinate &potvel, const int iparallel);
 
 ///Interface for unbinding proceedure
 int CheckUnboundGroups(Options opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup=NULL, Int_t **pglist=NULL,int ireorder=1, Int_t *groupflag=NULL);
 ///check if group self-bound
 int Unbind(Options &opt, Particle **gPartList, Int_t &numgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, int ireorder=1);
 int Unbind(Options &opt, Particle *Part, Int_t &numgroups, Int_t *&numingroup, Int_t *&noffset, Int_t *&pfof);
+///unbind a single group whose potential has been calculated, returns the number of removal iterations
+int UnbindGroup(Options &opt, Int_t &nig, Particle *Part, Int_t *pglist, Int_t *pfof, Coordinate &cmvel, Double_t &gmass, Double_t &totV, const Double_t potscale, const int iparallel);
 ///calculate the potential of an array of particles
 void Potential(Options &opt, Int_t nbodies, Particle *Part, Double_t *potV);
 void Potential(Options &opt, Int_t nbodies, Particle *Part);
@@ -457,6 +476,23 @@ Int_t MPIBuildParticleNNImportList(const Int_t nbodies, KDTree *tree, Particle *
 ///comparison function to order particles for export
 int nn_export_cmp(const void *a, const void *b);
 
+//@}
+
+/// \name MPI routines that divide the unbinding of a group between tasks
+/// see \ref mpiroutines.cxx for implementation
+//@{
+
+///divide the particles of a group held by the root of comm between its tasks
+Int_t MPIDistributeGroup(MPI_Comm comm, const Int_t nig, Particle *Part, Particle *&Plocal, Int_t *&orig);
+///collect the particles of a group divided between the tasks of comm on its root
+Int_t MPIGatherGroup(MPI_Comm comm, const Int_t nlocal, Particle *Plocal, const int nidx, Int_t *idxlocal, Particle *&Pall, Int_t *&idx);
+///exchange the parts of the trees of the tasks of comm needed for the field in each other's region
+GravityTree *MPIExchangeLET(MPI_Comm comm, GravityTree &gt, const Int_t nbodies);
+///collect the particles of all the tasks of comm on every task
+Int_t MPIAllgatherParticles(MPI_Comm comm, const Int_t nlocal, Particle *Plocal, Int_t *ilocal, Particle *&Pall, Int_t *&iall);
+///select the largest values over the tasks of comm
+Int_t MPISelectLargest(MPI_Comm comm, const Int_t n, const Double_t *val, const Int_t k, Int_t *sel);
+
 //@}
 #endif
 
@@ -491,6 +527,14 @@ Int_tree_t *BuildLenArray(const Int_t nbodies, const Int_t numgroups, Int_t *num
 Int_tree_t *BuildGroupTailArray(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t **pglist);
 ///sort particles according to the group value (or technically any integer array) unique to each group and return an array of offsets to access the particle array via their group
 Int_t *BuildNoffset(const Int_t nbodies, Particle *Part, Int_t numgroups,Int_t *numingroup, Int_t *sortval, Int_t ioffset=0);
+///reorder particles along a space filling curve, storing the input order in porder
+void ReorderParticlesSFC(Options &opt, const Int_t nbodies, Particle *Part, Int_t *porder, Int_t ioffset=0);
+///return particles reordered by \ref ReorderParticlesSFC (and their group ids) to input order
+void RestoreParticleOrder(const Int_t nbodies, Particle *Part, Int_t *porder, Int_t *pfof=NULL);
+///Morton key of integer coordinates of up to \ref PREORDERBITS bits
+unsigned long long MortonKey(unsigned int x[3]);
+///radix sort of space filling curve keys along with an index array. The arrays may be swapped with internal buffers
+void SFCRadixSort(const Int_t n, unsigned long long *&key, Int_t *&index);
 ///reorder groups from largest to smallest
 void ReorderGroupIDs(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist);
 ///reorder groups from largest to smallest not assuming particles are in id order
@@ -521,6 +565,8 @@ int GetMillSpan(int );
 int CompareInt(const void *, const void *);
 ///get a time
 double MyGetTime();
+///Split groups between those processed concurrently and those processed with all threads
+void BuildGroupSchedule(GroupSchedule &gs, const Int_t ngroup, const Int_t *numingroup, const int costtype, const Int_t nmin, const Int_t nmax);
 //@}
 
 #endif
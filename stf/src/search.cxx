@@ -9,6 +9,32 @@
 /// \name Searches full system
 //@{
 
+///6DFOF search of the n particles of a 3DFOF group, which are scaled by the linking lengths in param so a simple ball search can be run on a phase-space tree.
+///If not called from within a parallel region, the group is scaled, the tree built and searched using all threads whatever its size, since it is
+///then one of the groups of \ref GroupSchedule::large and the other threads would otherwise be idle, see \ref NBody::KDTree::FOF
+static Int_t *FOF6DSearchGroup(Options &opt, Particle *Part, const Int_t n, Double_t *param, Int_t &ng, Int_t minsize,
+    Int_tree_t *Head, Int_tree_t *Next, Int_tree_t *Tail, Int_tree_t *Len)
+{
+    KDTree *tree;
+    Int_t *pfof;
+    Double_t xscaling, vscaling;
+    //scale particle positions
+    xscaling=1.0/sqrt(param[1]);vscaling=1.0/sqrt(param[2]);
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (n>ompperiodnum && !omp_in_parallel())
+#endif
+    for (Int_t j=0;j<n;j++) Part[j].ScalePhase(xscaling,vscaling);
+    xscaling=1.0/xscaling;vscaling=1.0/vscaling;
+    tree=new KDTree(Part,n,opt.Bsize,tree->TPHS,tree->KEPAN,100);
+    pfof=tree->FOF(1.0,ng,minsize,1,Head,Next,Tail,Len,1);
+    delete tree;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (n>ompperiodnum && !omp_in_parallel())
+#endif
+    for (Int_t j=0;j<n;j++) Part[j].ScalePhase(xscaling,vscaling);
+    return pfof;
+}
+
 /*!
     Search full system without finding outliers first
     Here search simulation for FOF haloes (either 3d or 6d). Note for 6D search, first 3d FOF halos are found, then velocity scale is set by largest 3DFOF
@@ -68,12 +94,22 @@ Int_t* SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
     param[0]=tree->TPHYS;
     param[1]=(opt.ellxscale*opt.ellxscale)*(opt.ellphys*opt.ellphys)*(opt.ellhalophysfac*opt.ellhalophysfac);
     param[6]=param[1];
+    //the grid can only be used when all particles are linked with the same linking length and, as linking across mpi domains
+    //uses the tree, only without mpi
+    int igridfof=(opt.fofengine==FOFENGINEGRID && !(opt.partsearchtype==PSTALL && opt.iBaryonSearch>1));
+#ifdef USEMPI
+    igridfof=0;
+#endif
+    if (igridfof) tree=NULL;
+    else {
     cout<<"First build tree ... "<<endl;
     tree=new KDTree(Part.data(),nbodies,opt.Bsize,tree->TPHYS,tree->KEPAN,1000,0,0,0,period);
     cout<<"Done"<<endl;
-    cout<<"Search particles using 3DFOF in physical space"<<endl;
+    }
+    if (igridfof) cout<<"Search particles using 3DFOF in physical space on a grid of cells"<<endl;
+    else cout<<"Search particles using 3DFOF in physical space"<<endl;
     cout<<"Parameters used are : ellphys="<<sqrt(param[6])<<" Lunits (and likely "<<sqrt(param[6])/opt.ellxscale<<" in interparticle spacing"<<endl;
-    if (opt.partsearchtype==PSTALL && opt.iBaryonSearch>1) {fofcmp=&FOF3dDM;param[7]=DARKTYPE;}
+    if (opt.partsearchtype==PSTALL && opt.iBaryonSearch>1) {fofcmp=&FOF3dType;param[7]=DARKTYPE;}
     else fofcmp=&FOF3d;
     //if using mpi no need to locally sort just yet and might as well return the Head, Len, Next arrays
 #ifdef USEMPI
@@ -82,7 +118,8 @@ Int_t* SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
     if (opt.partsearchtype==PSTALL && opt.iBaryonSearch>1) pfof=tree->FOFCriterionSetBasisForLinks(fofcmp,param,numgroups,minsize,0,0,FOFchecktype,Head,Next);
     else pfof=tree->FOF(sqrt(param[1]),numgroups,minsize,0,Head,Next);
 #else
-    if (opt.partsearchtype==PSTALL && opt.iBaryonSearch>1) pfof=tree->FOFCriterionSetBasisForLinks(fofcmp,param,numgroups,minsize,1,0,FOFchecktype);
+    if (igridfof) pfof=SearchFOFGrid(opt,nbodies,Part.data(),sqrt(param[1]),numgroups,minsize);
+    else if (opt.partsearchtype==PSTALL && opt.iBaryonSearch>1) pfof=tree->FOFCriterionSetBasisForLinks(fofcmp,param,numgroups,minsize,1,0,FOFchecktype);
     else pfof=tree->FOF(sqrt(param[1]),numgroups,minsize,1);
 #endif
 
@@ -349,7 +386,6 @@ private(i,vscale2,mtotregion,vx,vy,vz,vmean)
     }
 
     Head=new Int_tree_t[Nlocal];Next=new Int_tree_t[Nlocal];Tail=new Int_tree_t[Nlocal];Len=new Int_tree_t[Nlocal];
-    KDTree *treeomp[nthreads];
     Double_t *paramomp=new Double_t[nthreads*20];
     Int_t **pfofomp;
     Int_t *ngomp;
@@ -373,14 +409,24 @@ private(i,vscale2,mtotregion,vx,vy,vz,vmean)
     ///6d phase tree and simple FOF ball search
     pfofomp=new Int_t*[iend+1];
     ngomp=new Int_t[iend+1];
-    Double_t xscaling, vscaling;
+    //the largest groups, which can hold a significant fraction of all particles, are searched one at a time with the tree
+    //built and searched using all threads, and the rest concurrently with one group per thread, see \ref BuildGroupSchedule
+    GroupSchedule gs;
+    BuildGroupSchedule(gs,iend,numingroup,GSCHEDNLOGN,ompsearchnum,CRITPARALLELFOFSIZE);
+    for (Int_t ig=0;ig<(Int_t)gs.large.size();ig++) {
+        i=gs.large[ig];
+        //if adaptive 6dfof, set params
+        if (opt.fofbgtype==FOF6DADAPTIVE) paramomp[2]=paramomp[7]=vscale2array[i];
+        pfofomp[i]=FOF6DSearchGroup(opt,&(Part.data()[noffset[i]]),numingroup[i],paramomp,ngomp[i],minsize,&Head[noffset[i]],&Next[noffset[i]],&Tail[noffset[i]],&Len[noffset[i]]);
+    }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,tid,xscaling,vscaling)
+private(i,tid)
 {
 #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (i=1;i<=iend;i++) {
+    for (Int_t ig=0;ig<(Int_t)gs.pool.size();ig++) {
+        i=gs.pool[ig];
 #ifdef USEOPENMP
         tid=omp_get_thread_num();
 #else
@@ -392,18 +438,7 @@ private(i,tid,xscaling,vscaling)
         treeomp[tid]=new KDTree(&Part[noffset[i]],numingroup[i],opt.Bsize,treeomp[tid]->TPHYS,tree->KEPAN,100);
         pfofomp[i]=treeomp[tid]->FOFCriterion(fofcmp,&paramomp[tid*20],ngomp[i],minsize,1,0,Pnocheck,&Head[noffset[i]],&Next[noffset[i]],&Tail[noffset[i]],&Len[noffset[i]]);
         */
-        //scale particle positions
-        xscaling=1.0/sqrt(paramomp[1+tid*20]);vscaling=1.0/sqrt(paramomp[2+tid*20]);
-        for (Int_t j=0;j<numingroup[i];j++) {
-            Part[noffset[i]+j].ScalePhase(xscaling,vscaling);
-        }
-        xscaling=1.0/xscaling;vscaling=1.0/vscaling;
-        treeomp[tid]=new KDTree(&(Part.data()[noffset[i]]),numingroup[i],opt.Bsize,treeomp[tid]->TPHS,tree->KEPAN,100);
-        pfofomp[i]=treeomp[tid]->FOF(1.0,ngomp[i],minsize,1,&Head[noffset[i]],&Next[noffset[i]],&Tail[noffset[i]],&Len[noffset[i]]);
-        delete treeomp[tid];
-        for (Int_t j=0;j<numingroup[i];j++) {
-            Part[noffset[i]+j].ScalePhase(xscaling,vscaling);
-        }
+        pfofomp[i]=FOF6DSearchGroup(opt,&(Part.data()[noffset[i]]),numingroup[i],&paramomp[tid*20],ngomp[i],minsize,&Head[noffset[i]],&Next[noffset[i]],&Tail[noffset[i]],&Len[noffset[i]]);
     }
 #ifdef USEOPENMP
 }
@@ -529,7 +564,14 @@ private(i,tid,xscaling,vscaling)
 
     //now if not search for substructure but want bound halos need to check binding
     if (opt.iBoundHalos>=1) {
+#ifdef USEMPI
+        //all tasks unbind their halos here so large halos can share their gravity calculation, see \ref MPIUnbindLargeGroups
+        mpi_icollectiveunbind=1;
+#endif
         CheckUnboundGroups(opt,Nlocal,Part.data(),numgroups,pfof);
+#ifdef USEMPI
+        mpi_icollectiveunbind=0;
+#endif
 #ifdef USEMPI
         if (ThisTask==0) cout<<ThisTask<<" After unnbinding halos"<<endl;
         //update number of groups if extra secondary search done
@@ -740,17 +782,39 @@ private(i,c,diff)
 ///\name Search using outliers from background velocity distribution.
 //@{
 
+///Whether the physical tree with bucket size opt.Bsize used to search a subset can also provide its background grid (see \ref FillTreeGridFromTree)
+///With SCALING or HALOONLYDEN the particles are altered or a new tree is built on them while the grid is constructed, so the tree is not reused.
+static inline int SearchTreeProvidesGrid(Options &opt)
+{
+#if defined(SCALING) || defined(HALOONLYDEN)
+    return 0;
+#else
+    return ((opt.gridtype==PHYSGRID||opt.gridtype==PHYSENGRID)&&!(opt.foftype==FOFSTPROBNN||opt.foftype==FOFSTPROBNNLX||opt.foftype==FOFSTPROBNNNODIST));
+#endif
+}
+
+///Build the physical tree used to search a subset. If it is to provide the grid, it is split using the same criterion as the grid tree built in \ref InitializeTreeGrid
+static inline KDTree *BuildSearchTree(Options &opt, const Int_t nsubset, Particle *Partsubset)
+{
+    KDTree *tree;
+    if (SearchTreeProvidesGrid(opt)&&opt.gridtype==PHYSENGRID) tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS,tree->KEPAN,100,1);
+    else tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS);
+    return tree;
+}
+
 ///Search subset
 /*!
+    If subsettree is not NULL, it is a physical tree of the subset built by \ref BuildSearchTree, typically the one used to construct the grid in \ref SearchSubSubStructure,
+    and is used in the search rather than building a new tree. The routine takes ownership of the tree.
     \todo there are issues with locality for iterative search, significance check, regarding MPI threads. Currently these processes assume all necessary particles
     are locally accessible to the threads domain. For iSingleHalo==0, that is a full search of all fof halos has been done, that is the case as halos are localized
     to a MPI domain before the subsearch is made. However, in the case a of a single halo which has been broken up into several mpi domains, I must think carefully
     how the search should be localized. It should definitely be localized prior to CheckSignificance and the search window across mpi domains should use the larger
     physical search window used by the iterative search if that has been called.
  */
-Int_t* SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t sublevel, Int_t *pnumcores)
+Int_t* SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t sublevel, Int_t *pnumcores, KDTree *subsettree)
 {
-    KDTree *tree;
+    KDTree *tree=subsettree;
     Int_t *pfof, i, ii;
     FOFcompfunc fofcmp;
     fstream Fout;
@@ -861,7 +925,7 @@ Int_t* SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Part
         cout<<"FOF6DCORE which identifies phase-space dense regions and assigns particles, ie core identification and growth\n";
         }
         //just build tree and initialize the pfof array
-        tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS);
+        if (tree==NULL) tree=BuildSearchTree(opt,nsubset,Partsubset);
         numgroups=0;
         pfof=new Int_t[nsubset];
         for (i=0;i<nsubset;i++) pfof[i]=0;
@@ -870,8 +934,10 @@ Int_t* SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Part
     //now actually search for dynamically distinct substructures
     //@{
     if (!(opt.foftype==FOFSTPROBNN||opt.foftype==FOFSTPROBNNLX||opt.foftype==FOFSTPROBNNNODIST||opt.foftype==FOF6DCORE)) {
-        if (opt.iverbose) cout<<"Building tree ... "<<endl;
-        tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS);
+        if (tree==NULL) {
+            if (opt.iverbose) cout<<"Building tree ... "<<endl;
+            tree=BuildSearchTree(opt,nsubset,Partsubset);
+        }
         param[0]=tree->GetTreeType();
         //if large enough for statistically significant structures to be found then search. This is a robust search
         if (nsubset>=MINSUBSIZE) {
@@ -1155,9 +1221,11 @@ private(i,tid)
     if (nsubset>=MINSUBSIZE)
     {
 
-        //first have to delete tree used in search so that particles are in original particle order
-        //then construct a new grid with much larger cells so that new bg velocity dispersion can be estimated
-        delete tree;
+        //construct a new grid with much larger cells so that new bg velocity dispersion can be estimated.
+        //If possible, the grid is taken from the tree used in the search, which is then also used for the 6d search below,
+        //otherwise first have to delete tree used in search so that particles are in original particle order
+        int itreegrid=SearchTreeProvidesGrid(opt);
+        if (!itreegrid) delete tree;
         Int_t ngrid;
         Coordinate *gvel;
         Matrix *gveldisp;
@@ -1169,18 +1237,21 @@ private(i,tid)
 
         //ONLY calculate grid quantities if substructures have been found
         if (numgroups>0) {
-            tree=InitializeTreeGrid(opt,nsubset,Partsubset);
-            ngrid=tree->GetNumLeafNodes();
+            if (itreegrid) FillTreeGridFromTree(opt, nsubset, ngrid, tree, Partsubset, grid);
+            else {
+                tree=InitializeTreeGrid(opt,nsubset,Partsubset);
+                ngrid=tree->GetNumLeafNodes();
+                grid=new GridCell[ngrid];
+                FillTreeGrid(opt, nsubset, ngrid, tree, Partsubset, grid);
+            }
             if (opt.iverbose) cout<<ThisTask<<" "<<"bg search using "<<ngrid<<" grid cells, with each node containing ~"<<(opt.Ncell=nsubset/ngrid)<<" particles"<<endl;
-            grid=new GridCell[ngrid];
-            FillTreeGrid(opt, nsubset, ngrid, tree, Partsubset, grid);
             gvel=GetCellVel(opt,nsubset,Partsubset,ngrid,grid);
             gveldisp=GetCellVelDisp(opt,nsubset,Partsubset,ngrid,grid,gvel);
             GetDenVRatio(opt,nsubset,Partsubset,ngrid,grid,gvel,gveldisp);
             GetOutliersValues(opt,nsubset,Partsubset,-1);
         }
         ///produce tree to search for 6d phase space structures
-        tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS);
+        if (!itreegrid) tree=new KDTree(Partsubset,nsubset,opt.Bsize,tree->TPHYS);
 
         //now begin fof6d search for large background objects that are missed using smaller grid cells ONLY IF substructures have been found
         //this search can identify merger excited radial shells so for the moment, disabled
@@ -1440,7 +1511,14 @@ private(i,tid)
         for (i=0;i<nsubset;i++) Partsubset[i].SetPotential(pfof[Partsubset[i].GetID()]);
         for (i=0;i<nsubset;i++) Partsubset[i].SetType(-1);
         param[9]=0.5;
-        pfofbg=tree->FOFCriterion(fofcmp,param,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
+        //if the loops below shrink the configuration and velocity linking lengths by the same factor, each loop links a subset
+        //of the links of this search and only searches particles of a group of the previous loop, so the groups of every loop are
+        //found from the minimum spanning forest of the links of this search rather than searching the tree again
+        vector<FOFMSTEdge> coreedges;
+        int imstcore=(opt.halocorenumloops>1 && opt.halocorexfaciter==opt.halocorevfaciter && opt.halocorexfaciter<=1.0);
+        if (imstcore) imstcore=tree->FOFMinimumSpanningTree(fofcmp,param,coreedges,icheck,FOFcheckbg);
+        if (imstcore) pfofbg=tree->FOFMinimumSpanningTreeGroups(fofcmp,param,coreedges,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
+        else pfofbg=tree->FOFCriterion(fofcmp,param,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
 
         for (i=0;i<nsubset;i++) if (pfofbg[Partsubset[i].GetID()]<=1 && pfof[Partsubset[i].GetID()]==0) Partsubset[i].SetType(numactiveloops);
 
@@ -1487,7 +1565,8 @@ private(i,tid)
                 //we adjust the particles potentials so as to ignore already tagged particles using FOFcheckbg
                 //here since loop just iterates to search the largest core, we just set all previously tagged particles not belonging to main core as 1
                 for (i=0;i<nsubset;i++) Partsubset[i].SetPotential((pfofbgnew[Partsubset[i].GetID()]!=1)+(pfof[Partsubset[i].GetID()]>0));
-                pfofbg=tree->FOFCriterion(fofcmp,param,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
+                if (imstcore) pfofbg=tree->FOFMinimumSpanningTreeGroups(fofcmp,param,coreedges,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
+                else pfofbg=tree->FOFCriterion(fofcmp,param,numgroupsbg,minsize,iorder,icheck,FOFcheckbg);
                 //now if numgroupsbg is greater than one, need to update the pfofbgnew array
                 if (numgroupsbg>1) {
                     numactiveloops++;
@@ -1642,6 +1721,40 @@ private(i,tid)
     return pfof;
 }
 
+///Calculate the phase-space centre of mass and inverse dispersion tensor of the cores used in \ref HaloCoreGrowth for which iupdate is set.
+///Only the particles of these cores are copied and they are placed by core using offsets given by the core sizes ncore rather than sorted.
+static void CalcCorePhaseMetrics(const Int_t nsubset, Particle *Partsubset, Int_t *pfofbg, const Int_t numgroupsbg, Int_t *ncore, vector<int> &iupdate,
+    vector<GMatrix> &cmphase, vector<GMatrix> &invdisp)
+{
+    Int_t i, icore, nincore=0;
+    Int_t *noffset=new Int_t[numgroupsbg+1];
+    Int_t *nfill=new Int_t[numgroupsbg+1];
+    Particle *Pcore;
+    for (i=1;i<=numgroupsbg;i++) {
+        noffset[i]=nincore;
+        nfill[i]=0;
+        if (iupdate[i]) nincore+=ncore[i];
+    }
+    Pcore=new Particle[nincore];
+    for (i=0;i<nsubset;i++) {
+        icore=pfofbg[Partsubset[i].GetID()];
+        if (icore>0 && iupdate[icore]) Pcore[noffset[icore]+(nfill[icore]++)]=Partsubset[i];
+    }
+    for (i=1;i<=numgroupsbg;i++) if (iupdate[i]) {
+        cmphase[i]=CalcPhaseCM(ncore[i], &Pcore[noffset[i]]);
+        for (Int_t j=0;j<ncore[i];j++) {
+            for (int k=0;k<6;k++) Pcore[noffset[i]+j].SetPhase(k,Pcore[noffset[i]+j].GetPhase(k)-cmphase[i](k,0));
+        }
+        CalcPhaseSigmaTensor(ncore[i], &Pcore[noffset[i]], invdisp[i]);
+        ///\todo must be issue with either phase-space tensor or number of particles assigned as
+        ///it is possible to get haloes of size 0
+        invdisp[i]=invdisp[i].Inverse();
+    }
+    delete[] Pcore;
+    delete[] noffset;
+    delete[] nfill;
+}
+
 //search for unassigned background particles if cores have been found.
 void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, Int_t *&pfof, Int_t *&pfofbg, Int_t &numgroupsbg, Double_t param[], vector<Double_t> &dispfac,
     int numactiveloops, vector<int> &corelevel,
@@ -1650,7 +1763,6 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
     Int_t nincore=0,nbucket=opt.Bsize,pid, pidcore;
     Particle *Pcore,*Pval;
     KDTree *tcore;
-    Coordinate x1;
     Double_t D2,dval,mval;
     Double_t *mcore=new Double_t[numgroupsbg+1];
     Int_t *ncore=new Int_t[numgroupsbg+1];
@@ -1659,8 +1771,8 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
     int mincoresize;
     int tid,i;
     Int_t **nnID;
-    Double_t **dist2;
-    PriorityQueue *pq;
+    Double_t **dist2, **xbatch;
+    PriorityQueue *pq, **pqbatch;
     Int_t nactivepart=nsubset;
 
     for (i=0;i<=numgroupsbg;i++)ncore[i]=mcore[i]=0;
@@ -1679,7 +1791,6 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
     }
     //if number of particles in core less than number in subset then start assigning particles
     if (nincore<nsubset) {
-        Int_t *noffset=new Int_t[numgroupsbg+1];
         //if running fully adaptive core linking, then need to calculate phase-space dispersions for each core
         //about their centres and use this to determine distances
         if (opt.iPhaseCoreGrowth) {
@@ -1689,30 +1800,12 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
             vector<GMatrix> invdisp(numgroupsbg+1,GMatrix(6,6));
             GMatrix coredist(6,1);
             Int_t nactive=0;
+            //flags which cores need their centre and dispersion (re)calculated
+            vector<int> iupdate(numgroupsbg+1,1);
+            vector<Int_t> ncoreold(numgroupsbg+1);
 
-            //store particles
-            Pcore=new Particle[nincore];
-            nincore=0;
-            for (i=0;i<nsubset;i++) if (pfofbg[Partsubset[i].GetID()]>0) {
-                Pcore[nincore]=Partsubset[i];
-                Pcore[nincore].SetType(pfofbg[Partsubset[i].GetID()]);
-                nincore++;
-            }
-            qsort(Pcore,nincore,sizeof(Particle),TypeCompare);
-            noffset[0]=noffset[1]=0;
-            for (i=2;i<=numgroupsbg;i++) noffset[i]=noffset[i-1]+ncore[i-1];
-            //now get centre of masses and dispersions
-            for (i=1;i<=numgroupsbg;i++) {
-                cmphase[i]=CalcPhaseCM(ncore[i], &Pcore[noffset[i]]);
-                for (int j=0;j<ncore[i];j++) {
-                    for (int k=0;k<6;k++) Pcore[noffset[i]+j].SetPhase(k,Pcore[noffset[i]+j].GetPhase(k)-cmphase[i](k,0));
-                }
-                CalcPhaseSigmaTensor(ncore[i], &Pcore[noffset[i]], invdisp[i]);
-                ///\todo must be issue with either phase-space tensor or number of particles assigned as
-                ///it is possible to get haloes of size 0
-                invdisp[i]=invdisp[i].Inverse();
-            }
-            delete[] Pcore;
+            //get centre of masses and dispersions
+            CalcCorePhaseMetrics(nsubset, Partsubset, pfofbg, numgroupsbg, ncore, iupdate, cmphase, invdisp);
 
             //once phase-space centers and dispersions are calculated, check to see
             //if distance is significant. Here idea is get distance in dispersion of
@@ -1795,34 +1888,13 @@ private(i,tid,Pval,D2,dval,mval,pid)
 #ifdef USEOPENMP
             }
 #endif
-            //otherwise, recalculate dispersions
+            //otherwise, recalculate dispersions. Particles are only ever added to cores, so only the cores
+            //at this level whose size has changed need to be updated, the rest keep their cached values
             if (opt.iPhaseCoreGrowth>=2) {
-                nincore=0;
-                for (i=0;i<nsubset;i++)
-                    if (pfofbg[i]>0)
-                        nincore++;
-                Pcore=new Particle[nincore];
-                for (i=1;i<=numgroupsbg;i++) ncore[i]=0;
-                nincore=0;
-                for (i=0;i<nsubset;i++) if (pfofbg[Partsubset[i].GetID()]>0) {
-                    Pcore[nincore]=Partsubset[i];
-                    Pcore[nincore].SetType(pfofbg[Partsubset[i].GetID()]);
-                    nincore++;
-                    ncore[pfofbg[Partsubset[i].GetID()]]++;
-                }
-                qsort(Pcore,nincore,sizeof(Particle),TypeCompare);
-                noffset[0]=noffset[1]=0;
-                for (i=2;i<=numgroupsbg;i++) noffset[i]=noffset[i-1]+ncore[i-1];
-                //now get centre of masses and dispersions
-                for (i=1;i<=numgroupsbg;i++) if (corelevel[i]>=iloop) {
-                    cmphase[i]=CalcPhaseCM(ncore[i], &Pcore[noffset[i]]);
-                    for (int j=0;j<ncore[i];j++) {
-                        for (int k=0;k<6;k++) Pcore[noffset[i]+j].SetPhase(k,Pcore[noffset[i]+j].GetPhase(k)-cmphase[i](k,0));
-                    }
-                    CalcPhaseSigmaTensor(ncore[i], &Pcore[noffset[i]], invdisp[i]);
-                    invdisp[i]=invdisp[i].Inverse();
-                }
-                delete[] Pcore;
+                for (i=1;i<=numgroupsbg;i++) {ncoreold[i]=ncore[i];ncore[i]=0;}
+                for (i=0;i<nsubset;i++) if (pfofbg[i]>0) ncore[pfofbg[i]]++;
+                for (i=1;i<=numgroupsbg;i++) iupdate[i]=(corelevel[i]>=iloop && ncore[i]!=ncoreold[i]);
+                CalcCorePhaseMetrics(nsubset, Partsubset, pfofbg, numgroupsbg, ncore, iupdate, cmphase, invdisp);
             }
         }//
         }//end of phase core growth
@@ -1842,31 +1914,52 @@ private(i,tid,Pval,D2,dval,mval,pid)
             tcore=new KDTree(Pcore,nincore,opt.Bsize,tcore->TPHYS);
             nnID=new Int_t*[nthreads];
             dist2=new Double_t*[nthreads];
+            xbatch=new Double_t*[nthreads];
+            pqbatch=new PriorityQueue*[nthreads];
             for (i=0;i<nthreads;i++) {
-                nnID[i]=new Int_t[nsearch];
-                dist2[i]=new Double_t[nsearch];
+                nnID[i]=new Int_t[nsearch*NNBATCHSIZE];
+                dist2[i]=new Double_t[nsearch*NNBATCHSIZE];
+                xbatch[i]=new Double_t[3*NNBATCHSIZE];
+                pqbatch[i]=new PriorityQueue(nsearch);
             }
             for (i=1;i<=numgroupsbg;i++) ncore[i]=0;
+            //only untagged particles require a search, so gather these first. As the subset is in tree order, consecutive untagged particles
+            //are spatially close, so their positions are searched against the core tree in batches of NNBATCHSIZE (see \ref NBody::KDTree::FindNearestBatch)
+            //and the batches are dynamically distributed between threads
+            vector<Int_t> untagged;
+            for (i=0;i<nsubset;i++) {
+                pid=Partsubset[i].GetID();
+                if (pfofbg[pid]==0 && pfof[pid]==0) untagged.push_back(i);
+            }
+            Int_t nuntagged=untagged.size(), nbatch=(nuntagged+NNBATCHSIZE-1)/NNBATCHSIZE, nb;
+            Int_t *nnIDi;
 #ifdef USEOPENMP
-            //if particle number large enough to warrant parallel search
-            if (nsubset>ompperiodnum) {
-#pragma omp parallel default(shared) \
-private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
+#pragma omp parallel default(shared) if (nuntagged>ompperiodnum) \
+private(i,tid,Pval,D2,dval,mval,pid,pidcore,nb,nnIDi)
 {
-#pragma omp for
+#pragma omp for schedule(dynamic)
+#endif
             //for each particle in the subset if not assigned to any group (core or substructure) then assign particle
             //this is done using either a simple distance/sigmax+velocity distance/sigmav calculation to the nearest core particles
             //or if a more complex routine is required then ...
-            for (i=0;i<nsubset;i++)
+            for (Int_t ib=0;ib<nbatch;ib++)
             {
+#ifdef USEOPENMP
                 tid=omp_get_thread_num();
-                Pval=&Partsubset[i];
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    x1=Coordinate(Pval->GetPosition());
-                    tcore->FindNearestPos(x1, nnID[tid], dist2[tid],nsearch);
+#else
+                tid=0;
+#endif
+                nb=0;
+                for (Int_t ii=ib*NNBATCHSIZE;ii<nuntagged && ii<(ib+1)*NNBATCHSIZE;ii++,nb++)
+                    for (int k=0;k<3;k++) xbatch[tid][nb*3+k]=Partsubset[untagged[ii]].GetPosition(k);
+                tcore->FindNearestBatch(nb, xbatch[tid], nnID[tid], dist2[tid], nsearch, pqbatch[tid]);
+                for (Int_t ii=0;ii<nb;ii++)
+                {
+                    Pval=&Partsubset[untagged[ib*NNBATCHSIZE+ii]];
+                    pid=Pval->GetID();
+                    nnIDi=&nnID[tid][ii*nsearch];
                     dval=0;
-                    pidcore=nnID[tid][0];
+                    pidcore=nnIDi[0];
                     //calculat distance from current particle to core particle
                     for (int k=0;k<3;k++) {
                         dval+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
@@ -1877,7 +1970,7 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
                     //now initialized to first core particle, examine the rest to see if one is closer
                     for (int j=1;j<nsearch;j++) {
                         D2=0;
-                        pidcore=nnID[tid][j];
+                        pidcore=nnIDi[j];
                         for (int k=0;k<3;k++) {
                             D2+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
                         }
@@ -1886,37 +1979,8 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
                     }
                 }
             }
-}
-            }
-            else {
-#endif
-            for (i=0;i<nsubset;i++)
-            {
-                tid=0;
-                Pval=&Partsubset[i];
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    x1=Coordinate(Pval->GetPosition());
-                    tcore->FindNearestPos(x1, nnID[tid], dist2[tid],nsearch);
-                    dval=0;
-                    pidcore=nnID[tid][0];
-                    for (int k=0;k<3;k++) {
-                        dval+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                    }
-                    mval=mcore[Pcore[pidcore].GetType()];
-                    pfofbg[pid]=Pcore[pidcore].GetType();
-                    for (int j=1;j<nsearch;j++) {
-                        D2=0;
-                        pidcore=nnID[tid][j];
-                        for (int k=0;k<3;k++) {
-                            D2+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                        }
-                        if (dval>D2*mval/mcore[Pcore[pidcore].GetType()]) {dval=D2;mval=mcore[Pcore[pidcore].GetType()];pfofbg[pid]=Pcore[pidcore].GetType();}
-                    }
-                }
-            }
 #ifdef USEOPENMP
-            }
+}
 #endif
             //clean up memory
             delete tcore;
@@ -1924,9 +1988,13 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
             for (i=0;i<nthreads;i++) {
                 delete [] nnID[i];
                 delete [] dist2[i];
+                delete [] xbatch[i];
+                delete pqbatch[i];
             }
             delete[] nnID;
             delete[] dist2;
+            delete[] xbatch;
+            delete[] pqbatch;
         }
         //now that particles assigned to cores, remove if core too small
         if (opt.partsearchtype!=PSTSTAR&&opt.foftype!=FOF6DCORE) mincoresize=max((Int_t)(nsubset*opt.halocorenfac),(Int_t)opt.MinSize);//max((Int_t)(nsubset*MAXCELLFRACTION/2.0),(Int_t)opt.MinSize);
@@ -1970,6 +2038,171 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
     }
 }
 
+/*!
+    Searches a single (sub)structure for substructure as part of \ref SearchSubSub. The nsub particles of the structure, whose indices in Partsubset
+    are given by subpglist, are copied, moved to their centre of mass frame if requested, the local velocity density is compared to the background
+    if the structure is large enough and the structure is searched with \ref SearchSubset. The substructures found are then unbound.
+    Returns the local group ids of the particles of the structure and sets the number of substructures, the number of cores among them
+    and the number and (global) indices of the particles of each substructure. The scales of the structure are stored in opt, so
+    structures searched concurrently must be given their own copy. Loops within the search are only multithreaded for large structures.
+*/
+static Int_t *SearchSubSubStructure(Options &opt, vector<Particle> &Partsubset, const Int_t nsub, Int_t *subpglist, const Int_t isub, const Int_t sublevel,
+    Int_t &subngroup, Int_t &numcores, Int_t *&subsubnumingroup, Int_t **&subsubpglist)
+{
+    Particle *subPart;
+    Int_t *subpfof,*coreflag;
+    Int_t ng,ngrid,j;
+    bool iunbindflag;
+    Coordinate *gvel;
+    Matrix *gveldisp;
+    KDTree *tree=NULL;
+    GridCell *grid;
+    Coordinate cm,cmvel;
+#ifndef USEMPI
+    int ThisTask=0;
+#endif
+
+    subPart=new Particle[nsub];
+    for (j=0;j<nsub;j++) subPart[j]=Partsubset[subpglist[j]];
+    //now if low statistics, then possible that very central regions of subhalo will be higher due to cell size used and Nv search
+    //so first determine centre of subregion
+    Double_t cmx=0.,cmy=0.,cmz=0.,cmvelx=0.,cmvely=0.,cmvelz=0.;
+    Double_t mtotregion=0.0;
+    if (opt.icmrefadjust) {
+        if(opt.iverbose) cout<<"moving to cm frame"<<endl;
+#ifdef USEOPENMP
+    if (nsub>ompsearchnum) {
+#pragma omp parallel default(shared)
+{
+#pragma omp for private(j) reduction(+:mtotregion,cmx,cmy,cmz,cmvelx,cmvely,cmvelz)
+    for (j=0;j<nsub;j++) {
+        cmx+=subPart[j].X()*subPart[j].GetMass();
+        cmy+=subPart[j].Y()*subPart[j].GetMass();
+        cmz+=subPart[j].Z()*subPart[j].GetMass();
+        cmvelx+=subPart[j].Vx()*subPart[j].GetMass();
+        cmvely+=subPart[j].Vy()*subPart[j].GetMass();
+        cmvelz+=subPart[j].Vz()*subPart[j].GetMass();
+        mtotregion+=subPart[j].GetMass();
+    }
+}
+    }
+    else {
+#endif
+    for (j=0;j<nsub;j++) {
+        cmx+=subPart[j].X()*subPart[j].GetMass();
+        cmy+=subPart[j].Y()*subPart[j].GetMass();
+        cmz+=subPart[j].Z()*subPart[j].GetMass();
+        cmvelx+=subPart[j].Vx()*subPart[j].GetMass();
+        cmvely+=subPart[j].Vy()*subPart[j].GetMass();
+        cmvelz+=subPart[j].Vz()*subPart[j].GetMass();
+        mtotregion+=subPart[j].GetMass();
+    }
+#ifdef USEOPENMP
+}
+#endif
+    cm[0]=cmx;cm[1]=cmy;cm[2]=cmz;
+    cmvel[0]=cmvelx;cmvel[1]=cmvely;cmvel[2]=cmvelz;
+    for (int k=0;k<3;k++) {cm[k]/=mtotregion;cmvel[k]/=mtotregion;}
+#ifdef USEOPENMP
+    if (nsub>ompsearchnum) {
+#pragma omp parallel default(shared)
+{
+#pragma omp for private(j)
+    for (j=0;j<nsub;j++)
+        for (int k=0;k<3;k++) {
+            subPart[j].SetPosition(k,subPart[j].GetPosition(k)-cm[k]);subPart[j].SetVelocity(k,subPart[j].GetVelocity(k)-cmvel[k]);
+        }
+}
+    }
+    else {
+#endif
+    for (j=0;j<nsub;j++)
+        for (int k=0;k<3;k++) {
+            subPart[j].SetPosition(k,subPart[j].GetPosition(k)-cm[k]);subPart[j].SetVelocity(k,subPart[j].GetVelocity(k)-cmvel[k]);
+        }
+#ifdef USEOPENMP
+}
+#endif
+    }
+    if (nsub>=MINSUBSIZE&&opt.foftype!=FOF6DCORE) {
+        //now if object is large enough for phase-space decomposition and search, compare local field to bg field
+        opt.Ncell=opt.Ncellfac*nsub;
+        //if ncell is such that uncertainty would be greater than 0.5% based on Poisson noise, increase ncell till above unless cell would contain >25%
+        while (opt.Ncell<MINCELLSIZE && nsub/4.0>opt.Ncell) opt.Ncell*=2;
+        //if possible build the tree used to search the substructure now and construct the grid from its upper levels,
+        //in which case particles stay in tree order till the search is finished
+        if (SearchTreeProvidesGrid(opt)) {
+            tree=BuildSearchTree(opt,nsub,subPart);
+            FillTreeGridFromTree(opt, nsub, ngrid, tree, subPart, grid);
+        }
+        else {
+            tree=InitializeTreeGrid(opt,nsub,subPart);
+            ngrid=tree->GetNumLeafNodes();
+            grid=new GridCell[ngrid];
+            FillTreeGrid(opt, nsub, ngrid, tree, subPart, grid);
+            tree=NULL;
+        }
+        if (opt.iverbose) cout<<ThisTask<<" Substructure "<<isub<< " at sublevel "<<sublevel<<" with "<<nsub<<" particles split into are "<<ngrid<<" grid cells, with each node containing ~"<<nsub/ngrid<<" particles"<<endl;
+        gvel=GetCellVel(opt,nsub,subPart,ngrid,grid);
+        gveldisp=GetCellVelDisp(opt,nsub,subPart,ngrid,grid,gvel);
+        opt.HaloLocalSigmaV=0;for (int j=0;j<ngrid;j++) opt.HaloLocalSigmaV+=pow(gveldisp[j].Det(),1./3.);opt.HaloLocalSigmaV/=(double)ngrid;
+
+        Matrix eigvec(0.),I(0.);
+        Double_t sigma2x,sigma2y,sigma2z;
+        CalcVelSigmaTensor(nsub, subPart, sigma2x, sigma2y, sigma2z, eigvec, I);
+        opt.HaloSigmaV=pow(sigma2x*sigma2y*sigma2z,1.0/3.0);
+        if (opt.HaloSigmaV>opt.HaloVelDispScale) opt.HaloVelDispScale=opt.HaloSigmaV;
+#ifdef HALOONLYDEN
+        GetVelocityDensity(opt,nsub,subPart);
+#endif
+        GetDenVRatio(opt,nsub,subPart,ngrid,grid,gvel,gveldisp);
+        GetOutliersValues(opt,nsub,subPart,sublevel);
+        opt.idenvflag++;//largest field halo used to deteremine statistics of ratio
+    }
+    //otherwise only need to calculate a velocity scale for merger separation
+    else {
+        Matrix eigvec(0.),I(0.);
+        Double_t sigma2x,sigma2y,sigma2z;
+        CalcVelSigmaTensor(nsub, subPart, sigma2x, sigma2y, sigma2z, eigvec, I);
+        opt.HaloLocalSigmaV=opt.HaloSigmaV=pow(sigma2x*sigma2y*sigma2z,1.0/3.0);
+    }
+    subpfof=SearchSubset(opt,nsub,nsub,subPart,subngroup,sublevel,&numcores,tree);
+    //now if subngroup>0 see if there are any substrucures that can be searched again.
+    //the group ids must be stored along with the number of groups in this substructure that will be searched at next level.
+    //now check if self bound and if not, id doesn't change from original subhalo,ie: subpfof[j]=0
+    if (subngroup) {
+        ng=subngroup;
+        subsubnumingroup=BuildNumInGroup(nsub, subngroup, subpfof);
+        subsubpglist=BuildPGList(nsub, subngroup, subsubnumingroup, subpfof);
+        if (opt.uinfo.unbindflag&&subngroup>0) {
+            //if also keeping track of cores then must allocate coreflag
+            if (numcores>0 && opt.iHaloCoreSearch>=1) {
+                coreflag=new Int_t[ng+1];
+                for (int icore=1;icore<=ng;icore++) coreflag[icore]=1+(icore>ng-numcores);
+            }
+            else {coreflag=NULL;}
+            iunbindflag=CheckUnboundGroups(opt,nsub,subPart,subngroup,subpfof,subsubnumingroup,subsubpglist,1, coreflag);
+            if (iunbindflag) {
+                for (int j=1;j<=ng;j++) delete[] subsubpglist[j];
+                delete[] subsubnumingroup;
+                delete[] subsubpglist;
+                if (subngroup>0) {
+                    subsubnumingroup=BuildNumInGroup(nsub, subngroup, subpfof);
+                    subsubpglist=BuildPGList(nsub, subngroup, subsubnumingroup, subpfof);
+                }
+                //if need to update number of cores,
+                if (numcores>0 && opt.iHaloCoreSearch>=1) {
+                    numcores=0;
+                    for (int icore=1;icore<=subngroup;icore++)numcores+=(coreflag[icore]==2);
+                    delete[] coreflag;
+                }
+            }
+        }
+    }
+    delete[] subPart;
+    return subpfof;
+}
+
 /*!
     Given a initial ordered candidate list of substructures, find all substructures that are large enough to be searched.
     These substructures are used as a mean background velocity field and a new outlier list is found and searched.
@@ -1992,21 +2225,18 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
 void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubset, Int_t *&pfof, Int_t &ngroup, Int_t &nhalos, PropData *pdata)
 {
     //now build a sublist of groups to search for substructure
-    Int_t nsubsearch, oldnsubsearch,sublevel,maxsublevel,ngroupidoffset,ngroupidoffsetold,ngrid;
-    bool iflag,iunbindflag;
-    Particle *subPart;
+    Int_t nsubsearch, oldnsubsearch,sublevel,maxsublevel,ngroupidoffset,ngroupidoffsetold;
+    bool iflag;
     Int_t firstgroup,firstgroupoffset;
-    Int_t ng,*numingroup,**pglist;
-    Int_t *subpfof,*subngroup;
+    Int_t i,ig,ng,*numingroup,**pglist;
+    Int_t **subpfof,*subngroup;
     Int_t *subnumingroup,**subpglist;
     Int_t **subsubnumingroup, ***subsubpglist;
-    Int_t *numcores,*coreflag;
+    Int_t *numcores;
     Int_t *subpfofold;
-    Coordinate *gvel;
-    Matrix *gveldisp;
-    KDTree *tree;
-    GridCell *grid;
-    Coordinate cm,cmvel;
+    int idenvflag;
+    //order in which the structures of a sublevel are searched, see \ref BuildGroupSchedule
+    GroupSchedule gs;
     //variables to keep track of structure level, pfof values (ie group ids) and their parent structure
     //use to point to current level
     StrucLevelData *pcsld;
@@ -2070,147 +2300,51 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
         numcores=new Int_t[nsubsearch+1];
         subpfofold=new Int_t[nsubsearch+1];
         ns=0;
-        //here loop over all sublevel groups that need to be searched for substructure
-        for (Int_t i=1;i<=oldnsubsearch;i++) {
-            subpfofold[i]=pfof[subpglist[i][0]];
-            subPart=new Particle[subnumingroup[i]];
-            for (Int_t j=0;j<subnumingroup[i];j++) subPart[j]=Partsubset[subpglist[i][j]];
-            //now if low statistics, then possible that very central regions of subhalo will be higher due to cell size used and Nv search
-            //so first determine centre of subregion
-            Double_t cmx=0.,cmy=0.,cmz=0.,cmvelx=0.,cmvely=0.,cmvelz=0.;
-            Double_t mtotregion=0.0;
-            Int_t j;
-            if (opt.icmrefadjust) {
-                if(opt.iverbose) cout<<"moving to cm frame"<<endl;
-#ifdef USEOPENMP
-            if (subnumingroup[i]>ompsearchnum) {
-#pragma omp parallel default(shared)
-{
-#pragma omp for private(j) reduction(+:mtotregion,cmx,cmy,cmz,cmvelx,cmvely,cmvelz)
-            for (j=0;j<subnumingroup[i];j++) {
-                cmx+=subPart[j].X()*subPart[j].GetMass();
-                cmy+=subPart[j].Y()*subPart[j].GetMass();
-                cmz+=subPart[j].Z()*subPart[j].GetMass();
-                cmvelx+=subPart[j].Vx()*subPart[j].GetMass();
-                cmvely+=subPart[j].Vy()*subPart[j].GetMass();
-                cmvelz+=subPart[j].Vz()*subPart[j].GetMass();
-                mtotregion+=subPart[j].GetMass();
-            }
-}
-            }
-            else {
-#endif
-            for (j=0;j<subnumingroup[i];j++) {
-                cmx+=subPart[j].X()*subPart[j].GetMass();
-                cmy+=subPart[j].Y()*subPart[j].GetMass();
-                cmz+=subPart[j].Z()*subPart[j].GetMass();
-                cmvelx+=subPart[j].Vx()*subPart[j].GetMass();
-                cmvely+=subPart[j].Vy()*subPart[j].GetMass();
-                cmvelz+=subPart[j].Vz()*subPart[j].GetMass();
-                mtotregion+=subPart[j].GetMass();
-            }
-#ifdef USEOPENMP
-}
-#endif
-            cm[0]=cmx;cm[1]=cmy;cm[2]=cmz;
-            cmvel[0]=cmvelx;cmvel[1]=cmvely;cmvel[2]=cmvelz;
-            for (int k=0;k<3;k++) {cm[k]/=mtotregion;cmvel[k]/=mtotregion;}
+        subpfof=new Int_t*[nsubsearch+1];
+        //here loop over all sublevel groups that need to be searched for substructure, see \ref SearchSubSubStructure
+        //the large ones are searched one at a time using all threads and the rest concurrently, see \ref BuildGroupSchedule
+        BuildGroupSchedule(gs,oldnsubsearch,subnumingroup,GSCHEDNLOGN,ompsearchnum,ompsearchnum);
+        for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+            i=gs.large[ig];
+            subpfof[i]=SearchSubSubStructure(opt,Partsubset,subnumingroup[i],subpglist[i],i,sublevel,subngroup[i],numcores[i],subsubnumingroup[i],subsubpglist[i]);
+        }
+        idenvflag=opt.idenvflag;
 #ifdef USEOPENMP
-            if (subnumingroup[i]>ompsearchnum) {
-#pragma omp parallel default(shared)
+#pragma omp parallel default(shared) \
+private(i)
 {
-#pragma omp for private(j)
-            for (j=0;j<subnumingroup[i];j++)
-                for (int k=0;k<3;k++) {
-                    subPart[j].SetPosition(k,subPart[j].GetPosition(k)-cm[k]);subPart[j].SetVelocity(k,subPart[j].GetVelocity(k)-cmvel[k]);
-                }
-}
-            }
-            else {
+        //each thread has its own copy of the options as these store the scales of the structure being searched
+        Options optthread=opt;
+        #pragma omp for schedule(dynamic,1)
+#else
+        Options &optthread=opt;
 #endif
-            for (j=0;j<subnumingroup[i];j++)
-                for (int k=0;k<3;k++) {
-                    subPart[j].SetPosition(k,subPart[j].GetPosition(k)-cm[k]);subPart[j].SetVelocity(k,subPart[j].GetVelocity(k)-cmvel[k]);
-                }
+        for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+            i=gs.pool[ig];
+            subpfof[i]=SearchSubSubStructure(optthread,Partsubset,subnumingroup[i],subpglist[i],i,sublevel,subngroup[i],numcores[i],subsubnumingroup[i],subsubpglist[i]);
+        }
 #ifdef USEOPENMP
+        #pragma omp critical (subsubsearch)
+        {
+        if (optthread.HaloVelDispScale>opt.HaloVelDispScale) opt.HaloVelDispScale=optthread.HaloVelDispScale;
+        opt.idenvflag+=optthread.idenvflag-idenvflag;
+        }
 }
 #endif
-            }
-            if (subnumingroup[i]>=MINSUBSIZE&&opt.foftype!=FOF6DCORE) {
-                //now if object is large enough for phase-space decomposition and search, compare local field to bg field
-                opt.Ncell=opt.Ncellfac*subnumingroup[i];
-                //if ncell is such that uncertainty would be greater than 0.5% based on Poisson noise, increase ncell till above unless cell would contain >25%
-                while (opt.Ncell<MINCELLSIZE && subnumingroup[i]/4.0>opt.Ncell) opt.Ncell*=2;
-                tree=InitializeTreeGrid(opt,subnumingroup[i],subPart);
-                ngrid=tree->GetNumLeafNodes();
-                if (opt.iverbose) cout<<ThisTask<<" Substructure "<<i<< " at sublevel "<<sublevel<<" with "<<subnumingroup[i]<<" particles split into are "<<ngrid<<" grid cells, with each node containing ~"<<subnumingroup[i]/ngrid<<" particles"<<endl;
-                grid=new GridCell[ngrid];
-                FillTreeGrid(opt, subnumingroup[i], ngrid, tree, subPart, grid);
-                gvel=GetCellVel(opt,subnumingroup[i],subPart,ngrid,grid);
-                gveldisp=GetCellVelDisp(opt,subnumingroup[i],subPart,ngrid,grid,gvel);
-                opt.HaloLocalSigmaV=0;for (int j=0;j<ngrid;j++) opt.HaloLocalSigmaV+=pow(gveldisp[j].Det(),1./3.);opt.HaloLocalSigmaV/=(double)ngrid;
-
-                Matrix eigvec(0.),I(0.);
-                Double_t sigma2x,sigma2y,sigma2z;
-                CalcVelSigmaTensor(subnumingroup[i], subPart, sigma2x, sigma2y, sigma2z, eigvec, I);
-                opt.HaloSigmaV=pow(sigma2x*sigma2y*sigma2z,1.0/3.0);
-                if (opt.HaloSigmaV>opt.HaloVelDispScale) opt.HaloVelDispScale=opt.HaloSigmaV;
-#ifdef HALOONLYDEN
-                GetVelocityDensity(opt,subnumingroup[i],subPart);
-#endif
-                GetDenVRatio(opt,subnumingroup[i],subPart,ngrid,grid,gvel,gveldisp);
-                GetOutliersValues(opt,subnumingroup[i],subPart,sublevel);
-                opt.idenvflag++;//largest field halo used to deteremine statistics of ratio
-            }
-            //otherwise only need to calculate a velocity scale for merger separation
-            else {
-                Matrix eigvec(0.),I(0.);
-                Double_t sigma2x,sigma2y,sigma2z;
-                CalcVelSigmaTensor(subnumingroup[i], subPart, sigma2x, sigma2y, sigma2z, eigvec, I);
-                opt.HaloLocalSigmaV=opt.HaloSigmaV=pow(sigma2x*sigma2y*sigma2z,1.0/3.0);
-            }
-            subpfof=SearchSubset(opt,subnumingroup[i],subnumingroup[i],subPart,subngroup[i],sublevel,&numcores[i]);
-            //now if subngroup>0 change the pfof ids of these particles in question and see if there are any substrucures that can be searched again.
-            //the group ids must be stored along with the number of groups in this substructure that will be searched at next level.
-            //now check if self bound and if not, id doesn't change from original subhalo,ie: subpfof[j]=0
+        //now change the pfof ids of the particles in the substructures found, in the order of the structures searched
+        //and alter subsubpglist so that index pointed is global subset index as global subset is used to get the particles to be searched for subsubstructure
+        for (i=1;i<=oldnsubsearch;i++) {
+            subpfofold[i]=pfof[subpglist[i][0]];
             if (subngroup[i]) {
-                ng=subngroup[i];
-                subsubnumingroup[i]=BuildNumInGroup(subnumingroup[i], subngroup[i], subpfof);
-                subsubpglist[i]=BuildPGList(subnumingroup[i], subngroup[i], subsubnumingroup[i], subpfof);
-                if (opt.uinfo.unbindflag&&subngroup[i]>0) {
-                    //if also keeping track of cores then must allocate coreflag
-                    if (numcores[i]>0 && opt.iHaloCoreSearch>=1) {
-                        coreflag=new Int_t[ng+1];
-                        for (int icore=1;icore<=ng;icore++) coreflag[icore]=1+(icore>ng-numcores[i]);
-                    }
-                    else {coreflag=NULL;}
-                    iunbindflag=CheckUnboundGroups(opt,subnumingroup[i],subPart,subngroup[i],subpfof,subsubnumingroup[i],subsubpglist[i],1, coreflag);
-                    if (iunbindflag) {
-                        for (int j=1;j<=ng;j++) delete[] subsubpglist[i][j];
-                        delete[] subsubnumingroup[i];
-                        delete[] subsubpglist[i];
-                        if (subngroup[i]>0) {
-                            subsubnumingroup[i]=BuildNumInGroup(subnumingroup[i], subngroup[i], subpfof);
-                            subsubpglist[i]=BuildPGList(subnumingroup[i], subngroup[i], subsubnumingroup[i], subpfof);
-                        }
-                        //if need to update number of cores,
-                        if (numcores[i]>0 && opt.iHaloCoreSearch>=1) {
-                            numcores[i]=0;
-                            for (int icore=1;icore<=subngroup[i];icore++)numcores[i]+=(coreflag[icore]==2);
-                            delete[] coreflag;
-                        }
-                    }
-                }
-                for (j=0;j<subnumingroup[i];j++) if (subpfof[j]>0) pfof[subpglist[i][j]]=ngroup+ngroupidoffset+subpfof[j];
+                for (Int_t j=0;j<subnumingroup[i];j++) if (subpfof[i][j]>0) pfof[subpglist[i][j]]=ngroup+ngroupidoffset+subpfof[i][j];
                 ngroupidoffset+=subngroup[i];
-                //now alter subsubpglist so that index pointed is global subset index as global subset is used to get the particles to be searched for subsubstructure
-                for (j=1;j<=subngroup[i];j++) for (Int_t k=0;k<subsubnumingroup[i][j];k++) subsubpglist[i][j][k]=subpglist[i][subsubpglist[i][j][k]];
+                for (Int_t j=1;j<=subngroup[i];j++) for (Int_t k=0;k<subsubnumingroup[i][j];k++) subsubpglist[i][j][k]=subpglist[i][subsubpglist[i][j][k]];
             }
-            delete[] subpfof;
-            delete[] subPart;
+            delete[] subpfof[i];
             //increase tot num of objects at sublevel
             ns+=subngroup[i];
         }
+        delete[] subpfof;
         //if objects have been found adjust the StrucLevelData
         //this stores the address of the parent particle and pfof along with child substructure particle and pfof
         if (ns>0) {
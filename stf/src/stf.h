@@ -243,6 +243,11 @@ the options to use.
     \subsection baryonic_analysis Analysing baryons
     Code to analyse baryonic component of haloes. Obsolete/In need of revision.
 
+    \subsection unbinding_benchmark Benchmarking the unbinding
+    The unbindbench code located within the analysis directory times the direct and tree potential, unbinding and binding energy
+    routines on synthetic NFW and Hernquist haloes with subhaloes and unbound contaminants over a range of sizes and numbers of threads.
+    Run as <tt>unbindbench -n 1000,100000 -t 1,8</tt>, see <tt>unbindbench -h</tt> for all options.
+
     \section modifications Modifications/Searching for other types of Structures
 
 The code can be modified to search for other types of substructures by altering the definition of an outlier
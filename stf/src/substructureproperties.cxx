@@ -24,7 +24,6 @@ void GetProperties(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngro
     Int_t i,j,k,ii;
     int inflag=0, ipflag=0;
     Int_t *noffset=new Int_t[ngroup+1];
-    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps;
     Double_t ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside;
     Double_t vc,rc,x,y,z;
     Coordinate cmold(0.),cmref;
@@ -320,21 +319,15 @@ private(i,j,k)
     #pragma omp for schedule(dynamic,1) nowait
 #endif
     for (i=1;i<=ngroup;i++) if (numingroup[i]<ompunbindnum) {
-        Double_t r2=0.0,v2,poti,Ti,pot;
+        Double_t v2,Ti;
+        if (!GetPotentialCache(opt,numingroup[i],&Part[noffset[i]])) DirectPotential(opt,numingroup[i],&Part[noffset[i]]);
         for (j=0;j<numingroup[i];j++) {
-            for (k=j+1;k<numingroup[i];k++) {
-                r2=0.;for (int n=0;n<3;n++) r2+=pow(Part[j+noffset[i]].GetPosition(n)-Part[k+noffset[i]].GetPosition(n),2.0);
-                r2+=eps2;
-                r2=1.0/sqrt(r2);
-                pdata[i].Pot+=pot=-opt.G*(Part[j+noffset[i]].GetMass()*Part[k+noffset[i]].GetMass())*r2;
-                poti=Part[j+noffset[i]].GetPotential()+pot;Part[j+noffset[i]].SetPotential(poti);
-                poti=Part[k+noffset[i]].GetPotential()+pot;Part[k+noffset[i]].SetPotential(poti);
-            }
+            pdata[i].Pot+=0.5*Part[j+noffset[i]].GetPotential();
             v2=0.;for (int n=0;n<3;n++) v2+=pow(Part[j+noffset[i]].GetVelocity(n)-pdata[i].gcmvel[n],2.0);
             Ti=0.5*Part[j+noffset[i]].GetMass()*v2;
 #ifdef NOMASS
             Ti*=opt.MassValue;
-            Part[k+noffset[i]].SetPotential(Part[k+noffset[i]].GetPotential()*mw2);
+            Part[j+noffset[i]].SetPotential(Part[j+noffset[i]].GetPotential()*mw2);
 #endif
             pdata[i].T+=Ti;
             if(Ti+Part[j+noffset[i]].GetPotential()<0) pdata[i].Efrac+=1.0;
@@ -345,8 +338,8 @@ private(i,j,k)
 }
 #endif
     for (i=1;i<=ngroup;i++) if (numingroup[i]>=ompunbindnum) {
-        //here a monopole kd tree calculation of potential
-        Potential(opt,numingroup[i],&Part[noffset[i]]);
+        //here a quadrupole kd tree calculation of potential, unless cached when unbinding
+        if (!GetPotentialCache(opt,numingroup[i],&Part[noffset[i]])) Potential(opt,numingroup[i],&Part[noffset[i]]);
         Double_t v2,Ti;
         Double_t Tval,Potval,Efracval;
         Tval=0;Potval=0;Efracval=0;
@@ -394,7 +387,7 @@ private(j,v2,Ti)
 void GetCMProp(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngroup, Int_t *&pfof, Int_t *&numingroup, PropData *&pdata, Int_t *&noffset)
 {
     Particle *Pval;
-    Int_t i,j,k;
+    Int_t i,j,k,ig;
     if (opt.iverbose) cout<<"Get CM"<<endl;
     Coordinate cmold(0.),cmref;
     Double_t ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside;
@@ -421,6 +414,10 @@ private(i)
 #ifdef USEOPENMP
 }
 #endif
+    //order the groups by decreasing cost so the most expensive are started first, see \ref BuildGroupSchedule
+    //the split at omppropnum is kept fixed as large groups are processed differently
+    GroupSchedule gs;
+    BuildGroupSchedule(gs,ngroup,numingroup,GSCHEDNLOGN,omppropnum,omppropnum);
     //for small groups loop over groups
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
@@ -428,8 +425,9 @@ private(i,j,k,Pval,ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside,cmold,change,tol,x,y,z
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (i=1;i<=ngroup;i++) if (numingroup[i]<omppropnum)
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++)
     {
+        i=gs.pool[ig];
         for (k=0;k<3;k++) pdata[i].gcm[k]=pdata[i].gcmvel[k]=0;
         pdata[i].gmass=pdata[i].gmaxvel=0.0;
         for (j=0;j<numingroup[i];j++) {
@@ -1026,6 +1024,7 @@ private(i,j,k,Pval,ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside,cmold,change,tol,x,y,z
 
         //reset particle positions
         for (j=0;j<numingroup[i];j++) {
+            Pval=&Part[j+noffset[i]];
             x = (*Pval).X()+pdata[i].gcm[0];
             y = (*Pval).Y()+pdata[i].gcm[1];
             z = (*Pval).Z()+pdata[i].gcm[2];
@@ -1036,8 +1035,9 @@ private(i,j,k,Pval,ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside,cmold,change,tol,x,y,z
 }
 #endif
 
-    for (i=1;i<=ngroup;i++) if (numingroup[i]>=omppropnum)
+    for (ig=0;ig<(Int_t)gs.large.size();ig++)
     {
+        i=gs.large[ig];
         for (k=0;k<3;k++) pdata[i].gcm[k]=pdata[i].gcmvel[k]=0;
         pdata[i].gmass=pdata[i].gmaxvel=0.0;
         EncMass=cmx=cmy=cmz=0.;
@@ -1807,6 +1807,7 @@ private(j,Pval,x,y,z,vx,vy,vz,jval,jzval,zdist,Rdist)
 #endif
         //reset particle positions
         for (j=0;j<numingroup[i];j++) {
+            Pval=&Part[j+noffset[i]];
             x = (*Pval).X()+pdata[i].gcm[0];
             y = (*Pval).Y()+pdata[i].gcm[1];
             z = (*Pval).Z()+pdata[i].gcm[2];
@@ -1834,9 +1835,9 @@ private(i,j,k,Pval)
 void GetInclusiveMasses(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngroup, Int_t *&pfof, Int_t *&numingroup, PropData *&pdata, Int_t *&noffset)
 {
     Particle *Pval;
-    Int_t i,j,k;
+    Int_t i,j,k,ig;
     if (opt.iverbose) cout<<"Get inclusive masses"<<endl;
-    Double_t ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside;
+    Double_t ri,rcmv,r2,cmx,cmy,cmz,cmvx,cmvy,cmvz,EncMass,Ninside;
     Double_t vc,rc,x,y,z,vx,vy,vz;
     Coordinate cmold(0.),cmref;
     Double_t change=MAXVALUE,tol=1e-2;
@@ -1847,7 +1848,10 @@ void GetInclusiveMasses(Options &opt, const Int_t nbodies, Particle *Part, Int_t
     Double_t m500val=log(opt.rhobg/opt.Omega_m*500.0);
 
     for (i=1;i<=ngroup;i++) pdata[i].gNFOF=numingroup[i];
-    //for small groups loop over groups
+    //split the groups between those processed concurrently and those large enough to use all threads, see \ref BuildGroupSchedule
+    GroupSchedule gs;
+    BuildGroupSchedule(gs,ngroup,numingroup,GSCHEDNLOGN,omppropnum,GSCHEDMAXFAC*omppropnum);
+    //for groups in the pool loop over groups
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
 private(i,j,k,Pval,ri,rcmv,r2,cmx,cmy,cmz,EncMass,Ninside,cmold,change,tol,x,y,z,vc,rc,vx,vy,vz,numinvir,num200c,num200m)\
@@ -1855,8 +1859,9 @@ firstprivate(virval,m200val,m200mval)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (i=1;i<=ngroup;i++) if (numingroup[i]<omppropnum)
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++)
     {
+        i=gs.pool[ig];
         for (k=0;k<3;k++) pdata[i].gcm[k]=pdata[i].gcmvel[k]=0;
         pdata[i].gmass=pdata[i].gmaxvel=0.0;
         for (j=0;j<numingroup[i];j++) {
@@ -1920,16 +1925,18 @@ firstprivate(virval,m200val,m200mval)
 #ifdef USEOPENMP
 }
 #endif
-    for (i=1;i<=ngroup;i++) if (numingroup[i]>=omppropnum)
+    //otherwise thread over the particles of each group
+    for (ig=0;ig<(Int_t)gs.large.size();ig++)
     {
+        i=gs.large[ig];
         for (k=0;k<3;k++) pdata[i].gcm[k]=pdata[i].gcmvel[k]=0;
         pdata[i].gmass=pdata[i].gmaxvel=0.0;
-        EncMass=cmx=cmy=cmz=0.;
+        EncMass=cmx=cmy=cmz=cmvx=cmvy=cmvz=0.;
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
 private(j,Pval)
 {
-    #pragma omp for reduction(+:EncMass,cmx,cmy,cmz)
+    #pragma omp for reduction(+:EncMass,cmx,cmy,cmz,cmvx,cmvy,cmvz)
 #endif
         for (j=0;j<numingroup[i];j++) {
             Pval=&Part[j+noffset[i]];
@@ -1937,11 +1944,15 @@ private(j,Pval)
             cmx+=(*Pval).X()*(*Pval).GetMass();
             cmy+=(*Pval).Y()*(*Pval).GetMass();
             cmz+=(*Pval).Z()*(*Pval).GetMass();
+            cmvx+=(*Pval).Vx()*(*Pval).GetMass();
+            cmvy+=(*Pval).Vy()*(*Pval).GetMass();
+            cmvz+=(*Pval).Vz()*(*Pval).GetMass();
         }
 #ifdef USEOPENMP
 }
 #endif
         pdata[i].gcm[0]=cmx;pdata[i].gcm[1]=cmy;pdata[i].gcm[2]=cmz;
+        pdata[i].gcmvel[0]=cmvx;pdata[i].gcmvel[1]=cmvy;pdata[i].gcmvel[2]=cmvz;
         pdata[i].gmass=EncMass;
         pdata[i].gMFOF=EncMass;
         for (k=0;k<3;k++){pdata[i].gcm[k]*=(1.0/pdata[i].gmass);pdata[i].gcmvel[k]*=(1.0/pdata[i].gmass);}
@@ -2608,6 +2619,25 @@ void ReorderInclusiveMasses(const Int_t &numgroups, const Int_t &newnumgroups, I
 
 ///\name Routines related to calculating energy of groups and sorting of particles
 //@{
+///Calculate the potential of a group with the tree calculation unless it is cached, see \ref GetPotentialCache. The particle ids are preserved.
+static void GetLargeGroupPotential(Options &opt, const Int_t nig, Particle *Part)
+{
+    Int_t *storepid;
+    if (GetPotentialCache(opt,nig,Part)) return;
+    //the tree code used to calculate potential overwrites the id of particles so store id values in PID value
+    storepid=new Int_t[nig];
+    for (Int_t j=0;j<nig;j++) {
+        storepid[j]=Part[j].GetPID();
+        Part[j].SetPID(Part[j].GetID());
+    }
+    Potential(opt,nig,Part);
+    for (Int_t j=0;j<nig;j++) {
+        Part[j].SetID(Part[j].GetPID());
+        Part[j].SetPID(storepid[j]);
+    }
+    delete[] storepid;
+}
+
 /*!
     Calculate the potential energy and kinetic energy relative to the velocity frame stored in gcmvel. Note that typically this is the velocity of particles within
     the inner region used to determine the centre-of-mass. BUT of course, this frame is not without its flaws, as in a chaotic mergering system, one might not be able
@@ -2630,89 +2660,52 @@ void GetBindingEnergy(Options &opt, const Int_t nbodies, Particle *Part, Int_t n
 
     //used to access current particle
     Particle *Pval;
-    Int_t i,j,k;
-    //store eps2 for plummer softening to cut down number of floating point operations
-    //Note could use more complicated b-spline but at least here since not evolving dynamics, plummer potential not an issue.
-    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps;
-
+    Int_t i,j,k,ig;
     //useful variables to store temporary results
-    Double_t r2,v2,Ti,poti,pot;
+    Double_t v2,Ti;
     Double_t Tval,Potval,Efracval,Eval,Emostbound,Eunbound,imostbound,iunbound;
     Double_t Efracval_gas,Efracval_star;
     Double_t mw2=opt.MassValue*opt.MassValue;
-    Double_t potmin,menc;
-    Int_t npot,ipotmin;
 
-    //used to temporarily store pids. Needed for large groups as the tree code used to calculate potential overwrites the id of particles so that once
-    //finished it puts the particles back into the input order. Therefore store id values in PID  value (which can be over written)
-    //also if wish to use the deepest potential as a reference, then used to store original order
-    Int_t *storepid;
+    //split the groups between those processed concurrently and those large enough to use all threads, see \ref BuildGroupSchedule
+    GroupSchedule gs;
+    BuildGroupSchedule(gs,ngroup,numingroup,GSCHEDNLOGN,ompunbindnum,GSCHEDMAXFAC*ompunbindnum);
 
-    //small groups with PP calculations of potential.
+    //groups in the pool, small groups with PP calculations of potential and others with the tree calculation used for large groups
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid,menc,potmin,ipotmin)
+private(i,j,k,v2,Ti,Eval)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (i=1;i<=ngroup;i++) if (numingroup[i]<ompunbindnum) {
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+        i=gs.pool[ig];
+        if (numingroup[i]>=ompunbindnum) {
+            GetLargeGroupPotential(opt,numingroup[i],&Part[noffset[i]]);
+            continue;
+        }
+        if (!GetPotentialCache(opt,numingroup[i],&Part[noffset[i]])) DirectPotential(opt,numingroup[i],&Part[noffset[i]]);
         for (j=0;j<numingroup[i];j++) {
-            for (k=j+1;k<numingroup[i];k++) {
-                r2=0.;for (int n=0;n<3;n++) r2+=pow(Part[j+noffset[i]].GetPosition(n)-Part[k+noffset[i]].GetPosition(n),2.0);
-                r2+=eps2;
-                r2=1.0/sqrt(r2);
 #ifdef NOMASS
-                pot=-opt.G*r2*mw2;
-#else
-                pot=-opt.G*(Part[j+noffset[i]].GetMass()*Part[k+noffset[i]].GetMass())*r2;
+            Part[j+noffset[i]].SetPotential(Part[j+noffset[i]].GetPotential()*mw2);
 #endif
-                pdata[i].Pot+=pot;
-                poti=Part[j+noffset[i]].GetPotential()+pot;Part[j+noffset[i]].SetPotential(poti);
-                poti=Part[k+noffset[i]].GetPotential()+pot;Part[k+noffset[i]].SetPotential(poti);
-            }
+            pdata[i].Pot+=0.5*Part[j+noffset[i]].GetPotential();
         }
     }
 #ifdef USEOPENMP
 }
 #endif
 
-        //once potential is calculated, iff using velocity around deepest potential well NOT cm
+        //once potential is calculated, iff using velocity around deepest potential well NOT cm, see \ref GetPotentialMinimumFrame
     if (opt.uinfo.cmvelreftype==POTREF) {
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid,menc,potmin,ipotmin)
+private(i)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-        for (i=1;i<=ngroup;i++) if (numingroup[i]<ompunbindnum) {
-            //determine how many particles to use
-            npot=max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*numingroup[i]));
-            //store old ordering
-            storepid=new Int_t[numingroup[i]];
-            for (j=0;j<numingroup[i];j++) {storepid[j]=Part[j+noffset[i]].GetPID();Part[j+noffset[i]].SetPID(j);}
-            //determine position of minimum potential and by radius around this position
-            potmin=Part[noffset[i]].GetPotential();ipotmin=0;
-            for (j=0;j<numingroup[i];j++) if (Part[j+noffset[i]].GetPotential()<potmin) {potmin=Part[j+noffset[i]].GetPotential();ipotmin=j;}
-            for (k=0;k<3;k++) pdata[i].gcm[k]=Part[ipotmin+noffset[i]].GetPosition(k);
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) Part[j+noffset[i]].SetPosition(k,Part[j+noffset[i]].GetPosition(k)-pdata[i].gcm[k]);
-            }
-            gsl_heapsort(&Part[noffset[i]],numingroup[i],sizeof(Particle),RadCompare);
-            //now determine kinetic frame
-            pdata[i].gcmvel[0]=pdata[i].gcmvel[1]=pdata[i].gcmvel[2]=menc=0.;
-            for (j=0;j<npot;j++) {
-                for (k=0;k<3;k++) pdata[i].gcmvel[k]+=Part[j+noffset[i]].GetVelocity(k)*Part[j+noffset[i]].GetMass();
-                menc+=Part[j+noffset[i]].GetMass();
-            }
-            for (j=0;j<3;j++) {pdata[i].gcmvel[j]/=menc;}
-            //and restore order and original frame
-            gsl_heapsort(&Part[noffset[i]],numingroup[i],sizeof(Particle),PIDCompare);
-            for (j=0;j<numingroup[i];j++) Part[j+noffset[i]].SetPID(storepid[j]);
-            delete[] storepid;
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) Part[j+noffset[i]].SetPosition(k,Part[j+noffset[i]].GetPosition(k)+pdata[i].gcm[k]);
-            }
-        }
+        for (i=1;i<=ngroup;i++) if (numingroup[i]<ompunbindnum)
+            GetPotentialMinimumFrame(opt,numingroup[i],&Part[noffset[i]],pdata[i].gcm,pdata[i].gcmvel,0);
 #ifdef USEOPENMP
 }
 #endif
@@ -2721,7 +2714,7 @@ private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid,menc,potmin,ipotmin)
     //then calculate binding energy and store in potential
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid)
+private(i,j,k,v2,Ti,Eval)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
@@ -2766,58 +2759,23 @@ private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid)
 #endif
 
     //loop for large groups with tree calculation
-    for (i=1;i<=ngroup;i++) if (numingroup[i]>=ompunbindnum) {
-        storepid=new Int_t[numingroup[i]];
-        for (j=0;j<numingroup[i];j++) {
-            storepid[j]=Part[noffset[i]+j].GetPID();
-            Part[noffset[i]+j].SetPID(Part[noffset[i]+j].GetID());
-        }
-        //calculate potential
-        Potential(opt,numingroup[i],&Part[noffset[i]]);
-        for (j=0;j<numingroup[i];j++) {
-            Part[noffset[i]+j].SetID(Part[noffset[i]+j].GetPID());
-            Part[noffset[i]+j].SetPID(storepid[j]);
-        }
-        delete[] storepid;
-    }
+    for (ig=0;ig<(Int_t)gs.large.size();ig++) GetLargeGroupPotential(opt,numingroup[gs.large[ig]],&Part[noffset[gs.large[ig]]]);
 
-    //if using POTREF, most computations involve sorts, so parallize over groups
+    //if using POTREF, find the frame of the groups with tree potentials, threading over the particles of the largest
     if (opt.uinfo.cmvelreftype==POTREF) {
+        for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+            i=gs.large[ig];
+            GetPotentialMinimumFrame(opt,numingroup[i],&Part[noffset[i]],pdata[i].gcm,pdata[i].gcmvel,1);
+        }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,r2,v2,poti,Ti,pot,Eval,npot,storepid,menc,potmin,ipotmin)
+private(i)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-        for (i=1;i<=ngroup;i++) if (numingroup[i]>=ompunbindnum) {
-            //once potential is calculated, iff using NOT cm but velocity around deepest potential well
-            //determine how many particles to use
-            npot=max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*numingroup[i]));
-            //store old ordering
-            storepid=new Int_t[numingroup[i]];
-            for (j=0;j<numingroup[i];j++) {storepid[j]=Part[j+noffset[i]].GetPID();Part[j+noffset[i]].SetPID(j);}
-            //determine position of minimum potential and by radius around this position
-            potmin=Part[noffset[i]].GetPotential();ipotmin=0;
-            for (j=0;j<numingroup[i];j++) if (Part[j+noffset[i]].GetPotential()<potmin) {potmin=Part[j+noffset[i]].GetPotential();ipotmin=j;}
-            for (k=0;k<3;k++) pdata[i].gcm[k]=Part[ipotmin+noffset[i]].GetPosition(k);
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) Part[j+noffset[i]].SetPosition(k,Part[j+noffset[i]].GetPosition(k)-pdata[i].gcm[k]);
-            }
-            gsl_heapsort(&Part[noffset[i]],numingroup[i],sizeof(Particle),RadCompare);
-            //now determine kinetic frame
-            pdata[i].gcmvel[0]=pdata[i].gcmvel[1]=pdata[i].gcmvel[2]=menc=0.;
-            for (j=0;j<npot;j++) {
-                for (k=0;k<3;k++) pdata[i].gcmvel[k]+=Part[j+noffset[i]].GetVelocity(k)*Part[j+noffset[i]].GetMass();
-                menc+=Part[j+noffset[i]].GetMass();
-            }
-            for (j=0;j<3;j++) {pdata[i].gcmvel[j]/=menc;}
-            //and restore order and original frame
-            gsl_heapsort(&Part[noffset[i]],numingroup[i],sizeof(Particle),PIDCompare);
-            for (j=0;j<numingroup[i];j++) Part[j+noffset[i]].SetPID(storepid[j]);
-            delete[] storepid;
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) Part[j+noffset[i]].SetPosition(k,Part[j+noffset[i]].GetPosition(k)+pdata[i].gcm[k]);
-            }
+        for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+            i=gs.pool[ig];
+            if (numingroup[i]>=ompunbindnum) GetPotentialMinimumFrame(opt,numingroup[i],&Part[noffset[i]],pdata[i].gcm,pdata[i].gcmvel,0);
         }
 #ifdef USEOPENMP
 }
@@ -172,6 +172,7 @@ void usage(void)
         - \b 5 \e standard 3D FOF based algorithm
         - \b 4 \e standard 3D FOF based algorithm <b> FOLLOWED </b> by 6D FOF search using the velocity scale defined by the largest halo on <b> ONLY </b> particles in 3DFOF groups
         - \b 3 \e standard 3D FOF based algorithm <b> FOLLOWED </b> by 6D FOF search using the velocity scale for each 3DFOF group
+    \arg <b> \e FoF_Field_search_engine </b> 0/1 flag indicating whether the 3D FOF search for field objects uses a kd-tree (0) or a uniform grid of cells the size of the linking length (1), which is faster for cosmological volumes. The grid is only used without MPI and when all particles are linked with the same criterion, otherwise the tree is used. \ref Options.fofengine \n
     \arg <b> \e Minimum_halo_size </b> Allows field objects (or so-called halos) to require a different minimum size (typically would be <= \ref Options.MinSize. Default is -1 which sets it to \ref Options.MinSize) \ref Options.HaloMinSize \n
     \arg <b> \e Halo_linking_length_factor </b> allows one to use different physical linking lengths between field objects and substructures.  (Typically for 3DFOF searches of dark matter haloes, set to value such that this times \ref Options.ellphys = 0.2 the interparticle spacing when examining cosmological simulations ) \ref Options.ellhalophysfac \n
     \arg <b> \e Halo_velocity_linking_length_factor </b> allows one to use different velocity linking lengths between field objects and substructures when using 6D FOF searches.  (Since in such cases the general idea is to use the local velocity dispersion to define a scale, \f$ \geq5 \f$ times this value seems to correctly scale searches) \ref Options.ellhalovelfac \n
@@ -207,6 +208,9 @@ void usage(void)
     and extracted from the halo. Demanding boundness after substructure search can have interesting consequences as it is possible that a multiple merger will appear as
     a single FOF halo, however all with all the cores removed, the FOF halo is actually an unbound structure. \ref Options.iBoundHalos \n
     \arg <b> \e Keep_background_potential </b> 1/0 flag When determining whether a structure is self-bound, the approach taken is to treat the candidate structure in isolation. Then determine the velocity reference frame to determine the kinetic energy of each particle and remove them. However, it is possible one wishes to keep the background particles when determining the potential, that is once one starts unbinding, don't treat the candidate structure in isolation but in a background sea. When finding tidal debris, it is useful to keep the background. \ref Options.uinfo & \ref UnbindInfo.bgpot \n
+    \arg <b> \e Tree_potential_opening_angle </b> Opening angle \f$ \theta \f$ used by the tree potential of large groups (0.7). A cell of the tree with quadrupole moments is used in place of its particles if it is further than \f$ b_{\rm max}/\theta \f$, where \f$ b_{\rm max} \f$ is the radius enclosing the cell's particles. Smaller values are more accurate and more expensive. With verbose output the bound on the relative error is reported. \ref Options.uinfo & \ref UnbindInfo.TreeThetaOpen \n
+    \arg <b> \e Cache_potential </b> 1/0 flag to cache the potentials calculated when unbinding and reuse them when calculating binding energies and properties (0). Groups whose membership has changed since they were unbound get only the change in their potential calculated. Groups of more than \ref UNBINDNUM particles then have the accuracy of the tree potential rather than that of the direct sum otherwise used for groups of fewer than \ref Options.ompunbindnum particles. For each particle in a group, the cache holds its id, position, mass and potential along with an entry in a hash map from id to group, roughly 80 bytes per particle in groups in single precision and 100 in double precision. \ref Options.uinfo & \ref UnbindInfo.icachepot \n
+    \arg <b> \e Mixed_precision_potential </b> 1/0 flag to sum the particle-particle terms of the potential in single precision, from positions relative to the centre of the group, adding partial sums in double precision (0). This is faster and gives potentials with a relative accuracy of about \ref GRAVMIXEDERR, sufficient for the binding check. When unbinding groups whose potential is calculated by direct summation, particles whose energy is this close to the threshold have their potential recalculated in double precision. \ref Options.uinfo & \ref UnbindInfo.imixedpot \n
     \arg <b> \e Kinetic_reference_frame_type </b> specify kinetic frame when determining whether particle is bound.
     Default is to use the centre-of-mass velocity frame (0) but can also use region around minimum of the potential (1). \ref Options.uinfo & \ref UnbindInfo.cmvelreftype \n
     \arg <b> \e Min_npot_ref </b> Set the minimum number of particles used to calculate the velocity of the minimum of the potential (10). \ref Options.uinfo & \ref UnbindInfo.Npotref \n
@@ -247,6 +251,7 @@ void usage(void)
     \section ioconfigs I/O options
     \arg <b> \e Cosmological_input </b> 1/0 indicating that input simulation is cosmological or not. With cosmological input, a variety of length/velocity scales are set to determine such things as the virial overdensity, linking length. \ref Options.icosmologicalin \n
     \arg <b> \e Input_chunk_size </b> Amount of information to read from input file in one go (100000). \ref Options.inputbufsize \n
+    \arg <b> \e Particle_reorder_type </b> 0/1/2 flag indicating whether particles are reordered along a Morton (1) or Peano-Hilbert (2) curve once read, so that particles close in space are close in memory. Output is unaffected as particles are returned to input order before it is written. \ref Options.iparticlereorder \n
     \arg <b> \e Write_group_array_file </b> 0/1 flag indicating whether write a single large tipsy style group assignment file is written. \ref Options.iwritefof \n
     \arg <b> \e Separate_output_files </b> 1/0 flag indicating whether separate files are written for field and subhalo groups. \ref Options.iseparatefiles \n
     \arg <b> \e Binary_output </b> 3/2/1/0 flag indicating whether output is hdf, binary or ascii. \ref Options.ibinaryout, \ref OUTADIOS, \ref OUTHDF, \ref OUTBINARY, \ref OUTASCII \n
@@ -272,6 +277,10 @@ void usage(void)
     of data. \ref Options.mpipartfac \n
     \arg <b> \e MPI_particle_total_buf_size </b> Total memory size in bytes used to store particles in temporary buffer such that
     particles are sent to non-reading mpi processes in one communication round in chunks of size buffer_size/NProcs/sizeof(Particle). \ref Options.mpiparticlebufsize \n
+    \arg <b> \e MPI_collective_unbinding_min_size </b> When unbinding halos (see Bound_halos), halos with at least this many particles are divided between a group of mpi tasks
+    and unbound by them together rather than by the task holding the halo alone, so that a few very large halos do not leave the other tasks idle. Each task holds a spatially compact piece
+    of the halo and its tree, only the top of the other pieces' trees and the particles near their boundaries are exchanged, and the kinetic frame and removal of unbound particles are done collectively.
+    0 disables this (0). \ref Options.uinfo & \ref UnbindInfo.mpiunbindnum \n
 
 
 
@@ -363,6 +372,8 @@ void GetParamFile(Options &opt)
                         opt.foftype = atoi(vbuff);
                     else if (strcmp(tbuff, "FoF_Field_search_type")==0)
                         opt.fofbgtype = atoi(vbuff);
+                    else if (strcmp(tbuff, "FoF_Field_search_engine")==0)
+                        opt.fofengine = atoi(vbuff);
                     else if (strcmp(tbuff, "Search_for_substructure")==0)
                         opt.iSubSearch = atoi(vbuff);
                     else if (strcmp(tbuff, "Keep_FOF")==0)
@@ -497,6 +508,12 @@ void GetParamFile(Options &opt)
                     //unbinding
                     else if (strcmp(tbuff, "Softening_length")==0)
                         opt.uinfo.eps = atof(vbuff);
+                    else if (strcmp(tbuff, "Tree_potential_opening_angle")==0)
+                        opt.uinfo.TreeThetaOpen = atof(vbuff);
+                    else if (strcmp(tbuff, "Cache_potential")==0)
+                        opt.uinfo.icachepot = atoi(vbuff);
+                    else if (strcmp(tbuff, "Mixed_precision_potential")==0)
+                        opt.uinfo.imixedpot = atoi(vbuff);
                     else if (strcmp(tbuff, "Allowed_kinetic_potential_ratio")==0)
                         opt.uinfo.Eratio = atof(vbuff);
                     else if (strcmp(tbuff, "Min_bound_mass_frac")==0)
@@ -530,11 +547,15 @@ void GetParamFile(Options &opt)
                     //input read related
                     else if (strcmp(tbuff, "Input_chunk_size")==0)
                         opt.inputbufsize = atol(vbuff);
+                    else if (strcmp(tbuff, "Particle_reorder_type")==0)
+                        opt.iparticlereorder = atoi(vbuff);
                     else if (strcmp(tbuff, "MPI_particle_total_buf_size")==0)
                         opt.mpiparticletotbufsize = atol(vbuff);
                     //mpi memory related
                     else if (strcmp(tbuff, "MPI_part_allocation_fac")==0)
                         opt.mpipartfac = atof(vbuff);
+                    else if (strcmp(tbuff, "MPI_collective_unbinding_min_size")==0)
+                        opt.uinfo.mpiunbindnum = atol(vbuff);
 
                     //output related
                     else if (strcmp(tbuff, "Separate_output_files")==0)
@@ -629,6 +650,42 @@ inline void ConfigCheck(Options &opt)
 #endif
     }
 
+    if (opt.fofengine!=FOFENGINETREE && opt.fofengine!=FOFENGINEGRID){
+#ifdef USEMPI
+    if (ThisTask==0)
+#endif
+        cerr<<"Invalid FOF search engine, must be 0 (tree) or 1 (grid)\n";
+#ifdef USEMPI
+            MPI_Abort(MPI_COMM_WORLD,8);
+#else
+            exit(8);
+#endif
+    }
+
+    if (opt.uinfo.TreeThetaOpen<=0 || opt.uinfo.TreeThetaOpen>=1){
+#ifdef USEMPI
+    if (ThisTask==0)
+#endif
+        cerr<<"Invalid tree potential opening angle, must be in (0,1)\n";
+#ifdef USEMPI
+            MPI_Abort(MPI_COMM_WORLD,8);
+#else
+            exit(8);
+#endif
+    }
+
+    if (opt.iparticlereorder<PREORDERNONE || opt.iparticlereorder>PREORDERPH){
+#ifdef USEMPI
+    if (ThisTask==0)
+#endif
+        cerr<<"Invalid particle reorder type, must be 0 (none), 1 (Morton) or 2 (Peano-Hilbert)\n";
+#ifdef USEMPI
+            MPI_Abort(MPI_COMM_WORLD,8);
+#else
+            exit(8);
+#endif
+    }
+
     if (opt.lengthtokpc<=0){
 #ifdef USEMPI
     if (ThisTask==0)
@@ -1,912 +1,1131 @@
 /*! \file unbind.cxx
  *  \brief this file contains routines to check if groups are self-bound and if not unbind them as requried
 
-    \todo Need to improve the gravity calculation (ie: for tree potential use something other than just monopole and also apply corrections if necessary).
+    \todo Need to improve the gravity calculation (ie: apply corrections for periodic systems if necessary).
     \todo Need to clean up unbind proceedure, ensure its mpi compatible and can be combined with a pglist output easily
  */
 
 #include "stf.h"
 
-///\name Tree-Potential routines
+///\name Potential routines
 //@{
-///subroutine that generates node list for tree gravity calculation
-void GetNodeList(Node *np, Int_t &ncell, Node **nodelist, const Int_t bsize){
-    nodelist[ncell]=np;
-    nodelist[ncell]->SetID(ncell);
-    if (np->GetCount()>bsize){
-        ncell++;GetNodeList(((SplitNode*)np)->GetLeft(),ncell,nodelist,bsize);
-        ncell++;GetNodeList(((SplitNode*)np)->GetRight(),ncell,nodelist,bsize);
-    }
-    //else ncell++;
+///parameters of the gravity calculations of \ref Gravity.h for the unbinding options
+static inline GravityInfo GetGravityInfo(Options &opt)
+{
+    GravityInfo gi;
+    gi.G=opt.G;
+    gi.eps=opt.uinfo.eps;
+    gi.theta=opt.uinfo.TreeThetaOpen;
+    gi.bsize=opt.uinfo.BucketSize;
+    gi.ompnum=ompunbindnum;
+    gi.imixed=opt.uinfo.imixedpot;
+    return gi;
 }
 
-///subroutine that marks a cell for a given particle in tree-walk
-inline void MarkCell(Node *np, Int_t *marktreecell, Int_t *markleafcell, Int_t &ntreecell, Int_t &nleafcell, Double_t *r2val, const Int_t bsize, Double_t *cR2max, Coordinate *cm, Double_t *cmtot, Coordinate xpos, Double_t eps2){
-    Int_t nid=np->GetID();
-    Double_t r2;
-    r2=0;
-    //determine the distance from cells cm to particle
-    for (int k=0;k<3;k++)r2+=(cm[nid][k]-xpos[k])*(cm[nid][k]-xpos[k]);
-    //if the particle is not distant enough to treat cell (and all subcells) as a mono (or quad) pole mass then
-    //enter the cell so long as it is not a leaf node (or minimum cell size)
-    //if it is a minimum cell size, the cell is marked with a ileafflag
-    if (r2<cR2max[nid]) {
-        if (np->GetCount()>bsize){
-            MarkCell(((SplitNode*)np)->GetLeft(),marktreecell,markleafcell,ntreecell,nleafcell,r2val,bsize,cR2max,cm,cmtot,xpos,eps2);
-            MarkCell(((SplitNode*)np)->GetRight(),marktreecell,markleafcell,ntreecell,nleafcell,r2val,bsize,cR2max,cm,cmtot,xpos,eps2);
-        }
-        else markleafcell[nleafcell++]=nid;
-    }
-    else {
-        r2val[ntreecell]=cmtot[nid]/sqrt(r2+eps2);
-        marktreecell[ntreecell++]=nid;
-    }
+/*!
+    Calculates the gravitational potential energy of a set of particles, \f$ -G m_i\sum_j m_j/\sqrt{r_{ij}^2+\epsilon^2} \f$, by direct summation
+    and stores it in the particles (see \ref NBody::GravityDirectPotential). Used for small groups, where building a tree is not worthwhile.
+*/
+void DirectPotential(Options &opt, const Int_t nbodies, Particle *Part)
+{
+    GravityDirectPotential(GetGravityInfo(opt),nbodies,Part);
 }
 
+/*!
+    Calculates the gravitational potential energy of a set of particles using a kd-tree with quadrupole moments and a dual tree walk
+    (see \ref NBody::GravityTreePotential). The accuracy is set by the opening angle \ref UnbindInfo.TreeThetaOpen.
+    If potV is NULL the potential is stored in the particles, otherwise it is stored in potV in the original order of the particles.
+    Returns the maximum over particles of the bound on the relative error.
+*/
+Double_t TreePotential(Options &opt, const Int_t nbodies, Particle *Part, Double_t *potV)
+{
+    return GravityTreePotential(GetGravityInfo(opt),nbodies,Part,potV);
+}
 //@}
 
-///\name Remove unbound particles from a candidate group
+///\name Potential cache routines
 //@{
+///mixes the bits of a particle id so that the sum over the members of a group is an order independent hash of the membership
+static inline unsigned long long PotentialCacheHash(PARTPIDTYPE pid)
+{
+    unsigned long long z=(unsigned long long)pid+0x9E3779B97F4A7C15ULL;
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return z^(z>>31);
+}
+
 /*!
-    Interface for unbinding proceedure. Unbinding routine requires several arrays, such as numingroup, pglist,gPart,ids, etc
-    This arrays may have been constructed prior to the unbinding call and so can be passed to the routine
-    if this is called it uses Particle array then deletes it.
+    Stores the potentials of a group in \ref potcache, dividing out potscale so the cached values are those returned by \ref Potential.
+    Each member is indexed by its particle id, replacing any older entry, and cached groups are freed once none of their members refer to them.
 */
-int CheckUnboundGroups(Options opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup, Int_t **pglist, int ireorder, Int_t *groupflag){
-    bool ningflag=false, pglistflag=false;
-    int iflag;
-    Int_t ng=ngroup;
-#ifndef USEMPI
-    int ThisTask=0,NProcs=1;
+void StorePotentialCache(Options &opt, const Int_t nbodies, Particle *Part, const Double_t potscale)
+{
+    if (potcache==NULL || nbodies<=0) return;
+    //members must be identifiable by their particle ids, which is not the case for input that does not provide them
+    vector<PARTPIDTYPE> pids(nbodies);
+    for (Int_t j=0;j<nbodies;j++) pids[j]=Part[j].GetPID();
+    sort(pids.begin(),pids.end());
+    if (adjacent_find(pids.begin(),pids.end())!=pids.end()) return;
+    PotentialCacheGroup *g=new PotentialCacheGroup;
+    g->hash=0;
+    g->nref=0;
+    g->pid.resize(nbodies);
+    g->x.resize(nbodies);g->y.resize(nbodies);g->z.resize(nbodies);
+    g->mass.resize(nbodies);g->pot.resize(nbodies);
+    for (Int_t j=0;j<nbodies;j++) {
+        g->pid[j]=Part[j].GetPID();
+        g->x[j]=Part[j].GetPosition(0);g->y[j]=Part[j].GetPosition(1);g->z[j]=Part[j].GetPosition(2);
+        g->mass[j]=Part[j].GetMass();
+        g->pot[j]=Part[j].GetPotential()/potscale;
+        g->hash+=PotentialCacheHash(g->pid[j]);
+    }
+#ifdef USEOPENMP
+#pragma omp critical (potentialcache)
 #endif
+{
+    Int_t igroup=potcache->groups.size();
+    potcache->groups.push_back(g);
+    for (Int_t j=0;j<nbodies;j++) {
+        auto entry=potcache->index.find(g->pid[j]);
+        if (entry!=potcache->index.end()) {
+            PotentialCacheGroup *old=potcache->groups[entry->second.first];
+            if (--old->nref==0) {
+                delete old;
+                potcache->groups[entry->second.first]=NULL;
+            }
+            entry->second=make_pair(igroup,j);
+        }
+        else potcache->index[g->pid[j]]=make_pair(igroup,j);
+        g->nref++;
+    }
+}
+}
 
-    if (opt.iverbose) cout<<ThisTask<<" Unbinding "<<ngroup<<" groups  ... "<<endl;
-
-    //array creation check.
-    if (numingroup==NULL) ningflag=true;
-    if (pglist==NULL) pglistflag=true;
-    //if array was not created outside, build now
-    if (ningflag) numingroup=BuildNumInGroup(nbodies, ngroup, pfof);
-    if (pglistflag) pglist=BuildPGList(nbodies, ngroup, numingroup, pfof);
-    //unbind can either copy information into new arrays and not worry about order or reseting anything
-    //OR save memory at the cost of a few more computations (specifically sorts).
-    //Build particle array containing only particles in groups;
-#ifdef SAVEMEM
-    Int_t *storeval1=new Int_t[nbodies];
-    Int_t *storeval2=new Int_t[nbodies];
-    Int_t *noffset=new Int_t[ngroup+1];
-    Double_t *storeden=new Double_t[nbodies];
-    for (Int_t i=0;i<nbodies;i++) {storeval1[i]=Part[i].GetPID();storeval2[i]=Part[i].GetID();storeden[i]=Part[i].GetDensity();Part[i].SetPID(i);Part[i].SetID(pfof[i]+nbodies*(pfof[i]==0));}
-    qsort(Part,nbodies,sizeof(Particle),IDCompare);
-    noffset[0]=noffset[1]=0;
-    for (Int_t i=2;i<=ngroup;i++) noffset[i]=noffset[i-1]+numingroup[i-1];
-#else
-    Particle **gPart=BuildPartList(ngroup, numingroup, pglist, Part);
+/*!
+    Sets the potentials of a group from \ref potcache, in the units of \ref Potential, returning 0 if they must be calculated instead.
+    The group is matched to the cached group of its first member and the cached values are used if it has the same members.
+    Particles do not move between the two calculations, so positions are not compared, and the potentials are those of the positions
+    when the group was unbound, unaffected by any later change of frame. If particles have since been removed or added, and these are no more than
+    \ref GRAVCACHEMAXFRAC of the group, only the change in the potential is calculated: the field of the removed particles is subtracted,
+    with the direct sum or for many removed particles from a large group with a tree of the cached group (see \ref GravityTreeRemove),
+    and that of a few added particles summed directly.
+*/
+int GetPotentialCache(Options &opt, const Int_t nbodies, Particle *Part)
+{
+    if (potcache==NULL || nbodies<=0) return 0;
+    auto first=potcache->index.find(Part[0].GetPID());
+    PotentialCacheGroup *g=NULL;
+    if (first!=potcache->index.end()) g=potcache->groups[first->second.first];
+    if (g==NULL) {
+#ifdef USEOPENMP
+#pragma omp atomic
 #endif
-
-#ifdef SAVEMEM
-    iflag=Unbind(opt, Part, ngroup, numingroup,noffset,pfof);
-    //if keeping track of a flag, set flag to 0 if group no longer present
-    if (groupflag!=NULL) {
-        for (Int_t i=0;i<=ng;i++) if (numingroup[i]==0) groupflag[i]=0;
-        //and reorder it if reordering group ids
-        if (ireorder) ReorderGroupIDsAndArraybyValue(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, Int_t *value, Int_t *gdata)
+        potcache->nmissed++;
+        return 0;
     }
-    //reset order
-    qsort(Part,nbodies,sizeof(Particle),PIDCompare);
-    for (Int_t i=0;i<nbodies;i++) {Part[i].SetPID(storeval1[i]);Part[i].SetID(storeval2[i]);Part[i].SetDensity(storeden[i]);}
-    //and alter pglist
-    for (Int_t i=0;i<=ng;i++) numingroup[i]=0;
-    for (Int_t i=0;i<nbodies;i++) if (pfof[i]>0) pglist[pfof[i]][numingroup[pfof[i]]++]=i;
-    if (ireorder==1 && iflag&&ngroup>0) {
-        if (groupflag!=NULL) {
-            //allocate memory to store the group value which is a combination of the groupflag value and numingroup
-            Double_t *groupvalue=new Double_t[ng+1];
-            for (Int_t i=0;i<=ng;i++) {
-                if (numingroup[i]==0) {groupvalue[i]=groupflag[i]=0;}
-                else {
-                    if (groupflag[i]==1) groupvalue[i]=numingroup[i];
-                    else groupvalue[i]=1.0/(Double_t)numingroup[i];
-                }
-            }
-            //and reorder it if reordering group ids
-            if (ireorder) ReorderGroupIDsAndArraybyValue(ng,ngroup,numingroup,pfof,pglist,groupvalue,groupflag);
-            delete[] groupvalue;
+    Int_t igroup=first->second.first, ng=g->pid.size(), nmatch=0, nadd=0, nrem, k;
+    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps;
+    unsigned long long hash=0;
+    vector<Int_t> match(nbodies,-1), added;
+    vector<bool> found(ng,false);
+    for (Int_t j=0;j<nbodies;j++) {
+        auto entry=potcache->index.find(Part[j].GetPID());
+        hash+=PotentialCacheHash(Part[j].GetPID());
+        if (entry!=potcache->index.end() && entry->second.first==igroup && !found[entry->second.second]) {
+            k=entry->second.second;
+            match[j]=k;
+            found[k]=true;
+            nmatch++;
+        }
+        else {
+            added.push_back(j);
+            nadd++;
         }
-        else ReorderGroupIDs(ng,ngroup,numingroup,pfof,pglist);
     }
-    delete[] noffset;
-#else
-    //if groupflags are provided then explicitly reorder here if required, otherwise internal reordering within unbind.
-    if (groupflag!=NULL) iflag=Unbind(opt, gPart, ngroup, numingroup,pfof,pglist,0);
-    else iflag=Unbind(opt, gPart, ngroup, numingroup,pfof,pglist,ireorder);
-    //if keeping track of a flag, set flag to 0 if group no longer present
-    if (ireorder==1 && iflag&&ngroup>0) {
-        if (groupflag!=NULL) {
-            //allocate memory to store the group value which is a combination of the groupflag value and numingroup
-            Double_t *groupvalue=new Double_t[ng+1];
-            for (Int_t i=0;i<=ng;i++) {
-                if (numingroup[i]==0) {groupvalue[i]=groupflag[i]=0;}
-                else {
-                    if (groupflag[i]==1) groupvalue[i]=numingroup[i];
-                    else groupvalue[i]=1.0/(Double_t)numingroup[i];
+    nrem=ng-nmatch;
+    if (nadd+nrem>GRAVCACHEMAXFRAC*nbodies || nadd>UNBINDNUM) {
+#ifdef USEOPENMP
+#pragma omp atomic
+#endif
+        potcache->nmissed++;
+        return 0;
+    }
+    //membership unchanged, so cached values can be used directly
+    if (nrem==0 && nadd==0 && hash==g->hash) {
+        for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(g->pot[match[j]]);
+#ifdef USEOPENMP
+#pragma omp atomic
+#endif
+        potcache->nreused++;
+        return 1;
+    }
+
+    //store the cached values in the frame of the cached group for the matched particles, the others are calculated below
+    vector<Double_t> pot(nbodies,0);
+    for (Int_t j=0;j<nbodies;j++) if (match[j]>=0) pot[j]=g->pot[match[j]];
+    if (nrem>0) {
+        vector<Int_t> removed;
+        removed.reserve(nrem);
+        for (k=0;k<ng;k++) if (!found[k]) removed.push_back(k);
+        //for many particles removed from a large group, subtract their field with a tree of the cached group
+        if (nrem>UNBINDNUM && nbodies>=ompunbindnum) {
+            GravityTree gt;
+            Particle *Ptemp=new Particle[ng];
+            Int_t *removeid=new Int_t[nrem];
+            for (k=0;k<ng;k++) {
+                Ptemp[k].SetPosition(g->x[k],g->y[k],g->z[k]);
+                Ptemp[k].SetMass(g->mass[k]);
+                Ptemp[k].SetPotential(g->pot[k]);
+            }
+            for (k=0;k<nrem;k++) removeid[k]=removed[k];
+            GravityTreeBuild(GetGravityInfo(opt),gt,ng,Ptemp);
+            GravityTreeRemove(gt,ng,Ptemp,nrem,removeid,opt.G);
+            GravityTreeFree(gt);
+            for (Int_t j=0;j<nbodies;j++) if (match[j]>=0) pot[j]=Ptemp[match[j]].GetPotential();
+            delete[] Ptemp;
+            delete[] removeid;
+        }
+        else {
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) if (nbodies>=ompunbindnum)
+#endif
+            for (Int_t j=0;j<nbodies;j++) if (match[j]>=0) {
+                Double_t r2, phi=0;
+                Int_t km=match[j];
+                for (Int_t l=0;l<nrem;l++) {
+                    Int_t kr=removed[l];
+                    r2=(g->x[km]-g->x[kr])*(g->x[km]-g->x[kr])+(g->y[km]-g->y[kr])*(g->y[km]-g->y[kr])+(g->z[km]-g->z[kr])*(g->z[km]-g->z[kr]);
+                    phi+=g->mass[kr]/sqrt(r2+eps2);
                 }
+                pot[j]+=opt.G*g->mass[km]*phi;
             }
-            //and reorder it if reordering group ids
-            if (ireorder) ReorderGroupIDsAndArraybyValue(ng,ngroup,numingroup,pfof,pglist,groupvalue,groupflag);
-            delete[] groupvalue;
         }
-        else ReorderGroupIDs(ng,ngroup,numingroup,pfof,pglist);
     }
-    for (Int_t i=1;i<=ng;i++) delete[] gPart[i];delete[] gPart;
+    //added particles interact with all members, including the other added particles, so sum them directly
+    for (Int_t l=0;l<nadd;l++) {
+        Int_t ja=added[l];
+        for (Int_t j=0;j<nbodies;j++) if (j!=ja && (match[j]>=0 || j>ja)) {
+            Double_t r2=0, phi;
+            for (int n=0;n<3;n++) r2+=(Part[j].GetPosition(n)-Part[ja].GetPosition(n))*(Part[j].GetPosition(n)-Part[ja].GetPosition(n));
+            phi=opt.G/sqrt(r2+eps2);
+            pot[j]-=phi*Part[j].GetMass()*Part[ja].GetMass();
+            pot[ja]-=phi*Part[j].GetMass()*Part[ja].GetMass();
+        }
+    }
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetPotential(pot[j]);
+#ifdef USEOPENMP
+#pragma omp atomic
 #endif
-    if (pglistflag) {for (Int_t i=1;i<=ng;i++) delete[] pglist[i];delete[] pglist;}
-    if (ningflag) delete[] numingroup;
-
-    if (opt.iverbose) cout<<ThisTask<<" Done. Number of groups remaining "<<ngroup<<endl;
-
-    return iflag;
+    potcache->ncorrected++;
+    return 1;
 }
 
+///frees \ref potcache, reporting how often cached potentials were used
+void FreePotentialCache(Options &opt)
+{
+    if (potcache==NULL) return;
+#ifndef USEMPI
+    int ThisTask=0;
+#endif
+    if (opt.iverbose) cout<<ThisTask<<" Potential cache reused "<<potcache->nreused<<", corrected "<<potcache->ncorrected<<" and recalculated "<<potcache->nmissed<<" group potentials"<<endl;
+    delete potcache;
+    potcache=NULL;
+}
 
 /*!
-    Unbinding algorithm that checks to see if a group is self-bound. For small groups the potential is calculated using a PP algorithm, for large groups a tree-potential using kd-tree and monopole is calculated. \n
-    There are several ways a group can be defined as bound, it total energy is negative, its least bound particle has negative energy, or both. Also one can have different
-    kinetic reference frames. By default, uses the CM velocity of the total system BUT could also use the velocity of a region centred on the minimum potential well. \n
-
-    If a group is not self bound, the least bound particle is removed from the group. Then
-    \arg if CM reference frame, the centre-of-mass velocity is recalculated and kinetic energies are recalculated (if it has changed enough). \n
-    \arg the potential can be left unchanged or if one ignores the background unbound but linked particles, the energies are adjusted for the loss of the particle from the group.
-    NOTE that for groups where the tree-potential was calculated, at the moment, the subtracted energy corresponds to the PP calculation which can lead to decrepancies. However, unless one is
-    worried about the exact details of when an object is self-bound, this is not an issue. \n
-
-    Finally, this routines assumes that the pglist passed to the routine is for a gPart array that was build in id order from pfof and a local particle array.
+    Determine the reference frame of a group at the minimum of its potential, used when \ref UnbindInfo.cmvelreftype is \ref POTREF.
+    potpos is the position of the particle with the lowest potential and potvel the mass weighted velocity of the
+    max(\ref UnbindInfo.Npotref, \ref UnbindInfo.fracpotref*nbodies) particles closest to it.
+    The closest particles are found by a partial selection (std::nth_element) of an array of radii and indices, so the particles are not reordered.
+    If iparallel is set, each thread selects the closest particles of a block of the group and the final selection is made from these candidates.
+    Ties in radius are broken by index and the velocity is summed in particle order, so the frame does not depend on the number of threads.
 */
-int Unbind(Options &opt, Particle **gPart, Int_t &numgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, int ireorder)
+void GetPotentialMinimumFrame(Options &opt, const Int_t nbodies, Particle *Part, Coordinate &potpos, Coordinate &potvel, const int iparallel)
 {
-    //flag which is changed if any groups are altered as groups may need to be reordered.
-    int iunbindflag=0;
-    //flag used to determine what style of update to the potential is done for larger groups as
-    //if the amount of particles removed is large enough for large groups, it is more efficient to
-    //recalculate the entire potential using a Tree code than it is removing the contribution of each removed particle from
-    //all other particles
-    int iunbindsizeflag;
-    int maxnthreads,nthreads=1,l,n;
-    Int_t i,j,k,ng=numgroups;
-    Double_t maxE,totT,v2,r2,poti,Ti,eps2=opt.uinfo.eps*opt.uinfo.eps,mv2=opt.MassValue*opt.MassValue,Efrac;
-    Double_t *gmass,*totV;
-    PriorityQueue *pq;
-    Int_t nEplus,pqsize, nEfrac;
-    Int_t *nEplusid;
-    int *Eplusflag;
-    bool unbindcheck;
-    Coordinate *cmvel;
-    //for tree code potential calculation
-    KDTree *tree;
-    Int_t ncell,ntreecell,nleafcell;
-    Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
-    Coordinate *cellcm;
-    Node *root,**nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
-
-    //used to determine potential based reference velocity frame
-    Double_t potmin,menc;
-    Int_t npot,ipotmin;
-    Coordinate potpos;
+    Int_t j,ipotmin=0,npot,ncand;
+    Double_t potmin,menc=0;
+    vector<pair<Double_t,Int_t> > rad(nbodies);
+    vector<int> isel;
 
-#ifndef USEMPI
-    int ThisTask=0,NProcs=1;
+    potvel[0]=potvel[1]=potvel[2]=0;
+    if (nbodies==0) return;
+    npot=min(nbodies,max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*nbodies)));
+    potmin=Part[0].GetPotential();
+    for (j=1;j<nbodies;j++) if (Part[j].GetPotential()<potmin) {potmin=Part[j].GetPotential();ipotmin=j;}
+    for (int k=0;k<3;k++) potpos[k]=Part[ipotmin].GetPosition(k);
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) if (iparallel && nbodies>ompunbindnum)
 #endif
-
-    cmvel   =new Coordinate[numgroups+1];
-    gmass   =new Double_t[numgroups+1];
-    totV    =new Double_t[numgroups+1];
-    for (i=1;i<=numgroups;i++) {
-        cmvel[i]=Coordinate(0.);
-        gmass[i]=totV[i]=0.;
-        for (j=0;j<numingroup[i];j++) gPart[i][j].SetPotential(0);
+    for (j=0;j<nbodies;j++) {
+        Double_t r2=0;
+        for (int k=0;k<3;k++) r2+=(Part[j].GetPosition(k)-potpos[k])*(Part[j].GetPosition(k)-potpos[k]);
+        rad[j]=make_pair(r2,j);
     }
-
-    //for parallel environment store maximum number of threads
-    nthreads=1;
+    ncand=nbodies;
 #ifdef USEOPENMP
-#pragma omp parallel
-    {
-    if (omp_get_thread_num()==0) maxnthreads=nthreads=omp_get_num_threads();
+    //the npot closest particles are amongst the npot closest of each block
+    int nblocks=omp_get_max_threads();
+    if (iparallel && nbodies>ompunbindnum && nblocks>1 && (Int_t)nblocks*npot<nbodies) {
+        #pragma omp parallel for default(shared) schedule(static,1)
+        for (int iblock=0;iblock<nblocks;iblock++) {
+            Int_t start=nbodies*iblock/nblocks,end=nbodies*(iblock+1)/nblocks;
+            if (end-start>npot) nth_element(rad.begin()+start,rad.begin()+start+npot,rad.begin()+end);
+        }
+        ncand=0;
+        for (int iblock=0;iblock<nblocks;iblock++) {
+            Int_t start=nbodies*iblock/nblocks,end=min(nbodies*(iblock+1)/nblocks,start+npot);
+            for (j=start;j<end;j++) rad[ncand++]=rad[j];
+        }
     }
 #endif
+    if (npot<ncand) nth_element(rad.begin(),rad.begin()+npot-1,rad.begin()+ncand);
+    isel.assign(nbodies,0);
+    for (j=0;j<npot;j++) isel[rad[j].second]=1;
+    for (j=0;j<nbodies;j++) {
+        if (isel[j]==0) continue;
+        for (int k=0;k<3;k++) potvel[k]+=Part[j].GetVelocity(k)*Part[j].GetMass();
+        menc+=Part[j].GetMass();
+    }
+    for (int k=0;k<3;k++) potvel[k]/=menc;
+}
+//@}
 
-    //for each group calculate potential
-    //if group is small calculate potentials using PP
-    //here openmp is over groups since each group is small
+///\name Remove unbound particles from a candidate group
+//@{
+/*!
+    If the potentials of a directly summed group are calculated in mixed precision (see \ref UnbindInfo.imixedpot), recalculate the potential of
+    particle j in double precision when its energy is within the accuracy of the mixed precision sum of the threshold, so that whether
+    it is bound does not depend on rounding. Potentials from the tree are not checked as the error of the multipole expansion is larger.
+*/
+static inline void CheckMixedPotential(Options &opt, const Int_t nig, Particle *Part, const Int_t j, const Double_t Ti, const Double_t potscale)
+{
+    if (opt.uinfo.imixedpot==0 || opt.uinfo.bgpot!=0 || nig>UNBINDNUM) return;
+    Double_t pot=Part[j].GetPotential(), Ebound=min(fabs(opt.uinfo.Eratio*Ti+pot),fabs(Ti+pot));
+    if (Ebound<=GRAVMIXEDERR*fabs(pot)) Part[j].SetPotential(GravityParticlePotential(GetGravityInfo(opt),nig,Part,j)*potscale);
+}
+
+/*!
+    Unbind a single group whose potentials have already been calculated, iteratively removing the least bound particles
+    until the group is bound or has fewer than opt.MinSize members, in which case it is removed entirely. Removed particles
+    have their pfof set to 0 and nig, cmvel, gmass and totV are updated.
+    If pglist is not NULL, the removed particles are overwritten and pglist is updated alongside Part, otherwise the removed
+    particles are swapped to the end of the group and pfof is accessed through the particle PIDs (as in the SAVEMEM version of \ref Unbind).
+    Groups that start with at least ompunbindnum members update the potential using the group's tree when many particles are
+    removed at once (see \ref GravityTreeRemove), smaller groups always remove the contribution of each particle directly.
+    The loops over particles are multithreaded only if iparallel is set, so small groups can be processed concurrently.
+    Returns the number of removal iterations, which is nonzero if the group was altered.
+*/
+int UnbindGroup(Options &opt, Int_t &nig, Particle *Part, Int_t *pglist, Int_t *pfof, Coordinate &cmvel, Double_t &gmass, Double_t &totV, const Double_t potscale, const int iparallel)
+{
+    int iunbind=0,iunbindsizeflag,igt=0,ismall=(nig<ompunbindnum),n;
+    Int_t j,k,nEplus,pqsize,nEfrac;
+    Int_t *nEplusid;
+    int *Eplusflag;
+    Double_t maxE,totT,v2,r2,poti,Ti,Efrac,eps2=opt.uinfo.eps*opt.uinfo.eps,mv2=opt.MassValue*opt.MassValue;
+    PriorityQueue *pq;
+    bool unbindcheck;
+    Particle Ptemp;
+    //tree of a large group kept across unbinding iterations to update the potential as particles are removed
+    GravityTree gt;
+
+    totT=0;
+    Efrac=0;
 #ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k,n,r2,poti)
+#pragma omp parallel default(shared) if (iparallel) \
+private(j,k,v2,Ti,unbindcheck)
 {
-    #pragma omp for schedule(dynamic,1) nowait
+    #pragma omp for reduction(+:totT,Efrac)
 #endif
-    for (i=1;i<=numgroups;i++)
-    {
-        if (numingroup[i]<=UNBINDNUM) {
-            for (j=0;j<numingroup[i];j++) {
-                for (k=j+1;k<numingroup[i];k++) {
-                    r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[i][j].GetPosition(n)-gPart[i][k].GetPosition(n),2.0);
-                    r2+=eps2;
-                    r2=1.0/sqrt(r2);
-                    Double_t pot=-opt.G*(gPart[i][j].GetMass()*gPart[i][k].GetMass())*r2;
-                    poti=gPart[i][j].GetPotential()+pot;gPart[i][j].SetPotential(poti);
-                    poti=gPart[i][k].GetPotential()+pot;gPart[i][k].SetPotential(poti);
-                }
-            }
+    for (j=0;j<nig;j++) {
+        v2=0.0;for (k=0;k<3;k++) v2+=pow(Part[j].GetVelocity(k)-cmvel[k],2.0);
 #ifdef NOMASS
-        for (j=0;j<numingroup[i];j++) gPart[i][j].SetPotential(gPart[i][j].GetPotential()*mv2);
+        Ti=0.5*Part[j].GetMass()*v2*opt.MassValue;
+#ifdef GASON
+        Ti+=opt.MassValue*Part[j].GetU();
 #endif
-        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[i][j].GetPotential();
-        }
+#else
+        Ti=0.5*Part[j].GetMass()*v2;
+#ifdef GASON
+        Ti+=Part[j].GetMass()*Part[j].GetU();
+#endif
+#endif
+        totT+=Ti;
+        CheckMixedPotential(opt,nig,Part,j,Ti,potscale);
+        Part[j].SetDensity(opt.uinfo.Eratio*Ti+Part[j].GetPotential());
+        Efrac+=(Ti+Part[j].GetPotential()<0);
     }
 #ifdef USEOPENMP
 }
 #endif
-    //reset number of threads to maximum number
-#ifdef USEOPENMP
-#pragma omp master
-    {
-        omp_set_num_threads(maxnthreads);
+    Efrac/=(Double_t)nig;
+    //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
+    nEplus=0;
+    pqsize=(Int_t)(opt.uinfo.maxunbindfrac*nig+2);
+    nEplusid=new Int_t[pqsize];
+    Eplusflag=new int[nig];
+    maxE=Part[0].GetDensity();
+    for (j=1;j<nig;j++) if(maxE<Part[j].GetDensity()) maxE=Part[j].GetDensity();
+    //check if bound;
+    if (opt.uinfo.unbindtype==USYSANDPART) {
+        if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(nig>=opt.MinSize)) unbindcheck=true;
+        else unbindcheck=false;
+    }
+    else if (opt.uinfo.unbindtype==UPART) {
+        if ((maxE>0)&&(nig>=opt.MinSize))unbindcheck=true;
+        else unbindcheck=false;
+    }
+    //if need to unbind load largest energies so as to remove at most pqsize particles (roughly 1%) per removal loop
+    if (unbindcheck) {
+        for (j=0;j<nig;j++)Eplusflag[j]=0;
+        pq=new PriorityQueue(pqsize);
+        for (j=0;j<pqsize;j++) pq->Push(j,Part[j].GetDensity());
+        for (j=pqsize;j<nig;j++) if (Part[j].GetDensity()>Part[pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,Part[j].GetDensity());}
+        nEplus=0;
+        //if just looking at particle then add to removal list till energy >0
+        if (opt.uinfo.unbindtype==UPART) {
+            for (j=0;j<pqsize;j++) {
+                if (Part[pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
+                else break;
+            }
+        }
+        //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
+        else if (opt.uinfo.unbindtype==USYSANDPART) {
+            nEfrac=0;
+            if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*nig;
+            for (j=0;j<pqsize;j++) {
+                if (Part[pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
+                else break;
+            }
+        }
+        delete pq;
     }
-    nthreads=maxnthreads;
-#endif
 
-    //now begin large group calculation
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    //otherwise use tree tree gravity calculation
-    //here openmp is per group since each group is large
-    for (i=1;i<=numgroups;i++)
+    while(unbindcheck)
     {
-        if (numingroup[i]>UNBINDNUM) {
-            //to make this memory efficient really need just KDTree that uses Coordinates
-            tree=new KDTree(gPart[i],numingroup[i],opt.uinfo.BucketSize,tree->TPHYS);
-
-            ncell=tree->GetNumNodes();
-            root=tree->GetRoot();
-            //to store particles in a given node
-            start=new Int_t[ncell];
-            end=new Int_t[ncell];
-            //distance calculations used to determine when one uses cell or when one uses particles
-            cmtot=new Double_t[ncell];
-            cBmax=new Double_t[ncell];
-            cR2max=new Double_t[ncell];
-            cellcm=new Coordinate[ncell];
-            //to store note list
-            nodelist=new Node*[ncell];
-
-            //search tree
-            for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-            for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
-            //from root node calculate cm for each node
-            //start at root node and recursively move through list
-            ncell=0;
-            GetNodeList(root,ncell,nodelist,opt.uinfo.BucketSize);
-            ncell++;
-
-            //determine cm for all cells and openings
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,n)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-            for (j=0;j<ncell;j++) {
-                start[j]=(nodelist[j])->GetStart();
-                end[j]=(nodelist[j])->GetEnd();
-                cellcm[j][0]=cellcm[j][1]=cellcm[j][2]=0.;
-                cmtot[j]=0;
-                for (k=start[j];k<end[j];k++) {
-                    for (n=0;n<3;n++) cellcm[j][n]+=gPart[i][k].GetPosition(n)*gPart[i][k].GetMass();
-                    cmtot[j]+=gPart[i][k].GetMass();
-                }
-                for (n=0;n<3;n++) cellcm[j][n]/=cmtot[j];
-                Double_t xdiff,xdiff1;
-                xdiff=(cellcm[j]-Coordinate(gPart[i][start[j]].GetPosition())).Length();
-                for (k=start[j]+1;k<end[j];k++) {
-                    xdiff1=(cellcm[j]-Coordinate(gPart[i][k].GetPosition())).Length();
-                    if (xdiff<xdiff1) xdiff=xdiff1;
-                }
-                cBmax[j]=xdiff;
-                cR2max[j]=4.0/3.0*xdiff*xdiff/(opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen);
+        iunbind++;
+        //first correct for removal of all least bound particle
+        double temp=1.0/gmass, temp2=0.;
+        if (opt.uinfo.cmvelreftype==CMVELREF) {
+            for (j=0;j<nEplus;j++) {
+                for (k=0;k<3;k++) cmvel[k]-=Part[nEplusid[j]].GetVelocity(k)*Part[nEplusid[j]].GetMass()*temp;
+                temp2+=Part[nEplusid[j]].GetMass();
             }
+            temp=gmass/(gmass-temp2);
+            for (k=0;k<3;k++) cmvel[k]*=temp;
+            gmass-=temp2;
+        }
+        else {
+            for (j=0;j<nEplus;j++) gmass-=Part[nEplusid[j]].GetMass();
+        }
+        //if ignore the background then adjust the potential energy of the particles
+        //for large groups with many particles removed more computationally effective to simply
+        //calculate the field of the removed particles with the group's tree, which is kept across iterations
+        //for smaller number of particles removed, simply remove the contribution of this particle
+        //from all others. The change in efficiency occurs at roughly nEplus>~log(nig) particles. Here
+        //we set the limit at 2*log(nig) to account for overhead in producing tree and walking it
+        iunbindsizeflag=(ismall||nEplus<2.0*log((double)nig));
+        if (iunbindsizeflag) {
+            if (opt.uinfo.bgpot==0) {
+                for (k=0;k<nEplus;k++) {
+                    totV-=0.5*Part[nEplusid[k]].GetPotential();
 #ifdef USEOPENMP
-}
-#endif
-            //then for each cell find all other cells that contain particles within a cells gRmax and mark those
-            //and mark all cells for which one does not have to unfold
-            //for marked cells calculate pp, for every other cell just use the CM of the cell to calculate the potential.
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,l,n,ntreecell,nleafcell,r2,poti)
+#pragma omp parallel default(shared) if (iparallel) \
+private(j,r2,poti)
 {
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-            for (j=0;j<numingroup[i];j++) {
-                int tid;
-#ifdef USEOPENMP
-                tid=omp_get_thread_num();
-#else
-                tid=0;
+    #pragma omp for schedule(dynamic) nowait
 #endif
-                npomp[tid]=tree->GetRoot();
-                Coordinate xpos(gPart[i][j].GetPosition());
-                nleafcell=ntreecell=0;
-                MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
-                poti=0;
-                for (k=0;k<ntreecell;k++) {
-                    poti+=-gPart[i][j].GetMass()*r2val[tid][k];
-                }
-                for (k=0;k<nleafcell;k++) {
-                    for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
-                        if (j!=l) {
-                            r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[i][j].GetPosition(n)-gPart[i][l].GetPosition(n),(Double_t)2.0);
+                    for (j=0;j<nig;j++) {
+                        if (j!=nEplusid[k]) {
+                            r2=0.;for (n=0;n<3;n++) r2+=pow(Part[nEplusid[k]].GetPosition(n)-Part[j].GetPosition(n),2.0);
                             r2+=eps2;
                             r2=1.0/sqrt(r2);
-                            poti+=-(gPart[i][j].GetMass()*gPart[i][l].GetMass())*r2;
-                        }
-                    }
-                }
-                poti*=opt.G;
 #ifdef NOMASS
-                poti*=mv2;
+                            poti=Part[j].GetPotential()+opt.G*(Part[nEplusid[k]].GetMass()*Part[j].GetMass())*r2*mv2;
+#else
+                            poti=Part[j].GetPotential()+opt.G*(Part[nEplusid[k]].GetMass()*Part[j].GetMass())*r2;
 #endif
-                gPart[i][j].SetPotential(poti);
-            }
+                            Part[j].SetPotential(poti);
+                        }
+                    }
 #ifdef USEOPENMP
 }
 #endif
-            for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[i][j].GetPotential();
-            delete tree;
-            delete[] start;
-            delete[] end;
-            delete[] cmtot;
-            delete[] cBmax;
-            delete[] cR2max;
-            delete[] cellcm;
-            delete[] nodelist;
-            for (j=0;j<nthreads;j++) {delete[] marktreecell[j];delete[] markleafcell[j];delete[] r2val[j];}
+                }
+            }
         }
-    }
-
-    //Now set the kinetic reference frame
-    //if using standard frame, then using CMVEL of the entire structure
-    if (opt.uinfo.cmvelreftype==CMVELREF) {
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-    for (i=1;i<=numgroups;i++)
-    {
-        for (j=0;j<numingroup[i];j++) {
-            gmass[i]+=gPart[i][j].GetMass();
-            for (k=0;k<3;k++)
-                cmvel[i][k]+=gPart[i][j].GetVelocity(k)*gPart[i][j].GetMass();
+        else {
+            if (opt.uinfo.bgpot==0) {
+                for (k=0;k<nEplus;k++) totV-=0.5*Part[nEplusid[k]].GetPotential();
+                if (!igt) {GravityTreeBuild(GetGravityInfo(opt),gt,nig,Part);igt=1;}
+                GravityTreeRemove(gt,nig,Part,nEplus,nEplusid,opt.G*potscale);
+            }
         }
-        for (k=0;k<3;k++)cmvel[i][k]*=(1.0/gmass[i]);
-    }
-#ifdef USEOPENMP
-}
-#endif
-    }
-    //if using potential then must identify minimum potential.
-    //Note that  most computations involve sorts, so parallize over groups
-    else if (opt.uinfo.cmvelreftype==POTREF) {
-        //must store original order
-        Int_t *storeval;
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k,npot,menc,potmin,ipotmin,potpos,storeval)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-        for (i=1;i<=numgroups;i++) {
-            storeval=new Int_t[numingroup[i]];
-            for (j=0;j<numingroup[i];j++) {storeval[i]=gPart[i][j].GetID();gPart[i][j].SetID(i);}
-            //determine how many particles to use
-            npot=max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*numingroup[i]));
-            //determine position of minimum potential and by radius around this position
-            potmin=gPart[i][0].GetPotential();ipotmin=0;
-            for (j=0;j<numingroup[i];j++) if (gPart[i][j].GetPotential()<potmin) {potmin=gPart[i][j].GetPotential();ipotmin=j;}
-            for (k=0;k<3;k++) potpos[k]=gPart[i][ipotmin].GetPosition(k);
-
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) gPart[i][j].SetPosition(k,gPart[i][j].GetPosition(k)-potpos[k]);
+        //remove particles with positive energy
+        if (pglist!=NULL) for (j=0;j<nEplus;j++) pfof[pglist[nEplusid[j]]]=0;
+        else for (j=0;j<nEplus;j++) pfof[Part[nEplusid[j]].GetPID()]=0;
+        k=nig-1;
+        for (j=0;j<nEplus;j++) if (nEplusid[j]<nig-nEplus) {
+            while(Eplusflag[k]==1)k--;
+            if (pglist!=NULL) {
+                pglist[nEplusid[j]]=pglist[k];
+                Part[nEplusid[j]]=Part[k];
+                if (igt) gt.slot[nEplusid[j]]=gt.slot[k];
             }
-            gsl_heapsort(gPart[i],numingroup[i],sizeof(Particle),RadCompare);
-            //now determine kinetic frame
-            cmvel[i][0]=cmvel[i][1]=cmvel[i][2]=menc=0.;
-            for (j=0;j<npot;j++) {
-                for (k=0;k<3;k++) cmvel[i][k]+=gPart[i][j].GetVelocity(k)*gPart[i][j].GetMass();
-                menc+=gPart[i][j].GetMass();
+            else {
+                Ptemp=Part[nEplusid[j]];
+                Part[nEplusid[j]]=Part[k];
+                Part[k]=Ptemp;
+                if (igt) {Int_t itemp=gt.slot[nEplusid[j]];gt.slot[nEplusid[j]]=gt.slot[k];gt.slot[k]=itemp;}
             }
-            for (j=0;j<3;j++) {cmvel[i][j]/=menc;}
-            gsl_heapsort(gPart[i],numingroup[i],sizeof(Particle),IDCompare);
-            for (j=0;j<numingroup[i];j++) gPart[i][j].SetID(storeval[i]);
-            delete[] storeval;
+            Eplusflag[nEplusid[j]]=0;
+            k--;
         }
-#ifdef USEOPENMP
-}
-#endif
-    }
-
+        nig-=nEplus;
+        //once a large fraction of the mass of the tree has been removed, recalculate the potential and rebuild the tree when next needed
+        if (igt && gt.mremoved>GRAVREBUILDFRAC*gt.mtot) {
+            GravityTreeFree(gt);
+            igt=0;
+            TreePotential(opt,nig,Part);
+            totV=0;
+            for (j=0;j<nig;j++) {
+                Part[j].SetPotential(Part[j].GetPotential()*potscale);
+                totV+=0.5*Part[j].GetPotential();
+            }
+        }
+        //if number of particles remove with positive energy is near to the number allowed to be removed
+        //must recalculate kinetic energies and check if maxE>0
+        //otherwise, end unbinding.
+        if (nEplus>=0.1*pqsize+0.5) {
 
-    //now go through groups and begin unbinding by finding least bound particle
-    //again for small groups multithread over groups
-    //larger groups thread over particles in a group
-    //for large groups, paralleize over particle, for small groups parallelize over groups
-    //here energy data is stored in density
-    for (i=1;i<=numgroups;i++) if (numingroup[i]>=ompunbindnum)
-    {
-        totT=0;
-        Efrac=0;
+        //recalculate kinetic energies since cmvel has changed
+        totT=0.;
+        Efrac=0.;
 #ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
+#pragma omp parallel default(shared) if (iparallel) \
 private(j,k,v2,Ti,unbindcheck)
 {
     #pragma omp for reduction(+:totT,Efrac)
 #endif
-        for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[i][j].GetVelocity(k)-cmvel[i][k],2.0);
+    for (j=0;j<nig;j++) {
+        v2=0.0;for (k=0;k<3;k++) v2+=pow(Part[j].GetVelocity(k)-cmvel[k],2.0);
 #ifdef NOMASS
-            Ti=0.5*gPart[i][j].GetMass()*v2*opt.MassValue;
+        Ti=0.5*Part[j].GetMass()*v2*opt.MassValue;
 #ifdef GASON
-            Ti+=opt.MassValue*gPart[i][j].GetU();
+        Ti+=opt.MassValue*Part[j].GetU();
 #endif
 #else
-            Ti=0.5*gPart[i][j].GetMass()*v2;
+        Ti=0.5*Part[j].GetMass()*v2;
 #ifdef GASON
-            Ti+=gPart[i][j].GetMass()*gPart[i][j].GetU();
+        Ti+=Part[j].GetMass()*Part[j].GetU();
 #endif
 #endif
-            totT+=Ti;
-            gPart[i][j].SetDensity(opt.uinfo.Eratio*Ti+gPart[i][j].GetPotential());
-            Efrac+=(Ti+gPart[i][j].GetPotential()<0);
-        }
+        totT+=Ti;
+        CheckMixedPotential(opt,nig,Part,j,Ti,potscale);
+        Part[j].SetDensity(opt.uinfo.Eratio*Ti+Part[j].GetPotential());
+        Efrac+=(Ti+Part[j].GetPotential()<0);
+    }
 #ifdef USEOPENMP
 }
 #endif
-        Efrac/=(Double_t)numingroup[i];
+        Efrac/=nig;
         //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-        nEplus=0;
-        pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+2);
-        nEplusid=new Int_t[pqsize];
-        Eplusflag=new int[numingroup[i]];
-        maxE=gPart[i][0].GetDensity();
-        for (j=1;j<numingroup[i];j++) if(maxE<gPart[i][j].GetDensity()) maxE=gPart[i][j].GetDensity();
-        //check if bound;
+        maxE=Part[0].GetDensity();
+        for (j=1;j<nig;j++) if(maxE<Part[j].GetDensity()) maxE=Part[j].GetDensity();
+        pqsize=(Int_t)(opt.uinfo.maxunbindfrac*nig+1);
         if (opt.uinfo.unbindtype==USYSANDPART) {
-            if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
+            if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(nig>=opt.MinSize)) unbindcheck=true;
             else unbindcheck=false;
         }
         else if (opt.uinfo.unbindtype==UPART) {
-            if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
+            if ((maxE>0)&&(nig>=opt.MinSize))unbindcheck=true;
             else unbindcheck=false;
         }
-        //if need to unbind load largest energies so as to remove at most pqsize particles (roughly 1%) per removal loop
         if (unbindcheck) {
-            for (j=0;j<numingroup[i];j++)Eplusflag[j]=0;
             pq=new PriorityQueue(pqsize);
-            for (j=0;j<pqsize;j++) pq->Push(j,gPart[i][j].GetDensity());
-            for (j=pqsize;j<numingroup[i];j++) if (gPart[i][j].GetDensity()>gPart[i][pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[i][j].GetDensity());}
             nEplus=0;
+            for (j=0;j<pqsize;j++) pq->Push(j,Part[j].GetDensity());
+            for (j=pqsize;j<nig;j++) if (Part[j].GetDensity()>Part[pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,Part[j].GetDensity());}
             //if just looking at particle then add to removal list till energy >0
             if (opt.uinfo.unbindtype==UPART) {
                 for (j=0;j<pqsize;j++) {
-                    if (gPart[i][pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
+                    if (Part[pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
                     else break;
                 }
             }
             //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
             else if (opt.uinfo.unbindtype==USYSANDPART) {
                 nEfrac=0;
-                if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
+                if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*nig;
                 for (j=0;j<pqsize;j++) {
-                    if (gPart[i][pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
+                    if (Part[pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
                     else break;
                 }
             }
             delete pq;
         }
+    }
+    else unbindcheck=false;
+    }
+    //if group too small remove entirely
+    if (nig<opt.MinSize) {
+        if (pglist!=NULL) for (j=0;j<nig;j++) pfof[pglist[j]]=0;
+        else for (j=0;j<nig;j++) pfof[Part[j].GetPID()]=0;
+        nig=0;
+        Efrac=0;
+        iunbind++;
+    }
+    delete[] nEplusid;
+    delete[] Eplusflag;
+    if (igt) GravityTreeFree(gt);
+    return iunbind;
+}
 
-        while(unbindcheck)
-        {
-            iunbindflag+=1;
-            //first correct for removal of all least bound particle
-            double temp=1.0/gmass[i], temp2=0.;
-            if (opt.uinfo.cmvelreftype==CMVELREF) {
-                for (j=0;j<nEplus;j++) {
-                    for (k=0;k<3;k++) cmvel[i][k]-=gPart[i][nEplusid[j]].GetVelocity(k)*gPart[i][nEplusid[j]].GetMass()*temp;
-                    temp2+=gPart[i][nEplusid[j]].GetMass();
-                }
-                temp=gmass[i]/(gmass[i]-temp2);
-                for (k=0;k<3;k++) cmvel[i][k]*=temp;
-                gmass[i]-=temp2;
-            }
-            else {
-                for (j=0;j<nEplus;j++) gmass[i]-=gPart[i][nEplusid[j]].GetMass();
-            }
-            //if ignore the background then adjust the potential energy of the particles
-            //for large groups with many particles removed more computationally effective to simply
-            //recalculate the potential energy after removing particles
-            //for smaller number of particles removed, simply remove the contribution of this particle
-            //from all others. The change in efficiency occurs at roughly nEplus>~log(numingroup[i]) particles. Here
-            //we set the limit at 2*log(numingroup[i]) to account for overhead in producing tree and calculating new potential
-            iunbindsizeflag=(nEplus<2.0*log((double)numingroup[i]));
-            if (iunbindsizeflag) {
-                if (opt.uinfo.bgpot==0) {
-                    for (k=0;k<nEplus;k++) {
-                        totV[i]-=0.5*gPart[i][nEplusid[k]].GetPotential();
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,r2,poti)
+#ifdef USEMPI
+///whether a group is unbound by \ref MPIUnbindLargeGroups rather than by the task holding it alone, only groups that use the tree potential qualify
+static inline bool IsMPIUnbindGroup(Options &opt, const Int_t nig)
 {
-    #pragma omp for schedule(dynamic) nowait
-#endif
-                        for (j=0;j<numingroup[i];j++) {
-                            if (j!=nEplusid[k]) {
-                                r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[i][nEplusid[k]].GetPosition(n)-gPart[i][j].GetPosition(n),2.0);
-                                r2+=eps2;
-                                r2=1.0/sqrt(r2);
-#ifdef NOMASS
-                                poti=gPart[i][j].GetPotential()+opt.G*(gPart[i][nEplusid[k]].GetMass()*gPart[i][j].GetMass())*r2*mv2;
-#else
-                                poti=gPart[i][j].GetPotential()+opt.G*(gPart[i][nEplusid[k]].GetMass()*gPart[i][j].GetMass())*r2;
-#endif
-                                gPart[i][j].SetPotential(poti);
-                            }
-                        }
-#ifdef USEOPENMP
+    return mpi_icollectiveunbind && opt.uinfo.mpiunbindnum>0 && nig>=opt.uinfo.mpiunbindnum && nig>UNBINDNUM;
 }
-#endif
-                    }
-                }
-            }
-            else {
-                if (opt.uinfo.bgpot==0) for (k=0;k<nEplus;k++) totV[i]-=0.5*gPart[i][nEplusid[k]].GetPotential();
-            }
-            //remove particles with positive energy
-            for (j=0;j<nEplus;j++) pfof[pglist[i][nEplusid[j]]]=0;
-            k=numingroup[i]-1;
-            for (j=0;j<nEplus;j++) if (nEplusid[j]<numingroup[i]-nEplus) {
-                while(Eplusflag[k]==1)k--;
-                pglist[i][nEplusid[j]]=pglist[i][k];
-                gPart[i][nEplusid[j]]=gPart[i][k];
-                Eplusflag[nEplusid[j]]=0;
-                k--;
-            }
-            numingroup[i]-=nEplus;
-            if (iunbindsizeflag && opt.uinfo.bgpot==0) Potential(opt, numingroup[i], gPart[i]);
-            //if number of particles remove with positive energy is near to the number allowed to be removed
-            //must recalculate kinetic energies and check if maxE>0
-            //otherwise, end unbinding.
-            if (nEplus>=0.1*pqsize+0.5) {
-
-            //recalculate kinetic energies since cmvel has changed
-            totT=0.;
-            Efrac=0.;
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,v2,Ti,unbindcheck)
+
+///kinetic energy of a particle in the frame moving with cmvel, including the internal energy of gas, as used by \ref UnbindGroup
+static inline Double_t UnbindKineticEnergy(Options &opt, Particle &p, const Coordinate &cmvel)
 {
-    #pragma omp for reduction(+:totT,Efrac)
-#endif
-        for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[i][j].GetVelocity(k)-cmvel[i][k],2.0);
+    Double_t v2=0.0, Ti;
+    for (int k=0;k<3;k++) v2+=pow(p.GetVelocity(k)-cmvel[k],2.0);
 #ifdef NOMASS
-            Ti=0.5*gPart[i][j].GetMass()*v2*opt.MassValue;
+    Ti=0.5*p.GetMass()*v2*opt.MassValue;
 #ifdef GASON
-            Ti+=opt.MassValue*gPart[i][j].GetU();
+    Ti+=opt.MassValue*p.GetU();
 #endif
 #else
-            Ti=0.5*gPart[i][j].GetMass()*v2;
+    Ti=0.5*p.GetMass()*v2;
 #ifdef GASON
-            Ti+=gPart[i][j].GetMass()*gPart[i][j].GetU();
+    Ti+=p.GetMass()*p.GetU();
 #endif
 #endif
-            totT+=Ti;
-            gPart[i][j].SetDensity(opt.uinfo.Eratio*Ti+gPart[i][j].GetPotential());
-            Efrac+=(Ti+gPart[i][j].GetPotential()<0);
-        }
-#ifdef USEOPENMP
+    return Ti;
+}
+
+/*!
+    Potential of the particles of a group divided between the tasks of comm, each holding nlocal particles in Plocal. Each task builds the tree of its
+    particles in gt and walks it, then adds the field of the other tasks' particles from the parts of their trees exchanged by \ref MPIExchangeLET,
+    so only the top cells of distant trees and the particles near the boundaries between tasks are communicated. The potentials are scaled by potscale,
+    the total potential energy of the group is returned in totV and the largest bound on the relative error is returned. gt is kept for
+    \ref MPIUnbindGroup if the task has particles.
+*/
+static Double_t MPIUnbindTreePotential(Options &opt, MPI_Comm comm, const Int_t nlocal, Particle *Plocal, GravityTree &gt, const Double_t potscale, Double_t &totV)
+{
+    int size;
+    Double_t errbound=0, Vlocal=0;
+    GravityInfo gi=GetGravityInfo(opt);
+    GravityTree *let;
+    MPI_Comm_size(comm,&size);
+    if (nlocal>0) {
+        GravityTreeBuild(gi,gt,nlocal,Plocal);
+        GravityTreeWalk(gt);
+    }
+    let=MPIExchangeLET(comm,gt,nlocal);
+    if (nlocal>0) {
+        GravityTreeExternalWalk(gt,size,let);
+        errbound=GravityTreeGetPotential(gi,gt,Plocal);
+    }
+    for (int itask=0;itask<size;itask++) if (let[itask].ncell>0) GravityTreeFree(let[itask]);
+    delete[] let;
+    for (Int_t j=0;j<nlocal;j++) {
+        Plocal[j].SetPotential(Plocal[j].GetPotential()*potscale);
+        Vlocal+=0.5*Plocal[j].GetPotential();
+    }
+    MPI_Allreduce(&Vlocal,&totV,1,MPI_Real_t,MPI_SUM,comm);
+    MPI_Allreduce(MPI_IN_PLACE,&errbound,1,MPI_Real_t,MPI_MAX,comm);
+    return errbound;
 }
+
+///as \ref GetPotentialMinimumFrame for the nig particles of a group divided between the tasks of comm, with the closest particles selected by \ref MPISelectLargest
+static void MPIGetPotentialMinimumFrame(Options &opt, MPI_Comm comm, const Int_t nig, const Int_t nlocal, Particle *Plocal, Coordinate &potvel)
+{
+    int rank;
+    Int_t npot, nsel, *sel;
+    Double_t potpos[3], sum[4]={0,0,0,0}, *r2;
+    struct {double val; int rank;} potmin, allpotmin;
+    MPI_Comm_rank(comm,&rank);
+    npot=min(nig,max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*nig)));
+    potmin.val=numeric_limits<double>::max();
+    potmin.rank=rank;
+    for (Int_t j=0;j<nlocal;j++) if (Plocal[j].GetPotential()<potmin.val) {
+        potmin.val=Plocal[j].GetPotential();
+        for (int k=0;k<3;k++) potpos[k]=Plocal[j].GetPosition(k);
+    }
+    MPI_Allreduce(&potmin,&allpotmin,1,MPI_DOUBLE_INT,MPI_MINLOC,comm);
+    MPI_Bcast(potpos,3,MPI_Real_t,allpotmin.rank,comm);
+    //the closest particles are those with the largest negative radii
+    r2=new Double_t[nlocal];
+    sel=new Int_t[min(nlocal,npot)];
+    for (Int_t j=0;j<nlocal;j++) {
+        r2[j]=0;
+        for (int k=0;k<3;k++) r2[j]-=(Plocal[j].GetPosition(k)-potpos[k])*(Plocal[j].GetPosition(k)-potpos[k]);
+    }
+    nsel=MPISelectLargest(comm,nlocal,r2,npot,sel);
+    //the velocity is summed in particle order as in \ref GetPotentialMinimumFrame
+    sort(sel,sel+nsel);
+    for (Int_t j=0;j<nsel;j++) {
+        for (int k=0;k<3;k++) sum[k]+=Plocal[sel[j]].GetVelocity(k)*Plocal[sel[j]].GetMass();
+        sum[3]+=Plocal[sel[j]].GetMass();
+    }
+    MPI_Allreduce(MPI_IN_PLACE,sum,4,MPI_Real_t,MPI_SUM,comm);
+    for (int k=0;k<3;k++) potvel[k]=sum[k]/sum[3];
+    delete[] r2;
+    delete[] sel;
+}
+
+/*!
+    Energies of the nlocal particles of a group of nig particles divided between the tasks of comm, stored in their density as in \ref UnbindGroup.
+    Returns whether the group must be unbound further and, if the fraction of particles with negative energy is below \ref UnbindInfo.minEfrac,
+    the number of particles that must be removed to reach it in nEfrac.
+*/
+static bool MPIUnbindEnergies(Options &opt, MPI_Comm comm, const Int_t nig, const Int_t nlocal, Particle *Plocal, const Coordinate &cmvel, Int_t &nEfrac)
+{
+    Int_t nbound=0;
+    Double_t maxE=-numeric_limits<Double_t>::max(), Efrac;
+    bool unbindcheck=false;
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(static) reduction(+:nbound) reduction(max:maxE) if (nlocal>ompunbindnum)
 #endif
-            Efrac/=numingroup[i];
-            //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-            maxE=gPart[i][0].GetDensity();
-            for (j=1;j<numingroup[i];j++) if(maxE<gPart[i][j].GetDensity()) maxE=gPart[i][j].GetDensity();
-            pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+1);
-            if (opt.uinfo.unbindtype==USYSANDPART) {
-                if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-                else unbindcheck=false;
-            }
-            else if (opt.uinfo.unbindtype==UPART) {
-                if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-                else unbindcheck=false;
+    for (Int_t j=0;j<nlocal;j++) {
+        Double_t Ti=UnbindKineticEnergy(opt,Plocal[j],cmvel);
+        Plocal[j].SetDensity(opt.uinfo.Eratio*Ti+Plocal[j].GetPotential());
+        nbound+=(Ti+Plocal[j].GetPotential()<0);
+        if (Plocal[j].GetDensity()>maxE) maxE=Plocal[j].GetDensity();
+    }
+    MPI_Allreduce(MPI_IN_PLACE,&nbound,1,MPI_Int_t,MPI_SUM,comm);
+    MPI_Allreduce(MPI_IN_PLACE,&maxE,1,MPI_Real_t,MPI_MAX,comm);
+    Efrac=nbound/(Double_t)nig;
+    if (opt.uinfo.unbindtype==USYSANDPART) unbindcheck=(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(nig>=opt.MinSize));
+    else if (opt.uinfo.unbindtype==UPART) unbindcheck=((maxE>0)&&(nig>=opt.MinSize));
+    nEfrac=0;
+    if (opt.uinfo.unbindtype==USYSANDPART && Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*nig;
+    return unbindcheck;
+}
+
+/*!
+    Select the particles removed by an iteration of \ref UnbindGroup from a group of nig particles divided between the tasks of comm, pos being the index each particle
+    would have in the group unbound by a single task. The candidates are the particles the priority queue of pqsize entries of \ref UnbindGroup holds: the first
+    pqsize particles, with the largest energy amongst them replaced by the largest of the group if that is larger. The candidates with positive energy, or the
+    nEfrac least bound if that is more, are removed (see \ref MPISelectLargest). Stores the local indices of the removed particles in sel and returns their number,
+    with the number over all tasks in nremove.
+*/
+static Int_t MPIUnbindSelect(MPI_Comm comm, const Int_t nig, const Int_t nlocal, Particle *Plocal, const Int_t *pos, const Int_t pqsize, const Int_t nEfrac, Int_t *sel, Int_t &nremove)
+{
+    int rank;
+    Int_t ntop=min(pqsize,nig), npos=0, nsel, imax[2]={-1,-1};
+    struct {double val; int rank;} emax[2], allemax[2];
+    vector<Int_t> cand;
+    vector<Double_t> ecand;
+    MPI_Comm_rank(comm,&rank);
+    //largest energy amongst the first ntop particles and over the group
+    for (int i=0;i<2;i++) {emax[i].val=-numeric_limits<double>::max();emax[i].rank=rank;}
+    for (Int_t j=0;j<nlocal;j++) {
+        if (pos[j]<ntop && Plocal[j].GetDensity()>emax[0].val) {emax[0].val=Plocal[j].GetDensity();imax[0]=j;}
+        if (Plocal[j].GetDensity()>emax[1].val) {emax[1].val=Plocal[j].GetDensity();imax[1]=j;}
+    }
+    MPI_Allreduce(emax,allemax,2,MPI_DOUBLE_INT,MPI_MAXLOC,comm);
+    for (Int_t j=0;j<nlocal;j++) if (pos[j]<ntop) {
+        if (allemax[1].val>allemax[0].val && allemax[0].rank==rank && j==imax[0]) continue;
+        cand.push_back(j);
+    }
+    if (allemax[1].val>allemax[0].val && allemax[1].rank==rank) cand.push_back(imax[1]);
+    ecand.resize(cand.size());
+    for (Int_t j=0;j<(Int_t)cand.size();j++) {
+        ecand[j]=Plocal[cand[j]].GetDensity();
+        npos+=(ecand[j]>0);
+    }
+    MPI_Allreduce(MPI_IN_PLACE,&npos,1,MPI_Int_t,MPI_SUM,comm);
+    nremove=min(ntop,max(npos,nEfrac));
+    nsel=MPISelectLargest(comm,cand.size(),ecand.data(),nremove,sel);
+    for (Int_t j=0;j<nsel;j++) sel[j]=cand[sel[j]];
+    return nsel;
+}
+
+/*!
+    Unbind a group divided between the tasks of comm, called by all the tasks of comm. The root of comm holds the group in Part (and pglist, pfof as in \ref UnbindGroup),
+    the other tasks pass nig=0 and Part=NULL. The particles are divided into spatially compact pieces, one per task (see \ref MPIDistributeGroup),
+    and each task calculates the potential of its piece with its own tree and the parts of the trees of the other tasks it needs (see \ref MPIUnbindTreePotential).
+    The kinetic frame, the energies and the particles removed in each iteration are then found with reductions over the tasks, following \ref UnbindGroup
+    (see \ref MPIUnbindSelect), with each task keeping track of the index its particles would have in the group unbound by a single task.
+    The removed particles are sent to every task, which subtracts their field from the potential of its particles, directly if there are few and otherwise
+    with the tree of the removed particles walked against its own tree (see \ref NBody::GravityTreeRemoveExternal).
+    At the end the bound particles are collected on the root, which updates the group as \ref UnbindGroup does. No task holds more than its piece of the group,
+    the removed particles and the parts of the trees of the other tasks it needs. The maximum bound on the relative error of the tree potential is returned in errbound.
+    Returns the number of removal iterations.
+*/
+static int MPIUnbindGroup(Options &opt, MPI_Comm comm, Int_t &nig, Particle *Part, Int_t *pglist, Int_t *pfof, Coordinate &cmvel, Double_t &gmass, Double_t &totV,
+    const Double_t potscale, Double_t &errbound)
+{
+    int rank, iunbind=0, igt, ismall;
+    Int_t nig0, nlocal, nEfrac, nEplus, pqsize, nrem, nall, nkeep, nnew, jtail, *orig, *pos, *sel, *posall, *idx;
+    Double_t mcur, mremove, mtree=0, mremoved=0, eps2=opt.uinfo.eps*opt.uinfo.eps, sum[4];
+    Particle *Plocal, *Prem, *Pall;
+    vector<Int_t> order, tailpos;
+    vector<int> removed;
+    bool unbindcheck;
+    GravityTree gt, rt;
+
+    MPI_Comm_rank(comm,&rank);
+    MPI_Bcast(&nig,1,MPI_Int_t,0,comm);
+    nig0=nig;
+    ismall=(nig<ompunbindnum);
+    nlocal=MPIDistributeGroup(comm,nig,Part,Plocal,orig);
+    pos=new Int_t[nlocal];
+    for (Int_t j=0;j<nlocal;j++) pos[j]=orig[j];
+    errbound=MPIUnbindTreePotential(opt,comm,nlocal,Plocal,gt,potscale,totV);
+    igt=(nlocal>0);
+    //the kinetic reference frame
+    for (int k=0;k<4;k++) sum[k]=0;
+    for (Int_t j=0;j<nlocal;j++) {
+        for (int k=0;k<3;k++) sum[k]+=Plocal[j].GetVelocity(k)*Plocal[j].GetMass();
+        sum[3]+=Plocal[j].GetMass();
+    }
+    MPI_Allreduce(MPI_IN_PLACE,sum,4,MPI_Real_t,MPI_SUM,comm);
+    mcur=sum[3];
+    if (opt.uinfo.cmvelreftype==CMVELREF) {
+        gmass=sum[3];
+        for (int k=0;k<3;k++) cmvel[k]=sum[k]*(1.0/gmass);
+    }
+    else if (opt.uinfo.cmvelreftype==POTREF) MPIGetPotentialMinimumFrame(opt,comm,nig,nlocal,Plocal,cmvel);
+
+    pqsize=(Int_t)(opt.uinfo.maxunbindfrac*nig+2);
+    unbindcheck=MPIUnbindEnergies(opt,comm,nig,nlocal,Plocal,cmvel,nEfrac);
+    while (unbindcheck)
+    {
+        iunbind++;
+        sel=new Int_t[nlocal];
+        nrem=MPIUnbindSelect(comm,nig,nlocal,Plocal,pos,pqsize,nEfrac,sel,nEplus);
+        removed.assign(nlocal,0);
+        Prem=new Particle[nrem];
+        for (Int_t j=0;j<nrem;j++) {
+            removed[sel[j]]=1;
+            Prem[j]=Plocal[sel[j]];
+            sel[j]=pos[sel[j]];
+        }
+        //every task gets the removed particles, in the order \ref UnbindGroup removes them, from the least bound, so the frame and energy are updated as it does
+        nall=MPIAllgatherParticles(comm,nrem,Prem,sel,Pall,posall);
+        delete[] Prem;
+        delete[] sel;
+        order.resize(nall);
+        for (Int_t k=0;k<nall;k++) order[k]=k;
+        sort(order.begin(),order.end(),[Pall,posall](const Int_t a, const Int_t b){return (Pall[a].GetDensity()>Pall[b].GetDensity())||(Pall[a].GetDensity()==Pall[b].GetDensity()&&posall[a]<posall[b]);});
+        mremove=0;
+        for (Int_t k=0;k<nall;k++) mremove+=Pall[k].GetMass();
+        if (opt.uinfo.cmvelreftype==CMVELREF) {
+            double temp=1.0/gmass, temp2=0.;
+            for (Int_t k=0;k<nall;k++) {
+                for (int n=0;n<3;n++) cmvel[n]-=Pall[order[k]].GetVelocity(n)*Pall[order[k]].GetMass()*temp;
+                temp2+=Pall[order[k]].GetMass();
             }
-            if (unbindcheck) {
-                pq=new PriorityQueue(pqsize);
-                nEplus=0;
-                for (j=0;j<pqsize;j++) pq->Push(j,gPart[i][j].GetDensity());
-                for (j=pqsize;j<numingroup[i];j++) if (gPart[i][j].GetDensity()>gPart[i][pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[i][j].GetDensity());}
-                //if just looking at particle then add to removal list till energy >0
-                if (opt.uinfo.unbindtype==UPART) {
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[i][pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
+            temp=gmass/(gmass-temp2);
+            for (int n=0;n<3;n++) cmvel[n]*=temp;
+            gmass-=temp2;
+        }
+        else {
+            for (Int_t k=0;k<nall;k++) gmass-=Pall[order[k]].GetMass();
+        }
+        //if ignoring the background remove the field of the removed particles, directly for a few and otherwise with their tree, see \ref UnbindGroup
+        if (opt.uinfo.bgpot==0) {
+            for (Int_t k=0;k<nall;k++) totV-=0.5*Pall[order[k]].GetPotential();
+            if (ismall||nEplus<2.0*log((double)nig)) {
+#ifdef USEOPENMP
+#pragma omp parallel for schedule(dynamic,64) if (nlocal>ompunbindnum)
+#endif
+                for (Int_t j=0;j<nlocal;j++) {
+                    if (removed[j]) continue;
+                    Double_t r2, poti=Plocal[j].GetPotential();
+                    for (Int_t k=0;k<nall;k++) {
+                        const Particle &p=Pall[order[k]];
+                        r2=eps2;
+                        for (int n=0;n<3;n++) r2+=pow(p.GetPosition(n)-Plocal[j].GetPosition(n),2.0);
+                        poti+=opt.G*potscale*p.GetMass()*Plocal[j].GetMass()/sqrt(r2);
                     }
+                    Plocal[j].SetPotential(poti);
                 }
-                //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-                else if (opt.uinfo.unbindtype==USYSANDPART) {
-                    nEfrac=0;
-                    if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[i][pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
+            }
+            else {
+                if (mtree==0) mtree=mcur;
+                if (igt) {
+                    GravityTreeBuild(GetGravityInfo(opt),rt,nall,Pall);
+                    GravityTreeRemoveExternal(gt,nlocal,Plocal,rt,opt.G*potscale);
+                    GravityTreeFree(rt);
                 }
-                delete pq;
+                mremoved+=mremove;
             }
         }
+        mcur-=mremove;
+        //remove the particles, moving the last particles of the group into the places of the removed ones as \ref UnbindGroup does
+        nnew=nig-nEplus;
+        tailpos.assign(nEplus,0);
+        for (Int_t k=0;k<nall;k++) if (posall[k]>=nnew) tailpos[posall[k]-nnew]=-1;
+        jtail=nEplus-1;
+        for (Int_t k=0;k<nall;k++) if (posall[order[k]]<nnew) {
+            while (tailpos[jtail]==-1) jtail--;
+            tailpos[jtail--]=posall[order[k]];
+        }
+        delete[] Pall;
+        delete[] posall;
+        nkeep=0;
+        for (Int_t j=0;j<nlocal;j++) if (!removed[j]) {
+            Plocal[nkeep]=Plocal[j];
+            orig[nkeep]=orig[j];
+            pos[nkeep]=(pos[j]<nnew)?pos[j]:tailpos[pos[j]-nnew];
+            if (igt) gt.slot[nkeep]=gt.slot[j];
+            nkeep++;
+        }
+        nlocal=nkeep;
+        nig=nnew;
+        //once a large fraction of the mass has been removed with the trees, recalculate the potential with new trees
+        if (mtree>0 && mremoved>GRAVREBUILDFRAC*mtree) {
+            if (igt) GravityTreeFree(gt);
+            Double_t err=MPIUnbindTreePotential(opt,comm,nlocal,Plocal,gt,potscale,totV);
+            if (err>errbound) errbound=err;
+            igt=(nlocal>0);
+            mtree=mremoved=0;
+        }
+        //if the number of particles removed is near to the number allowed to be removed recalculate the energies, otherwise end unbinding
+        if (nEplus>=0.1*pqsize+0.5) {
+            pqsize=(Int_t)(opt.uinfo.maxunbindfrac*nig+1);
+            unbindcheck=MPIUnbindEnergies(opt,comm,nig,nlocal,Plocal,cmvel,nEfrac);
+        }
         else unbindcheck=false;
+    }
+    if (igt) GravityTreeFree(gt);
+    //if group too small remove entirely
+    if (nig<opt.MinSize) {
+        nlocal=nig=0;
+        iunbind++;
+    }
+    //collect the bound particles on the root in the order \ref UnbindGroup leaves them and update the group, keeping the removed particles after them if there is no pglist
+    idx=new Int_t[2*nlocal];
+    for (Int_t j=0;j<nlocal;j++) {idx[2*j]=orig[j];idx[2*j+1]=pos[j];}
+    delete[] orig;
+    delete[] pos;
+    MPIGatherGroup(comm,nlocal,Plocal,2,idx,Pall,sel);
+    delete[] Plocal;
+    delete[] idx;
+    if (rank==0) {
+        removed.assign(nig0,1);
+        for (Int_t j=0;j<nig;j++) removed[sel[2*j]]=0;
+        if (pglist!=NULL) {
+            vector<Int_t> pgold(pglist,pglist+nig0);
+            for (Int_t j=0;j<nig0;j++) if (removed[j]) pfof[pgold[j]]=0;
+            for (Int_t j=0;j<nig;j++) {Part[sel[2*j+1]]=Pall[j];pglist[sel[2*j+1]]=pgold[sel[2*j]];}
         }
-        //if group too small remove entirely
-        if (numingroup[i]<opt.MinSize) {
-            for (j=0;j<numingroup[i];j++) pfof[pglist[i][j]]=0;
-            numingroup[i]=0;
-            Efrac=0;
-            iunbindflag++;
+        else {
+            vector<Particle> Pold;
+            for (Int_t j=0;j<nig0;j++) if (removed[j]) {pfof[Part[j].GetPID()]=0;Pold.push_back(Part[j]);}
+            for (Int_t j=0;j<nig;j++) Part[sel[2*j+1]]=Pall[j];
+            for (Int_t j=nig;j<nig0;j++) Part[j]=Pold[j-nig];
         }
-        delete[] nEplusid;
-        delete[] Eplusflag;
+        delete[] Pall;
+        delete[] sel;
     }
+    return iunbind;
+}
 
-    //now for small groups loop over groups
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k,maxE,pq,pqsize,nEplus,nEplusid,Eplusflag,totT,v2,Ti,unbindcheck,Efrac,nEfrac)
+/*!
+    Unbind the groups with at least \ref UnbindInfo.mpiunbindnum members with the help of other mpi tasks, called by \ref Unbind when all tasks unbind
+    together (see \ref mpi_icollectiveunbind). The groups are processed in rounds, each task unbinding at most one of its groups per round, largest first.
+    Tasks without a group in a round are assigned in turn to the group with the largest cost per task and each group is divided between the tasks
+    assigned to it, with its own communicator, and unbound by \ref MPIUnbindGroup. A halo is therefore never held whole by a helping task,
+    only by the task that holds it before and after unbinding. The potentials of these groups are not stored in \ref potcache.
+*/
+static int MPIUnbindLargeGroups(Options &opt, Particle **gPart, const Int_t numgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist,
+    Coordinate *cmvel, Double_t *gmass, Double_t *totV, const Double_t potscale)
 {
-    #pragma omp for schedule(dynamic) nowait reduction(+:iunbindflag)
-#endif
-    for (i=1;i<=numgroups;i++) if (numingroup[i]<=ompunbindnum && numingroup[i]>0)
-    {
-        totT=0;
-        maxE=-MAXVALUE;
-        nEplus=0;
-        Efrac=0.;
-        for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[i][j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-            Ti=0.5*gPart[i][j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-            Ti+=opt.MassValue*gPart[i][j].GetU();
-#endif
-#else
-            Ti=0.5*gPart[i][j].GetMass()*v2;
-#ifdef GASON
-            Ti+=gPart[i][j].GetMass()*gPart[i][j].GetU();
-#endif
-#endif
-            totT+=Ti;
-            gPart[i][j].SetDensity(opt.uinfo.Eratio*Ti+gPart[i][j].GetPotential());
-            Efrac+=(Ti+gPart[i][j].GetPotential()<0);
-            if(maxE<gPart[i][j].GetDensity()) maxE=gPart[i][j].GetDensity();
+    int iunbindflag=0, nrounds=0, nlocal, owner, ibest;
+    Int_t i, nig;
+    Double_t maxerrbound=0, errbound, gmasshelp, totVhelp;
+    vector<Int_t> glocal, roundsize(NProcs);
+    vector<int> nlarge(NProcs), ntasks(NProcs), assigned(NProcs);
+    Coordinate cmvelhelp;
+    MPI_Comm comm;
+
+    for (i=1;i<=numgroups;i++) if (IsMPIUnbindGroup(opt,numingroup[i])) glocal.push_back(i);
+    sort(glocal.begin(),glocal.end(),[numingroup](const Int_t a, const Int_t b){return (numingroup[a]>numingroup[b])||(numingroup[a]==numingroup[b]&&a<b);});
+    nlocal=glocal.size();
+    MPI_Allgather(&nlocal,1,MPI_INT,nlarge.data(),1,MPI_INT,MPI_COMM_WORLD);
+    for (int itask=0;itask<NProcs;itask++) nrounds=max(nrounds,nlarge[itask]);
+    if (opt.iverbose && ThisTask==0 && nrounds>0) cout<<ThisTask<<" Unbinding groups with at least "<<opt.uinfo.mpiunbindnum<<" particles divided between tasks in "<<nrounds<<" rounds"<<endl;
+
+    for (int iround=0;iround<nrounds;iround++) {
+        nig=(iround<nlocal)?numingroup[glocal[iround]]:0;
+        MPI_Allgather(&nig,1,MPI_Int_t,roundsize.data(),1,MPI_Int_t,MPI_COMM_WORLD);
+        //tasks with a group unbind it and the others help the group with the largest n log n cost per task, the same on all tasks
+        for (int itask=0;itask<NProcs;itask++) {
+            ntasks[itask]=(roundsize[itask]>0);
+            assigned[itask]=(roundsize[itask]>0)?itask:-1;
         }
-        Efrac/=(Double_t)numingroup[i];
-        //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-        pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+2);
-        Eplusflag=new int[numingroup[i]];
-        nEplusid=new Int_t[pqsize];
-        if (opt.uinfo.unbindtype==USYSANDPART) {
-            if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-            else unbindcheck=false;
+        for (int itask=0;itask<NProcs;itask++) if (assigned[itask]<0) {
+            ibest=-1;
+            for (int jtask=0;jtask<NProcs;jtask++) if (ntasks[jtask]>0) {
+                if (ibest<0 || roundsize[jtask]*log((double)roundsize[jtask])*ntasks[ibest]>roundsize[ibest]*log((double)roundsize[ibest])*ntasks[jtask]) ibest=jtask;
+            }
+            assigned[itask]=ibest;
+            ntasks[ibest]++;
         }
-        else if (opt.uinfo.unbindtype==UPART) {
-            if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-            else unbindcheck=false;
+        owner=assigned[ThisTask];
+        MPI_Comm_split(MPI_COMM_WORLD,owner,(owner==ThisTask)?0:ThisTask+1,&comm);
+        if (owner==ThisTask) {
+            i=glocal[iround];
+            if (opt.iverbose>=2) cout<<ThisTask<<" Unbinding group of "<<numingroup[i]<<" particles with "<<ntasks[ThisTask]<<" tasks"<<endl;
+            iunbindflag+=MPIUnbindGroup(opt,comm,numingroup[i],gPart[i],(pglist!=NULL)?pglist[i]:NULL,pfof,cmvel[i],gmass[i],totV[i],potscale,errbound);
         }
-        if (unbindcheck) {
-            for (j=0;j<numingroup[i];j++)Eplusflag[j]=0;
-            pq=new PriorityQueue(pqsize);
-            for (j=0;j<pqsize;j++) pq->Push(j,gPart[i][j].GetDensity());
-            for (j=pqsize;j<numingroup[i];j++) if (gPart[i][j].GetDensity()>gPart[i][pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[i][j].GetDensity());}
-            nEplus=0;
-            //if just looking at particle then add to removal list till energy >0
-            if (opt.uinfo.unbindtype==UPART) {
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[i][pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-            else if (opt.uinfo.unbindtype==USYSANDPART) {
-                nEfrac=0;
-                if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[i][pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            delete pq;
+        else {
+            nig=0;
+            MPIUnbindGroup(opt,comm,nig,NULL,NULL,NULL,cmvelhelp,gmasshelp,totVhelp,potscale,errbound);
         }
-        while(unbindcheck)
-        {
-            iunbindflag++;
-            //first correct for removal of all least bound particle
-            double temp=1.0/gmass[i], temp2=0.;
-            if (opt.uinfo.cmvelreftype==CMVELREF) {
-                for (j=0;j<nEplus;j++) {
-                    for (k=0;k<3;k++) cmvel[i][k]-=gPart[i][nEplusid[j]].GetVelocity(k)*gPart[i][nEplusid[j]].GetMass()*temp;
-                    temp2+=gPart[i][nEplusid[j]].GetMass();
-                }
-                temp=gmass[i]/(gmass[i]-temp2);
-                for (k=0;k<3;k++) cmvel[i][k]*=temp;
-                gmass[i]-=temp2;
-            }
-            else {
-                for (j=0;j<nEplus;j++) gmass[i]-=gPart[i][nEplusid[j]].GetMass();
-            }
-            //if ignore the background then adjust the potential energy of the particles
-            if (opt.uinfo.bgpot==0) {
-                for (k=0;k<nEplus;k++) {
-                    totV[i]-=0.5*gPart[i][nEplusid[k]].GetPotential();
-                    for (j=0;j<numingroup[i];j++) {
-                        if (j!=nEplusid[k]) {
-                            r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[i][nEplusid[k]].GetPosition(n)-gPart[i][j].GetPosition(n),2.0);
-                            r2+=eps2;
-                            r2=1.0/sqrt(r2);
-#ifdef NOMASS
-                            poti=gPart[i][j].GetPotential()+opt.G*(gPart[i][nEplusid[k]].GetMass()*gPart[i][j].GetMass())*r2*mv2;
+        if (errbound>maxerrbound) maxerrbound=errbound;
+        MPI_Comm_free(&comm);
+    }
+    if (opt.iverbose>=2 && maxerrbound>0) cout<<ThisTask<<" Tree potential relative error bound "<<maxerrbound<<" for opening angle "<<opt.uinfo.TreeThetaOpen<<endl;
+    return iunbindflag;
+}
+#endif
+
+/*!
+    Interface for unbinding proceedure. Unbinding routine requires several arrays, such as numingroup, pglist,gPart,ids, etc
+    This arrays may have been constructed prior to the unbinding call and so can be passed to the routine
+    if this is called it uses Particle array then deletes it.
+*/
+int CheckUnboundGroups(Options opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup, Int_t **pglist, int ireorder, Int_t *groupflag){
+    bool ningflag=false, pglistflag=false;
+    int iflag;
+    Int_t ng=ngroup;
+#ifndef USEMPI
+    int ThisTask=0,NProcs=1;
+#endif
+
+    if (opt.iverbose) cout<<ThisTask<<" Unbinding "<<ngroup<<" groups  ... "<<endl;
+
+    //array creation check.
+    if (numingroup==NULL) ningflag=true;
+    if (pglist==NULL) pglistflag=true;
+    //if array was not created outside, build now
+    if (ningflag) numingroup=BuildNumInGroup(nbodies, ngroup, pfof);
+    if (pglistflag) pglist=BuildPGList(nbodies, ngroup, numingroup, pfof);
+    //unbind can either copy information into new arrays and not worry about order or reseting anything
+    //OR save memory at the cost of a few more computations (specifically sorts).
+    //Build particle array containing only particles in groups;
+#ifdef SAVEMEM
+    Int_t *storeval1=new Int_t[nbodies];
+    Int_t *storeval2=new Int_t[nbodies];
+    Int_t *noffset=new Int_t[ngroup+1];
+    Double_t *storeden=new Double_t[nbodies];
+    for (Int_t i=0;i<nbodies;i++) {storeval1[i]=Part[i].GetPID();storeval2[i]=Part[i].GetID();storeden[i]=Part[i].GetDensity();Part[i].SetPID(i);Part[i].SetID(pfof[i]+nbodies*(pfof[i]==0));}
+    qsort(Part,nbodies,sizeof(Particle),IDCompare);
+    noffset[0]=noffset[1]=0;
+    for (Int_t i=2;i<=ngroup;i++) noffset[i]=noffset[i-1]+numingroup[i-1];
 #else
-                            poti=gPart[i][j].GetPotential()+opt.G*(gPart[i][nEplusid[k]].GetMass()*gPart[i][j].GetMass())*r2;
+    Particle **gPart=BuildPartList(ngroup, numingroup, pglist, Part);
 #endif
-                            gPart[i][j].SetPotential(poti);
-                        }
-                    }
+
+#ifdef SAVEMEM
+    iflag=Unbind(opt, Part, ngroup, numingroup,noffset,pfof);
+    //if keeping track of a flag, set flag to 0 if group no longer present
+    if (groupflag!=NULL) {
+        for (Int_t i=0;i<=ng;i++) if (numingroup[i]==0) groupflag[i]=0;
+        //and reorder it if reordering group ids
+        if (ireorder) ReorderGroupIDsAndArraybyValue(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, Int_t *value, Int_t *gdata)
+    }
+    //reset order
+    qsort(Part,nbodies,sizeof(Particle),PIDCompare);
+    for (Int_t i=0;i<nbodies;i++) {Part[i].SetPID(storeval1[i]);Part[i].SetID(storeval2[i]);Part[i].SetDensity(storeden[i]);}
+    //and alter pglist
+    for (Int_t i=0;i<=ng;i++) numingroup[i]=0;
+    for (Int_t i=0;i<nbodies;i++) if (pfof[i]>0) pglist[pfof[i]][numingroup[pfof[i]]++]=i;
+    if (ireorder==1 && iflag&&ngroup>0) {
+        if (groupflag!=NULL) {
+            //allocate memory to store the group value which is a combination of the groupflag value and numingroup
+            Double_t *groupvalue=new Double_t[ng+1];
+            for (Int_t i=0;i<=ng;i++) {
+                if (numingroup[i]==0) {groupvalue[i]=groupflag[i]=0;}
+                else {
+                    if (groupflag[i]==1) groupvalue[i]=numingroup[i];
+                    else groupvalue[i]=1.0/(Double_t)numingroup[i];
                 }
             }
-            //remove particles with positive energy
-            for (j=0;j<nEplus;j++) pfof[pglist[i][nEplusid[j]]]=0;
-            k=numingroup[i]-1;
-            for (j=0;j<nEplus;j++) if (nEplusid[j]<numingroup[i]-nEplus) {
-                while(Eplusflag[k]==1)k--;
-                pglist[i][nEplusid[j]]=pglist[i][k];
-                gPart[i][nEplusid[j]]=gPart[i][k];
-                Eplusflag[nEplusid[j]]=0;
-                k--;
-            }
-            numingroup[i]-=nEplus;
-
-            if (nEplus>=0.1*pqsize+0.5) {
-
-            //recalculate kinetic energies since cmvel has changed
-            totT=0;
-            maxE=-MAXVALUE;
-            for (j=0;j<numingroup[i];j++) {
-                v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[i][j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-                Ti=0.5*gPart[i][j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-                Ti+=opt.MassValue*gPart[i][j].GetU();
-#endif
+            //and reorder it if reordering group ids
+            if (ireorder) ReorderGroupIDsAndArraybyValue(ng,ngroup,numingroup,pfof,pglist,groupvalue,groupflag);
+            delete[] groupvalue;
+        }
+        else ReorderGroupIDs(ng,ngroup,numingroup,pfof,pglist);
+    }
+    delete[] noffset;
 #else
-                Ti=0.5*gPart[i][j].GetMass()*v2;
-#ifdef GASON
-                Ti+=gPart[i][j].GetMass()*gPart[i][j].GetU();
-#endif
-#endif
-                totT+=Ti;
-                gPart[i][j].SetDensity(opt.uinfo.Eratio*Ti+gPart[i][j].GetPotential());
-                Efrac+=(Ti+gPart[i][j].GetPotential()<0);
-                    if(maxE<gPart[i][j].GetDensity()) maxE=gPart[i][j].GetDensity();
-            }
-            Efrac/=(Double_t)numingroup[i];
-            if (opt.uinfo.unbindtype==USYSANDPART) {
-                if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-                else unbindcheck=false;
-            }
-            else if (opt.uinfo.unbindtype==UPART) {
-                if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-                else unbindcheck=false;
-            }
-            if (unbindcheck) {
-                //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-                pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+1);
-                pq=new PriorityQueue(pqsize);
-                for (j=0;j<pqsize;j++) pq->Push(j,gPart[i][j].GetDensity());
-                for (j=pqsize;j<numingroup[i];j++) if (gPart[i][j].GetDensity()>gPart[i][pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[i][j].GetDensity());}
-                nEplus=0;
-                //if just looking at particle then add to removal list till energy >0
-                if (opt.uinfo.unbindtype==UPART) {
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[i][pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
-                }
-                //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-                else if (opt.uinfo.unbindtype==USYSANDPART) {
-                    nEfrac=0;
-                    if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[i][pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
+    //if groupflags are provided then explicitly reorder here if required, otherwise internal reordering within unbind.
+    if (groupflag!=NULL) iflag=Unbind(opt, gPart, ngroup, numingroup,pfof,pglist,0);
+    else iflag=Unbind(opt, gPart, ngroup, numingroup,pfof,pglist,ireorder);
+    //if keeping track of a flag, set flag to 0 if group no longer present
+    if (ireorder==1 && iflag&&ngroup>0) {
+        if (groupflag!=NULL) {
+            //allocate memory to store the group value which is a combination of the groupflag value and numingroup
+            Double_t *groupvalue=new Double_t[ng+1];
+            for (Int_t i=0;i<=ng;i++) {
+                if (numingroup[i]==0) {groupvalue[i]=groupflag[i]=0;}
+                else {
+                    if (groupflag[i]==1) groupvalue[i]=numingroup[i];
+                    else groupvalue[i]=1.0/(Double_t)numingroup[i];
                 }
-                delete pq;
             }
+            //and reorder it if reordering group ids
+            if (ireorder) ReorderGroupIDsAndArraybyValue(ng,ngroup,numingroup,pfof,pglist,groupvalue,groupflag);
+            delete[] groupvalue;
         }
-        else unbindcheck=false;
-        }
-        //if group too small remove entirely
-        if (numingroup[i]<opt.MinSize) {
-            iunbindflag++;
-            for (j=0;j<numingroup[i];j++) pfof[pglist[i][j]]=0;
-            numingroup[i]=0;
-            Efrac=0;
-        }
-        delete[] nEplusid;
-        delete[] Eplusflag;
+        else ReorderGroupIDs(ng,ngroup,numingroup,pfof,pglist);
     }
-#ifdef USEOPENMP
-}
+    for (Int_t i=1;i<=ng;i++) delete[] gPart[i];delete[] gPart;
 #endif
+    if (pglistflag) {for (Int_t i=1;i<=ng;i++) delete[] pglist[i];delete[] pglist;}
+    if (ningflag) delete[] numingroup;
 
-    for (i=1;i<=numgroups;i++) if (numingroup[i]==0) ng--;
-    if (ireorder==1 && iunbindflag&&ng>0) ReorderGroupIDs(numgroups,ng,numingroup,pfof,pglist);
-    delete[] cmvel;
-    numgroups=ng;
-    //return if any unbinding done indicating groups have been reordered
-    if (iunbindflag) return 1;
-    else return 0;
+    if (opt.iverbose) cout<<ThisTask<<" Done. Number of groups remaining "<<ngroup<<endl;
+
+    return iflag;
 }
 
-///Similar to unbind algorithm but assumes particles are ordered. saves memory but more computations
-int Unbind(Options &opt, Particle *&gPart, Int_t &numgroups, Int_t *&numingroup, Int_t *&noffset, Int_t *&pfof)
+
+/*!
+    Unbinding algorithm that checks to see if a group is self-bound. For small groups the potential is calculated using a PP algorithm, for large groups a tree-potential using kd-tree with quadrupole moments is calculated (see \ref TreePotential). \n
+    There are several ways a group can be defined as bound, it total energy is negative, its least bound particle has negative energy, or both. Also one can have different
+    kinetic reference frames. By default, uses the CM velocity of the total system BUT could also use the velocity of a region centred on the minimum potential well. \n
+
+    If a group is not self bound, the least bound particle is removed from the group. Then
+    \arg if CM reference frame, the centre-of-mass velocity is recalculated and kinetic energies are recalculated (if it has changed enough). \n
+    \arg the potential can be left unchanged or if one ignores the background unbound but linked particles, the energies are adjusted for the loss of the particle from the group.
+    NOTE that for groups where the tree-potential was calculated, at the moment, the subtracted energy corresponds to the PP calculation which can lead to decrepancies. However, unless one is
+    worried about the exact details of when an object is self-bound, this is not an issue. \n
+
+    Finally, this routines assumes that the pglist passed to the routine is for a gPart array that was build in id order from pfof and a local particle array.
+*/
+int Unbind(Options &opt, Particle **gPart, Int_t &numgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, int ireorder)
 {
     //flag which is changed if any groups are altered as groups may need to be reordered.
     int iunbindflag=0;
-    //flag used to determine what style of update to the potential is done for larger groups as
-    //if the amount of particles removed is large enough for large groups, it is more efficient to
-    //recalculate the entire potential using a Tree code than it is removing the contribution of each removed particle from
-    //all other particles
-    int iunbindsizeflag;
-    int maxnthreads,nthreads=1,l,n;
-    Int_t i,j,k,ng=numgroups;
-    Double_t maxE,totT,v2,r2,poti,Ti,eps2=opt.uinfo.eps*opt.uinfo.eps,mv2=opt.MassValue*opt.MassValue,Efrac;
+    int maxnthreads,nthreads=1;
+    Int_t i,j,k,ig,ng=numgroups;
+    Double_t mv2=opt.MassValue*opt.MassValue;
     Double_t *gmass,*totV;
-    PriorityQueue *pq;
-    Int_t nEplus,pqsize,nEfrac;
-    Int_t *nEplusid;
-    int *Eplusflag;
-    bool unbindcheck;
     Coordinate *cmvel;
-    Particle Ptemp;
+    //for tree code potential calculation, the largest bound on the relative error of the multipole expansion
+    Double_t maxerrbound=0;
+    //order in which groups are processed, see \ref BuildGroupSchedule
+    GroupSchedule gs;
+    Int_t *schedsize;
+#ifdef NOMASS
+    Double_t potscale=mv2;
+#else
+    Double_t potscale=1.0;
+#endif
 
-    //for tree code potential calculation
-    KDTree *tree;
-    Int_t ncell,ntreecell,nleafcell;
-    Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
-    Coordinate *cellcm;
-    Node *root,**nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
-
-    //used to determine potential based reference velocity frame
-    Double_t potmin,menc;
-    Int_t npot,ipotmin;
+    //position of the minimum of the potential used by the potential based reference velocity frame
     Coordinate potpos;
 
-
 #ifndef USEMPI
     int ThisTask=0,NProcs=1;
 #endif
@@ -917,7 +1136,7 @@ int Unbind(Options &opt, Particle *&gPart, Int_t &numgroups, Int_t *&numingroup,
     for (i=1;i<=numgroups;i++) {
         cmvel[i]=Coordinate(0.);
         gmass[i]=totV[i]=0.;
-        for (j=0;j<numingroup[i];j++) gPart[noffset[i]+j].SetPotential(0);
+        for (j=0;j<numingroup[i];j++) gPart[i][j].SetPotential(0);
     }
 
     //for parallel environment store maximum number of threads
@@ -929,33 +1148,40 @@ int Unbind(Options &opt, Particle *&gPart, Int_t &numgroups, Int_t *&numingroup,
     }
 #endif
 
+    //split the groups between those processed concurrently and those large enough to use all threads, see \ref BuildGroupSchedule
+    //groups unbound together with other mpi tasks are left out of the schedule, see \ref MPIUnbindLargeGroups
+    schedsize=numingroup;
+#ifdef USEMPI
+    vector<Int_t> localsize;
+    if (mpi_icollectiveunbind && opt.uinfo.mpiunbindnum>0) {
+        localsize.assign(numingroup,numingroup+numgroups+1);
+        for (i=1;i<=numgroups;i++) if (IsMPIUnbindGroup(opt,numingroup[i])) localsize[i]=0;
+        schedsize=localsize.data();
+    }
+#endif
+    BuildGroupSchedule(gs,numgroups,schedsize,GSCHEDNLOGN,ompunbindnum,GSCHEDMAXFAC*ompunbindnum);
+
     //for each group calculate potential
-    //if group is small calculate potentials using PP
-    //here openmp is over groups since each group is small
+    //if group is small calculate potentials using PP otherwise use tree gravity calculation
+    //here openmp is over groups for the groups in the pool
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,n,r2,poti)
+private(i,j)
 {
-    #pragma omp for schedule(dynamic,1) nowait
+    #pragma omp for schedule(dynamic,1) nowait reduction(max:maxerrbound)
 #endif
-    for (i=1;i<=numgroups;i++)
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++)
     {
-        if (numingroup[i]<=UNBINDNUM) {
-            for (j=0;j<numingroup[i];j++) {
-                for (k=j+1;k<numingroup[i];k++) {
-                    r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[noffset[i]+j].GetPosition(n)-gPart[noffset[i]+k].GetPosition(n),2.0);
-                    r2+=eps2;
-                    r2=1.0/sqrt(r2);
-                    Double_t pot=-opt.G*(gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+k].GetMass())*r2;
-                    poti=gPart[noffset[i]+j].GetPotential()+pot;gPart[noffset[i]+j].SetPotential(poti);
-                    poti=gPart[noffset[i]+k].GetPotential()+pot;gPart[noffset[i]+k].SetPotential(poti);
-                }
-            }
+        i=gs.pool[ig];
+        if (numingroup[i]<=UNBINDNUM) DirectPotential(opt,numingroup[i],gPart[i]);
+        else {
+            Double_t errbound=TreePotential(opt,numingroup[i],gPart[i]);
+            if (errbound>maxerrbound) maxerrbound=errbound;
+        }
 #ifdef NOMASS
-        for (j=0;j<numingroup[i];j++) gPart[noffset[i]+j].SetPotential(gPart[noffset[i]+j].GetPotential()*mv2);
+        for (j=0;j<numingroup[i];j++) gPart[i][j].SetPotential(gPart[i][j].GetPotential()*mv2);
 #endif
-        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[noffset[i]+j].GetPotential();
-        }
+        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[i][j].GetPotential();
     }
 #ifdef USEOPENMP
 }
@@ -966,634 +1192,149 @@ private(i,j,k,n,r2,poti)
     {
         omp_set_num_threads(maxnthreads);
     }
-    nthreads=maxnthreads;
-#endif
-
-    //now begin large group calculation
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    //otherwise use tree tree gravity calculation
-    //here openmp is per group since each group is large
-    for (i=1;i<=numgroups;i++)
-    {
-        if (numingroup[i]>UNBINDNUM) {
-            //to make this memory efficient really need just KDTree that uses Coordinates
-            tree=new KDTree(&gPart[noffset[i]],numingroup[i],opt.uinfo.BucketSize,tree->TPHYS);
-
-            ncell=tree->GetNumNodes();
-            root=tree->GetRoot();
-            //to store particles in a given node
-            start=new Int_t[ncell];
-            end=new Int_t[ncell];
-            //distance calculations used to determine when one uses cell or when one uses particles
-            cmtot=new Double_t[ncell];
-            cBmax=new Double_t[ncell];
-            cR2max=new Double_t[ncell];
-            cellcm=new Coordinate[ncell];
-            //to store note list
-            nodelist=new Node*[ncell];
-
-            //search tree
-            for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-            for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
-            //from root node calculate cm for each node
-            //start at root node and recursively move through list
-            ncell=0;
-            GetNodeList(root,ncell,nodelist,opt.uinfo.BucketSize);
-            ncell++;
-
-            //determine cm for all cells and openings
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,n)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-            for (j=0;j<ncell;j++) {
-                start[j]=(nodelist[j])->GetStart();
-                end[j]=(nodelist[j])->GetEnd();
-                cellcm[j][0]=cellcm[j][1]=cellcm[j][2]=0.;
-                cmtot[j]=0;
-                for (k=start[j];k<end[j];k++) {
-                    for (n=0;n<3;n++) cellcm[j][n]+=gPart[noffset[i]+k].GetPosition(n)*gPart[noffset[i]+k].GetMass();
-                    cmtot[j]+=gPart[noffset[i]+k].GetMass();
-                }
-                for (n=0;n<3;n++) cellcm[j][n]/=cmtot[j];
-                Double_t xdiff,xdiff1;
-                xdiff=(cellcm[j]-Coordinate(gPart[noffset[i]+start[j]].GetPosition())).Length();
-                for (k=start[j]+1;k<end[j];k++) {
-                    xdiff1=(cellcm[j]-Coordinate(gPart[noffset[i]+k].GetPosition())).Length();
-                    if (xdiff<xdiff1) xdiff=xdiff1;
-                }
-                cBmax[j]=xdiff;
-                cR2max[j]=4.0/3.0*xdiff*xdiff/(opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen);
-            }
-#ifdef USEOPENMP
-}
-#endif
-            //then for each cell find all other cells that contain particles within a cells gRmax and mark those
-            //and mark all cells for which one does not have to unfold
-            //for marked cells calculate pp, for every other cell just use the CM of the cell to calculate the potential.
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,l,n,ntreecell,nleafcell,r2,poti)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-            for (j=0;j<numingroup[i];j++) {
-                int tid;
-#ifdef USEOPENMP
-                tid=omp_get_thread_num();
-#else
-                tid=0;
-#endif
-                npomp[tid]=tree->GetRoot();
-                Coordinate xpos(gPart[noffset[i]+j].GetPosition());
-                nleafcell=ntreecell=0;
-                MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
-                poti=0;
-                for (k=0;k<ntreecell;k++) {
-                    poti+=-gPart[noffset[i]+j].GetMass()*r2val[tid][k];
-                }
-                for (k=0;k<nleafcell;k++) {
-                    for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
-                        if (j!=l) {
-                            r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[noffset[i]+j].GetPosition(n)-gPart[noffset[i]+l].GetPosition(n),(Double_t)2.0);
-                            r2+=eps2;
-                            r2=1.0/sqrt(r2);
-                            poti+=-(gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+l].GetMass())*r2;
-                        }
-                    }
-                }
-                poti*=opt.G;
-#ifdef NOMASS
-                poti*=mv2;
-#endif
-                gPart[noffset[i]+j].SetPotential(poti);
-            }
-#ifdef USEOPENMP
-}
-#endif
-            for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[noffset[i]+j].GetPotential();
-            delete tree;
-            delete[] start;
-            delete[] end;
-            delete[] cmtot;
-            delete[] cBmax;
-            delete[] cR2max;
-            delete[] cellcm;
-            delete[] nodelist;
-            for (j=0;j<nthreads;j++) {delete[] marktreecell[j];delete[] markleafcell[j];delete[] r2val[j];}
-        }
-    }
-
-    //Now set the kinetic reference frame
-    //if using standard frame, then using CMVEL of the entire structure
-    if (opt.uinfo.cmvelreftype==CMVELREF) {
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-    for (i=1;i<=numgroups;i++)
-    {
-        for (j=0;j<numingroup[i];j++) {
-            gmass[i]+=gPart[noffset[i]+j].GetMass();
-            for (k=0;k<3;k++)
-                cmvel[i][k]+=gPart[noffset[i]+j].GetVelocity(k)*gPart[noffset[i]+j].GetMass();
-        }
-        for (k=0;k<3;k++)cmvel[i][k]*=(1.0/gmass[i]);
-    }
-#ifdef USEOPENMP
-}
-#endif
-    }
-    //if using potential then must identify minimum potential.
-    //Note that  most computations involve sorts, so parallize over groups
-    else if (opt.uinfo.cmvelreftype==POTREF) {
-        Int_t *storeval;
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(i,j,k,npot,menc,potmin,ipotmin,potpos,storeval)
-{
-    #pragma omp for schedule(dynamic,1) nowait
-#endif
-        for (i=1;i<=numgroups;i++) {
-            //must store original order
-            storeval=new Int_t[numingroup[i]];
-            for (j=0;j<numingroup[i];j++) {storeval[i]=gPart[noffset[i]+j].GetID();gPart[noffset[i]+j].SetID(i);}
-            //determine how many particles to use
-            npot=max(opt.uinfo.Npotref,Int_t(opt.uinfo.fracpotref*numingroup[i]));
-            //determine position of minimum potential and by radius around this position
-            potmin=gPart[noffset[i]+0].GetPotential();ipotmin=0;
-            for (j=0;j<numingroup[i];j++) if (gPart[noffset[i]+j].GetPotential()<potmin) {potmin=gPart[noffset[i]+j].GetPotential();ipotmin=j;}
-            for (k=0;k<3;k++) potpos[k]=gPart[noffset[i]+ipotmin].GetPosition(k);
-            for (j=0;j<numingroup[i];j++) {
-                for (k=0;k<3;k++) gPart[noffset[i]+j].SetPosition(k,gPart[noffset[i]+j].GetPosition(k)-potpos[k]);
-            }
-            gsl_heapsort(&gPart[noffset[i]],numingroup[i],sizeof(Particle),RadCompare);
-            //now determine kinetic frame
-            cmvel[i][0]=cmvel[i][1]=cmvel[i][2]=menc=0.;
-            for (j=0;j<npot;j++) {
-                for (k=0;k<3;k++) cmvel[i][k]+=gPart[noffset[i]+j].GetVelocity(k)*gPart[noffset[i]+j].GetMass();
-                menc+=gPart[noffset[i]+j].GetMass();
-            }
-            for (j=0;j<3;j++) {cmvel[i][j]/=menc;}
-            gsl_heapsort(&gPart[noffset[i]],numingroup[i],sizeof(Particle),IDCompare);
-            for (j=0;j<numingroup[i];j++) {
-                gPart[noffset[i]+j].SetID(storeval[i]);
-                for (k=0;k<3;k++) gPart[noffset[i]+j].SetPosition(k,gPart[noffset[i]+j].GetPosition(k)+potpos[k]);
-            }
-            delete[] storeval;
-        }
-#ifdef USEOPENMP
-}
-#endif
-    }
-
-    //now go through groups and begin unbinding by finding least bound particle
-    //again for small groups multithread over groups
-    //larger groups thread over particles in a group
-    //for large groups, paralleize over particle, for small groups parallelize over groups
-    //here energy data is stored in density
-    for (i=1;i<=numgroups;i++) if (numingroup[i]>=ompunbindnum)
-    {
-        totT=0;
-        Efrac=0;
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,k,v2,Ti,unbindcheck)
-{
-    #pragma omp for reduction(+:totT,Efrac)
-#endif
-        for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[noffset[i]+j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-            Ti+=opt.MassValue*gPart[noffset[i]+j].GetU();
-#endif
-#else
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2;
-#ifdef GASON
-            Ti+=gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+j].GetU();
-#endif
-#endif
-            totT+=Ti;
-            gPart[noffset[i]+j].SetDensity(opt.uinfo.Eratio*Ti+gPart[noffset[i]+j].GetPotential());
-            Efrac+=(Ti+gPart[noffset[i]+j].GetPotential()<0);
-        }
-#ifdef USEOPENMP
-}
-#endif
-        Efrac/=(Double_t)numingroup[i];
-        //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-        nEplus=0;
-        pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+2);
-        nEplusid=new Int_t[pqsize];
-        Eplusflag=new int[numingroup[i]];
-        maxE=gPart[noffset[i]+0].GetDensity();
-        for (j=1;j<numingroup[i];j++) if(maxE<gPart[noffset[i]+j].GetDensity()) maxE=gPart[noffset[i]+j].GetDensity();
-        //if largest energy is positive load largest energies so as to remove at most pqsize particles (roughly 1%) per removal loop
-        if (opt.uinfo.unbindtype==USYSANDPART) {
-            if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-            else unbindcheck=false;
-        }
-        else if (opt.uinfo.unbindtype==UPART) {
-            if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-            else unbindcheck=false;
-        }
-        if (unbindcheck) {
-            for (j=0;j<numingroup[i];j++)Eplusflag[j]=0;
-            pq=new PriorityQueue(pqsize);
-            for (j=0;j<pqsize;j++) pq->Push(j,gPart[noffset[i]+j].GetDensity());
-            for (j=pqsize;j<numingroup[i];j++) if (gPart[noffset[i]+j].GetDensity()>gPart[noffset[i]+pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[noffset[i]+j].GetDensity());}
-            nEplus=0;
-            //if just looking at particle then add to removal list till energy >0
-            if (opt.uinfo.unbindtype==UPART) {
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-            else if (opt.uinfo.unbindtype==USYSANDPART) {
-                nEfrac=0;
-                if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            delete pq;
-        }
-        while(unbindcheck)
-        {
-            iunbindflag++;
-            //first correct for removal of all least bound particle
-            double temp=1.0/gmass[i], temp2=0.;
-            if (opt.uinfo.cmvelreftype==CMVELREF) {
-                for (j=0;j<nEplus;j++) {
-                    for (k=0;k<3;k++) cmvel[i][k]-=gPart[noffset[i]+nEplusid[j]].GetVelocity(k)*gPart[noffset[i]+nEplusid[j]].GetMass()*temp;
-                    temp2+=gPart[noffset[i]+nEplusid[j]].GetMass();
-                }
-                temp=gmass[i]/(gmass[i]-temp2);
-                for (k=0;k<3;k++) cmvel[i][k]*=temp;
-                gmass[i]-=temp2;
-            }
-            else {
-                for (j=0;j<nEplus;j++) gmass[i]-=gPart[noffset[i]+nEplusid[j]].GetMass();
-            }
-            //if ignore the background then adjust the potential energy of the particles
-            //for large groups with many particles removed more computationally effective to simply
-            //recalculate the potential energy after removing particles
-            //for smaller number of particles removed, simply remove the contribution of this particle
-            //from all others. The change in efficiency occurs at roughly nEplus>~log(numingroup[i]) particles. Here
-            //we set the limit at 2*log(numingroup[i]) to account for overhead in producing tree and calculating new potential
-            iunbindsizeflag=(nEplus<2.0*log((double)numingroup[i]));
-            if (iunbindsizeflag) {
-                if (opt.uinfo.bgpot==0) {
-                    for (k=0;k<nEplus;k++) {
-                        totV[i]-=0.5*gPart[noffset[i]+nEplusid[k]].GetPotential();
-#ifdef USEOPENMP
-#pragma omp parallel default(shared)  \
-private(j,r2,poti)
-{
-    #pragma omp for schedule(dynamic) nowait
+    nthreads=maxnthreads;
 #endif
-                        for (j=0;j<numingroup[i];j++) {
-                            if (j!=nEplusid[k]) {
-                                r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[noffset[i]+nEplusid[k]].GetPosition(n)-gPart[noffset[i]+j].GetPosition(n),2.0);
-                                r2+=eps2;
-                                r2=1.0/sqrt(r2);
+
+    //now begin large group calculation
+    //here openmp is within the tree calculation since each group is large
+    for (ig=0;ig<(Int_t)gs.large.size();ig++)
+    {
+        i=gs.large[ig];
+        Double_t errbound=TreePotential(opt,numingroup[i],gPart[i]);
+        if (errbound>maxerrbound) maxerrbound=errbound;
 #ifdef NOMASS
-                                poti=gPart[noffset[i]+j].GetPotential()+opt.G*(gPart[noffset[i]+nEplusid[k]].GetMass()*gPart[noffset[i]+j].GetMass())*r2*mv2;
-#else
-                                poti=gPart[noffset[i]+j].GetPotential()+opt.G*(gPart[noffset[i]+nEplusid[k]].GetMass()*gPart[noffset[i]+j].GetMass())*r2;
-#endif
-                                gPart[noffset[i]+j].SetPotential(poti);
-                            }
-                        }
-#ifdef USEOPENMP
-}
+        for (j=0;j<numingroup[i];j++) gPart[i][j].SetPotential(gPart[i][j].GetPotential()*mv2);
 #endif
-                    }
-                }
-            }
-            else {
-                if (opt.uinfo.bgpot==0) for (k=0;k<nEplus;k++) totV[i]-=0.5*gPart[noffset[i]+nEplusid[k]].GetPotential();
-            }
-            //remove particles with positive energy
-            for (j=0;j<nEplus;j++) pfof[gPart[noffset[i]+nEplusid[j]].GetPID()]=0;
-            k=numingroup[i]-1;
-            for (j=0;j<nEplus;j++) if (nEplusid[j]<numingroup[i]-nEplus) {
-                while(Eplusflag[k]==1)k--;
-                Ptemp=gPart[noffset[i]+nEplusid[j]];
-                gPart[noffset[i]+nEplusid[j]]=gPart[noffset[i]+k];
-                gPart[noffset[i]+k]=Ptemp;
-                Eplusflag[nEplusid[j]]=0;
-                k--;
-            }
-            numingroup[i]-=nEplus;
-            if (iunbindsizeflag && opt.uinfo.bgpot==0) Potential(opt, numingroup[i], &gPart[noffset[i]]);
-            //if number of particles remove with positive energy is near to the number allowed to be removed
-            //must recalculate kinetic energies and check if maxE>0
-            //otherwise, end unbinding.
-            if (nEplus>=0.1*pqsize+0.5) {
-
-            //recalculate kinetic energies since cmvel has changed
-            totT=0.;
-            Efrac=0.;
+        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[i][j].GetPotential();
+    }
+    if (opt.iverbose>=2 && maxerrbound>0) cout<<ThisTask<<" Tree potential relative error bound "<<maxerrbound<<" for opening angle "<<opt.uinfo.TreeThetaOpen<<endl;
+    //cache the potentials of the initial members so they need not be recalculated for the bound groups, see \ref GetPotentialCache
+    if (potcache!=NULL) {
+        for (ig=0;ig<(Int_t)gs.large.size();ig++) StorePotentialCache(opt,numingroup[gs.large[ig]],gPart[gs.large[ig]],potscale);
+        for (ig=0;ig<(Int_t)gs.pool.size();ig++) StorePotentialCache(opt,numingroup[gs.pool[ig]],gPart[gs.pool[ig]],potscale);
+    }
+
+    //Now set the kinetic reference frame
+    //if using standard frame, then using CMVEL of the entire structure
+    if (opt.uinfo.cmvelreftype==CMVELREF) {
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(j,k,v2,Ti,unbindcheck)
+private(i,j,k)
 {
-    #pragma omp for reduction(+:totT,Efrac)
+    #pragma omp for schedule(dynamic,1) nowait
 #endif
+    for (i=1;i<=numgroups;i++)
+    {
+        //the frame of groups unbound with other mpi tasks is calculated by \ref MPIUnbindGroup
+        if (schedsize[i]==0) continue;
         for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[noffset[i]+j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-            Ti+=opt.MassValue*gPart[noffset[i]+j].GetU();
-#endif
-#else
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2;
-#ifdef GASON
-            Ti+=gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+j].GetU();
-#endif
-#endif
-            totT+=Ti;
-            gPart[noffset[i]+j].SetDensity(opt.uinfo.Eratio*Ti+gPart[noffset[i]+j].GetPotential());
-            Efrac+=(Ti+gPart[noffset[i]+j].GetPotential()<0);
+            gmass[i]+=gPart[i][j].GetMass();
+            for (k=0;k<3;k++)
+                cmvel[i][k]+=gPart[i][j].GetVelocity(k)*gPart[i][j].GetMass();
         }
+        for (k=0;k<3;k++)cmvel[i][k]*=(1.0/gmass[i]);
+    }
 #ifdef USEOPENMP
 }
 #endif
-            //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-            maxE=gPart[noffset[i]+0].GetDensity();
-            for (j=1;j<numingroup[i];j++) if(maxE<gPart[noffset[i]+j].GetDensity()) maxE=gPart[noffset[i]+j].GetDensity();
-            pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+1);
-            if (opt.uinfo.unbindtype==USYSANDPART) {
-                if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-                else unbindcheck=false;
-            }
-            else if (opt.uinfo.unbindtype==UPART) {
-                if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-                else unbindcheck=false;
-            }
-            if (unbindcheck) {
-                pq=new PriorityQueue(pqsize);
-                nEplus=0;
-                for (j=0;j<pqsize;j++) pq->Push(j,gPart[noffset[i]+j].GetDensity());
-                for (j=pqsize;j<numingroup[i];j++) if (gPart[noffset[i]+j].GetDensity()>gPart[noffset[i]+pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[noffset[i]+j].GetDensity());}
-                //if just looking at particle then add to removal list till energy >0
-                if (opt.uinfo.unbindtype==UPART) {
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
-                }
-                //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-                else if (opt.uinfo.unbindtype==USYSANDPART) {
-                    nEfrac=0;
-                    if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
-                }
-                delete pq;
-            }
-            }
-            else unbindcheck=false;
-        }
-        //if group too small remove entirely
-        if (numingroup[i]<opt.MinSize) {
-            iunbindflag++;
-            for (j=0;j<numingroup[i];j++) pfof[gPart[noffset[i]+j].GetPID()]=0;
-            numingroup[i]=0;
-        }
-        delete[] nEplusid;
-        delete[] Eplusflag;
     }
-    //now for small groups loop over groups
+    //if using potential then must identify minimum potential, see \ref GetPotentialMinimumFrame
+    //large groups are processed one at a time, threading over the particles of a group
+    else if (opt.uinfo.cmvelreftype==POTREF) {
+        for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+            i=gs.large[ig];
+            GetPotentialMinimumFrame(opt,numingroup[i],gPart[i],potpos,cmvel[i],1);
+        }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(i,j,k,maxE,pq,pqsize,nEplus,nEplusid,Eplusflag,totT,v2,Ti,unbindcheck,Efrac,Ptemp,nEfrac)
+private(i,potpos)
 {
-    #pragma omp for schedule(dynamic) nowait reduction(+:iunbindflag)
-#endif
-    for (i=1;i<=numgroups;i++) if (numingroup[i]<=ompunbindnum)
-    {
-        totT=0;
-        maxE=-MAXVALUE;
-        nEplus=0;
-        Efrac=0.;
-        for (j=0;j<numingroup[i];j++) {
-            v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[noffset[i]+j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-            Ti+=opt.MassValue*gPart[noffset[i]+j].GetU();
-#endif
-#else
-            Ti=0.5*gPart[noffset[i]+j].GetMass()*v2;
-#ifdef GASON
-            Ti+=gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+j].GetU();
-#endif
+    #pragma omp for schedule(dynamic,1) nowait
 #endif
-            totT+=Ti;
-            gPart[noffset[i]+j].SetDensity(opt.uinfo.Eratio*Ti+gPart[noffset[i]+j].GetPotential());
-            Efrac+=(Ti+gPart[noffset[i]+j].GetPotential()<0);
-            if(maxE<gPart[noffset[i]+j].GetDensity()) maxE=gPart[noffset[i]+j].GetDensity();
-        }
-        Efrac/=(Double_t)numingroup[i];
-        //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-        pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+2);
-        Eplusflag=new int[numingroup[i]];
-        nEplusid=new Int_t[pqsize];
-        if (opt.uinfo.unbindtype==USYSANDPART) {
-            if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-            else unbindcheck=false;
-        }
-        else if (opt.uinfo.unbindtype==UPART) {
-            if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-            else unbindcheck=false;
-        }
-        if (unbindcheck) {
-            for (j=0;j<numingroup[i];j++)Eplusflag[j]=0;
-            pq=new PriorityQueue(pqsize);
-            for (j=0;j<pqsize;j++) pq->Push(j,gPart[noffset[i]+j].GetDensity());
-            for (j=pqsize;j<numingroup[i];j++) if (gPart[noffset[i]+j].GetDensity()>gPart[noffset[i]+pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[noffset[i]+j].GetDensity());}
-            nEplus=0;
-            //if just looking at particle then add to removal list till energy >0
-            if (opt.uinfo.unbindtype==UPART) {
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-            else if (opt.uinfo.unbindtype==USYSANDPART) {
-                nEfrac=0;
-                if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                for (j=0;j<pqsize;j++) {
-                    if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                    else break;
-                }
-            }
-            delete pq;
+        for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+            i=gs.pool[ig];
+            GetPotentialMinimumFrame(opt,numingroup[i],gPart[i],potpos,cmvel[i],0);
         }
-        while(unbindcheck)
-        {
-            iunbindflag++;
-            //first correct for removal of all least bound particle
-            double temp=1.0/gmass[i], temp2=0.;
-            if (opt.uinfo.cmvelreftype==CMVELREF) {
-                for (j=0;j<nEplus;j++) {
-                    for (k=0;k<3;k++) cmvel[i][k]-=gPart[noffset[i]+nEplusid[j]].GetVelocity(k)*gPart[noffset[i]+nEplusid[j]].GetMass()*temp;
-                    temp2+=gPart[noffset[i]+nEplusid[j]].GetMass();
-                }
-                temp=gmass[i]/(gmass[i]-temp2);
-                for (k=0;k<3;k++) cmvel[i][k]*=temp;
-                gmass[i]-=temp2;
-            }
-            else {
-                for (j=0;j<nEplus;j++) gmass[i]-=gPart[noffset[i]+nEplusid[j]].GetMass();
-            }
-            //if ignore the background then adjust the potential energy of the particles
-            if (opt.uinfo.bgpot==0) {
-                for (k=0;k<nEplus;k++) {
-                    totV[i]-=0.5*gPart[noffset[i]+nEplusid[k]].GetPotential();
-                    for (j=0;j<numingroup[i];j++) {
-                        if (j!=nEplusid[k]) {
-                            r2=0.;for (n=0;n<3;n++) r2+=pow(gPart[noffset[i]+nEplusid[k]].GetPosition(n)-gPart[noffset[i]+j].GetPosition(n),2.0);
-                            r2+=eps2;
-                            r2=1.0/sqrt(r2);
-#ifdef NOMASS
-                            poti=gPart[noffset[i]+j].GetPotential()+opt.G*(gPart[noffset[i]+nEplusid[k]].GetMass()*gPart[noffset[i]+j].GetMass())*r2*mv2;
-#else
-                            poti=gPart[noffset[i]+j].GetPotential()+opt.G*(gPart[noffset[i]+nEplusid[k]].GetMass()*gPart[noffset[i]+j].GetMass())*r2;
+#ifdef USEOPENMP
+}
 #endif
-                            gPart[noffset[i]+j].SetPotential(poti);
-                        }
-                    }
-                }
-            }
-            //remove particles with positive energy
-            for (j=0;j<nEplus;j++) pfof[gPart[noffset[i]+nEplusid[j]].GetPID()]=0;
-            k=numingroup[i]-1;
-            for (j=0;j<nEplus;j++) if (nEplusid[j]<numingroup[i]-nEplus) {
-                while(Eplusflag[k]==1)k--;
-                Ptemp=gPart[noffset[i]+nEplusid[j]];
-                gPart[noffset[i]+nEplusid[j]]=gPart[noffset[i]+k];
-                gPart[noffset[i]+k]=Ptemp;
-                Eplusflag[nEplusid[j]]=0;
-                k--;
-            }
-            numingroup[i]-=nEplus;
+    }
 
-            if (nEplus>=0.1*pqsize+0.5) {
 
-            //recalculate kinetic energies since cmvel has changed
-            totT=0;
-            maxE=-MAXVALUE;
-            for (j=0;j<numingroup[i];j++) {
-                v2=0.0;for (k=0;k<3;k++) v2+=pow(gPart[noffset[i]+j].GetVelocity(k)-cmvel[i][k],2.0);
-#ifdef NOMASS
-                Ti=0.5*gPart[noffset[i]+j].GetMass()*v2*opt.MassValue;
-#ifdef GASON
-                Ti+=opt.MassValue*gPart[noffset[i]+j].GetU();
-#endif
-#else
-                Ti=0.5*gPart[noffset[i]+j].GetMass()*v2;
-#ifdef GASON
-                Ti+=gPart[noffset[i]+j].GetMass()*gPart[noffset[i]+j].GetU();
+    //now go through groups and begin unbinding by finding least bound particle, see \ref UnbindGroup
+    //large groups are unbound one at a time, threading over the particles of a group
+    //and the groups in the pool are unbound concurrently
+    //here energy data is stored in density
+#ifdef USEMPI
+    if (mpi_icollectiveunbind && opt.uinfo.mpiunbindnum>0) iunbindflag+=MPIUnbindLargeGroups(opt,gPart,numgroups,numingroup,pfof,pglist,cmvel,gmass,totV,potscale);
 #endif
+    for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+        i=gs.large[ig];
+        iunbindflag+=UnbindGroup(opt,numingroup[i],gPart[i],pglist[i],pfof,cmvel[i],gmass[i],totV[i],potscale,1);
+    }
+#ifdef USEOPENMP
+#pragma omp parallel default(shared)  \
+private(i)
+{
+    #pragma omp for schedule(dynamic,1) nowait reduction(+:iunbindflag)
 #endif
-                totT+=Ti;
-                gPart[noffset[i]+j].SetDensity(opt.uinfo.Eratio*Ti+gPart[noffset[i]+j].GetPotential());
-                Efrac+=(Ti+gPart[noffset[i]+j].GetPotential()<0);
-                    if(maxE<gPart[noffset[i]+j].GetDensity()) maxE=gPart[noffset[i]+j].GetDensity();
-            }
-            Efrac/=(Double_t)numingroup[i];
-            if (opt.uinfo.unbindtype==USYSANDPART) {
-                if(((Efrac<opt.uinfo.minEfrac)||(maxE>0))&&(numingroup[i]>=opt.MinSize)) unbindcheck=true;
-                else unbindcheck=false;
-            }
-            else if (opt.uinfo.unbindtype==UPART) {
-                if ((maxE>0)&&(numingroup[i]>=opt.MinSize))unbindcheck=true;
-                else unbindcheck=false;
-            }
-            if (unbindcheck) {
-                //determine if any particle  number of particle with positive energy upto opt.uinfo.maxunbindfrac*numingroup+1
-                pqsize=(Int_t)(opt.uinfo.maxunbindfrac*numingroup[i]+1);
-                pq=new PriorityQueue(pqsize);
-                for (j=0;j<pqsize;j++) pq->Push(j,gPart[noffset[i]+j].GetDensity());
-                for (j=pqsize;j<numingroup[i];j++) if (gPart[noffset[i]+j].GetDensity()>gPart[noffset[i]+pq->TopQueue()].GetDensity()) {pq->Pop();pq->Push(j,gPart[noffset[i]+j].GetDensity());}
-                nEplus=0;
-                //if just looking at particle then add to removal list till energy >0
-                if (opt.uinfo.unbindtype==UPART) {
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
-                }
-                //otherwise, remove all positive energies and also if Efrac< minEfrac, keep adding to removal list
-                else if (opt.uinfo.unbindtype==USYSANDPART) {
-                    nEfrac=0;
-                    if (Efrac<opt.uinfo.minEfrac) nEfrac=(opt.uinfo.minEfrac-Efrac)*numingroup[i];
-                    for (j=0;j<pqsize;j++) {
-                        if (gPart[noffset[i]+pq->TopQueue()].GetDensity()>0 || nEplus<nEfrac) {nEplusid[nEplus++]=pq->TopQueue();Eplusflag[pq->TopQueue()]=1;pq->Pop();}
-                        else break;
-                    }
-                }
-                delete pq;
-            }
-            }
-            else unbindcheck=false;
-        }
-        //if group too small remove entirely
-        if (numingroup[i]<opt.MinSize) {
-            iunbindflag++;
-            for (j=0;j<numingroup[i];j++) pfof[gPart[noffset[i]+j].GetPID()]=0;
-            numingroup[i]=0;
-        }
-        delete[] nEplusid;
-        delete[] Eplusflag;
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+        i=gs.pool[ig];
+        iunbindflag+=UnbindGroup(opt,numingroup[i],gPart[i],pglist[i],pfof,cmvel[i],gmass[i],totV[i],potscale,0);
     }
 #ifdef USEOPENMP
 }
 #endif
+
     for (i=1;i<=numgroups;i++) if (numingroup[i]==0) ng--;
+    if (ireorder==1 && iunbindflag&&ng>0) ReorderGroupIDs(numgroups,ng,numingroup,pfof,pglist);
     delete[] cmvel;
+    delete[] gmass;
+    delete[] totV;
     numgroups=ng;
     //return if any unbinding done indicating groups have been reordered
     if (iunbindflag) return 1;
     else return 0;
 }
 
-/// Calculates the gravitational potential using a kd-tree and monopole expansion
-///\todo need ewald correction for periodic systems and also use more than monopole.
-void Potential(Options &opt, Int_t nbodies, Particle *Part, Double_t *potV)
+///Similar to unbind algorithm but assumes particles are ordered. saves memory but more computations
+int Unbind(Options &opt, Particle *&gPart, Int_t &numgroups, Int_t *&numingroup, Int_t *&noffset, Int_t *&pfof)
 {
-    int maxnthreads,nthreads,l,n;
-    Int_t i,j,k,ntreecell,nleafcell;
-    Double_t v2,r2,Ti,eps2=opt.uinfo.eps*opt.uinfo.eps;
-    //for tree code potential calculation
-    Int_t ncell;
-    Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
-    Coordinate *cellcm;
-    Node *root;
-    Node **nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
-    //Double_t **nnr2;
-    KDTree *tree;
+    //flag which is changed if any groups are altered as groups may need to be reordered.
+    int iunbindflag=0;
+    int maxnthreads,nthreads=1;
+    Int_t i,j,k,ig,ng=numgroups;
+    Double_t mv2=opt.MassValue*opt.MassValue;
+    Double_t *gmass,*totV;
+    Coordinate *cmvel;
+
+    //for tree code potential calculation, the largest bound on the relative error of the multipole expansion
+    Double_t maxerrbound=0;
+    //order in which groups are processed, see \ref BuildGroupSchedule
+    GroupSchedule gs;
+    Int_t *schedsize;
+#ifdef NOMASS
+    Double_t potscale=mv2;
+#else
+    Double_t potscale=1.0;
+#endif
+
+    //position of the minimum of the potential used by the potential based reference velocity frame
+    Coordinate potpos;
+
+
+#ifndef USEMPI
+    int ThisTask=0,NProcs=1;
+#endif
+
+    cmvel   =new Coordinate[numgroups+1];
+    gmass   =new Double_t[numgroups+1];
+    totV    =new Double_t[numgroups+1];
+    for (i=1;i<=numgroups;i++) {
+        cmvel[i]=Coordinate(0.);
+        gmass[i]=totV[i]=0.;
+        for (j=0;j<numingroup[i];j++) gPart[noffset[i]+j].SetPotential(0);
+    }
 
     //for parallel environment store maximum number of threads
     nthreads=1;
@@ -1604,240 +1345,164 @@ void Potential(Options &opt, Int_t nbodies, Particle *Part, Double_t *potV)
     }
 #endif
 
-    cout<<"Calculating potentials ..."<<endl;
-    //otherwise use tree tree gravity calculation
-    //here openmp is per group since each group is large
-    //to make this memory efficient really need just KDTree that uses Coordinates
-    tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS,tree->KEPAN,1000,1);
-    ncell=tree->GetNumNodes();
-    root=tree->GetRoot();
-    //to store particles in a given node
-    start=new Int_t[ncell];
-    end=new Int_t[ncell];
-    //distance calculations used to determine when one uses cell or when one uses particles
-    cmtot=new Double_t[ncell];
-    cBmax=new Double_t[ncell];
-    cR2max=new Double_t[ncell];
-    cellcm=new Coordinate[ncell];
-    //to store note list
-    nodelist=new Node*[ncell];
-
-    //search tree
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-    for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
-    //from root node calculate cm for each node
-    //start at root node and recursively move through list
-    ncell=0;
-    GetNodeList(root,ncell,nodelist,opt.uinfo.BucketSize);
-    ncell++;
-    //determine cm for all cells and openings
+    //split the groups between those processed concurrently and those large enough to use all threads, see \ref BuildGroupSchedule
+    //groups unbound together with other mpi tasks are left out of the schedule, see \ref MPIUnbindLargeGroups
+    schedsize=numingroup;
+#ifdef USEMPI
+    vector<Int_t> localsize;
+    if (mpi_icollectiveunbind && opt.uinfo.mpiunbindnum>0) {
+        localsize.assign(numingroup,numingroup+numgroups+1);
+        for (i=1;i<=numgroups;i++) if (IsMPIUnbindGroup(opt,numingroup[i])) localsize[i]=0;
+        schedsize=localsize.data();
+    }
+#endif
+    BuildGroupSchedule(gs,numgroups,schedsize,GSCHEDNLOGN,ompunbindnum,GSCHEDMAXFAC*ompunbindnum);
+
+    //for each group calculate potential
+    //if group is small calculate potentials using PP otherwise use tree gravity calculation
+    //here openmp is over groups for the groups in the pool
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(j,k,n)
+private(i,j)
 {
-    #pragma omp for schedule(dynamic,1) nowait
+    #pragma omp for schedule(dynamic,1) nowait reduction(max:maxerrbound)
 #endif
-    for (j=0;j<ncell;j++) {
-        start[j]=(nodelist[j])->GetStart();
-        end[j]=(nodelist[j])->GetEnd();
-        cellcm[j][0]=cellcm[j][1]=cellcm[j][2]=0.;
-        cmtot[j]=0;
-        for (k=start[j];k<end[j];k++) {
-            for (n=0;n<3;n++) cellcm[j][n]+=Part[k].GetPosition(n)*Part[k].GetMass();
-            cmtot[j]+=Part[k].GetMass();
-        }
-        for (n=0;n<3;n++) cellcm[j][n]/=cmtot[j];
-        Double_t xdiff,xdiff1;
-        xdiff=(cellcm[j]-Coordinate(Part[start[j]].GetPosition())).Length();
-        for (k=start[j]+1;k<end[j];k++) {
-            xdiff1=(cellcm[j]-Coordinate(Part[k].GetPosition())).Length();
-            if (xdiff<xdiff1) xdiff=xdiff1;
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++)
+    {
+        i=gs.pool[ig];
+        if (numingroup[i]<=UNBINDNUM) DirectPotential(opt,numingroup[i],&gPart[noffset[i]]);
+        else {
+            Double_t errbound=TreePotential(opt,numingroup[i],&gPart[noffset[i]]);
+            if (errbound>maxerrbound) maxerrbound=errbound;
         }
-        cBmax[j]=xdiff;
-        cR2max[j]=4.0/3.0*xdiff*xdiff/(opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen);
+#ifdef NOMASS
+        for (j=0;j<numingroup[i];j++) gPart[noffset[i]+j].SetPotential(gPart[noffset[i]+j].GetPotential()*mv2);
+#endif
+        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[noffset[i]+j].GetPotential();
     }
 #ifdef USEOPENMP
 }
 #endif
-    //then for each cell find all other cells that contain particles within a cells gRmax and mark those
-    //and mark all cells for which one does not have to unfold
-    //for marked cells calculate pp, for every other cell just use the CM of the cell to calculate the potential.
+    //reset number of threads to maximum number
+#ifdef USEOPENMP
+#pragma omp master
+    {
+        omp_set_num_threads(maxnthreads);
+    }
+    nthreads=maxnthreads;
+#endif
+
+    //now begin large group calculation
+    //here openmp is within the tree calculation since each group is large
+    for (ig=0;ig<(Int_t)gs.large.size();ig++)
+    {
+        i=gs.large[ig];
+        Double_t errbound=TreePotential(opt,numingroup[i],&gPart[noffset[i]]);
+        if (errbound>maxerrbound) maxerrbound=errbound;
+#ifdef NOMASS
+        for (j=0;j<numingroup[i];j++) gPart[noffset[i]+j].SetPotential(gPart[noffset[i]+j].GetPotential()*mv2);
+#endif
+        for (j=0;j<numingroup[i];j++) totV[i]+=0.5*gPart[noffset[i]+j].GetPotential();
+    }
+    if (opt.iverbose>=2 && maxerrbound>0) cout<<ThisTask<<" Tree potential relative error bound "<<maxerrbound<<" for opening angle "<<opt.uinfo.TreeThetaOpen<<endl;
+
+    //Now set the kinetic reference frame
+    //if using standard frame, then using CMVEL of the entire structure
+    if (opt.uinfo.cmvelreftype==CMVELREF) {
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(j,k,l,n,ntreecell,nleafcell,r2)
+private(i,j,k)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (j=0;j<nbodies;j++) {
-        int tid;
-#ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
-#endif
-        npomp[tid]=tree->GetRoot();
-        potV[Part[j].GetID()]=0.;
-        ntreecell=nleafcell=0;
-        Coordinate xpos(Part[j].GetPosition());
-        MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
-        for (k=0;k<ntreecell;k++) {
-          potV[Part[j].GetID()]+=-Part[j].GetMass()*r2val[tid][k];
-        }
-        for (k=0;k<nleafcell;k++) {
-            for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
-                if (j!=l) {
-                    r2=0.;for (n=0;n<3;n++) r2+=pow(Part[j].GetPosition(n)-Part[l].GetPosition(n),(Double_t)2.0);
-                    r2+=eps2;
-                    r2=1.0/sqrt(r2);
-                    potV[Part[j].GetID()]+=-(Part[j].GetMass()*Part[l].GetMass())*r2;
-                }
-            }
+    for (i=1;i<=numgroups;i++)
+    {
+        //the frame of groups unbound with other mpi tasks is calculated by \ref MPIUnbindGroup
+        if (schedsize[i]==0) continue;
+        for (j=0;j<numingroup[i];j++) {
+            gmass[i]+=gPart[noffset[i]+j].GetMass();
+            for (k=0;k<3;k++)
+                cmvel[i][k]+=gPart[noffset[i]+j].GetVelocity(k)*gPart[noffset[i]+j].GetMass();
         }
-        potV[Part[j].GetID()]*=opt.G;
+        for (k=0;k<3;k++)cmvel[i][k]*=(1.0/gmass[i]);
     }
 #ifdef USEOPENMP
 }
 #endif
-    delete tree;
-    cout<<"Done\n";
-}
-
-void Potential(Options &opt, Int_t nbodies, Particle *Part)
-{
-    int maxnthreads,nthreads,l,n;
-    Int_t i,j,k,ntreecell,nleafcell;
-    Double_t v2,r2,Ti,eps2=opt.uinfo.eps*opt.uinfo.eps;
-    //for tree code potential calculation
-    Int_t ncell;
-    Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
-    Coordinate *cellcm;
-    Node *root;
-    Node **nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
-    //Double_t **nnr2;
-    KDTree *tree;
-
-    //for parallel environment store maximum number of threads
-    nthreads=1;
-#ifdef USEOPENMP
-#pragma omp parallel
-    {
-    if (omp_get_thread_num()==0) maxnthreads=nthreads=omp_get_num_threads();
     }
-#endif
-    //otherwise use tree tree gravity calculation
-    //here openmp is per group since each group is large
-    //to make this memory efficient really need just KDTree that uses Coordinates
-    tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS);
-    ncell=tree->GetNumNodes();
-    root=tree->GetRoot();
-    //to store particles in a given node
-    start=new Int_t[ncell];
-    end=new Int_t[ncell];
-    //distance calculations used to determine when one uses cell or when one uses particles
-    cmtot=new Double_t[ncell];
-    cBmax=new Double_t[ncell];
-    cR2max=new Double_t[ncell];
-    cellcm=new Coordinate[ncell];
-    //to store note list
-    nodelist=new Node*[ncell];
-
-    //search tree
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-    for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
-    //from root node calculate cm for each node
-    //start at root node and recursively move through list
-    ncell=0;
-    GetNodeList(root,ncell,nodelist,opt.uinfo.BucketSize);
-    ncell++;
-    //determine cm for all cells and openings
+    //if using potential then must identify minimum potential, see \ref GetPotentialMinimumFrame
+    //large groups are processed one at a time, threading over the particles of a group
+    else if (opt.uinfo.cmvelreftype==POTREF) {
+        for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+            i=gs.large[ig];
+            GetPotentialMinimumFrame(opt,numingroup[i],&gPart[noffset[i]],potpos,cmvel[i],1);
+        }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(j,k,n)
+private(i,potpos)
 {
     #pragma omp for schedule(dynamic,1) nowait
 #endif
-    for (j=0;j<ncell;j++) {
-        start[j]=(nodelist[j])->GetStart();
-        end[j]=(nodelist[j])->GetEnd();
-        cellcm[j][0]=cellcm[j][1]=cellcm[j][2]=0.;
-        cmtot[j]=0;
-        for (k=start[j];k<end[j];k++) {
-            for (n=0;n<3;n++) cellcm[j][n]+=Part[k].GetPosition(n)*Part[k].GetMass();
-            cmtot[j]+=Part[k].GetMass();
-        }
-        for (n=0;n<3;n++) cellcm[j][n]/=cmtot[j];
-        Double_t xdiff,xdiff1;
-        xdiff=(cellcm[j]-Coordinate(Part[start[j]].GetPosition())).Length();
-        for (k=start[j]+1;k<end[j];k++) {
-            xdiff1=(cellcm[j]-Coordinate(Part[k].GetPosition())).Length();
-            if (xdiff<xdiff1) xdiff=xdiff1;
+        for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+            i=gs.pool[ig];
+            GetPotentialMinimumFrame(opt,numingroup[i],&gPart[noffset[i]],potpos,cmvel[i],0);
         }
-        cBmax[j]=xdiff;
-        cR2max[j]=4.0/3.0*xdiff*xdiff/(opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen);
-    }
 #ifdef USEOPENMP
 }
 #endif
-    //then for each cell find all other cells that contain particles within a cells gRmax and mark those
-    //and mark all cells for which one does not have to unfold
-    //for marked cells calculate pp, for every other cell just use the CM of the cell to calculate the potential.
+    }
+
+    //now go through groups and begin unbinding by finding least bound particle, see \ref UnbindGroup
+    //large groups are unbound one at a time, threading over the particles of a group
+    //and the groups in the pool are unbound concurrently
+    //here energy data is stored in density
+#ifdef USEMPI
+    if (mpi_icollectiveunbind && opt.uinfo.mpiunbindnum>0) {
+        Particle **gparts=new Particle*[numgroups+1];
+        for (i=1;i<=numgroups;i++) gparts[i]=&gPart[noffset[i]];
+        iunbindflag+=MPIUnbindLargeGroups(opt,gparts,numgroups,numingroup,pfof,NULL,cmvel,gmass,totV,potscale);
+        delete[] gparts;
+    }
+#endif
+    for (ig=0;ig<(Int_t)gs.large.size();ig++) {
+        i=gs.large[ig];
+        iunbindflag+=UnbindGroup(opt,numingroup[i],&gPart[noffset[i]],NULL,pfof,cmvel[i],gmass[i],totV[i],potscale,1);
+    }
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)  \
-private(j,k,l,n,ntreecell,nleafcell,r2)
+private(i)
 {
-    #pragma omp for schedule(dynamic,1) nowait
+    #pragma omp for schedule(dynamic,1) nowait reduction(+:iunbindflag)
 #endif
-    for (j=0;j<nbodies;j++) {
-        int tid;
-#ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
-#endif
-        npomp[tid]=tree->GetRoot();
-        Part[j].SetPotential(0.);
-        ntreecell=nleafcell=0;
-        Coordinate xpos(Part[j].GetPosition());
-        MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
-        for (k=0;k<ntreecell;k++) {
-          Part[j].SetPotential(Part[j].GetPotential()-Part[j].GetMass()*r2val[tid][k]);
-        }
-        for (k=0;k<nleafcell;k++) {
-            for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
-                if (j!=l) {
-                    r2=0.;for (n=0;n<3;n++) r2+=pow(Part[j].GetPosition(n)-Part[l].GetPosition(n),(Double_t)2.0);
-                    r2+=eps2;
-                    r2=1.0/sqrt(r2);
-                    Part[j].SetPotential(Part[j].GetPotential()-(Part[j].GetMass()*Part[l].GetMass())*r2);
-                }
-            }
-        }
-        Part[j].SetPotential(Part[j].GetPotential()*opt.G);
+    for (ig=0;ig<(Int_t)gs.pool.size();ig++) {
+        i=gs.pool[ig];
+        iunbindflag+=UnbindGroup(opt,numingroup[i],&gPart[noffset[i]],NULL,pfof,cmvel[i],gmass[i],totV[i],potscale,0);
     }
 #ifdef USEOPENMP
 }
 #endif
-    delete tree;
-    delete[] start;
-    delete[] end;
-    delete[] cmtot;
-    delete[] cBmax;
-    delete[] cR2max;
-    delete[] cellcm;
-    delete[] nodelist;
-    for (j=0;j<nthreads;j++) {delete[] marktreecell[j]; delete[] markleafcell[j]; delete[] r2val[j];}
-    delete[] marktreecell;
-    delete[] markleafcell;
-    delete[] r2val;
-    delete[] npomp;
+    for (i=1;i<=numgroups;i++) if (numingroup[i]==0) ng--;
+    delete[] cmvel;
+    delete[] gmass;
+    delete[] totV;
+    numgroups=ng;
+    //return if any unbinding done indicating groups have been reordered
+    if (iunbindflag) return 1;
+    else return 0;
+}
+
+/// Calculates the gravitational potential using the tree gravity of \ref TreePotential, storing it in potV in the original order of the particles
+void Potential(Options &opt, Int_t nbodies, Particle *Part, Double_t *potV)
+{
+    Double_t errbound;
+    cout<<"Calculating potentials ..."<<endl;
+    errbound=TreePotential(opt,nbodies,Part,potV);
+    if (opt.iverbose>=2) cout<<"Tree potential relative error bound "<<errbound<<" for opening angle "<<opt.uinfo.TreeThetaOpen<<endl;
+    cout<<"Done\n";
+}
+
+/// Calculates the gravitational potential of the particles using the tree gravity of \ref TreePotential
+void Potential(Options &opt, Int_t nbodies, Particle *Part)
+{
+    TreePotential(opt,nbodies,Part);
 }
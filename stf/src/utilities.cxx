@@ -42,3 +42,50 @@ double MyGetTime(){
 }
 
 
+
+/// Scheduling of loops over groups
+//@{
+/*!
+    Split groups 1..ngroup between \ref GroupSchedule::pool, processed concurrently one group per thread, and \ref GroupSchedule::large,
+    processed one at a time with all threads. Empty groups are skipped. Groups with fewer than nmin members always go to the pool and
+    groups with at least nmax members are always large. In between, the most expensive groups are moved out of the pool while their cost
+    exceeds GSCHEDFRAC of the cost per thread of the groups left in the pool, so the split adapts to the number of threads and to the
+    distribution of group sizes rather than relying on a fixed size threshold. The cost model is given by costtype (GSCHEDLINEAR,
+    GSCHEDNLOGN or GSCHEDNSQUARED). Both lists are sorted by decreasing cost, ties by group index, so the order does not depend on the threads.
+    Loops use this as two phases rather than as a single shared pool of tasks: the large groups are processed first, each with its
+    inner loops parallelised over all threads, and only then are the pool groups dealt out to the threads with dynamic scheduling.
+    Threads therefore wait at the end of each large group and the pool cannot start while a large group is being processed. A
+    task based pool would need the inner loops of the large groups (tree builds, potentials, unbinding) written as tasks.
+*/
+void BuildGroupSchedule(GroupSchedule &gs, const Int_t ngroup, const Int_t *numingroup, const int costtype, const Int_t nmin, const Int_t nmax)
+{
+    int nthreads=1;
+    Int_t npromote=0;
+    double n,pooltotal=0;
+    vector<double> cost(ngroup+1,0.);
+#ifdef USEOPENMP
+    nthreads=omp_get_max_threads();
+#endif
+    gs.pool.clear();
+    gs.large.clear();
+    for (Int_t i=1;i<=ngroup;i++) if (numingroup[i]>0) {
+        n=numingroup[i];
+        if (costtype==GSCHEDNSQUARED) cost[i]=n*n;
+        else if (costtype==GSCHEDNLOGN) cost[i]=n*log(n+1.0);
+        else cost[i]=n;
+        if (numingroup[i]>=nmax) gs.large.push_back(i);
+        else {gs.pool.push_back(i);pooltotal+=cost[i];}
+    }
+    auto costcompare=[&cost](const Int_t a, const Int_t b){return (cost[a]>cost[b])||(cost[a]==cost[b]&&a<b);};
+    sort(gs.pool.begin(),gs.pool.end(),costcompare);
+    if (nthreads>1) {
+        while (npromote<(Int_t)gs.pool.size() && numingroup[gs.pool[npromote]]>=nmin && cost[gs.pool[npromote]]>GSCHEDFRAC*pooltotal/(double)nthreads) {
+            pooltotal-=cost[gs.pool[npromote]];
+            npromote++;
+        }
+        gs.large.insert(gs.large.end(),gs.pool.begin(),gs.pool.begin()+npromote);
+        gs.pool.erase(gs.pool.begin(),gs.pool.begin()+npromote);
+    }
+    sort(gs.large.begin(),gs.large.end(),costcompare);
+}
+//@}